@@ -49,6 +49,184 @@ EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEA( HDC context, FILE* fp, const RECT*
 EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEW( HDC context, FILE* fp, const RECT* size,
 				LPCWSTR description );
 EMF_DECLARE(HENHMETAFILE) CloseEnhMetaFileWithFILE( HDC context );
+/*
+ * Reading with several threads constructing the records at once. With
+ * threads 0 (as GetEnhMetaFile does), a big enough metafile is read with
+ * one thread per processor; with threads 1, it is read sequentially.
+ * No more threads than processors are ever used.
+ */
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileWithThreadsA( LPCSTR filename, UINT threads );
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileWithThreadsW( LPCWSTR filename, UINT threads );
+/*
+ * Lazy loading: the records are decoded from the file as they are used.
+ * Decoded records are kept until their total size exceeds budget bytes
+ * (0 for no limit), then the least recently used are dropped.
+ */
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileLazyA( LPCSTR filename, DWORD budget );
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileLazyW( LPCWSTR filename, DWORD budget );
+/*
+ * The same, from a metafile in memory (SetEnhMetaFileBits reads it all at
+ * once). With borrow, the records are decoded from data itself, which
+ * must be kept until the metafile is deleted; otherwise, from a copy.
+ */
+EMF_DECLARE(HENHMETAFILE) SetEnhMetaFileBitsLazy( UINT n, const BYTE* data, BOOL borrow,
+						  DWORD budget );
+/*
+ * Random access to the records. GetEnhMetaFileIndexed opens a metafile
+ * lazily and caches its record index in a file next to it (its name plus
+ * ".idx"), keyed by the metafile's size and modification time.
+ */
+typedef struct tagEMFRECORDINFO {
+  DWORD iType;			/* record type */
+  DWORD nSize;			/* record size in bytes */
+  DWORD offset;			/* where it starts in the metafile */
+  RECTL rclBounds;		/* logical bounds of what it paints; empty if nothing */
+} EMFRECORDINFO, *LPEMFRECORDINFO;
+
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileIndexedA( LPCSTR filename, DWORD budget );
+EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileIndexedW( LPCWSTR filename, DWORD budget );
+EMF_DECLARE(UINT) GetEnhMetaFileRecordIndex( HENHMETAFILE metafile, UINT first, UINT n,
+					     LPEMFRECORDINFO info );
+EMF_DECLARE(UINT) GetEnhMetaFileRecord( HENHMETAFILE metafile, UINT index, UINT size,
+					LPENHMETARECORD record );
+/*
+ * Read only the header (and up to length WCHARs of the description) of a
+ * metafile, without opening it. These return the number of bytes copied
+ * into header, or 0 if there is no metafile there.
+ */
+EMF_DECLARE(UINT) ProbeEnhMetaFileA( LPCSTR filename, UINT size, LPENHMETAHEADER header,
+				     UINT length, LPWSTR description );
+EMF_DECLARE(UINT) ProbeEnhMetaFileW( LPCWSTR filename, UINT size, LPENHMETAHEADER header,
+				     UINT length, LPWSTR description );
+EMF_DECLARE(UINT) ProbeEnhMetaFileWithFILE( FILE* fp, UINT size, LPENHMETAHEADER header,
+					    UINT length, LPWSTR description );
+EMF_DECLARE(UINT) ProbeEnhMetaFileBits( const BYTE* data, UINT n, UINT size,
+					LPENHMETAHEADER header, UINT length,
+					LPWSTR description );
+/*
+ * Walk the records of a metafile without opening it: each record in turn
+ * is read into the same buffer and handed to proc (with no device context
+ * or handle table). The record type and size are in the host's byte
+ * order; the rest is as in the file. The stream need not be seekable.
+ */
+EMF_DECLARE(BOOL) StreamEnhMetaFileA( LPCSTR filename, ENHMFENUMPROC proc, LPVOID data );
+EMF_DECLARE(BOOL) StreamEnhMetaFileW( LPCWSTR filename, ENHMFENUMPROC proc, LPVOID data );
+EMF_DECLARE(BOOL) StreamEnhMetaFileWithFILE( FILE* fp, ENHMFENUMPROC proc, LPVOID data );
+EMF_DECLARE(BOOL) StreamEnhMetaFileBits( const BYTE* bits, UINT n, ENHMFENUMPROC proc,
+					 LPVOID data );
+/*
+ * Combine metafiles into one by copying their records: each is placed with
+ * a world transform (xforms may be null) between a SaveDC and a RestoreDC,
+ * with its object handles moved past those of the ones before it.
+ */
+EMF_DECLARE(UINT) MergeEnhMetaFileBits( UINT count, const BYTE* const* bits,
+					const UINT* sizes, const XFORM* xforms,
+					UINT size, LPBYTE buffer );
+EMF_DECLARE(BOOL) MergeEnhMetaFilesA( LPCSTR filename, UINT count, const LPCSTR* sources,
+				      const XFORM* xforms );
+EMF_DECLARE(BOOL) MergeEnhMetaFilesW( LPCWSTR filename, UINT count, const LPCWSTR* sources,
+				      const XFORM* xforms );
+/*
+ * Keep the pens, brushes and fonts which playing a metafile back creates,
+ * so that playing it again selects them instead of creating new ones.
+ * They are held until ReleaseEnhMetaFilePlayCache, turning the cache off
+ * or DeleteEnhMetaFile.
+ */
+EMF_DECLARE(BOOL) SetEnhMetaFilePlayCache( HENHMETAFILE metafile, BOOL enable );
+EMF_DECLARE(BOOL) ReleaseEnhMetaFilePlayCache( HENHMETAFILE metafile );
+/*
+ * Optional writer optimizations. These are all off by default and are
+ * enabled per metafile device context with SetEnhMetaFileOptions().
+ */
+#define EMF_OPTION_ELIDE_STATE	0x00000001 /* Drop state records which don't change the state */
+#define EMF_OPTION_INTERN_OBJECTS 0x00000002 /* Share identical pens, brushes and fonts */
+#define EMF_OPTION_COALESCE_PIXELS 0x00000004 /* Write dense SetPixel clusters as bitmaps */
+#define EMF_OPTION_COMPRESS_PIXELS 0x00000008 /* ...RLE8 compressed, with unset pixels skipped */
+#define EMF_OPTION_BORROW_BITS	0x00000010 /* Bitmap bits stay in the caller's buffers until closing */
+#define EMF_OPTION_CLIP_TO_FRAME 0x00000020 /* Drop or trim geometry outside an explicit frame */
+#define EMF_OPTION_GROUP_OBJECTS 0x00000040 /* Group figures by pen, brush and font when closing */
+#define EMF_OPTION_PRUNE_RECORDS 0x00000080 /* Drop unused objects and records when closing */
+#define EMF_OPTION_BAKE_TRANSFORMS 0x00000100 /* Apply whole-number scaling world transforms to the coordinates */
+
+/*
+ * Counters describing what the optional optimizations did to a metafile.
+ */
+typedef struct tagEMFSTATS {
+  DWORD nStateRecordsDropped;	/* Set* records dropped by EMF_OPTION_ELIDE_STATE */
+  DWORD nSelectRecordsDropped;	/* SelectObject records dropped by EMF_OPTION_ELIDE_STATE */
+  DWORD nCreateRecordsDropped;	/* object creation records dropped by EMF_OPTION_INTERN_OBJECTS */
+  DWORD nDeleteRecordsDropped;	/* DeleteObject records dropped by EMF_OPTION_INTERN_OBJECTS */
+  DWORD nPointsSimplified;	/* points removed by SetPolylineSimplification */
+  DWORD nPixelsCoalesced;	/* SetPixel calls written as bitmaps by EMF_OPTION_COALESCE_PIXELS */
+  DWORD nBitmapsShared;		/* bitmaps held once in memory for several records */
+  DWORD nPrimitivesCulled;	/* figures left out by EMF_OPTION_CLIP_TO_FRAME,
+				   or outside the frame given to PlayEnhMetaFile */
+  DWORD nPointsClipped;		/* points trimmed from figures by EMF_OPTION_CLIP_TO_FRAME */
+  DWORD nSelectRecordsGrouped;	/* SelectObject records saved by EMF_OPTION_GROUP_OBJECTS */
+  DWORD nDeadRecordsDropped;	/* records dropped by EMF_OPTION_PRUNE_RECORDS */
+  DWORD nDeadBytesDropped;	/* ...and their total size in bytes */
+  DWORD nTransformsBaked;	/* world transforms applied to the coordinates by EMF_OPTION_BAKE_TRANSFORMS */
+} EMFSTATS, *LPEMFSTATS;
+
+EMF_DECLARE(DWORD) SetEnhMetaFileOptions( HDC context, DWORD options );
+EMF_DECLARE(DWORD) GetEnhMetaFileOptions( HDC context );
+EMF_DECLARE(BOOL) GetEnhMetaFileStats( HDC context, LPEMFSTATS stats );
+
+/*
+ * Lossy simplification of Polyline, PolylineTo and Polygon point lists.
+ * The tolerance is in device units: for Douglas-Peucker, the largest
+ * distance a removed point may lie from the simplified line; for
+ * Visvalingam-Whyatt, points whose triangle with their neighbors has an
+ * area less than tolerance squared are removed. M4 applies only to
+ * polylines with monotone x (time series): it keeps the first, last,
+ * minimum and maximum point in each device column tolerance units wide.
+ */
+#define EMF_SIMPLIFY_NONE		0
+#define EMF_SIMPLIFY_DOUGLAS_PEUCKER	1
+#define EMF_SIMPLIFY_VISVALINGAM	2
+#define EMF_SIMPLIFY_M4			3
+
+EMF_DECLARE(BOOL) SetPolylineSimplification( HDC context, DWORD method, FLOAT tolerance );
+
+/*
+ * Drawing from separate x and y coordinate arrays. Each point is
+ * (x * xScale + xOffset, y * yScale + yOffset) rounded to the nearest
+ * logical unit; scale may be null for the identity mapping.
+ */
+typedef struct tagEMFSCALE {
+  DOUBLE xScale;
+  DOUBLE yScale;
+  DOUBLE xOffset;
+  DOUBLE yOffset;
+} EMFSCALE, *LPEMFSCALE;
+
+EMF_DECLARE(BOOL) PolylineF( HDC context, const FLOAT* x, const FLOAT* y, INT n,
+			     const EMFSCALE* scale );
+EMF_DECLARE(BOOL) PolylineD( HDC context, const DOUBLE* x, const DOUBLE* y, INT n,
+			     const EMFSCALE* scale );
+EMF_DECLARE(BOOL) PolygonF( HDC context, const FLOAT* x, const FLOAT* y, INT n,
+			    const EMFSCALE* scale );
+EMF_DECLARE(BOOL) PolygonD( HDC context, const DOUBLE* x, const DOUBLE* y, INT n,
+			    const EMFSCALE* scale );
+EMF_DECLARE(BOOL) PolyBezierF( HDC context, const FLOAT* x, const FLOAT* y, DWORD n,
+			       const EMFSCALE* scale );
+EMF_DECLARE(BOOL) PolyBezierD( HDC context, const DOUBLE* x, const DOUBLE* y, DWORD n,
+			       const EMFSCALE* scale );
+
+/*
+ * Batched drawing: the equivalent of n calls to Rectangle, Ellipse, Arc or
+ * SetPixel. If colors is not null, item i is filled (or, for SetPixels,
+ * painted) with colors[i] instead of the current brush (or color).
+ */
+EMF_DECLARE(BOOL) PolyRectangle( HDC context, const RECT* rects, UINT n,
+				 const COLORREF* colors );
+EMF_DECLARE(BOOL) PolyEllipse( HDC context, const RECT* boxes, UINT n,
+			       const COLORREF* colors );
+EMF_DECLARE(BOOL) PolyArc( HDC context, const RECT* boxes, const POINT* starts,
+			   const POINT* ends, UINT n );
+EMF_DECLARE(BOOL) SetPixels( HDC context, const POINT* points, UINT n,
+			     const COLORREF* colors, COLORREF color );
+
 /*
  * This function will only produce output if the library has been compiled with
  * editing enabled (e.g., ./configure --enable-editing).
@@ -2167,7 +2167,33 @@ typedef struct {
     BYTE  Data[1];
 } EMRGDICOMMENT, *PEMRGDICOMMENT;
 
-#if 0
+typedef USHORT COLOR16;
+
+typedef struct _TRIVERTEX {
+    LONG    x;
+    LONG    y;
+    COLOR16 Red;
+    COLOR16 Green;
+    COLOR16 Blue;
+    COLOR16 Alpha;
+} TRIVERTEX, *PTRIVERTEX, *LPTRIVERTEX;
+
+typedef struct _GRADIENT_RECT {
+    ULONG UpperLeft;
+    ULONG LowerRight;
+} GRADIENT_RECT, *PGRADIENT_RECT, *LPGRADIENT_RECT;
+
+typedef struct _GRADIENT_TRIANGLE {
+    ULONG Vertex1;
+    ULONG Vertex2;
+    ULONG Vertex3;
+} GRADIENT_TRIANGLE, *PGRADIENT_TRIANGLE, *LPGRADIENT_TRIANGLE;
+
+#define GRADIENT_FILL_RECT_H    0x00000000
+#define GRADIENT_FILL_RECT_V    0x00000001
+#define GRADIENT_FILL_TRIANGLE  0x00000002
+#define GRADIENT_FILL_OP_FLAG   0x000000ff
+
 typedef struct {
     EMR       emr;
     RECTL     rclBounds;
@@ -2176,7 +2202,6 @@ typedef struct {
     ULONG     ulMode;
     TRIVERTEX Ver[1];
 } EMRGRADIENTFILL, *PEMRGRADIENTFILL;
-#endif
 
 typedef struct {
     EMR   emr;
@@ -2577,9 +2602,27 @@ typedef INT CALLBACK (*ENHMFENUMPROC)(HDC, LPHANDLETABLE,
 #define EMR_GLSRECORD	102
 #define EMR_GLSBOUNDEDRECORD	103
 #define EMR_PIXELFORMAT 104
+#define EMR_DRAWESCAPE	105
+#define EMR_EXTESCAPE	106
+#define EMR_STARTDOC	107
+#define EMR_SMALLTEXTOUT	108
+#define EMR_FORCEUFIMAPPING	109
+#define EMR_NAMEDESCAPE	110
+#define EMR_COLORCORRECTPALETTE	111
+#define EMR_SETICMPROFILEA	112
+#define EMR_SETICMPROFILEW	113
+#define EMR_ALPHABLEND	114
+#define EMR_SETLAYOUT	115
+#define EMR_TRANSPARENTBLT	116
+#define EMR_RESERVED_117	117
+#define EMR_GRADIENTFILL	118
+#define EMR_SETLINKEDUFI	119
+#define EMR_SETTEXTJUSTIFICATION	120
+#define EMR_COLORMATCHTOTARGETW	121
+#define EMR_CREATECOLORSPACEW	122
 
 #define EMR_MIN 1
-#define EMR_MAX 104
+#define EMR_MAX 122
 
 #define ENHMETA_SIGNATURE	1179469088
 #define ENHMETA_STOCK_OBJECT	0x80000000
@@ -3225,6 +3268,7 @@ BOOL      WINAPI GetViewportOrgEx(HDC,LPPOINT);
 BOOL      WINAPI GetWindowExtEx(HDC,LPSIZE);
 BOOL      WINAPI GetWindowOrgEx(HDC,LPPOINT);
 BOOL      WINAPI GetWorldTransform(HDC,LPXFORM);
+BOOL      WINAPI GradientFill(HDC,PTRIVERTEX,ULONG,PVOID,ULONG,ULONG);
 INT       WINAPI IntersectClipRect(HDC,INT,INT,INT,INT);
 BOOL      WINAPI InvertRgn(HDC,HRGN);
 BOOL      WINAPI LineDDA(INT,INT,INT,INT,LINEDDAPROC,LPARAM);
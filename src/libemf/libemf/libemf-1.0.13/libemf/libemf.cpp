@@ -20,7 +20,13 @@
  */
 #include <iostream>
 #include <climits>
+#include <algorithm>
 #include <functional>
+#include <queue>
+#include <system_error>
+#include <thread>
+#include <typeindex>
+#include <sys/stat.h>
 #include <emf_byteswap.h>
 
 #include "libemf.h"
@@ -107,112 +113,98 @@ namespace EMF {
   }
 
   /*!
-   * The single instance of the GlobalObjects database. Must be
-   * constructed when the library is loaded.
+   * The single instance of the GlobalObjects database. Its constructor
+   * is constexpr, so it is initialized at compile time and can't be seen
+   * half-built from another module's static initializers; the stock
+   * objects are created the first time anyone asks for an object.
    */
   GLOBALOBJECTS globalObjects;
 
-  GLOBALOBJECTS::GLOBALOBJECTS ( void )
-  {
-    // Create the STOCK objects
-    LOGBRUSH lbrush = { BS_SOLID, RGB(0xff,0xff,0xff), HS_HORIZONTAL };
-    add( new BRUSH( &lbrush ) );
-    lbrush.lbColor = RGB(0xb0,0xb0,0xb0);
-    add( new BRUSH( &lbrush ) );
-    lbrush.lbColor = RGB(0x80,0x80,0x80);
-    add( new BRUSH( &lbrush ) );
-    lbrush.lbColor = RGB(0x40,0x40,0x40);
-    add( new BRUSH( &lbrush ) );
-    lbrush.lbColor = RGB(0,0,0);
-    add( new BRUSH( &lbrush ) );
-    lbrush.lbStyle = BS_NULL;
-    add( new BRUSH( &lbrush ) );
-
-    LOGPEN lpen = { PS_SOLID, {0,0}, RGB(0xff,0xff,0xff) };
-    add( new PEN( &lpen ) );
-    lpen.lopnColor = RGB(0,0,0);
-    add( new PEN( &lpen ) );
-    lpen.lopnStyle = PS_NULL;
-    add( new PEN( &lpen ) );
+  //! The stock brushes: WHITE_BRUSH through NULL_BRUSH.
+  static constexpr LOGBRUSH stock_brushes[] = {
+    { BS_SOLID, RGB(0xff,0xff,0xff), HS_HORIZONTAL },
+    { BS_SOLID, RGB(0xb0,0xb0,0xb0), HS_HORIZONTAL },
+    { BS_SOLID, RGB(0x80,0x80,0x80), HS_HORIZONTAL },
+    { BS_SOLID, RGB(0x40,0x40,0x40), HS_HORIZONTAL },
+    { BS_SOLID, RGB(0,0,0), HS_HORIZONTAL },
+    { BS_NULL, RGB(0,0,0), HS_HORIZONTAL }
+  };
+
+  //! The stock pens: WHITE_PEN through NULL_PEN (plus the missing 9-th).
+  static constexpr LOGPEN stock_pens[] = {
+    { PS_SOLID, {0,0}, RGB(0xff,0xff,0xff) },
+    { PS_SOLID, {0,0}, RGB(0,0,0) },
+    { PS_NULL, {0,0}, RGB(0,0,0) },
     // There is no 9-th stock object!
-    add( new PEN( &lpen ) );
-
-    LOGFONTW lfont = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0} };
-    add( new FONT( &lfont ) );
-    add( new FONT( &lfont ) );
-    add( new FONT( &lfont ) );
-    add( new FONT( &lfont ) );
-    add( new FONT( &lfont ) );
-
-    LOGPALETTE lpalette = { 0, 0, { {0, 0, 0, 0 } } };
-    PALETTE* default_palette = new PALETTE( &lpalette );
-    add( default_palette );
-
-    add( new FONT( &lfont ) );
-    add( new FONT( &lfont ) );
-
-    // Get ready for reading a metafile, too.
-    new_records[EMR_EOF] = new_eof;
-    new_records[EMR_SETVIEWPORTORGEX] = new_setviewportorgex;
-    new_records[EMR_SETWINDOWORGEX] = new_setwindoworgex;
-    new_records[EMR_SETVIEWPORTEXTEX] = new_setviewportextex;
-    new_records[EMR_SETWINDOWEXTEX] = new_setwindowextex;
-    new_records[EMR_SCALEVIEWPORTEXTEX] = new_scaleviewportextex;
-    new_records[EMR_SCALEWINDOWEXTEX] = new_scalewindowextex;
-    new_records[EMR_MODIFYWORLDTRANSFORM] = new_modifyworldtransform;
-    new_records[EMR_SETWORLDTRANSFORM] = new_setworldtransform;
-    new_records[EMR_SETTEXTALIGN] = new_settextalign;
-    new_records[EMR_SETTEXTCOLOR] = new_settextcolor;
-    new_records[EMR_SETBKCOLOR] = new_setbkcolor;
-    new_records[EMR_SETBKMODE] = new_setbkmode;
-    new_records[EMR_SETPOLYFILLMODE] = new_setpolyfillmode;
-    new_records[EMR_SETMAPMODE] = new_setmapmode;
-    new_records[EMR_SELECTOBJECT] = new_selectobject;
-    new_records[EMR_DELETEOBJECT] = new_deleteobject;
-    new_records[EMR_MOVETOEX] = new_movetoex;
-    new_records[EMR_LINETO] = new_lineto;
-    new_records[EMR_ARC] = new_arc;
-    new_records[EMR_ARCTO] = new_arcto;
-    new_records[EMR_RECTANGLE] = new_rectangle;
-    new_records[EMR_ELLIPSE] = new_ellipse;
-    new_records[EMR_POLYLINE] = new_polyline;
-    new_records[EMR_POLYLINE16] = new_polyline16;
-    new_records[EMR_POLYGON] = new_polygon;
-    new_records[EMR_POLYGON16] = new_polygon16;
-    new_records[EMR_POLYPOLYGON] = new_polypolygon;
-    new_records[EMR_POLYPOLYGON16] = new_polypolygon16;
-    new_records[EMR_POLYBEZIER] = new_polybezier;
-    new_records[EMR_POLYBEZIER16] = new_polybezier16;
-    new_records[EMR_POLYBEZIERTO] = new_polybezierto;
-    new_records[EMR_POLYBEZIERTO16] = new_polybezierto16;
-    new_records[EMR_POLYLINETO] = new_polylineto;
-    new_records[EMR_POLYLINETO16] = new_polylineto16;
-    new_records[EMR_EXTTEXTOUTA] = new_exttextouta;
-    new_records[EMR_EXTTEXTOUTW] = new_exttextoutw;
-    new_records[EMR_SETPIXELV] = new_setpixelv;
-    new_records[EMR_CREATEPEN] = new_createpen;
-    new_records[EMR_EXTCREATEPEN] = new_extcreatepen;
-    new_records[EMR_CREATEBRUSHINDIRECT] = new_createbrushindirect;
-    new_records[EMR_EXTCREATEFONTINDIRECTW] = new_extcreatefontindirectw;
-    new_records[EMR_FILLPATH] = new_fillpath;
-    new_records[EMR_STROKEPATH] = new_strokepath;
-    new_records[EMR_STROKEANDFILLPATH] = new_strokeandfillpath;
-    new_records[EMR_BEGINPATH] = new_beginpath;
-    new_records[EMR_ENDPATH] = new_endpath;
-    new_records[EMR_CLOSEFIGURE] = new_closefigure;
-    new_records[EMR_SAVEDC] = new_savedc;
-    new_records[EMR_RESTOREDC] = new_restoredc;
-    new_records[EMR_SETMETARGN] = new_setmetargn;
-    new_records[EMR_SETMITERLIMIT] = new_setmiterlimit;
+    { PS_NULL, {0,0}, RGB(0,0,0) }
+  };
+
+  //! All the stock fonts are the same.
+  static constexpr LOGFONTW stock_font = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, {0} };
+
+  //! As is the stock palette.
+  static constexpr LOGPALETTE stock_palette = { 0, 0, { {0, 0, 0, 0 } } };
+
+  static_assert( sizeof stock_brushes / sizeof stock_brushes[0] == WHITE_PEN,
+		 "one stock brush per stock brush slot" );
+  static_assert( sizeof stock_pens / sizeof stock_pens[0] ==
+		 OEM_FIXED_FONT - WHITE_PEN, "one stock pen per stock pen slot" );
+
+  /*!
+   * Create the STOCK objects, which occupy the first STOCK_LAST+1 slots of
+   * the global vector.
+   * \param objects the (empty) global vector.
+   */
+  static void createStockObjects ( std::vector<OBJECT*>& objects )
+  {
+    objects.reserve( STOCK_LAST + 1 );
+
+    for ( const LOGBRUSH& lbrush : stock_brushes )
+      objects.push_back( new BRUSH( &lbrush ) );
+
+    for ( const LOGPEN& lpen : stock_pens )
+      objects.push_back( new PEN( &lpen ) );
+
+    for ( int i = OEM_FIXED_FONT; i < DEFAULT_PALETTE; i++ )
+      objects.push_back( new FONT( &stock_font ) );
+
+    objects.push_back( new PALETTE( &stock_palette ) );
+
+    for ( int i = DEFAULT_PALETTE + 1; i <= STOCK_LAST; i++ )
+      objects.push_back( new FONT( &stock_font ) );
+
+    for ( size_t o = 0; o < objects.size(); o++ )
+      objects[o]->handle = o | ENHMETA_STOCK_OBJECT;
+  }
+
+  /*!
+   * \return the global object vector, creating it (and the stock objects)
+   * the first time.
+   */
+  std::vector<OBJECT*>& GLOBALOBJECTS::table ( void ) const
+  {
+    if ( objects == nullptr ) {
+      objects = new std::vector<OBJECT*>;
+      createStockObjects( *objects );
+    }
+
+    return *objects;
   }
 
   GLOBALOBJECTS::~GLOBALOBJECTS ( void )
   {
     // Just clean up for memory checkers' sakes
-    for ( auto igo = objects.begin(); igo != objects.end(); igo++ )
-      if ( *igo != 0 ) delete *igo;
-    objects.clear();
-    new_records.clear();
+    if ( objects == nullptr ) return;
+
+    // Each slot is emptied before its object goes, since a destructor may
+    // still look up (or delete) other objects
+    for ( size_t o = 0; o < objects->size(); o++ ) {
+      OBJECT* object = (*objects)[o];
+      (*objects)[o] = 0;
+      delete object;
+    }
+    delete objects;
+    objects = nullptr;
   }
   /*!
    * Add an object to the global vector. The object's handle is simply its
@@ -224,6 +216,9 @@ namespace EMF {
   {
     HGDIOBJ handle;
 
+    // Putting the stock objects in their places first if need be
+    std::vector<OBJECT*>& objects = table();
+
     // See if there are any free slots
     auto igo = std::find( objects.begin(), objects.end(), (OBJECT*)0 );
 
@@ -256,16 +251,16 @@ namespace EMF {
   {
     if ( handle & ENHMETA_STOCK_OBJECT ) {
       size_t o = handle & (~ENHMETA_STOCK_OBJECT);
-      if ( o >= objects.size() ) {
+      if ( o >= table().size() ) {
         return nullptr;
       }
-      return objects[o];
+      return (*objects)[o];
     }
     else {
-      if ( handle >= objects.size() ) {
+      if ( objects == nullptr || handle >= objects->size() ) {
         return nullptr;
       }
-      return objects[ handle ];
+      return (*objects)[ handle ];
     }
   }
 
@@ -277,297 +272,245 @@ namespace EMF {
    */
   void GLOBALOBJECTS::remove ( const OBJECT* object )
   {
-    auto igo = std::find( objects.begin(), objects.end(), object );
+    if ( objects == nullptr ) return;
 
-    if ( igo != objects.end() ) {
+    auto igo = std::find( objects->begin(), objects->end(), object );
+
+    if ( igo != objects->end() ) {
       delete *igo;
       *igo = 0;
     }
   }
   /*!
-   * See if we have a constructor for a record of the given type.
-   * \param iType metarecord type.
-   * \return pointer to "virtual" constructor.
+   * The "virtual" constructor for records of class T.
+   * \param ds the datastream positioned at the start of the record.
+   * \return a new record read from ds.
    */
-  METARECORDCTOR GLOBALOBJECTS::newRecord ( DWORD iType ) const
-  {
-    auto new_record = new_records.find( iType );
-
-    if ( new_record != new_records.end() )
-      return new_record->second;
-    else
-      return 0;
-  }
-
-  METARECORD* GLOBALOBJECTS::new_eof ( DATASTREAM& ds )
-  {
-    return new EMF::EMREOF( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setviewportorgex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETVIEWPORTORGEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setwindoworgex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETWINDOWORGEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setviewportextex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETVIEWPORTEXTEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setwindowextex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETWINDOWEXTEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_scaleviewportextex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSCALEVIEWPORTEXTEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_scalewindowextex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSCALEWINDOWEXTEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_modifyworldtransform ( DATASTREAM& ds )
-  {
-    return new EMF::EMRMODIFYWORLDTRANSFORM( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setworldtransform ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETWORLDTRANSFORM( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_settextalign ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETTEXTALIGN( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_settextcolor ( DATASTREAM& ds )
+  template<class T> static METARECORD* newRecordOf ( DATASTREAM& ds )
   {
-    return new EMF::EMRSETTEXTCOLOR( ds );
+    return new T( ds );
   }
 
-  METARECORD* GLOBALOBJECTS::new_setbkcolor ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETBKCOLOR( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setbkmode ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETBKMODE( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setpolyfillmode ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETPOLYFILLMODE( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_setmapmode ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETMAPMODE( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_selectobject ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSELECTOBJECT( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_deleteobject ( DATASTREAM& ds )
-  {
-    return new EMF::EMRDELETEOBJECT( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_movetoex ( DATASTREAM& ds )
-  {
-    return new EMF::EMRMOVETOEX( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_lineto ( DATASTREAM& ds )
-  {
-    return new EMF::EMRLINETO( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_arc ( DATASTREAM& ds )
-  {
-    return new EMF::EMRARC( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_arcto ( DATASTREAM& ds )
-  {
-    return new EMF::EMRARCTO( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_rectangle ( DATASTREAM& ds )
-  {
-    return new EMF::EMRRECTANGLE( ds );
-  }
+  //! The record constructors, indexed directly by record type.
+  struct RECORDCTORTABLE {
+    METARECORDCTOR ctors[EMR_MAX+1];	//!< Null where there isn't one.
+  };
 
-  METARECORD* GLOBALOBJECTS::new_ellipse ( DATASTREAM& ds )
-  {
-    return new EMF::EMRELLIPSE( ds );
-  }
-
-  METARECORD* GLOBALOBJECTS::new_polyline ( DATASTREAM& ds )
+  /*!
+   * Build the record constructor table from the EMF_RECORD_TYPES registry.
+   * This is evaluated by the compiler, so registering a type outside of
+   * [0,EMR_MAX] or registering it twice is a compile-time error.
+   */
+  static constexpr RECORDCTORTABLE makeRecordCtorTable ( void )
   {
-    return new EMF::EMRPOLYLINE( ds );
+    RECORDCTORTABLE table = {};
+#define EMF_REGISTER_RECORD( type, record )				\
+    table.ctors[type] = table.ctors[type] == 0 ? &newRecordOf< record > :	\
+      throw std::logic_error( #type " registered twice" );
+    EMF_RECORD_TYPES( EMF_REGISTER_RECORD )
+#undef EMF_REGISTER_RECORD
+    return table;
   }
 
-  METARECORD* GLOBALOBJECTS::new_polyline16 ( DATASTREAM& ds )
-  {
-    return new EMF::EMRPOLYLINE16( ds );
-  }
+  //! Reading a metafile dispatches through this (constant) table.
+  static constexpr RECORDCTORTABLE record_ctors = makeRecordCtorTable();
 
-  METARECORD* GLOBALOBJECTS::new_polygon ( DATASTREAM& ds )
+  DWORD METARECORD::type ( void ) const
   {
-    return new EMF::EMRPOLYGON( ds );
-  }
+    static const std::map< std::type_index, DWORD > types = {
+#define EMF_RECORD_TYPEID( type, record ) { typeid( record ), type },
+      EMF_RECORD_TYPES( EMF_RECORD_TYPEID )
+#undef EMF_RECORD_TYPEID
+      { typeid( ENHMETAHEADER ), EMR_HEADER },
+      { typeid( EMRCREATEPALETTE ), EMR_CREATEPALETTE },
+    };
 
-  METARECORD* GLOBALOBJECTS::new_polygon16 ( DATASTREAM& ds )
-  {
-    return new EMF::EMRPOLYGON16( ds );
-  }
+    auto t = types.find( typeid( *this ) );
 
-  METARECORD* GLOBALOBJECTS::new_polypolygon ( DATASTREAM& ds )
-  {
-    return new EMF::EMRPOLYPOLYGON( ds );
+    return t != types.end() ? t->second : 0;
   }
 
-  METARECORD* GLOBALOBJECTS::new_polypolygon16 ( DATASTREAM& ds )
+  /*!
+   * See if we have a constructor for a record of the given type.
+   * \param iType metarecord type.
+   * \return pointer to "virtual" constructor.
+   */
+  METARECORDCTOR GLOBALOBJECTS::newRecord ( DWORD iType ) const
   {
-    return new EMF::EMRPOLYPOLYGON16( ds );
+    return iType <= EMR_MAX ? record_ctors.ctors[iType] : 0;
   }
 
-  METARECORD* GLOBALOBJECTS::new_polybezier ( DATASTREAM& ds )
+  /*!
+   * Play back a record of class T, calling its execute() directly.
+   * \param record the record, which is exactly a T.
+   * \param source the device context from which the record is taken.
+   * \param dc the destination context.
+   */
+  template<class T> static void playRecordOf ( const METARECORD* record,
+					       METAFILEDEVICECONTEXT* source,
+					       METAFILEDEVICECONTEXT* dc )
   {
-    return new EMF::EMRPOLYBEZIER( ds );
+    static_cast<const T*>( record )->T::execute( source, dc );
   }
 
-  METARECORD* GLOBALOBJECTS::new_polybezier16 ( DATASTREAM& ds )
+  /*!
+   * Play back a lazily loaded record whose type reads a T, decoding it if
+   * need be.
+   * \param record the LAZYRECORD.
+   * \param source the device context from which the record is taken.
+   * \param dc the destination context.
+   */
+  template<class T>
+  static void playLazyRecordOf ( const METARECORD* record,
+				 METAFILEDEVICECONTEXT* source,
+				 METAFILEDEVICECONTEXT* dc )
   {
-    return new EMF::EMRPOLYBEZIER16( ds );
-  }
+    const METARECORD* decoded =
+      static_cast<const LAZYRECORD*>( record )->record();
 
-  METARECORD* GLOBALOBJECTS::new_polybezierto ( DATASTREAM& ds )
-  {
-    return new EMF::EMRPOLYBEZIERTO( ds );
+    if ( decoded != 0 )
+      static_cast<const T*>( decoded )->T::execute( source, dc );
   }
 
-  METARECORD* GLOBALOBJECTS::new_polybezierto16 ( DATASTREAM& ds )
+  /*!
+   * Play back any other record, through its virtual execute().
+   * \param record the record.
+   * \param source the device context from which the record is taken.
+   * \param dc the destination context.
+   */
+  static void playRecord ( const METARECORD* record,
+			   METAFILEDEVICECONTEXT* source,
+			   METAFILEDEVICECONTEXT* dc )
   {
-    return new EMF::EMRPOLYBEZIERTO16( ds );
+    record->execute( source, dc );
   }
 
-  METARECORD* GLOBALOBJECTS::new_polylineto ( DATASTREAM& ds )
-  {
-    return new EMF::EMRPOLYLINETO( ds );
-  }
+  //! The record players, indexed directly by record type.
+  struct RECORDPLAYTABLE {
+    METARECORDPLAY plays[EMR_MAX+1];	//!< Null where there isn't one.
+    METARECORDPLAY lazy_plays[EMR_MAX+1]; //!< The same, for LAZYRECORDs.
+  };
 
-  METARECORD* GLOBALOBJECTS::new_polylineto16 ( DATASTREAM& ds )
+  /*!
+   * Build the record player table from the EMF_RECORD_TYPES registry,
+   * which record_ctors has already checked.
+   */
+  static constexpr RECORDPLAYTABLE makeRecordPlayTable ( void )
   {
-    return new EMF::EMRPOLYLINETO16( ds );
+    RECORDPLAYTABLE table = {};
+#define EMF_REGISTER_PLAY( type, record )			\
+    table.plays[type] = &playRecordOf< record >;		\
+    table.lazy_plays[type] = &playLazyRecordOf< record >;
+    EMF_RECORD_TYPES( EMF_REGISTER_PLAY )
+#undef EMF_REGISTER_PLAY
+    return table;
   }
 
-  METARECORD* GLOBALOBJECTS::new_exttextouta ( DATASTREAM& ds )
-  {
-    return new EMF::EMREXTTEXTOUTA( ds );
-  }
+  //! Playing a metafile back dispatches through this (constant) table.
+  static constexpr RECORDPLAYTABLE record_plays = makeRecordPlayTable();
 
-  METARECORD* GLOBALOBJECTS::new_exttextoutw ( DATASTREAM& ds )
+  EMRCREATEPEN::EMRCREATEPEN ( PEN* pen, HGDIOBJ handle )
   {
-    return new EMF::EMREXTTEXTOUTW( ds );
+    emr.iType = EMR_CREATEPEN;
+    emr.nSize = sizeof( ::EMRCREATEPEN );
+    ihPen = handle;
+    lopn = *pen;
   }
 
-  METARECORD* GLOBALOBJECTS::new_setpixelv ( DATASTREAM& ds )
+  void EMRSELECTOBJECT::execute ( METAFILEDEVICECONTEXT* source,
+				  METAFILEDEVICECONTEXT* dc ) const
   {
-    return new EMF::EMRSETPIXELV( ds );
-  }
+    // The primary subtlety here is that the handle of an object
+    // in the metafile is not the same as the global handle in memory.
+    // So, the source context has to keep a map of metafile handles
+    // to global object handles. It is this global handle which the
+    // destination dc wants to see. emf_handles is manipulated when
+    // a Create* object record is executed.
 
-  METARECORD* GLOBALOBJECTS::new_createpen ( DATASTREAM& ds )
-  {
-    return new EMF::EMRCREATEPEN( ds );
-  }
+    GRAPHICSOBJECT* gobj;
 
-  METARECORD* GLOBALOBJECTS::new_extcreatepen ( DATASTREAM& ds )
-  {
-    return new EMF::EMREXTCREATEPEN( ds );
-  }
+    if ( !( ihObject & ENHMETA_STOCK_OBJECT ) )
+      gobj = source->playedObject( ihObject );
+    else if ( ( ihObject & ~ENHMETA_STOCK_OBJECT ) <= STOCK_LAST )
+      // The stock objects fill the first slots of globalObjects
+      gobj = static_cast<GRAPHICSOBJECT*>( globalObjects.find( ihObject ) );
+    else
+      gobj = 0;
 
-  METARECORD* GLOBALOBJECTS::new_createbrushindirect ( DATASTREAM& ds )
-  {
-    return new EMF::EMRCREATEBRUSHINDIRECT( ds );
+    if ( gobj != 0 ) selectObject( dc, gobj );
   }
 
-  METARECORD* GLOBALOBJECTS::new_extcreatefontindirectw ( DATASTREAM& ds )
+  /*!
+   * Take a graphics object out of every device context into which it has
+   * been selected, as deleting it does: each gets a delete object record
+   * and goes back to the default object if it was current.
+   * \param gobj the graphics object.
+   */
+  static void detachObject ( GRAPHICSOBJECT* gobj )
   {
-    return new EMF::EMREXTCREATEFONTINDIRECTW( ds );
-  }
+    for ( auto c = gobj->contexts.begin(); c != gobj->contexts.end(); c++ ) {
 
-  METARECORD* GLOBALOBJECTS::new_fillpath ( DATASTREAM& ds )
-  {
-    return new EMF::EMRFILLPATH( ds );
-  }
+      HDC context = c->first;
 
-  METARECORD* GLOBALOBJECTS::new_strokepath ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSTROKEPATH( ds );
-  }
+      METAFILEDEVICECONTEXT* dc =
+	dynamic_cast<METAFILEDEVICECONTEXT*>(globalObjects.find(context));
 
-  METARECORD* GLOBALOBJECTS::new_strokeandfillpath ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSTROKEANDFILLPATH( ds );
-  }
+      // Nor is there anything to do in a metafile which has since been
+      // closed (or deleted)
+      if ( dc == 0 || dc->records.empty() ||
+	   dynamic_cast<EMREOF*>( dc->records.back() ) != 0 )
+	continue;
 
-  METARECORD* GLOBALOBJECTS::new_beginpath ( DATASTREAM& ds )
-  {
-    return new EMF::EMRBEGINPATH( ds );
-  }
+      // An interned metafile object may be shared with other objects (or
+      // will be, shortly), so it stays
 
-  METARECORD* GLOBALOBJECTS::new_endpath ( DATASTREAM& ds )
-  {
-    return new EMF::EMRENDPATH( ds );
-  }
+      if ( dc->releaseInterned( gobj, c->second ) ) {
+	EMRDELETEOBJECT* deleteobject = new EMRDELETEOBJECT( c->second );
 
-  METARECORD* GLOBALOBJECTS::new_closefigure ( DATASTREAM& ds )
-  {
-    return new EMF::EMRCLOSEFIGURE( ds );
-  }
+	dc->appendRecord( deleteobject );
 
-  METARECORD* GLOBALOBJECTS::new_savedc ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSAVEDC( ds );
-  }
+	// Reuse its metafile handle
+	dc->clearHandle( c->second );
+      }
 
-  METARECORD* GLOBALOBJECTS::new_restoredc ( DATASTREAM& ds )
-  {
-    return new EMF::EMRRESTOREDC( ds );
-  }
+      // Anything we thought we knew about its selection is now moot
+      dc->forgetObject( gobj );
 
-  METARECORD* GLOBALOBJECTS::new_setmetargn ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETMETARGN( ds );
-  }
+      // If this graphics object is current, then restore the default!
 
-  METARECORD* GLOBALOBJECTS::new_setmiterlimit ( DATASTREAM& ds )
-  {
-    return new EMF::EMRSETMITERLIMIT( ds );
-  }
+      switch ( gobj->getType( ) ) {
+      case O_BRUSH:
+	if ( (BRUSH*)gobj == dc->brush )
+	  dc->brush = (BRUSH*)globalObjects.find( BLACK_BRUSH | ENHMETA_STOCK_OBJECT );
+	break;
+      case O_FONT:
+	if ( (FONT*)gobj == dc->font )
+	  dc->font = (FONT*)globalObjects.find( DEVICE_DEFAULT_FONT | ENHMETA_STOCK_OBJECT );
+	break;
+      case O_PEN:
+	if ( (PEN*)gobj == dc->pen )
+	  dc->pen = (PEN*)globalObjects.find( BLACK_PEN | ENHMETA_STOCK_OBJECT );
+	break;
+      case O_EXTPEN:
+	if ( (EXTPEN*)gobj == dc->extpen ) {
+	  dc->pen = (PEN*)globalObjects.find( BLACK_PEN | ENHMETA_STOCK_OBJECT );
+	  dc->extpen = 0;
+	}
+	break;
+      case O_PALETTE:
+	if ( (PALETTE*)gobj == dc->palette )
+	  dc->palette = (PALETTE*)globalObjects.find( DEFAULT_PALETTE | ENHMETA_STOCK_OBJECT );
+	break;
+      default:
+	break;
+      }
+    }
 
-  EMRCREATEPEN::EMRCREATEPEN ( PEN* pen, HGDIOBJ handle )
-  {
-    emr.iType = EMR_CREATEPEN;
-    emr.nSize = sizeof( ::EMRCREATEPEN );
-    ihPen = handle;
-    lopn = *pen;
+    gobj->contexts.clear();
   }
 
-  void EMRSELECTOBJECT::execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+  void EMRDELETEOBJECT::execute ( METAFILEDEVICECONTEXT* source,
+				  METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
     // The primary subtlety here is that the handle of an object
     // in the metafile is not the same as the global handle in memory.
@@ -576,25 +519,30 @@ namespace EMF {
     // destination dc wants to see. emf_handles is manipulated when
     // a Create* object record is executed.
 
-    if ( !( ihObject & ENHMETA_STOCK_OBJECT ) )
-      SelectObject( dc, source->emf_handles[ihObject] );
-    else
-      SelectObject( dc, ihObject );
+    if ( ihObject & ENHMETA_STOCK_OBJECT ) return;
+
+    GRAPHICSOBJECT* gobj = source->playedObject( ihObject );
+
+    if ( gobj == 0 ) return;
+
+    detachObject( gobj );
+
+    // A cached object is only deleted as far as the destination can tell
+    if ( !source->play_caching )
+      globalObjects.remove( gobj );
+
+    source->setPlayedObject( ihObject, 0 );
   }
 
-  void EMRDELETEOBJECT::execute ( METAFILEDEVICECONTEXT* source, HDC /*dc*/ )
-    const
+  void METAFILEDEVICECONTEXT::releasePlayCache ( void )
   {
-    // The primary subtlety here is that the handle of an object
-    // in the metafile is not the same as the global handle in memory.
-    // So, the source context has to keep a map of metafile handles
-    // to global object handles. It is this global handle which the
-    // destination dc wants to see. emf_handles is manipulated when
-    // a Create* object record is executed.
+    for ( auto o = play_cache.begin(); o != play_cache.end(); o++ )
+      if ( *o != 0 ) {
+	detachObject( *o );
+	globalObjects.remove( *o );
+      }
 
-    if ( !( ihObject & ENHMETA_STOCK_OBJECT ) and
-         source->emf_handles.find( ihObject ) != source->emf_handles.end() )
-      DeleteObject( source->emf_handles[ihObject] );
+    play_cache.clear();
   }
 
   EMRCREATEPEN::EMRCREATEPEN ( DATASTREAM& ds )
@@ -602,17 +550,28 @@ namespace EMF {
     ds >> emr >> ihPen >> lopn;
   }
 
-  void EMRCREATEPEN::execute ( METAFILEDEVICECONTEXT* source, HDC /*dc*/ ) const
+  void EMRCREATEPEN::execute ( METAFILEDEVICECONTEXT* source,
+			       METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
-    HPEN pen = CreatePenIndirect( &lopn );
+    // A handle outside the metafile's table has nowhere to go
+    if ( !source->playable( ihPen ) ) return;
+
+    GRAPHICSOBJECT* pen = source->cachedObject();
+
+    if ( pen == 0 ) {
+      pen = new PEN( &lopn );
+      globalObjects.add( pen );
+      source->cacheObject( pen );
+    }
+
     // The primary subtlety here is that the handle of an object
     // in the metafile is not the same as the global handle in memory.
     // So, the source context has to keep a map of metafile handles
     // to global object handles. It is this global handle which the
     // destination dc wants to see. Use the current records handle
-    // as the index to store the real object's handle in the source
+    // as the index to store the real object in the source
     // source context's map.
-    source->emf_handles[ihPen] = pen;
+    source->setPlayedObject( ihPen, pen );
   }
 
   EMREXTCREATEPEN::EMREXTCREATEPEN ( EXTPEN* ext_pen, HGDIOBJ handle )
@@ -627,24 +586,27 @@ namespace EMF {
     elp = *ext_pen;
   }
 
-  void EMREXTCREATEPEN::execute ( METAFILEDEVICECONTEXT* source, HDC /*dc*/ )
-    const
+  void EMREXTCREATEPEN::execute ( METAFILEDEVICECONTEXT* source,
+				  METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
-    LOGBRUSH brush;
+    if ( !source->playable( ihPen ) ) return;
 
-    brush.lbStyle = elp.elpBrushStyle;
-    brush.lbColor = elp.elpColor;
-    brush.lbHatch = elp.elpHatch;
+    GRAPHICSOBJECT* pen = source->cachedObject();
+
+    if ( pen == 0 ) {
+      pen = new EXTPEN( &elp );
+      globalObjects.add( pen );
+      source->cacheObject( pen );
+    }
 
-    HPEN pen = ExtCreatePen ( elp.elpPenStyle, elp.elpWidth, &brush, 0, 0 );
     // The primary subtlety here is that the handle of an object
     // in the metafile is not the same as the global handle in memory.
     // So, the source context has to keep a map of metafile handles
     // to global object handles. It is this global handle which the
     // destination dc wants to see. Use the current records handle
-    // as the index to store the real object's handle in the source
+    // as the index to store the real object in the source
     // source context's map.
-    source->emf_handles[ihPen] = pen;
+    source->setPlayedObject( ihPen, pen );
   }
 
   EMREXTCREATEPEN::EMREXTCREATEPEN ( DATASTREAM& ds )
@@ -661,17 +623,26 @@ namespace EMF {
   }
 
   void EMRCREATEBRUSHINDIRECT::execute ( METAFILEDEVICECONTEXT* source,
-					 HDC /*dc*/ ) const
+					 METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
-    HBRUSH brush = CreateBrushIndirect( &lb );
+    if ( !source->playable( ihBrush ) ) return;
+
+    GRAPHICSOBJECT* brush = source->cachedObject();
+
+    if ( brush == 0 ) {
+      brush = new BRUSH( &lb );
+      globalObjects.add( brush );
+      source->cacheObject( brush );
+    }
+
     // The primary subtlety here is that the handle of an object
     // in the metafile is not the same as the global handle in memory.
     // So, the source context has to keep a map of metafile handles
     // to global object handles. It this global handle which the
     // destination dc wants to see. Use the current records handle
-    // as the index to store the real object's handle in the source
+    // as the index to store the real object in the source
     // source context's map.
-    source->emf_handles[ihBrush] = brush;
+    source->setPlayedObject( ihBrush, brush );
   }
 
   EMRCREATEBRUSHINDIRECT::EMRCREATEBRUSHINDIRECT ( DATASTREAM& ds )
@@ -694,17 +665,40 @@ namespace EMF {
   }
 
   void EMREXTCREATEFONTINDIRECTW::execute ( METAFILEDEVICECONTEXT* source,
-					    HDC /*dc*/ ) const
+					    METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
-    HFONT font = CreateFontIndirectW( &elfw.elfLogFont );
+    if ( !source->playable( ihFont ) ) return;
+
+    GRAPHICSOBJECT* font = source->cachedObject();
+
+    if ( font == 0 ) {
+      font = new FONT( &elfw.elfLogFont );
+      globalObjects.add( font );
+      source->cacheObject( font );
+    }
+
     // The primary subtlety here is that the handle of an object
     // in the metafile is not the same as the global handle in memory.
     // So, the source context has to keep a map of metafile handles
     // to global object handles. It this global handle which the
     // destination dc wants to see. Use the current records handle
-    // as the index to store the real object's handle in the source
+    // as the index to store the real object in the source
     // source context's map.
-    source->emf_handles[ihFont] = font;
+    source->setPlayedObject( ihFont, font );
+  }
+
+  void EMRPOLYPOLYGON::execute ( METAFILEDEVICECONTEXT* source,
+				 METAFILEDEVICECONTEXT* dc ) const
+  {
+    // According to the wine windef.h header, POINT and POINTL are equivalent
+    // (but DWORD and INT are not)
+    polyPolygon( dc, (POINT*)lpoints, source->playCounts( lcounts, nPolys ), nPolys );
+  }
+
+  void EMRPOLYPOLYGON16::execute ( METAFILEDEVICECONTEXT* source,
+				   METAFILEDEVICECONTEXT* dc ) const
+  {
+    polyPolygon16( dc, lpoints, source->playCounts( lcounts, nPolys ), nPolys );
   }
 
   EMRCREATEPALETTE::EMRCREATEPALETTE ( PALETTE* palette, HGDIOBJ handle )
@@ -716,466 +710,4894 @@ namespace EMF {
   }
 
   void EMRCREATEPALETTE::execute ( METAFILEDEVICECONTEXT* /*source*/,
-				   HDC /*dc*/ ) const
+				   METAFILEDEVICECONTEXT* /*dc*/ ) const
   {
     // Does nothing for now...
   }
-} // close EMF namespace
 
-extern "C" {
   /*!
-   * Delete a device context. (Have to check to see if there is any reason
-   * to ever call this.)
-   * \param context device context to delete.
-   * \return true if context successfully deleted.
+   * The distance from a point to a line segment.
+   * \param px,py the point.
+   * \param ax,ay,bx,by the ends of the segment.
+   * \return the distance.
    */
-  EMF_DECLARE(BOOL) DeleteDC ( HDC context )
+  static double segmentDistance ( double px, double py, double ax, double ay,
+				  double bx, double by )
   {
-    EMF::METAFILEDEVICECONTEXT* dc =
-      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+    double dx = bx - ax, dy = by - ay;
+    double length2 = dx * dx + dy * dy;
+    double t = length2 > 0 ? ( ( px - ax ) * dx + ( py - ay ) * dy ) / length2 : 0;
 
-    if ( dc == 0 ) return FALSE;
+    if ( t < 0 ) t = 0;
+    else if ( t > 1 ) t = 1;
 
-    EMF::globalObjects.remove( dc );
+    double ex = ax + t * dx - px, ey = ay + t * dy - py;
 
-    return TRUE;
+    return sqrt( ex * ex + ey * ey );
   }
+
   /*!
-   * Create an enhanced metafile on disk.
-   * \param context pseudo device context.
-   * \param filename ASCII filename of metafile.
-   * \param size the size (really the position on the paper) of the plot image.
-   * \param description description string for metafile (see EMF::METAFILE
-   * constructor for details).
-   * \return handle to a metafile device context.
+   * Mark the points of [first,last] which Douglas-Peucker keeps. The
+   * end points must already be marked. Each span is scanned once, so this
+   * takes O(n log n) for well-behaved input but O(n^2) in the worst case
+   * (when every split peels off a single point). The spans wait on an
+   * explicit stack, which never holds more than n of them, rather than on
+   * the call stack, since the point lists can be very long.
    */
-  EMF_DECLARE(HDC) CreateEnhMetaFileA ( HDC referenceContext, LPCSTR filename, const RECT* size,
-			   LPCSTR description )
-  {
-    // In this version, the library handles the file operations itself.
-    // Note: No effort is made to preserve the contents of an existing
-    // metafile!
+  static void douglasPeucker ( const std::vector<double>& x,
+			       const std::vector<double>& y,
+			       size_t first, size_t last, double tolerance,
+			       std::vector<char>& keep )
+  {
+    std::vector< std::pair<size_t,size_t> > spans;
+    spans.push_back( std::make_pair( first, last ) );
+
+    while ( !spans.empty() ) {
+      size_t a = spans.back().first, b = spans.back().second;
+      spans.pop_back();
+
+      double max_distance = -1;
+      size_t farthest = a;
+
+      for ( size_t i = a + 1; i < b; i++ ) {
+	double d = segmentDistance( x[i], y[i], x[a], y[a], x[b], y[b] );
+	if ( d > max_distance ) {
+	  max_distance = d;
+	  farthest = i;
+	}
+      }
 
-    ::FILE* fp = 0;
+      if ( max_distance > tolerance ) {
+	keep[farthest] = 1;
+	spans.push_back( std::make_pair( a, farthest ) );
+	spans.push_back( std::make_pair( farthest, b ) );
+      }
+    }
+  }
 
-    if ( filename ) {
-      fp = ::fopen( filename, "w" );
-      if ( fp == 0 ) return 0;
+  /*!
+   * Mark the points which Visvalingam-Whyatt keeps, i.e. repeatedly remove
+   * the point which forms the smallest triangle with its neighbors until
+   * all remaining triangles are at least as large as the threshold.
+   */
+  static void visvalingam ( const std::vector<double>& x,
+			    const std::vector<double>& y,
+			    double threshold, size_t minimum,
+			    std::vector<char>& keep )
+  {
+    size_t n = x.size();
+    std::vector<size_t> prev( n ), next( n );
+    std::vector<double> area( n, 0 );
+
+    auto triangle = [&]( size_t i ) {
+      return 0.5 * fabs( ( x[prev[i]] - x[i] ) * ( y[next[i]] - y[i] ) -
+			 ( x[next[i]] - x[i] ) * ( y[prev[i]] - y[i] ) );
+    };
+
+    typedef std::pair<double,size_t> ENTRY;
+    std::priority_queue< ENTRY, std::vector<ENTRY>, std::greater<ENTRY> > heap;
+
+    for ( size_t i = 0; i < n; i++ ) {
+      prev[i] = i - 1;
+      next[i] = i + 1;
+      keep[i] = 1;
+    }
+    for ( size_t i = 1; i + 1 < n; i++ ) {
+      area[i] = triangle( i );
+      heap.push( ENTRY( area[i], i ) );
     }
 
-    LPWSTR description_w = 0;
+    size_t remaining = n;
 
-    if ( description ) {
-      int description1_count = ::strlen( description );
-      int description2_count = ::strlen( description + (description1_count + 1) );
+    while ( !heap.empty() && remaining > minimum ) {
+      ENTRY e = heap.top();
+      heap.pop();
 
-      description_w = new WCHAR[ description1_count + description2_count + 3 ];
+      size_t i = e.second;
+      if ( !keep[i] || e.first != area[i] ) continue; // stale entry
+      if ( e.first >= threshold ) break;
 
-      for ( int i=0; i<=(description1_count + description2_count + 2); i++ )
-	description_w[i] = (WCHAR)*description++;
+      keep[i] = 0;
+      remaining--;
+      next[prev[i]] = next[i];
+      prev[next[i]] = prev[i];
+
+      // A neighbor's area never drops below that of the point just removed,
+      // otherwise removal order could depend on the order of evaluation
+      size_t neighbors[2] = { prev[i], next[i] };
+      for ( size_t j : neighbors ) {
+	if ( j == 0 || j == n - 1 ) continue;
+	area[j] = (std::max)( triangle( j ), e.first );
+	heap.push( ENTRY( area[j], j ) );
+      }
     }
+  }
 
-    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size,
-					  description_w );
+  /*!
+   * M4 decimation of a time series: of the points falling in each device
+   * column, keep only the first, last, minimum and maximum (in their
+   * original order). Rasterizing the result draws exactly the same pixels
+   * as the full series. This only works if x is monotone; otherwise the
+   * points are left alone.
+   * \param dc the device context supplying the window/viewport mapping.
+   * \param points the logical points.
+   * \param n the number of points.
+   * \param width the width of a column in device units.
+   * \param result filled with the decimated points.
+   * \return false if x is not monotone.
+   */
+  static bool m4 ( const METAFILEDEVICECONTEXT* dc, const POINT* points,
+		   size_t n, double width, std::vector<POINT>& result )
+  {
+    result.clear();
+
+    int direction = 0;		// Which way x is heading, once we know
+    double column = 0;		// The column of the points in hand
+    size_t first = 0, last = 0, lowest = 0, highest = 0;
+    double previous_x = 0, low_y = 0, high_y = 0;
+
+    auto flush = [&]( void ) {
+      size_t keep[4] = { first, lowest, highest, last };
+      std::sort( keep, keep + 4 );
+      for ( int k = 0; k < 4; k++ )
+	if ( k == 0 || keep[k] != keep[k-1] )
+	  result.push_back( points[keep[k]] );
+    };
+
+    for ( size_t i = 0; i < n; i++ ) {
+      double x, y;
+      dc->toDevice( points[i], x, y );
+
+      if ( i > 0 && x != previous_x ) {
+	int d = x > previous_x ? 1 : -1;
+	if ( direction == 0 )
+	  direction = d;
+	else if ( d != direction )
+	  return false;
+      }
+      previous_x = x;
 
-    if ( description_w ) delete[] description_w;
+      double c = floor( x / width );
 
-    return dc;
+      if ( i == 0 || c != column ) {
+	if ( i > 0 ) flush();
+	column = c;
+	first = lowest = highest = i;
+	low_y = high_y = y;
+      }
+      else if ( y < low_y ) {
+	low_y = y;
+	lowest = i;
+      }
+      else if ( y > high_y ) {
+	high_y = y;
+	highest = i;
+      }
+      last = i;
+    }
+
+    if ( n > 0 ) flush();
+
+    return true;
   }
+
   /*!
-   * Create an enhanced metafile on disk. This differs from CreateEnhMetaFileA
-   * only in that the filename and description are made of wide characters.
-   *
-   * \param context pseudo device context.
-   * \param filename ASCII filename of metafile.
-   * \param size the size (really the position on the paper) of the plot image.
-   * \param description description string for metafile (see EMF::METAFILE
-   * constructor for details).
-   * \return handle to a metafile device context.
+   * Apply the simplification selected with SetPolylineSimplification to a
+   * list of points. The work is done in device coordinates so that the
+   * tolerance means the same thing in both directions whatever the
+   * window/viewport mapping. The first and last points are always kept;
+   * for a closed figure (polygon) at least three points remain.
+   * \param points the logical points.
+   * \param n the number of points.
+   * \param closed true if the points describe a polygon.
+   * \param result filled with the simplified points.
+   * \return true if result should be used instead of points.
    */
-  EMF_DECLARE(HDC) CreateEnhMetaFileW ( HDC referenceContext, LPCWSTR filename,
-			   const RECT* size, LPCWSTR description )
+  bool METAFILEDEVICECONTEXT::simplify ( const POINT* points, size_t n,
+					 bool closed, std::vector<POINT>& result )
   {
-    ::FILE* fp = 0;
+    if ( simplify_method == EMF_SIMPLIFY_NONE || simplify_tolerance <= 0 ||
+	 n < ( closed ? 4u : 3u ) )
+      return false;
 
-    if ( filename ) {
-      // Well, the ANSI C library doesn't have any routines for
-      // opening a file with a wide character filename, so, we have to
-      // convert it back to ASCII and hope for the best.
-      LPCWSTR w_tmp = filename;
-      int n_char_w = 0;
-      while ( *w_tmp++ ) n_char_w++;
-      std::string filename_a( filename, filename + n_char_w );
+    if ( simplify_method == EMF_SIMPLIFY_M4 ) {
+      if ( closed || !m4( this, points, n, simplify_tolerance, result ) ||
+	   result.size() == n )
+	return false;
 
-      fp = ::fopen( filename_a.c_str(), "w" );
+      stats.nPointsSimplified += n - result.size();
 
-      if ( fp == 0 ) return 0;
+      return true;
     }
 
-    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size,
-					  description );
-    return dc;
+    std::vector<double> x( n ), y( n );
+
+    for ( size_t i = 0; i < n; i++ )
+      toDevice( points[i], x[i], y[i] );
+
+    std::vector<char> keep( n, 0 );
+
+    if ( simplify_method == EMF_SIMPLIFY_VISVALINGAM ) {
+      visvalingam( x, y, (double)simplify_tolerance * simplify_tolerance,
+		   closed ? 3 : 2, keep );
+    }
+    else {
+      keep[0] = keep[n-1] = 1;
+
+      // A closed figure is split at the point farthest from the start so
+      // that it can't collapse into a line
+      size_t farthest = 0;
+      if ( closed ) {
+	double max_distance = 0;
+	for ( size_t i = 1; i < n - 1; i++ ) {
+	  double dx = x[i] - x[0], dy = y[i] - y[0];
+	  if ( dx * dx + dy * dy > max_distance ) {
+	    max_distance = dx * dx + dy * dy;
+	    farthest = i;
+	  }
+	}
+      }
+
+      if ( farthest > 0 ) {
+	keep[farthest] = 1;
+	douglasPeucker( x, y, 0, farthest, simplify_tolerance, keep );
+	douglasPeucker( x, y, farthest, n - 1, simplify_tolerance, keep );
+      }
+      else
+	douglasPeucker( x, y, 0, n - 1, simplify_tolerance, keep );
+    }
+
+    // A polygon must come out with at least three corners. The count
+    // leaves out a last point which only repeats the first to close it.
+    if ( closed ) {
+      size_t last = n - 1;
+      if ( x[last] == x[0] && y[last] == y[0] ) last--;
+
+      std::vector<size_t> corners;
+      for ( size_t i = 0; i <= last; i++ )
+	if ( keep[i] ) corners.push_back( i );
+
+      while ( corners.size() < 3 ) {
+	// Add the point farthest from the corners kept so far
+	size_t a = corners.front(), b = corners.back(), farthest = 0;
+	double max_distance = -1;
+	for ( size_t i = 1; i <= last; i++ ) {
+	  if ( keep[i] ) continue;
+	  double d = segmentDistance( x[i], y[i], x[a], y[a], x[b], y[b] );
+	  if ( d > max_distance ) {
+	    max_distance = d;
+	    farthest = i;
+	  }
+	}
+	if ( farthest == 0 ) return false; // Not even three points to keep
+
+	keep[farthest] = 1;
+	corners.push_back( farthest );
+	std::sort( corners.begin(), corners.end() );
+      }
+    }
+
+    result.clear();
+    for ( size_t i = 0; i < n; i++ )
+      if ( keep[i] ) result.push_back( points[i] );
+
+    if ( result.size() == n ) return false;
+
+    stats.nPointsSimplified += n - result.size();
+
+    return true;
+  }
+
+  double METAFILEDEVICECONTEXT::penReach ( double scale ) const
+  {
+    DWORD style;
+    double width;
+
+    if ( extpen ) {
+      style = extpen->elpPenStyle;
+      width = ( style & PS_TYPE_MASK ) == PS_GEOMETRIC ?
+	extpen->elpWidth * scale : 1;
+    }
+    else {
+      style = pen->lopnStyle;
+      width = (std::max)( pen->lopnWidth.x * scale, 1. );
+    }
+
+    if ( ( style & PS_STYLE_MASK ) == PS_NULL ) return 0;
+
+    // Half the width, or more at a square cap or a mitered join
+    if ( ( style & PS_JOIN_MASK ) == PS_JOIN_MITER )
+      return width * (std::max)( miter_limit / 2., 1. );
+
+    return width;
+  }
+
+  bool METAFILEDEVICECONTEXT::styledPen ( void ) const
+  {
+    DWORD style = extpen ? extpen->elpPenStyle : pen->lopnStyle;
+
+    switch ( style & PS_STYLE_MASK ) {
+    case PS_SOLID:
+    case PS_NULL:
+    case PS_INSIDEFRAME:
+      return false;
+    default:
+      return true;
+    }
   }
 
   /*!
-   * Many graphics programs want to open and close output files themselves. At
-   * least, gnuplot and Grace do. So, supply the FILE pointer when creating
-   * a metafile and let the plotting program's driver handle it.
-   *
-   * \param context pseudo device context.
-   * \param fp open FILE pointer.
-   * \param size the size (really the position on the paper) of the plot image.
-   * \param description description string for metafile (see EMF::METAFILE
-   * constructor for details).
-   * \return handle to a metafile device context.
+   * The scale factors of the mapping from logical to device units, if this
+   * context can tell what they are: not under a world transform, nor under
+   * a mapping mode other than MM_TEXT (where the extents don't apply) or
+   * MM_ANISOTROPIC.
+   * \param sx returns the horizontal scale (device units per logical unit).
+   * \param sy returns the vertical scale.
+   * \return false if the mapping isn't known.
    */
-  EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEA ( HDC referenceContext, ::FILE* fp,
-				   const RECT* size, LPCSTR description )
+  bool METAFILEDEVICECONTEXT::deviceScale ( double& sx, double& sy ) const
   {
-    // All this does is promote the ASCII strings to UNICODE (after a fashion)
-    // and then use CreateEnhMetaFileWithFILEW
+    if ( world_transform ) return false;
+
+    if ( map_mode == MM_TEXT ) {
+      sx = sy = 1;
+      return true;
+    }
+
+    if ( map_mode != MM_ANISOTROPIC || window_ext.cx == 0 || window_ext.cy == 0 ||
+	 viewport_ext.cx == 0 || viewport_ext.cy == 0 )
+      return false;
+
+    sx = (double)viewport_ext.cx / window_ext.cx;
+    sy = (double)viewport_ext.cy / window_ext.cy;
+
+    return true;
+  }
+
+  /*!
+   * With EMF_OPTION_CLIP_TO_FRAME, find the rectangle in logical
+   * coordinates outside of which nothing drawn with the current pen can
+   * be seen in the frame given to CreateEnhMetaFile. That is the frame in
+   * device units, widened by the reach of the pen and a little for
+   * rounding, then mapped back through the window and viewport. Clipping
+   * doesn't apply without an explicit frame, inside a path bracket (the
+   * path may be stroked with another pen) or when deviceScale can't tell
+   * what the mapping is.
+   * \param clip returns the rectangle.
+   * \return false if clipping doesn't apply.
+   */
+  bool METAFILEDEVICECONTEXT::clipRect ( CLIPRECT& clip ) const
+  {
+    double sx, sy;
+
+    if ( !( options & EMF_OPTION_CLIP_TO_FRAME ) || update_frame || in_path ||
+	 !deviceScale( sx, sy ) )
+      return false;
+
+    if ( header->szlDevice.cx <= 0 || header->szlDevice.cy <= 0 ||
+	 header->szlMillimeters.cx <= 0 || header->szlMillimeters.cy <= 0 )
+      return false;
+
+    double px = (double)header->szlDevice.cx / ( header->szlMillimeters.cx * 100. );
+    double py = (double)header->szlDevice.cy / ( header->szlMillimeters.cy * 100. );
+    double margin = penReach( (std::max)( std::fabs( sx ), std::fabs( sy ) ) ) + 2;
+
+    double left = ( header->rclFrame.left * px - margin - viewport_org.x ) / sx +
+      window_org.x;
+    double right = ( header->rclFrame.right * px + margin - viewport_org.x ) / sx +
+      window_org.x;
+    double top = ( header->rclFrame.top * py - margin - viewport_org.y ) / sy +
+      window_org.y;
+    double bottom = ( header->rclFrame.bottom * py + margin - viewport_org.y ) / sy +
+      window_org.y;
+
+    clip.left = (std::min)( left, right );
+    clip.right = (std::max)( left, right );
+    clip.top = (std::min)( top, bottom );
+    clip.bottom = (std::max)( top, bottom );
+
+    return true;
+  }
+
+  /*!
+   * With EMF_OPTION_CLIP_TO_FRAME, decide whether a figure can be left
+   * out of the metafile because it lies entirely outside the frame.
+   * \param x0 x coordinate of one corner of the figure's bounds.
+   * \param y0 y coordinate of one corner of the figure's bounds.
+   * \param x1 x coordinate of the opposite corner.
+   * \param y1 y coordinate of the opposite corner.
+   * \return true if the caller should not append the figure.
+   */
+  bool METAFILEDEVICECONTEXT::culled ( LONG x0, LONG y0, LONG x1, LONG y1 )
+  {
+    CLIPRECT clip;
+
+    if ( !clipRect( clip ) ) return false;
+
+    if ( (std::max)( x0, x1 ) < clip.left || (std::min)( x0, x1 ) > clip.right ||
+	 (std::max)( y0, y1 ) < clip.top || (std::min)( y0, y1 ) > clip.bottom ) {
+      stats.nPrimitivesCulled++;
+      return true;
+    }
+
+    return false;
+  }
+
+  /*!
+   * Remove the vertices of a figure which lie in the outside half plane of
+   * one edge of the clip rectangle, except at the ends of each run of them:
+   * the edge joining the ends of a run stays in that half plane, so the
+   * outline only changes where it can't be seen, and (since the half plane
+   * is convex) the winding number of every point on the inside is the same.
+   * Unlike Sutherland-Hodgman proper, no new vertices are made, so there
+   * is nothing to round and the visible edges are exactly the originals.
+   * \param points the figure, updated in place.
+   * \param codes the outcodes of points, updated in place.
+   * \param side the outcode bit of the edge.
+   * \param closed true for a polygon (the vertices are cyclic).
+   * \param keep_ends true if the first and last points must stay.
+   * \return false if the whole figure is outside.
+   */
+  static bool clipSide ( std::vector<POINT>& points, std::vector<unsigned char>& codes,
+			 unsigned char side, bool closed, bool keep_ends )
+  {
+    size_t n = points.size(), kept = 0;
+
+    for ( size_t i = 0; i < n; i++ ) {
+      bool keep = !( codes[i] & side );
+
+      if ( !keep ) {
+	bool first = i == 0, last = i == n - 1;
+	bool after_inside, before_inside;
+
+	if ( closed ) {
+	  after_inside = !( codes[first ? n - 1 : i - 1] & side );
+	  before_inside = !( codes[last ? 0 : i + 1] & side );
+	}
+	else {
+	  after_inside = !first && !( codes[i - 1] & side );
+	  before_inside = !last && !( codes[i + 1] & side );
+	  if ( keep_ends && ( first || last ) ) after_inside = true;
+	}
+
+	keep = after_inside || before_inside;
+      }
+
+      if ( keep ) {
+	points[kept] = points[i];
+	codes[kept] = codes[i];
+	kept++;
+      }
+    }
+
+    points.resize( kept );
+    codes.resize( kept );
+
+    return kept > 0;
+  }
+
+  /*!
+   * With EMF_OPTION_CLIP_TO_FRAME, trim a polyline or polygon to the frame
+   * (see clipRect). A figure entirely outside one edge is culled, except
+   * that with keep_ends its first and last points are kept. Otherwise, if
+   * the pen isn't styled (the pattern would restart differently), the
+   * stretches of the figure which can't be seen are cut short by
+   * clipSide for each edge in turn.
+   * \param points the logical points.
+   * \param n the number of points.
+   * \param closed true if the points describe a polygon.
+   * \param keep_ends true if the first and last points must be kept (so
+   * that the current point comes out the same).
+   * \param result filled with the trimmed points.
+   * \return CLIP_TRIMMED if result should be used instead of points,
+   * CLIP_CULLED if nothing should be drawn.
+   */
+  METAFILEDEVICECONTEXT::CLIPRESULT
+  METAFILEDEVICECONTEXT::clip ( const POINT* points, size_t n, bool closed,
+				bool keep_ends, std::vector<POINT>& result )
+  {
+    CLIPRECT rect;
+
+    if ( n == 0 || !clipRect( rect ) ) return CLIP_UNCHANGED;
+
+    // Cohen-Sutherland outcodes. This loop has no branches, so the
+    // compiler is free to vectorize it.
+    std::vector<unsigned char> codes( n );
+    unsigned char any = 0, all = 0xf;
+
+    for ( size_t i = 0; i < n; i++ ) {
+      double x = points[i].x, y = points[i].y;
+      unsigned char code = (unsigned char)( ( x < rect.left ) |
+					    ( x > rect.right ) << 1 |
+					    ( y < rect.top ) << 2 |
+					    ( y > rect.bottom ) << 3 );
+      codes[i] = code;
+      any |= code;
+      all &= code;
+    }
+
+    if ( any == 0 ) return CLIP_UNCHANGED;
+
+    if ( all != 0 ) {
+      if ( !keep_ends ) {
+	stats.nPrimitivesCulled++;
+	return CLIP_CULLED;
+      }
+      if ( n <= 2 || styledPen() ) return CLIP_UNCHANGED;
+
+      result.clear();
+      result.push_back( points[0] );
+      result.push_back( points[n-1] );
+      stats.nPointsClipped += (DWORD)( n - 2 );
+
+      return CLIP_TRIMMED;
+    }
+
+    if ( styledPen() ) return CLIP_UNCHANGED;
+
+    result.assign( points, points + n );
+
+    for ( unsigned char side = 1; side <= 8; side <<= 1 )
+      if ( ( any & side ) && !clipSide( result, codes, side, closed, keep_ends ) ) {
+	stats.nPrimitivesCulled++;
+	return CLIP_CULLED;
+      }
+
+    if ( result.size() == n ) return CLIP_UNCHANGED;
+
+    stats.nPointsClipped += (DWORD)( n - result.size() );
+
+    return CLIP_TRIMMED;
+  }
+
+  /*!
+   * With EMF_OPTION_GROUP_OBJECTS, note what the record just appended
+   * paints, and where on the device, so that groupObjects may move it.
+   * Figures drawn inside a path bracket or under a mapping this context
+   * can't follow are left where they are.
+   * \param record the record.
+   */
+  void METAFILEDEVICECONTEXT::describeRecord ( const METARECORD* record )
+  {
+    RECTL bounds;
+    DWORD uses = record->draws( bounds );
+    double sx, sy;
+
+    if ( uses == 0 || in_path || !deviceScale( sx, sy ) ) return;
+
+    double left = ( bounds.left - window_org.x ) * sx + viewport_org.x;
+    double right = ( bounds.right - window_org.x ) * sx + viewport_org.x;
+    double top = ( bounds.top - window_org.y ) * sy + viewport_org.y;
+    double bottom = ( bounds.bottom - window_org.y ) * sy + viewport_org.y;
+
+    // A pixel more for rounding, and the stroke if there is one
+    double margin = 1;
+    if ( uses & METARECORD::USES_PEN )
+      margin += penReach( (std::max)( std::fabs( sx ), std::fabs( sy ) ) );
+
+    ORDERING figure;
+    figure.record = records.size() - 1;
+    figure.uses = uses;
+    figure.object = 0;
+    figure.bounds.left = (LONG)floor( (std::min)( left, right ) - margin );
+    figure.bounds.right = (LONG)ceil( (std::max)( left, right ) + margin );
+    figure.bounds.top = (LONG)floor( (std::min)( top, bottom ) - margin );
+    figure.bounds.bottom = (LONG)ceil( (std::max)( top, bottom ) + margin );
+
+    orderings.push_back( figure );
+  }
+
+  //! Do two device rectangles share any pixel?
+  static inline bool overlap ( const RECTL& a, const RECTL& b )
+  {
+    return a.left <= b.right && b.left <= a.right &&
+      a.top <= b.bottom && b.top <= a.bottom;
+  }
+
+  /*!
+   * Reorder one run of movable records (see groupObjects).
+   * \param dc the metafile device context.
+   * \param run the descriptions of the records.
+   * \param n the number of records in the run.
+   * \param grouped the new list of records, to which the run is appended.
+   * \return the number of SelectObject records saved.
+   */
+  static size_t groupRun ( METAFILEDEVICECONTEXT* dc,
+			   const METAFILEDEVICECONTEXT::ORDERING* run, size_t n,
+			   std::vector<METARECORD*>& grouped )
+  {
+    //! A figure, with the objects it has to be drawn with.
+    struct FIGURE {
+      METARECORD* record;	//!< The record.
+      DWORD uses;		//!< The USES_* objects it is drawn with.
+      HGDIOBJ needs[3];		//!< Those objects, by slot (0: as before the run).
+      RECTL bounds;		//!< Its device bounds.
+    };
+    const DWORD slots[3] = { METARECORD::USES_PEN, METARECORD::USES_BRUSH,
+			     METARECORD::USES_FONT };
+
+    std::vector<FIGURE> figures;
+    std::vector<METARECORD*> creations, selections;
+    HGDIOBJ state[3] = { 0, 0, 0 };
+
+    for ( size_t k = 0; k < n; k++ ) {
+      METARECORD* record = dc->records[run[k].record];
+
+      if ( run[k].uses & METARECORD::DRAWS ) {
+	FIGURE figure = { record, run[k].uses, { 0, 0, 0 }, run[k].bounds };
+	for ( int s = 0; s < 3; s++ )
+	  if ( run[k].uses & slots[s] ) figure.needs[s] = state[s];
+	figures.push_back( figure );
+      }
+      else if ( run[k].uses != 0 ) {
+	for ( int s = 0; s < 3; s++ )
+	  if ( run[k].uses == slots[s] ) state[s] = run[k].object;
+	selections.push_back( record );
+      }
+      else
+	creations.push_back( record );
+    }
+
+    // Creations go first; selections are made again only as figures need them
+    std::vector<METARECORD*> out( creations );
+    std::vector<METARECORD*> made;
+    HGDIOBJ current[3] = { 0, 0, 0 };
+
+    auto select = [&]( HGDIOBJ object ) {
+      METARECORD* selection = new EMRSELECTOBJECT( object );
+      made.push_back( selection );
+      out.push_back( selection );
+    };
+
+    // The figures not yet placed, as a linked list
+    const size_t end = figures.size();
+    std::vector<size_t> next( end );
+    for ( size_t i = 0; i < end; i++ ) next[i] = i + 1;
+
+    std::vector<RECTL> passed;
+
+    for ( size_t head = 0; head != end; ) {
+      const FIGURE& first = figures[head];
+      head = next[head];
+
+      for ( int s = 0; s < 3; s++ )
+	if ( ( first.uses & slots[s] ) && first.needs[s] != current[s] ) {
+	  select( first.needs[s] );
+	  current[s] = first.needs[s];
+	}
+      out.push_back( first.record );
+
+      // Bring forward the later figures drawn with the same objects,
+      // provided they don't overlap any figure they would jump over
+      passed.clear();
+      RECTL reach = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+      size_t scanned = 0;
+
+      for ( size_t j = head, previous = end; j != end &&
+	      scanned < METAFILEDEVICECONTEXT::GROUP_LOOKAHEAD &&
+	      passed.size() < METAFILEDEVICECONTEXT::GROUP_MAX_PASSED;
+	    scanned++ ) {
+	const FIGURE& figure = figures[j];
+	size_t after = next[j];
+	bool movable = true;
+
+	for ( int s = 0; s < 3 && movable; s++ )
+	  if ( ( figure.uses & slots[s] ) && figure.needs[s] != current[s] )
+	    movable = false;
+
+	if ( movable && overlap( figure.bounds, reach ) )
+	  for ( size_t p = 0; p < passed.size() && movable; p++ )
+	    if ( overlap( figure.bounds, passed[p] ) ) movable = false;
+
+	if ( movable ) {
+	  out.push_back( figure.record );
+	  if ( previous == end ) head = after; else next[previous] = after;
+	}
+	else {
+	  passed.push_back( figure.bounds );
+	  reach.left = (std::min)( reach.left, figure.bounds.left );
+	  reach.top = (std::min)( reach.top, figure.bounds.top );
+	  reach.right = (std::max)( reach.right, figure.bounds.right );
+	  reach.bottom = (std::max)( reach.bottom, figure.bounds.bottom );
+	  previous = j;
+	}
+
+	j = after;
+      }
+    }
+
+    // Leave the objects selected as they were at the end of the run
+    for ( int s = 0; s < 3; s++ )
+      if ( state[s] != 0 && current[s] != state[s] )
+	select( state[s] );
+
+    // It is possible (if unlikely) for this to be no improvement
+    if ( made.size() >= selections.size() ) {
+      for ( auto m : made ) delete m;
+      for ( size_t k = 0; k < n; k++ )
+	grouped.push_back( dc->records[run[k].record] );
+      return 0;
+    }
+
+    for ( auto s : selections ) delete s;
+    grouped.insert( grouped.end(), out.begin(), out.end() );
+
+    return selections.size() - made.size();
+  }
+
+  /*!
+   * With EMF_OPTION_GROUP_OBJECTS, reorder the figures so that those drawn
+   * with the same pen, brush and font are together, and so need fewer
+   * SelectObject records. Only runs of records without any other state
+   * change between them are reordered, and a figure only moves ahead of
+   * another if their device bounds (stroke included) don't overlap, so the
+   * picture is painted just as before. The object selections are then
+   * made only where the reordered figures need them.
+   */
+  void METAFILEDEVICECONTEXT::groupObjects ( void )
+  {
+    if ( !pixels.empty() ) flushPixels();
+
+    if ( orderings.empty() ) return;
+
+    std::vector<METARECORD*> grouped;
+    grouped.reserve( records.size() );
+    size_t copied = 0, saved = 0;
+
+    for ( size_t a = 0, b; a < orderings.size(); a = b ) {
+      for ( b = a + 1; b < orderings.size() &&
+	      orderings[b].record == orderings[b-1].record + 1; b++ );
+
+      grouped.insert( grouped.end(), records.begin() + copied,
+		      records.begin() + orderings[a].record );
+      copied = orderings[b-1].record + 1;
+
+      saved += groupRun( this, &orderings[a], b - a, grouped );
+    }
+
+    grouped.insert( grouped.end(), records.begin() + copied, records.end() );
+    records.swap( grouped );
+    play_ops.clear();
+    orderings.clear();
+
+    header->nRecords -= saved;
+    header->nBytes -= saved * sizeof( ::EMRSELECTOBJECT );
+    stats.nSelectRecordsGrouped += saved;
+  }
+
+  //! What pruneRecords needs to know about a record.
+  enum RECORDKIND {
+    K_OTHER,			//!< Anything else: paints, uses the current position.
+    K_CREATE,			//!< Creates a metafile object.
+    K_SELECT,			//!< Selects a metafile object.
+    K_DELETE,			//!< Deletes a metafile object.
+    K_SAVE,			//!< SaveDC.
+    K_RESTORE,			//!< RestoreDC.
+    K_MOVE,			//!< MoveToEx.
+    K_BEGINPATH,		//!< BeginPath.
+    K_ENDPATH,			//!< EndPath.
+    K_PAINTPATH,		//!< Fills or strokes the path.
+    K_DRAWTO,			//!< Draws from the current position (or CloseFigure).
+    K_FIGURE,			//!< Draws without the current position (see draws()).
+    K_STATE			//!< Changes graphics state which RestoreDC restores.
+  };
+
+  /*!
+   * Classify a record for pruneRecords. Anything not recognized here is
+   * K_OTHER, which is never dropped and is assumed to use everything.
+   * \param record the record.
+   * \param uses returns, for K_FIGURE, the USES_* objects it is drawn with.
+   */
+  static RECORDKIND recordKind ( const METARECORD* record, DWORD& uses )
+  {
+    RECTL bounds;
+    uses = METARECORD::USES_PEN | METARECORD::USES_BRUSH | METARECORD::USES_FONT;
+
+    DWORD draws = record->draws( bounds );
+    if ( draws != 0 ) {
+      uses = draws;
+      return K_FIGURE;
+    }
+
+    if ( dynamic_cast<const EMRSELECTOBJECT*>( record ) ) return K_SELECT;
+    if ( dynamic_cast<const EMRDELETEOBJECT*>( record ) ) return K_DELETE;
+    if ( const_cast<METARECORD*>( record )->objectHandle() ) return K_CREATE;
+    if ( dynamic_cast<const EMRMOVETOEX*>( record ) ) return K_MOVE;
+    if ( dynamic_cast<const EMRSAVEDC*>( record ) ) return K_SAVE;
+    if ( dynamic_cast<const EMRRESTOREDC*>( record ) ) return K_RESTORE;
+    if ( dynamic_cast<const EMRBEGINPATH*>( record ) ) return K_BEGINPATH;
+    if ( dynamic_cast<const EMRENDPATH*>( record ) ) return K_ENDPATH;
+
+    if ( dynamic_cast<const EMRFILLPATH*>( record ) ||
+	 dynamic_cast<const EMRSTROKEPATH*>( record ) ||
+	 dynamic_cast<const EMRSTROKEANDFILLPATH*>( record ) )
+      return K_PAINTPATH;
+
+    if ( dynamic_cast<const EMRLINETO*>( record ) ||
+	 dynamic_cast<const EMRARCTO*>( record ) ||
+	 dynamic_cast<const EMRPOLYLINETO*>( record ) ||
+	 dynamic_cast<const EMRPOLYLINETO16*>( record ) ||
+	 dynamic_cast<const EMRPOLYBEZIERTO*>( record ) ||
+	 dynamic_cast<const EMRPOLYBEZIERTO16*>( record ) ||
+	 dynamic_cast<const EMRCLOSEFIGURE*>( record ) )
+      return K_DRAWTO;
+
+    if ( dynamic_cast<const EMRSETTEXTALIGN*>( record ) ||
+	 dynamic_cast<const EMRSETTEXTCOLOR*>( record ) ||
+	 dynamic_cast<const EMRSETBKCOLOR*>( record ) ||
+	 dynamic_cast<const EMRSETBKMODE*>( record ) ||
+	 dynamic_cast<const EMRSETPOLYFILLMODE*>( record ) ||
+	 dynamic_cast<const EMRSETMAPMODE*>( record ) ||
+	 dynamic_cast<const EMRSETMITERLIMIT*>( record ) ||
+	 dynamic_cast<const EMRSETVIEWPORTORGEX*>( record ) ||
+	 dynamic_cast<const EMRSETWINDOWORGEX*>( record ) ||
+	 dynamic_cast<const EMRSETVIEWPORTEXTEX*>( record ) ||
+	 dynamic_cast<const EMRSETWINDOWEXTEX*>( record ) ||
+	 dynamic_cast<const EMRSCALEVIEWPORTEXTEX*>( record ) ||
+	 dynamic_cast<const EMRSCALEWINDOWEXTEX*>( record ) ||
+	 dynamic_cast<const EMRSETWORLDTRANSFORM*>( record ) ||
+	 dynamic_cast<const EMRMODIFYWORLDTRANSFORM*>( record ) )
+      return K_STATE;
+
+    return K_OTHER;
+  }
+
+  /*!
+   * With EMF_OPTION_PRUNE_RECORDS, drop the records which have no effect
+   * on the picture, then number the remaining objects densely so that the
+   * handle table is as small as possible. Dropped are:
+   * \li pens, brushes and fonts (with their selections and deletion) which
+   * nothing is drawn with;
+   * \li MoveToEx records whose position is never used;
+   * \li paths which are never filled or stroked;
+   * \li SaveDC/RestoreDC pairs between which nothing but state changes
+   * (which RestoreDC undoes anyway) is left.
+   *
+   * Each of these is found in one pass over the records; anything which
+   * isn't understood is assumed to use the whole graphics state.
+   */
+  void METAFILEDEVICECONTEXT::pruneRecords ( void )
+  {
+    if ( !( options & EMF_OPTION_PRUNE_RECORDS ) ) return;
+
+    if ( !pixels.empty() ) flushPixels();
+
+    const size_t n = records.size();
+    std::vector<unsigned char> kinds( n );
+    std::vector<DWORD> uses( n );
+    std::vector<bool> dead( n, false );
+
+    for ( size_t i = 1; i < n; i++ )
+      kinds[i] = recordKind( records[i], uses[i] );
+
+    // First, backwards: is the current position (or the path) used by
+    // anything after each record? The figures in a path which is never
+    // painted only build the path, and change the current position.
+
+    std::vector<size_t> begin_path( n, 0 );
+    std::vector<bool> pure_path( n, false );
+
+    for ( size_t i = 1, begin = 0; i < n; i++ ) {
+      if ( kinds[i] == K_BEGINPATH )
+	begin = i;
+      else if ( kinds[i] == K_ENDPATH && begin != 0 ) {
+	bool pure = true;
+	for ( size_t j = begin + 1; j < i && pure; j++ )
+	  pure = kinds[j] != K_OTHER && kinds[j] != K_SAVE &&
+	    kinds[j] != K_RESTORE && kinds[j] != K_PAINTPATH;
+	begin_path[i] = begin;
+	pure_path[i] = pure;
+	begin = 0;
+      }
+    }
+
+    bool position_used = false, path_used = false;
+    size_t dead_path = 0;	// Inside a dropped path, where it begins
+    // SaveDC saves the position and the path, which are used again if
+    // they are used after the matching RestoreDC(-1)
+    std::vector< std::pair<bool,bool> > restored;
+    bool any_restore = false;	// Has a RestoreDC not been matched?
+
+    for ( size_t i = n - 1; i > 0; i-- ) {
+      switch ( kinds[i] ) {
+      case K_MOVE:
+      case K_DRAWTO:
+      case K_FIGURE:
+	if ( dead_path != 0 || ( kinds[i] == K_MOVE && !position_used ) )
+	  dead[i] = true;
+	else if ( kinds[i] == K_MOVE )
+	  position_used = false;
+	else if ( kinds[i] == K_DRAWTO )
+	  position_used = true;
+	break;
+      case K_ENDPATH:
+	if ( !path_used && !position_used && pure_path[i] ) {
+	  dead[i] = true;
+	  dead_path = begin_path[i];
+	}
+	break;
+      case K_BEGINPATH:
+	if ( dead_path == i ) {
+	  dead[i] = true;
+	  dead_path = 0;
+	}
+	path_used = false;
+	break;
+      case K_PAINTPATH:
+	path_used = true;
+	break;
+      case K_SAVE:
+	if ( !restored.empty() ) {
+	  position_used = position_used || restored.back().first;
+	  path_used = path_used || restored.back().second;
+	  restored.pop_back();
+	}
+	else if ( any_restore )
+	  position_used = path_used = true;
+	break;
+      case K_RESTORE:
+	if ( dynamic_cast<EMRRESTOREDC*>( records[i] )->relative() == -1 )
+	  restored.push_back( std::make_pair( position_used, path_used ) );
+	else
+	  restored.clear();
+	any_restore = true;
+	break;
+      case K_OTHER:
+	position_used = path_used = true;
+	break;
+      default:
+	break;
+      }
+    }
+
+    // Then forwards: which objects is anything drawn with? Follow the
+    // selections through SaveDC and RestoreDC; palettes are always kept.
+
+    //! The records of one metafile object, from its creation to its deletion.
+    struct LIFETIME {
+      DWORD slot;		//!< The USES_* slot it is selected into.
+      bool used;		//!< Is anything drawn with it?
+    };
+    std::vector<LIFETIME> lifetimes;
+    std::vector<long> owner( n, -1 );	// Index into lifetimes
+    std::map<DWORD, long> current;	// Metafile handle to lifetime
+    const DWORD slots[3] = { METARECORD::USES_PEN, METARECORD::USES_BRUSH,
+			     METARECORD::USES_FONT };
+    std::vector<long> selected( 3, -1 ), saved;	// Lifetime in each slot
+
+    for ( size_t i = 1; i < n; i++ ) {
+      if ( dead[i] ) continue;
+
+      switch ( kinds[i] ) {
+      case K_CREATE: {
+	LIFETIME lifetime = { 0, false };
+	if ( dynamic_cast<EMRCREATEPEN*>( records[i] ) ||
+	     dynamic_cast<EMREXTCREATEPEN*>( records[i] ) )
+	  lifetime.slot = METARECORD::USES_PEN;
+	else if ( dynamic_cast<EMRCREATEBRUSHINDIRECT*>( records[i] ) )
+	  lifetime.slot = METARECORD::USES_BRUSH;
+	else if ( dynamic_cast<EMREXTCREATEFONTINDIRECTW*>( records[i] ) )
+	  lifetime.slot = METARECORD::USES_FONT;
+	else
+	  lifetime.used = true;
+	owner[i] = lifetimes.size();
+	current[*records[i]->objectHandle()] = lifetimes.size();
+	lifetimes.push_back( lifetime );
+      }
+	break;
+      case K_SELECT:
+      case K_DELETE: {
+	DWORD handle = *records[i]->objectHandle();
+	long l = -1;
+	auto c = current.find( handle );
+	if ( c != current.end() ) {
+	  l = owner[i] = c->second;
+	  if ( kinds[i] == K_DELETE ) current.erase( c );
+	}
+	if ( kinds[i] == K_DELETE ) break;
+
+	DWORD slot = l >= 0 ? lifetimes[l].slot : 0;
+	if ( l < 0 && ( handle & ENHMETA_STOCK_OBJECT ) ) {
+	  GRAPHICSOBJECT* gobj =
+	    dynamic_cast<GRAPHICSOBJECT*>( globalObjects.find( handle ) );
+	  OBJECTTYPE type = gobj ? gobj->getType() : O_PALETTE;
+	  slot = type == O_PEN || type == O_EXTPEN ? METARECORD::USES_PEN :
+	    type == O_BRUSH ? METARECORD::USES_BRUSH :
+	    type == O_FONT ? METARECORD::USES_FONT : 0;
+	}
+	for ( int s = 0; s < 3; s++ )
+	  if ( slot == slots[s] ) selected[s] = l;
+      }
+	break;
+      case K_SAVE:
+	saved.insert( saved.end(), selected.begin(), selected.end() );
+	break;
+      case K_RESTORE: {
+	INT relative = dynamic_cast<EMRRESTOREDC*>( records[i] )->relative();
+	long depth = saved.size() / 3;
+	long level = relative < 0 ? depth + relative : relative - 1;
+	if ( level >= 0 && level < depth ) {
+	  std::copy( saved.begin() + 3 * level, saved.begin() + 3 * level + 3,
+		     selected.begin() );
+	  saved.resize( 3 * level );
+	}
+      }
+	break;
+      case K_MOVE:
+      case K_BEGINPATH:
+      case K_ENDPATH:
+      case K_STATE:
+	break;
+      default:
+	for ( int s = 0; s < 3; s++ )
+	  if ( ( uses[i] & slots[s] ) && selected[s] >= 0 )
+	    lifetimes[selected[s]].used = true;
+	break;
+      }
+    }
+
+    for ( size_t i = 1; i < n; i++ )
+      if ( owner[i] >= 0 && !lifetimes[owner[i]].used )
+	dead[i] = true;
+
+    // Then forwards again: SaveDC/RestoreDC pairs with nothing left between
+    // them but state which the RestoreDC undoes.
+
+    //! An open SaveDC.
+    struct SAVE {
+      size_t record;		//!< The SaveDC record.
+      bool needed;		//!< Has anything but state changed since?
+      size_t first_state;	//!< Where its state records start in states.
+    };
+    std::vector<SAVE> saves;
+    std::vector<size_t> states;
+
+    for ( size_t i = 1; i < n; i++ ) {
+      if ( dead[i] ) continue;
+
+      switch ( kinds[i] ) {
+      case K_SAVE: {
+	SAVE save = { i, false, states.size() };
+	saves.push_back( save );
+      }
+	break;
+      case K_RESTORE:
+	if ( saves.empty() ) break;
+	if ( dynamic_cast<EMRRESTOREDC*>( records[i] )->relative() != -1 ) {
+	  saves.clear();
+	  states.clear();
+	}
+	else if ( !saves.back().needed ) {
+	  dead[saves.back().record] = dead[i] = true;
+	  for ( size_t s = saves.back().first_state; s < states.size(); s++ )
+	    dead[states[s]] = true;
+	  states.resize( saves.back().first_state );
+	  saves.pop_back();
+	}
+	else {
+	  states.resize( saves.back().first_state );
+	  saves.pop_back();
+	  if ( !saves.empty() ) saves.back().needed = true;
+	}
+	break;
+      case K_STATE:
+      case K_SELECT:
+	if ( !saves.empty() ) states.push_back( i );
+	break;
+      case K_CREATE:
+      case K_DELETE:
+	break;
+      default:
+	if ( !saves.empty() ) saves.back().needed = true;
+	break;
+      }
+    }
+
+    // Finally, drop the dead records and renumber the objects, reusing
+    // the handles of deleted objects.
+
+    std::vector<METARECORD*> pruned;
+    pruned.reserve( n );
+    pruned.push_back( records[0] );
+
+    std::map<DWORD, DWORD> renumbered;
+    std::vector<DWORD> free_handles;
+    DWORD next_handle = 1;
+    size_t dropped = 0, bytes = 0;
+
+    for ( size_t i = 1; i < n; i++ ) {
+      if ( dead[i] ) {
+	dropped++;
+	bytes += records[i]->size();
+	delete records[i];
+	continue;
+      }
+
+      pruned.push_back( records[i] );
+
+      DWORD* handle = records[i]->objectHandle();
+      if ( handle == 0 || ( *handle & ENHMETA_STOCK_OBJECT ) ) continue;
+
+      if ( kinds[i] == K_CREATE ) {
+	DWORD h = next_handle;
+	if ( !free_handles.empty() ) {
+	  h = free_handles.back();
+	  free_handles.pop_back();
+	}
+	else
+	  next_handle++;
+	renumbered[*handle] = h;
+	*handle = h;
+      }
+      else {
+	auto r = renumbered.find( *handle );
+	if ( r == renumbered.end() ) continue;
+	*handle = r->second;
+	if ( kinds[i] == K_DELETE ) {
+	  free_handles.push_back( r->second );
+	  renumbered.erase( r );
+	}
+      }
+    }
+
+    records.swap( pruned );
+    play_ops.clear();
+
+    header->nHandles = next_handle;
+    header->nRecords -= dropped;
+    header->nBytes -= bytes;
+    stats.nDeadRecordsDropped += dropped;
+    stats.nDeadBytesDropped += bytes;
+  }
+
+  /*!
+   * RLE8 encode the rows of a tile of palette indices. Cells which are not
+   * set (-1) are skipped with delta and end-of-line escapes, which leaves
+   * those pixels unchanged on playback.
+   * \param index the palette indices, top row first.
+   * \param width width of the tile.
+   * \param height height of the tile.
+   * \param rle returns the encoded bits (bottom row first, as DIBs are).
+   */
+  static void encodeRLE8 ( const std::vector<int>& index, int width, int height,
+			   std::vector<BYTE>& rle )
+  {
+    rle.clear();
+
+    for ( int r = height - 1; r >= 0; r-- ) {
+      const int* line = &index[r * width];
+      int x = 0;
+
+      while ( x < width ) {
+	if ( line[x] < 0 ) {
+	  int end = x;
+	  while ( end < width && line[end] < 0 ) end++;
+	  if ( end == width ) break; // The end of line escape covers it
+
+	  for ( int dx = end - x; dx > 0; dx -= 255 ) {
+	    BYTE delta[] = { 0, 2, (BYTE)(std::min)( dx, 255 ), 0 };
+	    rle.insert( rle.end(), delta, delta + 4 );
+	  }
+	  x = end;
+	  continue;
+	}
+
+	int end = x + 1;
+	while ( end < width && end - x < 255 && line[end] == line[x] ) end++;
+
+	if ( end - x >= 2 ) {
+	  rle.push_back( (BYTE)( end - x ) );
+	  rle.push_back( (BYTE)line[x] );
+	  x = end;
+	  continue;
+	}
+
+	// A literal stretch lasts until a gap or the start of the next run
+	end = x + 1;
+	while ( end < width && end - x < 255 && line[end] >= 0 &&
+		!( end + 1 < width && line[end + 1] == line[end] ) )
+	  end++;
+
+	if ( end - x < 3 ) {	// Absolute mode needs at least three
+	  for ( ; x < end; x++ ) {
+	    rle.push_back( 1 );
+	    rle.push_back( (BYTE)line[x] );
+	  }
+	  continue;
+	}
+
+	rle.push_back( 0 );
+	rle.push_back( (BYTE)( end - x ) );
+	for ( int i = x; i < end; i++ )
+	  rle.push_back( (BYTE)line[i] );
+	if ( ( end - x ) & 1 )
+	  rle.push_back( 0 );
+	x = end;
+      }
+
+      rle.push_back( 0 );
+      rle.push_back( r > 0 ? 0 : 1 ); // End of line, or of bitmap
+    }
+  }
+
+  /*!
+   * Try to replace the SetPixel calls which fall in one tile with a bitmap.
+   * Later calls for the same pixel win, as they would on playback. The
+   * bitmap is 8 bits per pixel if the tile has at most 256 colors,
+   * otherwise 24. Unless RLE8 compression is allowed, only a tile which is
+   * completely covered can become a bitmap, since the other encodings
+   * would paint over the pixels which weren't set.
+   * \param dc the metafile device context.
+   * \param pixels the pending pixels.
+   * \param order indices into pixels of the ones in this tile.
+   * \param n the number of pixels in this tile.
+   * \param compress true if RLE8 encoding may be used.
+   * \return the StretchDIBits record, or null if the SetPixelV records
+   * are smaller.
+   */
+  static METARECORD* pixelTile ( METAFILEDEVICECONTEXT* dc,
+				 const std::vector<METAFILEDEVICECONTEXT::PIXEL>& pixels,
+				 const size_t* order, size_t n, bool compress )
+  {
+    const COLORREF UNSET = 0xffffffff;
+
+    LONG left = INT_MAX, top = INT_MAX, right = INT_MIN, bottom = INT_MIN;
+
+    for ( size_t i = 0; i < n; i++ ) {
+      const METAFILEDEVICECONTEXT::PIXEL& p = pixels[order[i]];
+      // Palette relative colors can't be put in an RGB color table
+      if ( p.color & 0xff000000 ) return 0;
+      left = (std::min)( left, p.x );
+      right = (std::max)( right, p.x );
+      top = (std::min)( top, p.y );
+      bottom = (std::max)( bottom, p.y );
+    }
+
+    const int width = right - left + 1, height = bottom - top + 1;
+    std::vector<COLORREF> grid( width * height, UNSET );
+
+    for ( size_t i = 0; i < n; i++ ) {
+      const METAFILEDEVICECONTEXT::PIXEL& p = pixels[order[i]];
+      grid[( p.y - top ) * width + p.x - left] = p.color;
+    }
+
+    std::vector<COLORREF> colors;
+    for ( COLORREF c : grid )
+      if ( c != UNSET ) colors.push_back( c );
+
+    const bool covered = colors.size() == grid.size();
+
+    std::sort( colors.begin(), colors.end() );
+    colors.erase( std::unique( colors.begin(), colors.end() ), colors.end() );
+
+    const DWORD budget = n * sizeof( ::EMRSETPIXELV );
+    const DWORD overhead = sizeof( ::EMRSTRETCHDIBITS ) + sizeof( BITMAPINFOHEADER );
+
+    WORD bit_count;
+    DWORD compression = BI_RGB;
+    std::vector<BYTE> bits;
+
+    if ( colors.size() <= 256 ) {
+      std::vector<int> index( grid.size(), -1 );
+      for ( size_t i = 0; i < grid.size(); i++ )
+	if ( grid[i] != UNSET )
+	  index[i] = std::lower_bound( colors.begin(), colors.end(), grid[i] )
+	    - colors.begin();
+
+      bit_count = 8;
+
+      if ( compress )
+	encodeRLE8( index, width, height, bits );
+
+      const DWORD stride = ROUND_TO_LONG( width );
+
+      if ( compress && ( !covered || bits.size() < stride * height ) )
+	compression = BI_RLE8;
+      else if ( covered ) {
+	bits.assign( stride * height, 0 );
+	for ( int r = 0; r < height; r++ )
+	  for ( int c = 0; c < width; c++ )
+	    bits[( height - 1 - r ) * stride + c] = (BYTE)index[r * width + c];
+      }
+      else
+	return 0;
+    }
+    else if ( covered ) {
+      bit_count = 24;
+      colors.clear();
+
+      const DWORD stride = ROUND_TO_LONG( 3 * width );
+      bits.assign( stride * height, 0 );
+      for ( int r = 0; r < height; r++ )
+	for ( int c = 0; c < width; c++ ) {
+	  BYTE* bgr = &bits[( height - 1 - r ) * stride + 3 * c];
+	  COLORREF color = grid[r * width + c];
+	  bgr[0] = (BYTE)( color >> 16 );
+	  bgr[1] = (BYTE)( color >> 8 );
+	  bgr[2] = (BYTE)color;
+	}
+    }
+    else
+      return 0;
+
+    const DWORD cb_bmi = sizeof( BITMAPINFOHEADER ) + colors.size() * sizeof( RGBQUAD );
+
+    if ( overhead + colors.size() * sizeof( RGBQUAD ) + ROUND_TO_LONG( bits.size() )
+	 >= budget )
+      return 0;
+
+    std::vector<BYTE> bmi_bytes( cb_bmi );
+    BITMAPINFO* bmi = reinterpret_cast<BITMAPINFO*>( bmi_bytes.data() );
+
+    bmi->bmiHeader.biSize = sizeof( BITMAPINFOHEADER );
+    bmi->bmiHeader.biWidth = width;
+    bmi->bmiHeader.biHeight = height;
+    bmi->bmiHeader.biPlanes = 1;
+    bmi->bmiHeader.biBitCount = bit_count;
+    bmi->bmiHeader.biCompression = compression;
+    bmi->bmiHeader.biSizeImage = bits.size();
+    bmi->bmiHeader.biXPelsPerMeter = 0;
+    bmi->bmiHeader.biYPelsPerMeter = 0;
+    bmi->bmiHeader.biClrUsed = colors.size();
+    bmi->bmiHeader.biClrImportant = 0;
+
+    for ( size_t i = 0; i < colors.size(); i++ ) {
+      RGBQUAD* quad = &bmi->bmiColors[0] + i;
+      quad->rgbRed = (BYTE)colors[i];
+      quad->rgbGreen = (BYTE)( colors[i] >> 8 );
+      quad->rgbBlue = (BYTE)( colors[i] >> 16 );
+      quad->rgbReserved = 0;
+    }
+
+    RECTL bounds = { left, top, right, bottom };
+
+    return new EMRSTRETCHDIBITS( &bounds, left, top, width, height,
+				 0, 0, width, height,
+				 dc->internDIB( bmi, cb_bmi, bits.data(), bits.size(),
+						false ),
+				 DIB_RGB_COLORS, SRCCOPY );
+  }
+
+  /*!
+   * Write out the pixels held back by EMF_OPTION_COALESCE_PIXELS. They are
+   * sorted into tiles; any tile for which a bitmap is smaller than its
+   * SetPixelV records is written as a StretchDIBits record. Since tiles
+   * don't overlap, only the order of calls within a tile matters, and
+   * that is preserved.
+   */
+  void METAFILEDEVICECONTEXT::flushPixels ( void )
+  {
+    // appendRecord comes back here if the list isn't empty
+    std::vector<PIXEL> pending;
+    pending.swap( pixels );
+
+    auto tile = []( const PIXEL& p ) {
+      return std::make_pair( p.y >> PIXEL_TILE_SHIFT, p.x >> PIXEL_TILE_SHIFT );
+    };
+
+    std::vector<size_t> order( pending.size() );
+    for ( size_t i = 0; i < order.size(); i++ )
+      order[i] = i;
+
+    std::stable_sort( order.begin(), order.end(),
+		      [&]( size_t a, size_t b ) {
+			return tile( pending[a] ) < tile( pending[b] );
+		      } );
+
+    const bool compress = ( options & EMF_OPTION_COMPRESS_PIXELS ) != 0;
+
+    for ( size_t a = 0, b; a < order.size(); a = b ) {
+      for ( b = a + 1; b < order.size() &&
+	      tile( pending[order[b]] ) == tile( pending[order[a]] ); b++ );
+
+      METARECORD* bitmap = pixelTile( this, pending, &order[a], b - a, compress );
+
+      if ( bitmap ) {
+	appendRecord( bitmap );
+	stats.nPixelsCoalesced += b - a;
+      }
+      else
+	for ( size_t i = a; i < b; i++ ) {
+	  const PIXEL& p = pending[order[i]];
+	  appendRecord( new EMRSETPIXELV( p.x, p.y, p.color ) );
+	}
+    }
+  }
+  /*!
+   * FNV-1a hash of a block of memory.
+   * \param data the memory to hash.
+   * \param n the number of bytes.
+   * \param hash the hash of any preceding blocks.
+   * \return the hash including this block.
+   */
+  static unsigned long long hashBytes ( const void* data, size_t n,
+					unsigned long long hash = 14695981039346656037ULL )
+  {
+    const BYTE* p = (const BYTE*)data;
+
+    for ( size_t i = 0; i < n; i++ )
+      hash = ( hash ^ p[i] ) * 1099511628211ULL;
+
+    return hash;
+  }
+
+  std::shared_ptr<DIB> METAFILEDEVICECONTEXT::internDIB ( const void* info,
+							  DWORD cb_info,
+							  const void* data,
+							  DWORD cb_data,
+							  bool borrow )
+  {
+    unsigned long long hash = hashBytes( data, cb_data,
+					 hashBytes( info, cb_info ) );
+
+    auto range = dibs.equal_range( hash );
+
+    for ( auto d = range.first; d != range.second; d++ )
+      if ( d->second->same( info, cb_info, data, cb_data ) ) {
+	stats.nBitmapsShared++;
+	return d->second;
+      }
+
+    auto dib = std::make_shared<DIB>( info, cb_info, data, cb_data, borrow );
+
+    dibs.emplace( hash, dib );
+
+    return dib;
+  }
+
+  /*!
+   * Work out how much of a bitmap a record has to carry.
+   * \param bmi the bitmap header and color table.
+   * \param usage whether the color table holds RGB values or palette indices.
+   * \param scans the number of scan lines in the bits.
+   * \param cb_bmi returns the size of the header and color table.
+   * \param cb_bits returns the size of the bits.
+   * \return false if the header doesn't make sense.
+   */
+  static bool dibSizes ( const BITMAPINFO* bmi, UINT usage, DWORD scans,
+			 DWORD& cb_bmi, DWORD& cb_bits )
+  {
+    const BITMAPINFOHEADER& header = bmi->bmiHeader;
+
+    if ( header.biSize < sizeof( BITMAPINFOHEADER ) ||
+	 header.biSize > sizeof( BITMAPV5HEADER ) ||
+	 header.biWidth <= 0 || header.biHeight == INT_MIN ||
+	 header.biBitCount > 32 )
+      return false;
+
+    DWORD colors = header.biClrUsed;
+
+    if ( colors == 0 && header.biBitCount > 0 && header.biBitCount <= 8 )
+      colors = 1 << header.biBitCount;
+
+    if ( colors > 1 << 16 ) return false;
+
+    cb_bmi = header.biSize + colors *
+      ( usage == DIB_PAL_COLORS ? sizeof( WORD ) : sizeof( RGBQUAD ) );
+
+    if ( header.biCompression == BI_BITFIELDS &&
+	 header.biSize == sizeof( BITMAPINFOHEADER ) )
+      cb_bmi += 3 * sizeof( DWORD );
+
+    if ( header.biCompression == BI_RGB || header.biCompression == BI_BITFIELDS ) {
+      unsigned long long stride =
+	( ( (unsigned long long)header.biWidth * header.biBitCount + 31 ) / 32 ) * 4;
+      unsigned long long n = stride * scans;
+
+      if ( n > INT_MAX ) return false;
+
+      cb_bits = (DWORD)n;
+    }
+    else
+      cb_bits = header.biSizeImage; // Compressed: only the header knows
+
+    return true;
+  }
+
+  /*!
+   * Check that a bitmap read from a metafile holds as much as its header
+   * says it does (which is what StretchDIBits and SetDIBitsToDevice will
+   * read from it).
+   * \param dib the bitmap.
+   * \param usage whether the color table holds RGB values or palette indices.
+   * \param scans the number of scan lines in the bits.
+   * \return true if the bitmap may be drawn.
+   */
+  static bool dibHolds ( const DIB& dib, UINT usage, DWORD scans )
+  {
+    DWORD cb_bmi, cb_bits;
+
+    return dibSizes( dib.info(), usage, scans, cb_bmi, cb_bits ) &&
+      cb_bmi <= dib.bmi.size() && cb_bits <= dib.cb_bits;
+  }
+
+  void EMRSTRETCHDIBITS::execute ( METAFILEDEVICECONTEXT* /*source*/,
+				   METAFILEDEVICECONTEXT* dc ) const
+  {
+    const BITMAPINFO* bmi = dib->info();
+
+    if ( bmi != 0 && ( bmi->bmiHeader.biHeight == INT_MIN ||
+		       !dibHolds( *dib, iUsageSrc,
+				  (std::abs)( bmi->bmiHeader.biHeight ) ) ) )
+      return;
+
+    stretchDIBits( dc, xDest, yDest, cxDest, cyDest, xSrc, ySrc, cxSrc, cySrc,
+		   dib->cb_bits > 0 ? dib->bits : 0, bmi, iUsageSrc, dwRop );
+  }
+
+  void EMRSETDIBITSTODEVICE::execute ( METAFILEDEVICECONTEXT* /*source*/,
+				       METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( dib->info() == 0 || !dibHolds( *dib, iUsageSrc, cScans ) )
+      return;
+
+    setDIBitsToDevice( dc, xDest, yDest, cxSrc, cySrc, xSrc, ySrc, iStartScan,
+		       cScans, dib->bits, dib->info(), iUsageSrc );
+  }
+
+
+  /*!
+   * Convert separate x and y coordinate arrays into logical points. In the
+   * same pass, compute their bounds and whether they all fit in 16 bits.
+   * \param x the x coordinates.
+   * \param y the y coordinates.
+   * \param n the number of points.
+   * \param scale mapping applied to the coordinates before rounding (may be null).
+   * \param points returns the points.
+   * \param bounds returns their bounding box.
+   * \param shorts_only returns true if all the points fit in 16 bits.
+   * \return false if any coordinate isn't representable (including NaNs).
+   */
+  template<class T, class P>
+  static bool convertPoints ( const T* x, const T* y, size_t n,
+			      const EMFSCALE* scale, P* points, RECTL& bounds,
+			      bool& shorts_only )
+  {
+    const double x_scale = scale ? scale->xScale : 1.;
+    const double y_scale = scale ? scale->yScale : 1.;
+    const double x_offset = ( scale ? scale->xOffset : 0. ) + 0.5;
+    const double y_offset = ( scale ? scale->yOffset : 0. ) + 0.5;
+
+    double left = INT_MAX, top = INT_MAX, right = INT_MIN, bottom = INT_MIN;
+    double nans = 0;		// Stays zero unless a NaN (or infinity) shows up
+
+    // Both passes are kept branch-free so that they vectorize. The first
+    // only measures; nothing is cast to LONG until every value is known to
+    // be finite and in range (the cast is undefined otherwise).
+    for ( size_t i = 0; i < n; i++ ) {
+      double px = floor( x[i] * x_scale + x_offset );
+      double py = floor( y[i] * y_scale + y_offset );
+
+      nans += ( px - px ) + ( py - py );
+
+      left = px < left ? px : left;
+      right = px > right ? px : right;
+      top = py < top ? py : top;
+      bottom = py > bottom ? py : bottom;
+    }
+
+    if ( !std::isfinite( nans ) || nans != 0 || left < INT_MIN ||
+	 right > INT_MAX || top < INT_MIN || bottom > INT_MAX )
+      return false;
+
+    for ( size_t i = 0; i < n; i++ ) {
+      points[i].x = (LONG)floor( x[i] * x_scale + x_offset );
+      points[i].y = (LONG)floor( y[i] * y_scale + y_offset );
+    }
+
+    bounds.left = (LONG)left;
+    bounds.top = (LONG)top;
+    bounds.right = (LONG)right;
+    bounds.bottom = (LONG)bottom;
+
+    shorts_only = left >= SHRT_MIN && right <= SHRT_MAX &&
+      top >= SHRT_MIN && bottom <= SHRT_MAX;
+
+    return true;
+  }
+
+  //! The kinds of figure drawn by appendFloatPoints.
+  enum FIGURE { F_POLYLINE, F_POLYGON, F_POLYBEZIER };
+
+  /*!
+   * The guts of PolylineF/D, PolygonF/D and PolyBezierF/D: convert the
+   * coordinates directly into the storage of the 16- or 32-bit form of
+   * the record, whichever is smaller, and append it to the metafile.
+   * \param context handle to metafile context.
+   * \param x the x coordinates.
+   * \param y the y coordinates.
+   * \param n the number of points.
+   * \param scale mapping applied to the coordinates (may be null).
+   * \param figure which kind of figure the points describe.
+   * \return true if the figure was successfully rendered.
+   */
+  template<class RECORD, class RECORD16, class T>
+  static BOOL appendFloatPoints ( HDC context, const T* x, const T* y, size_t n,
+				  const EMFSCALE* scale, FIGURE figure )
+  {
+    METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<METAFILEDEVICECONTEXT*>(globalObjects.find( context ));
+
+    if ( dc == 0 || x == 0 || y == 0 || n > INT_MAX ) return FALSE;
+
+    RECTL bounds;
+    bool shorts_only;
+
+    // Simplification and clipping work on ordinary POINTs, so let
+    // Polyline and Polygon handle those cases
+    METAFILEDEVICECONTEXT::CLIPRECT clip_rect;
+
+    if ( figure != F_POLYBEZIER && ( dc->simplify_method != EMF_SIMPLIFY_NONE ||
+				     dc->clipRect( clip_rect ) ) ) {
+      std::vector<POINT> points( n );
+
+      if ( !convertPoints( x, y, n, scale, points.data(), bounds, shorts_only ) )
+	return FALSE;
+
+      if ( figure == F_POLYGON )
+	return Polygon( context, points.data(), (INT)n );
+      else
+	return Polyline( context, points.data(), (INT)n );
+    }
+
+    std::unique_ptr<POINTL[]> points( new POINTL[n] );
+
+    if ( !convertPoints( x, y, n, scale, points.get(), bounds, shorts_only ) )
+      return FALSE;
+
+    // Optionally apply a scaling world transform to the rounded points (so
+    // that they come out just as GDI would transform them)
+    if ( n > 0 && dc->bakeWorld( METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+				 bounds.left, bounds.top, bounds.right, bounds.bottom ) ) {
+      for ( size_t i = 0; i < n; i++ )
+	dc->bake( points[i].x, points[i].y );
+
+      dc->bake( bounds.left, bounds.top );
+      dc->bake( bounds.right, bounds.bottom );
+
+      if ( bounds.left > bounds.right ) std::swap( bounds.left, bounds.right );
+      if ( bounds.top > bounds.bottom ) std::swap( bounds.top, bounds.bottom );
+
+      shorts_only = bounds.left >= SHRT_MIN && bounds.right <= SHRT_MAX &&
+	bounds.top >= SHRT_MIN && bounds.bottom <= SHRT_MAX;
+    }
+
+    if ( n > 0 && dc->culled( bounds ) ) return TRUE;
+
+    // Since the mapping to device coordinates treats x and y separately,
+    // the corners of the bounds are the only points which can enlarge
+    // the painted area
+    if ( n > 0 ) {
+      dc->mergePoint( bounds.left, bounds.top );
+      dc->mergePoint( bounds.right, bounds.bottom );
+    }
+
+    if ( shorts_only ) {
+      std::unique_ptr<POINT16[]> points16( new POINT16[n] );
+
+      for ( size_t i = 0; i < n; i++ ) {
+	points16[i].x = (INT16)points[i].x;
+	points16[i].y = (INT16)points[i].y;
+      }
+
+      dc->appendRecord( new RECORD16( &bounds, std::move( points16 ), (INT)n ) );
+    }
+    else
+      dc->appendRecord( new RECORD( &bounds, std::move( points ), (INT)n ) );
+
+    return TRUE;
+  }
+
+  /*!
+   * Selects a solid brush of the requested color for each item of a batched
+   * drawing call. Each color's brush is created only once per call. When
+   * this goes out of scope, the brush which was current beforehand is
+   * reselected and the temporary brushes are deleted.
+   */
+  class BATCHBRUSHES {
+    HDC context;		//!< The metafile device context.
+    HGDIOBJ original;		//!< The brush which was current before the batch.
+    COLORREF current;		//!< The color of the brush selected last.
+    std::map< COLORREF, HBRUSH > brushes; //!< The brushes created so far.
+  public:
+    /*!
+     * \param context handle to metafile context.
+     */
+    BATCHBRUSHES ( HDC context ) : context( context ), original( 0 ), current( 0 )
+    {}
+    /*!
+     * Put back the original brush and delete the ones created for the batch.
+     */
+    ~BATCHBRUSHES ( )
+    {
+      if ( original != 0 )
+	SelectObject( context, original );
+
+      for ( auto& b : brushes )
+	DeleteObject( b.second );
+    }
+    /*!
+     * Make a brush of the given color the current one.
+     * \param color the color of the brush.
+     */
+    void select ( COLORREF color )
+    {
+      if ( original != 0 && color == current ) return;
+
+      auto b = brushes.find( color );
+
+      if ( b == brushes.end() )
+	b = brushes.emplace( color, CreateSolidBrush( color ) ).first;
+
+      HGDIOBJ previous = SelectObject( context, b->second );
+
+      if ( original == 0 ) original = previous;
+      current = color;
+    }
+  };
+
+  /*!
+   * \param transform a world transform (may be null).
+   * \return true if transform leaves points where they are.
+   */
+  static inline bool isIdentity ( const XFORM* transform )
+  {
+    return transform == 0 ||
+      ( transform->eM11 == 1 && transform->eM12 == 0 && transform->eM21 == 0 &&
+	transform->eM22 == 1 && transform->eDx == 0 && transform->eDy == 0 );
+  }
+
+  /*!
+   * \param a the transform applied first.
+   * \param b the transform applied second.
+   * \return the transform applying a, then b (as CombineTransform does).
+   */
+  static XFORM combine ( const XFORM& a, const XFORM& b )
+  {
+    XFORM c;
+    c.eM11 = a.eM11 * b.eM11 + a.eM12 * b.eM21;
+    c.eM12 = a.eM11 * b.eM12 + a.eM12 * b.eM22;
+    c.eM21 = a.eM21 * b.eM11 + a.eM22 * b.eM21;
+    c.eM22 = a.eM21 * b.eM12 + a.eM22 * b.eM22;
+    c.eDx = a.eDx * b.eM11 + a.eDy * b.eM21 + b.eDx;
+    c.eDy = a.eDx * b.eM12 + a.eDy * b.eM22 + b.eDy;
+    return c;
+  }
+
+  /*!
+   * \param a a transform.
+   * \param inverse returns the transform undoing a.
+   * \return false if a is singular.
+   */
+  static bool invert ( const XFORM& a, XFORM& inverse )
+  {
+    double det = (double)a.eM11 * a.eM22 - (double)a.eM12 * a.eM21;
+
+    if ( det == 0 ) return false;
+
+    inverse.eM11 = a.eM22 / det;
+    inverse.eM12 = -a.eM12 / det;
+    inverse.eM21 = -a.eM21 / det;
+    inverse.eM22 = a.eM11 / det;
+    inverse.eDx = ( a.eM21 * a.eDy - a.eM22 * a.eDx ) / det;
+    inverse.eDy = ( a.eM12 * a.eDx - a.eM11 * a.eDy ) / det;
+    return true;
+  }
+
+  /*!
+   * The transform which fits a metafile into a frame as it is played
+   * back: its frame (in the device units of its reference device, which is
+   * where its page mapping takes its coordinates) is scaled and moved onto
+   * the given one.
+   * \param header the metafile's header.
+   * \param frame the destination rectangle.
+   * \param transform returns the transform.
+   * \return false if either rectangle is empty or the header doesn't
+   * say what a device unit is.
+   */
+  static bool frameTransform ( const ::ENHMETAHEADER& header, const RECT& frame,
+			       XFORM& transform )
+  {
+    if ( header.szlDevice.cx <= 0 || header.szlDevice.cy <= 0 ||
+	 header.szlMillimeters.cx <= 0 || header.szlMillimeters.cy <= 0 )
+      return false;
+
+    double px = (double)header.szlDevice.cx / ( header.szlMillimeters.cx * 100. );
+    double py = (double)header.szlDevice.cy / ( header.szlMillimeters.cy * 100. );
+    double width = ( header.rclFrame.right - header.rclFrame.left ) * px;
+    double height = ( header.rclFrame.bottom - header.rclFrame.top ) * py;
+
+    if ( width == 0 || height == 0 || frame.right == frame.left ||
+	 frame.bottom == frame.top )
+      return false;
+
+    transform.eM11 = ( frame.right - frame.left ) / width;
+    transform.eM12 = 0;
+    transform.eM21 = 0;
+    transform.eM22 = ( frame.bottom - frame.top ) / height;
+    transform.eDx = frame.left - header.rclFrame.left * px * transform.eM11;
+    transform.eDy = frame.top - header.rclFrame.top * py * transform.eM22;
+    return true;
+  }
+
+  /*!
+   * While a metafile is played back into a frame, decide whether a figure
+   * can be left out because it lands entirely outside the frame. This only
+   * applies while the metafile's page mapping and world transform are both
+   * the identity (its bounds then being what the frame transform maps);
+   * when they aren't, the destination's world transform differs from the
+   * one it started with.
+   * \param dc the destination context.
+   * \param world the destination's world transform at the start of playback.
+   * \param transform the transform fitting the metafile into the frame.
+   * \param frame the destination rectangle.
+   * \param bounds the logical bounds of the figure.
+   * \return true if the figure is not to be played.
+   */
+  static bool outsideFrame ( const METAFILEDEVICECONTEXT* dc, const XFORM& world,
+			     const XFORM& transform, const RECT& frame,
+			     const RECTL& bounds )
+  {
+    if ( memcmp( &dc->world, &world, sizeof( XFORM ) ) != 0 ) return false;
+
+    double margin = dc->penReach( (std::max)( std::fabs( transform.eM11 ),
+					      std::fabs( transform.eM22 ) ) ) + 2;
+    double x0 = bounds.left * transform.eM11 + transform.eDx;
+    double x1 = bounds.right * transform.eM11 + transform.eDx;
+    double y0 = bounds.top * transform.eM22 + transform.eDy;
+    double y1 = bounds.bottom * transform.eM22 + transform.eDy;
+
+    return (std::max)( x0, x1 ) + margin < (std::min)( frame.left, frame.right ) ||
+      (std::min)( x0, x1 ) - margin > (std::max)( frame.left, frame.right ) ||
+      (std::max)( y0, y1 ) + margin < (std::min)( frame.top, frame.bottom ) ||
+      (std::min)( y0, y1 ) - margin > (std::max)( frame.top, frame.bottom );
+  }
+
+  /*!
+   * \param points an array of 16-bit points.
+   * \param n the number of points.
+   * \param wide returns them as 32-bit points.
+   * \return the 32-bit points.
+   */
+  static const POINT* widen ( const POINT16* points, size_t n, std::vector<POINT>& wide )
+  {
+    wide.resize( n );
+
+    for ( size_t i = 0; i < n; i++ ) {
+      wide[i].x = points[i].x;
+      wide[i].y = points[i].y;
+    }
+
+    return wide.data();
+  }
+
+  void EMRSETWORLDTRANSFORM::execute ( METAFILEDEVICECONTEXT* source,
+				       METAFILEDEVICECONTEXT* dc ) const
+  {
+    // In a frame, the metafile's transform applies before its page mapping
+    // and the transform fitting it there
+    if ( source->play_framed ) {
+      source->play_mapping.world = xform;
+      source->playMapping( dc );
+    }
+    else
+      setWorldTransform( dc, &xform );
+  }
+
+  void EMRMODIFYWORLDTRANSFORM::execute ( METAFILEDEVICECONTEXT* source,
+					  METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( !source->play_framed ) {
+      modifyWorldTransform( dc, &xform, iMode );
+      return;
+    }
+
+    XFORM& world = source->play_mapping.world;
+
+    switch ( iMode ) {
+    case MWT_IDENTITY: {
+      XFORM identity = { 1, 0, 0, 1, 0, 0 };
+      world = identity;
+      break;
+    }
+    case MWT_LEFTMULTIPLY:
+      world = combine( xform, world );
+      break;
+    case MWT_RIGHTMULTIPLY:
+      world = combine( world, xform );
+      break;
+    default:
+      return;
+    }
+
+    source->playMapping( dc );
+  }
+
+  // In a frame, the metafile's mapping records are followed by playMapping
+  // rather than passed on
+  void EMRSETVIEWPORTORGEX::execute ( METAFILEDEVICECONTEXT* source,
+				      METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed ) {
+      source->play_mapping.viewport_org = ptlOrigin;
+      source->playMapping( dc );
+    }
+    else
+      setViewportOrgEx( dc, ptlOrigin.x, ptlOrigin.y, 0 );
+  }
+
+  void EMRSETWINDOWORGEX::execute ( METAFILEDEVICECONTEXT* source,
+				    METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed ) {
+      source->play_mapping.window_org = ptlOrigin;
+      source->playMapping( dc );
+    }
+    else
+      setWindowOrgEx( dc, ptlOrigin.x, ptlOrigin.y, 0 );
+  }
+
+  void EMRSETVIEWPORTEXTEX::execute ( METAFILEDEVICECONTEXT* source,
+				      METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed )
+      source->playExtent( dc, false, szlExtent.cx, szlExtent.cy );
+    else
+      setViewportExtEx( dc, szlExtent.cx, szlExtent.cy, 0 );
+  }
+
+  void EMRSCALEVIEWPORTEXTEX::execute ( METAFILEDEVICECONTEXT* source,
+					METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed ) {
+      if ( xDenom == 0 || yDenom == 0 ) return;
+      const SIZEL& ext = source->play_mapping.viewport_ext;
+      source->playExtent( dc, false, (LONG)( (long long)ext.cx * xNum / xDenom ),
+			  (LONG)( (long long)ext.cy * yNum / yDenom ) );
+    }
+    else
+      scaleViewportExtEx( dc, xNum, xDenom, yNum, yDenom, 0 );
+  }
+
+  void EMRSETWINDOWEXTEX::execute ( METAFILEDEVICECONTEXT* source,
+				    METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed )
+      source->playExtent( dc, true, szlExtent.cx, szlExtent.cy );
+    else
+      setWindowExtEx( dc, szlExtent.cx, szlExtent.cy, 0 );
+  }
+
+  void EMRSCALEWINDOWEXTEX::execute ( METAFILEDEVICECONTEXT* source,
+				      METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed ) {
+      if ( xDenom == 0 || yDenom == 0 ) return;
+      const SIZEL& ext = source->play_mapping.window_ext;
+      source->playExtent( dc, true, (LONG)( (long long)ext.cx * xNum / xDenom ),
+			  (LONG)( (long long)ext.cy * yNum / yDenom ) );
+    }
+    else
+      scaleWindowExtEx( dc, xNum, xDenom, yNum, yDenom, 0 );
+  }
+
+  void EMRSETMAPMODE::execute ( METAFILEDEVICECONTEXT* source,
+				METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed )
+      source->playMapMode( dc, iMode );
+    else
+      setMapMode( dc, iMode );
+  }
+
+  void EMRSAVEDC::execute ( METAFILEDEVICECONTEXT* source,
+			    METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed )
+      source->playSave( dc );
+    else
+      saveDC( dc );
+  }
+
+  void EMRRESTOREDC::execute ( METAFILEDEVICECONTEXT* source,
+			       METAFILEDEVICECONTEXT* dc ) const
+  {
+    if ( source->play_framed )
+      source->playRestore( dc, iRelative );
+    else
+      restoreDC( dc, iRelative );
+  }
+
+  /*!
+   * Follow a metafile as it sets its mapping mode. The fixed modes take
+   * their extents from its reference device.
+   * \param mode the new mapping mode.
+   * \param device the size of the reference device in pixels.
+   * \param millimeters the size of the reference device in millimeters.
+   * \return true if the page mapping may have changed.
+   */
+  bool METAFILEDEVICECONTEXT::PLAYMAPPING::setMapMode ( INT mode, const SIZEL& device,
+							const SIZEL& millimeters )
+  {
+    LONG units = 10, per = 1;	// logical units per millimeter
+
+    switch ( mode ) {
+    case MM_TEXT:
+      window_ext.cx = window_ext.cy = 1;
+      viewport_ext.cx = viewport_ext.cy = 1;
+      map_mode = mode;
+      return true;
+    case MM_ANISOTROPIC:
+      map_mode = mode;
+      return false;
+    case MM_LOMETRIC:
+    case MM_ISOTROPIC: break;
+    case MM_HIMETRIC: units = 100; break;
+    case MM_LOENGLISH: units = 1000; per = 254; break;
+    case MM_HIENGLISH: units = 10000; per = 254; break;
+    case MM_TWIPS: units = 14400; per = 254; break;
+    default:
+      return false;
+    }
+
+    window_ext.cx = (LONG)( (long long)millimeters.cx * units / per );
+    window_ext.cy = (LONG)( (long long)millimeters.cy * units / per );
+    viewport_ext.cx = device.cx;
+    viewport_ext.cy = -device.cy;
+    map_mode = mode;
+
+    return true;
+  }
+
+  /*!
+   * Follow a metafile as it sets the extent of its window or viewport
+   * (which only the scalable mapping modes allow).
+   * \param window true for the window; false for the viewport.
+   * \param cx the new horizontal extent.
+   * \param cy the new vertical extent.
+   * \param device the size of the reference device in pixels.
+   * \param millimeters the size of the reference device in millimeters.
+   * \return true if the page mapping changed.
+   */
+  bool METAFILEDEVICECONTEXT::PLAYMAPPING::setExtent ( bool window, LONG cx, LONG cy,
+						       const SIZEL& device,
+						       const SIZEL& millimeters )
+  {
+    if ( ( map_mode != MM_ISOTROPIC && map_mode != MM_ANISOTROPIC ) ||
+	 cx == 0 || cy == 0 )
+      return false;
+
+    SIZEL& extent = window ? window_ext : viewport_ext;
+
+    extent.cx = cx;
+    extent.cy = cy;
+
+    // An isotropic viewport shrinks in one direction to keep units square
+    // on the reference device
+    if ( map_mode == MM_ISOTROPIC && device.cx > 0 && device.cy > 0 ) {
+      double xdim = std::fabs( (double)viewport_ext.cx * millimeters.cx /
+			       ( (double)device.cx * window_ext.cx ) );
+      double ydim = std::fabs( (double)viewport_ext.cy * millimeters.cy /
+			       ( (double)device.cy * window_ext.cy ) );
+
+      if ( xdim > ydim ) {
+	LONG least = viewport_ext.cx >= 0 ? 1 : -1;
+	viewport_ext.cx = (LONG)floor( viewport_ext.cx * ydim / xdim + 0.5 );
+	if ( viewport_ext.cx == 0 ) viewport_ext.cx = least;
+      }
+      else if ( ydim > xdim ) {
+	LONG least = viewport_ext.cy >= 0 ? 1 : -1;
+	viewport_ext.cy = (LONG)floor( viewport_ext.cy * xdim / ydim + 0.5 );
+	if ( viewport_ext.cy == 0 ) viewport_ext.cy = least;
+      }
+    }
+
+    return true;
+  }
+
+  /*!
+   * \return the transform from logical to device units made by the page
+   * mapping (leaving out the world transform).
+   */
+  XFORM METAFILEDEVICECONTEXT::PLAYMAPPING::page ( void ) const
+  {
+    XFORM page;
+
+    page.eM11 = (FLOAT)( (double)viewport_ext.cx / window_ext.cx );
+    page.eM12 = 0;
+    page.eM21 = 0;
+    page.eM22 = (FLOAT)( (double)viewport_ext.cy / window_ext.cy );
+    page.eDx = (FLOAT)( viewport_org.x - window_org.x * (double)page.eM11 );
+    page.eDy = (FLOAT)( viewport_org.y - window_org.y * (double)page.eM22 );
+
+    return page;
+  }
+
+  /*!
+   * Follow a metafile played into a frame as it sets its mapping mode.
+   * \param dc the destination context.
+   * \param mode the new mapping mode.
+   */
+  void METAFILEDEVICECONTEXT::playMapMode ( METAFILEDEVICECONTEXT* dc,
+					    INT mode )
+  {
+    if ( play_mapping.setMapMode( mode, header->szlDevice, header->szlMillimeters ) )
+      playMapping( dc );
+  }
+
+  /*!
+   * Follow a metafile played into a frame as it sets the extent of its
+   * window or viewport.
+   * \param dc the destination context.
+   * \param window true for the window; false for the viewport.
+   * \param cx the new horizontal extent.
+   * \param cy the new vertical extent.
+   */
+  void METAFILEDEVICECONTEXT::playExtent ( METAFILEDEVICECONTEXT* dc,
+					   bool window, LONG cx, LONG cy )
+  {
+    if ( play_mapping.setExtent( window, cx, cy, header->szlDevice,
+				 header->szlMillimeters ) )
+      playMapping( dc );
+  }
+
+  /*!
+   * Follow a metafile played into a frame as it saves its state.
+   * \param dc the destination context.
+   */
+  void METAFILEDEVICECONTEXT::playSave ( METAFILEDEVICECONTEXT* dc )
+  {
+    play_saved.push_back( play_mapping );
+    saveDC( dc );
+  }
+
+  /*!
+   * Follow a metafile played into a frame as it restores a saved state.
+   * Its levels count from the destination's level when playback started,
+   * and a restore past its own saves is ignored, so that it can't pop the
+   * destination's state.
+   * \param dc the destination context.
+   * \param level the (metafile's) level to restore; negative to count back
+   * from the current one.
+   */
+  void METAFILEDEVICECONTEXT::playRestore ( METAFILEDEVICECONTEXT* dc,
+					    INT level )
+  {
+    INT depth = (INT)play_saved.size();
+
+    if ( level < 0 ) level += depth + 1;
+
+    if ( level < 1 || level > depth ) return;
+
+    play_mapping = play_saved[level-1];
+    play_saved.resize( level-1 );
+    restoreDC( dc, play_level + level );
+  }
+
+  /*!
+   * Give the destination of a metafile played into a frame the world
+   * transform taking the metafile's logical coordinates into the frame:
+   * the metafile's world transform, then its page mapping, then the
+   * transform fitting its reference device's units into the frame.
+   * \param dc the destination context.
+   */
+  void METAFILEDEVICECONTEXT::playMapping ( METAFILEDEVICECONTEXT* dc )
+  {
+    XFORM world = combine( combine( play_mapping.world, play_mapping.page() ),
+			   play_transform );
+
+    setWorldTransform( dc, &world );
+  }
+
+  /*!
+   * Compile the records for playback. Each gets the function which plays
+   * its class back, so that PlayEnhMetaFile calls its execute() directly.
+   * A lazily loaded record stays as it is, since its decoded record may be
+   * dropped; its type alone says how it will decode.
+   */
+  void METAFILEDEVICECONTEXT::compilePlayback ( void )
+  {
+    play_ops.resize( records.size() );
+
+    for ( size_t i = 0; i < records.size(); i++ ) {
+      PLAYOP& op = play_ops[i];
+      const METARECORDPLAY* plays = record_plays.plays;
+
+      if ( dynamic_cast<const LAZYRECORD*>( records[i] ) != 0 )
+	plays = record_plays.lazy_plays;
+
+      DWORD type = records[i]->type();
+
+      op.play = type <= EMR_MAX && plays[type] != 0 ?
+	plays[type] : &playRecord;
+      op.record = records[i];
+      op.measured = false;
+    }
+  }
+
+  /*!
+   * Where ArcTo leaves the current position: the point on the ellipse in
+   * the direction of the arc's end point from its center.
+   * \param left x position of left edge of arc box.
+   * \param top y position of top edge of arc box.
+   * \param right x position of right edge of arc box.
+   * \param bottom y position bottom edge of arc box.
+   * \param xend x position of arc end.
+   * \param yend y position of arc end.
+   * \return the end of the arc.
+   */
+  static POINT arcEnd ( INT left, INT top, INT right, INT bottom, INT xend, INT yend )
+  {
+    const double cx = ( (double)left + right ) / 2, cy = ( (double)top + bottom ) / 2;
+    const double rx = ( (double)right - left ) / 2, ry = ( (double)bottom - top ) / 2;
+    const double dx = xend - cx, dy = yend - cy;
+    POINT end = { xend, yend };
+
+    if ( rx == 0 || ry == 0 || ( dx == 0 && dy == 0 ) ) return end;
+
+    const double r = std::sqrt( dx * dx / ( rx * rx ) + dy * dy / ( ry * ry ) );
+
+    end.x = (LONG)floor( cx + dx / r + 0.5 );
+    end.y = (LONG)floor( cy + dy / r + 0.5 );
+
+    return end;
+  }
+
+  /*!
+   * Can a transform which only scales and translates be applied to integer
+   * coordinates without rounding? Only if its scale and offset are whole
+   * numbers, small enough that the arithmetic in double is exact.
+   * \param transform the world transform.
+   * \return true if the transformed coordinates are exact.
+   */
+  static bool wholeTransform ( const XFORM& transform )
+  {
+    const double whole[] = { transform.eM11, transform.eM22,
+			     transform.eDx, transform.eDy };
+
+    for ( double w : whole )
+      if ( !( std::fabs( w ) < 2147483648. ) || w != std::floor( w ) )
+	return false;
+
+    return std::fabs( transform.eM11 ) <= 65536 &&
+      std::fabs( transform.eM22 ) <= 65536;
+  }
+
+  /*!
+   * Keep track of a new world transform. With EMF_OPTION_BAKE_TRANSFORMS,
+   * one which only scales and translates by whole numbers is applied to the
+   * coordinates of what is drawn from now on, rather than written to the
+   * metafile (whose world transform is then the identity).
+   * \param transform the new world transform.
+   * \return true if the caller has to write the transform to the metafile.
+   */
+  bool METAFILEDEVICECONTEXT::setWorld ( const XFORM& transform )
+  {
+    bool bakes = ( options & EMF_OPTION_BAKE_TRANSFORMS ) && !in_path &&
+      !position_unknown && transform.eM12 == 0 && transform.eM21 == 0 &&
+      transform.eM11 != 0 && transform.eM22 != 0 && wholeTransform( transform );
+
+    // The current position was written under the old coordinates
+    XFORM identity = { 1, 0, 0, 1, 0, 0 };
+    const XFORM& old_baked = world_baked ? world : identity;
+    const XFORM& new_baked = bakes ? transform : identity;
+
+    if ( memcmp( &old_baked, &new_baked, sizeof( XFORM ) ) != 0 )
+      position_stale = true;
+
+    world = transform;
+    world_baked = bakes;
+
+    if ( !bakes ) {
+      world_transform = !isIdentity( &transform );
+      return true;
+    }
+
+    if ( world_transform ) {
+      appendRecord( new EMRSETWORLDTRANSFORM( &identity ) );
+      world_transform = false;
+    }
+
+    stats.nTransformsBaked++;
+
+    return false;
+  }
+
+  /*!
+   * Stop applying the world transform to the coordinates and write it to
+   * the metafile instead.
+   */
+  void METAFILEDEVICECONTEXT::writeWorld ( void )
+  {
+    if ( !world_baked ) return;
+
+    world_baked = false;
+
+    if ( isIdentity( &world ) ) return;
+
+    appendRecord( new EMRSETWORLDTRANSFORM( &world ) );
+    world_transform = true;
+    position_stale = true;
+  }
+
+  /*!
+   * Get ready to draw a figure. If the world transform is applied to the
+   * coordinates, but the figure would then look different (a scale also
+   * widens any pen but a zero width or cosmetic one, and enlarges a font; a
+   * mirror reverses the direction of an arc), write the transform out
+   * instead.
+   * \param bakes how much of a transform the figure can absorb.
+   * \param stroked is the figure outlined with the current pen?
+   * \return true if the coordinates of the figure are to be transformed.
+   */
+  bool METAFILEDEVICECONTEXT::bakeWorld ( BAKES bakes, bool stroked )
+  {
+    if ( !world_baked || isIdentity( &world ) ) return false;
+
+    const double sx = world.eM11, sy = world.eM22;
+    bool absorbed;
+
+    switch ( bakes ) {
+    case BAKES_SCALE:
+      absorbed = true;
+      break;
+    case BAKES_UNMIRRORED:
+      absorbed = sx * sy > 0;
+      break;
+    default:
+      absorbed = sx == 1 && sy == 1;
+      break;
+    }
+
+    if ( absorbed && stroked && ( std::fabs( sx ) != 1 || std::fabs( sy ) != 1 ) ) {
+      DWORD style = extpen ? extpen->elpPenStyle : pen->lopnStyle;
+
+      absorbed = ( style & PS_STYLE_MASK ) == PS_NULL ||
+	( extpen ? ( style & PS_TYPE_MASK ) == PS_COSMETIC : pen->lopnWidth.x == 0 );
+    }
+
+    if ( !absorbed ) writeWorld();
+
+    return absorbed;
+  }
+
+  /*!
+   * Before drawing from the current position: if it was last written under
+   * different coordinates, write it again.
+   */
+  void METAFILEDEVICECONTEXT::syncPosition ( void )
+  {
+    if ( !position_stale ) return;
+
+    position_stale = false;
+
+    POINT p = point;
+
+    if ( world_baked ) bake( p.x, p.y );
+
+    appendRecord( new EMRMOVETOEX( p.x, p.y ) );
+  }
+
+  /*!
+   * Apply the world transform taken into the coordinates to an array of
+   * points. If a point would be out of range, write the transform out
+   * instead.
+   * \param points the points.
+   * \param n the number of points.
+   * \param baked returns the transformed points.
+   * \return baked.data(); points if they weren't transformed.
+   */
+  const POINT* METAFILEDEVICECONTEXT::bake ( const POINT* points, size_t n,
+					     std::vector<POINT>& baked )
+  {
+    if ( !world_baked ) return points;
+
+    const double sx = world.eM11, sy = world.eM22;
+    const double dx = world.eDx, dy = world.eDy;
+    double low = 0, high = 0;
+
+    baked.resize( n );
+
+    // (The transform is whole, so this is exact)
+    for ( size_t i = 0; i < n; i++ ) {
+      const double x = points[i].x * sx + dx, y = points[i].y * sy + dy;
+
+      low = (std::min)( low, (std::min)( x, y ) );
+      high = (std::max)( high, (std::max)( x, y ) );
+      baked[i].x = (LONG)(long long)x;
+      baked[i].y = (LONG)(long long)y;
+    }
+
+    if ( low < LONG_MIN || high > LONG_MAX ) {
+      writeWorld();
+      return points;
+    }
+
+    return baked.data();
+  }
+
+  /*!
+   * Apply the world transform taken into the coordinates to an array of
+   * boxes. If a corner would be out of range, write the transform out
+   * instead.
+   * \param boxes the boxes.
+   * \param n the number of boxes.
+   * \param baked returns the transformed boxes.
+   * \return baked.data(); boxes if they weren't transformed.
+   */
+  const RECT* METAFILEDEVICECONTEXT::bake ( const RECT* boxes, size_t n,
+					    std::vector<RECT>& baked )
+  {
+    if ( !world_baked ) return boxes;
+
+    for ( size_t i = 0; i < n; i++ )
+      if ( !fits( boxes[i].left, boxes[i].top, boxes[i].right, boxes[i].bottom ) ) {
+	writeWorld();
+	return boxes;
+      }
+
+    baked.assign( boxes, boxes + n );
+
+    for ( auto& box : baked ) {
+      bake( box.left, box.top );
+      bake( box.right, box.bottom );
+    }
+
+    return baked.data();
+  }
+
+  /*!
+   * Grow a bounding rectangle to include a box whose corners may be given in
+   * either order.
+   * \param bounds the bounding rectangle.
+   * \param box the box to include.
+   */
+  static inline void mergeBox ( RECTL& bounds, const RECT& box )
+  {
+    bounds.left = (std::min)( bounds.left, (std::min)( box.left, box.right ) );
+    bounds.right = (std::max)( bounds.right, (std::max)( box.left, box.right ) );
+    bounds.top = (std::min)( bounds.top, (std::min)( box.top, box.bottom ) );
+    bounds.bottom = (std::max)( bounds.bottom, (std::max)( box.top, box.bottom ) );
+  }
+
+  /*!
+   * The guts of PolyRectangle and PolyEllipse: one record per box, with the
+   * bounds of the metafile updated once for the whole batch.
+   * \param context handle to metafile context.
+   * \param boxes array of boxes.
+   * \param n number of boxes.
+   * \param colors array of fill colors (may be null for the current brush).
+   * \return true if the boxes were successfully rendered.
+   */
+  template<class RECORD>
+  static BOOL appendBoxes ( HDC context, const RECT* boxes, UINT n,
+			    const COLORREF* colors )
+  {
+    METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<METAFILEDEVICECONTEXT*>(globalObjects.find( context ));
+
+    if ( dc == 0 || ( boxes == 0 && n > 0 ) ) return FALSE;
+
+    if ( n == 0 ) return TRUE;
+
+    // Optionally apply a scaling world transform to the boxes themselves
+    std::vector<RECT> baked;
+
+    if ( dc->bakeWorld( METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      boxes = dc->bake( boxes, n, baked );
+
+    BATCHBRUSHES brushes( context );
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+    dc->records.reserve( dc->records.size() + n );
+
+    for ( UINT i = 0; i < n; i++ ) {
+      if ( dc->culled( boxes[i].left, boxes[i].top, boxes[i].right, boxes[i].bottom ) )
+	continue;
+
+      if ( colors ) brushes.select( colors[i] );
+
+      dc->appendRecord( new RECORD( boxes[i].left, boxes[i].top,
+				    boxes[i].right, boxes[i].bottom ) );
+
+      mergeBox( bounds, boxes[i] );
+    }
+
+    if ( bounds.left > bounds.right ) return TRUE; // All culled
+
+    // The mapping to device coordinates treats x and y separately, so
+    // only the corners of the overall bounds matter
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
+
+    return TRUE;
+  }
+
+  //! Where a record lies in a metafile being read, as found by the first pass.
+  struct RECORDSPAN {
+    long position;		//!< The offset of the record in the file.
+    DWORD nSize;		//!< The size of the record.
+    DWORD iType;		//!< The type of the record.
+    METARECORDCTOR ctor;	//!< Its virtual constructor; null if unknown.
+  };
+
+  //! Metafiles smaller than this per thread are read sequentially.
+  static const long PARALLEL_READ_MINIMUM = 4 << 20;
+
+  /*!
+   * Decide how many threads should construct the records of a metafile.
+   * \param fp the metafile, positioned after its header.
+   * \param threads the number of threads asked for; 0 for one per
+   * processor, if the metafile is big enough to be worth it. No more than
+   * one per processor are used either way.
+   * \return the number of threads to use (1 to read sequentially).
+   */
+  static unsigned readerThreads ( ::FILE* fp, unsigned threads )
+  {
+    const unsigned processors = (std::max)( std::thread::hardware_concurrency(), 1U );
+
+    if ( threads != 0 ) return (std::min)( threads, processors );
+
+    long position = ::ftell( fp );
+
+    if ( position < 0 || ::fseek( fp, 0, SEEK_END ) != 0 ) return 1;
+
+    long length = ::ftell( fp );
+
+    ::fseek( fp, position, SEEK_SET );
+
+    return (unsigned)(std::min)( (long)processors, length / PARALLEL_READ_MINIMUM + 1 );
+  }
+
+  /*!
+   * The first pass of reading a metafile in parallel (and all there is to
+   * loading it lazily): find where each record lies. Record boundaries
+   * follow from nSize alone, so this only looks at the first two words of
+   * each record.
+   * \param fp the metafile, positioned after its header.
+   * \param visit called with each record found, in order.
+   * \param message returns why reading stopped short of the end of the
+   * file; empty if it didn't.
+   */
+  template<class VISIT>
+  static void scanRecords ( ::FILE* fp, VISIT visit, std::string& message )
+  {
+    std::vector<unsigned char> block( 1 << 16 );
+    long block_position = ::ftell( fp );
+    size_t block_size = 0;
+
+    for ( long position = block_position; ; ) {
+      // Make sure the block holds the first two words of the record
+      if ( position < block_position ||
+	   position + 2 * (long)sizeof(DWORD) > block_position + (long)block_size ) {
+	::fseek( fp, position, SEEK_SET );
+	block_position = position;
+	block_size = ::fread( block.data(), 1, block.size(), fp );
+      }
+
+      size_t offset = position - block_position;
+
+      // As when reading sequentially, the end of the file is only expected
+      // in place of a record type
+      if ( offset + sizeof(DWORD) > block_size ) {
+	if ( ! feof( fp ) ) message = strerror( errno );
+	break;
+      }
+      if ( offset + 2 * sizeof(DWORD) > block_size ) {
+	message = strerror( errno );
+	break;
+      }
+
+      RECORDSPAN span;
+      memcpy( &span.iType, &block[offset], sizeof(DWORD) );
+      memcpy( &span.nSize, &block[offset+sizeof(DWORD)], sizeof(DWORD) );
+      span.iType = swab( span.iType );
+      span.nSize = swab( span.nSize );
+
+      if ( span.nSize == 0 ) {
+	message = "record size == 0";
+	break;
+      }
+
+      span.position = position;
+      span.ctor = globalObjects.newRecord( span.iType );
+      visit( span );
+
+      position += span.nSize;
+    }
+  }
+
+  //! What went wrong constructing one slice of the records.
+  struct READFAILURE {
+    size_t index;		//!< The record which couldn't be constructed.
+    std::string message;	//!< Why not; empty if out of memory.
+    bool unopened;		//!< Couldn't the file be opened again at all?
+  };
+
+  /*!
+   * Construct a slice of the records found by scanRecords, reading them
+   * through a stream of its own.
+   * \param filename the name of the metafile.
+   * \param spans the records found by scanRecords.
+   * \param begin the first record of the slice.
+   * \param end one past the last record of the slice.
+   * \param records returns the records, indexed as spans.
+   * \param failure returns where the slice stopped short, if it did.
+   */
+  static void readSlice ( const std::string& filename,
+			  const std::vector<RECORDSPAN>& spans,
+			  size_t begin, size_t end, METARECORD** records,
+			  READFAILURE& failure )
+  {
+    ::FILE* fp = ::fopen( filename.c_str(), "rb" );
+
+    if ( fp == 0 ) {
+      failure.index = begin;
+      failure.message = strerror( errno );
+      failure.unopened = true;
+      return;
+    }
+
+    DATASTREAM ds( fp );
+
+    for ( size_t i = begin; i < end; i++ ) {
+      if ( spans[i].ctor == 0 ) continue;
+
+      ::fseek( fp, spans[i].position, SEEK_SET );
+      try {
+	records[i] = spans[i].ctor( ds );
+      }
+      catch ( const std::runtime_error& e ) {
+	failure.index = i;
+	failure.message = e.what();
+	break;
+      }
+      catch ( const std::bad_alloc& ) {
+	failure.index = i;
+	failure.message.clear();
+	break;
+      }
+    }
+
+    ::fclose( fp );
+  }
+
+  /*!
+   * Read the records of a metafile with several threads. The first pass
+   * finds the records, then each thread constructs those in a slice of
+   * the file directly into their place in the metafile's list. The result,
+   * down to the warnings and the record count and size in the header, is
+   * the same as reading the records one after another.
+   * \param dc the metafile, with its header read.
+   * \param fp the metafile, positioned after its header.
+   * \param filename its name (each thread opens it again).
+   * \param threads the number of threads.
+   * \return false if a thread couldn't open the file; none of the records
+   * are kept then, rather than the metafile missing a slice of them.
+   */
+  static bool readRecords ( METAFILEDEVICECONTEXT* dc, ::FILE* fp,
+			    const std::string& filename, unsigned threads )
+  {
+    std::vector<RECORDSPAN> spans;
+    std::string message;
+
+    scanRecords( fp, [&spans]( const RECORDSPAN& span ) { spans.push_back( span ); },
+		 message );
+
+    // No more threads than slices with a record in them
+    threads = (unsigned)(std::min)( (size_t)threads, (std::max)( spans.size(), (size_t)1 ) );
+
+    // Cut the records into slices of about the same number of bytes
+    std::vector<size_t> slices( 1, 0 );
+    long total = 0, done = 0;
+
+    for ( const auto& span : spans ) total += span.nSize;
+
+    for ( size_t i = 0; i < spans.size() && slices.size() < threads; i++ ) {
+      done += spans[i].nSize;
+      if ( done >= total / threads * (long)slices.size() )
+	slices.push_back( i + 1 );
+    }
+    slices.push_back( spans.size() );
+
+    const size_t base = dc->records.size();
+    const size_t none = spans.size();
+    std::vector<READFAILURE> failures( slices.size() - 1,
+				       READFAILURE{ none, "", false } );
+
+    dc->records.resize( base + spans.size(), 0 );
+
+    METARECORD** records = &dc->records[base];
+    std::vector<std::thread> workers;
+
+    for ( size_t s = 1; s + 1 < slices.size(); s++ ) {
+      try {
+	workers.emplace_back( readSlice, std::cref( filename ), std::cref( spans ),
+			      slices[s], slices[s+1], records,
+			      std::ref( failures[s] ) );
+      }
+      catch ( const std::system_error& ) {
+	readSlice( filename, spans, slices[s], slices[s+1], records, failures[s] );
+      }
+    }
+
+    readSlice( filename, spans, slices[0], slices[1], records, failures[0] );
+
+    for ( auto& worker : workers ) worker.join();
+
+    for ( const auto& failure : failures ) {
+      if ( !failure.unopened ) continue;
+
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+		<< failure.message
+		<< std::endl;
+
+      for ( size_t i = 0; i < spans.size(); i++ )
+	delete records[i];
+
+      dc->records.resize( base );
+
+      return false;
+    }
+
+    // Now account for the records in order, as if they were read one at a time
+    size_t kept = base;
+    size_t failed = none;
+
+    for ( size_t s = 0; s < failures.size() && failed == none; s++ )
+      failed = failures[s].index;
+
+    for ( size_t i = 0; i < spans.size(); i++ ) {
+      if ( i == failed ) {
+	const READFAILURE& failure =
+	  *std::find_if( failures.begin(), failures.end(),
+			 [failed]( const READFAILURE& f ) { return f.index == failed; } );
+	if ( failure.message.empty() )
+	  std::cerr << "GetEnhMetaFileW out of memory. cannot continue"
+		    << std::endl;
+	else
+	  std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+		    << failure.message
+		    << std::endl;
+	message.clear();
+      }
+
+      METARECORD* record = records[i];
+
+      if ( i >= failed ) {
+	delete record;
+	continue;
+      }
+
+      if ( record == 0 ) {
+	std::cerr << "GetEnhMetaFileW warning: read unknown record type "
+		  << spans[i].iType << " of size " << spans[i].nSize << std::endl;
+	continue;
+      }
+
+      dc->records[kept++] = record;
+      dc->header->nBytes += record->size();
+      dc->header->nRecords++;
+    }
+
+    dc->records.resize( kept );
+
+    if ( ! message.empty() )
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+		<< message
+		<< std::endl;
+
+    return true;
+  }
+
+  /*!
+   * Load a metafile lazily: only find where its records lie, and let them
+   * be decoded as they are used.
+   * \param dc the metafile, with its header read.
+   * \param fp the metafile, positioned after its header (the metafile
+   * keeps it open).
+   * \param budget the most bytes of decoded records to keep; 0 for no limit.
+   */
+  static void indexRecords ( METAFILEDEVICECONTEXT* dc, ::FILE* fp, size_t budget )
+  {
+    RECORDSOURCE* source = new RECORDSOURCE( fp, budget );
+    std::string message;
+
+    dc->record_source.reset( source );
+
+    scanRecords( fp, [dc, source]( const RECORDSPAN& span ) {
+	if ( span.ctor == 0 ) {
+	  std::cerr << "GetEnhMetaFileW warning: read unknown record type "
+		    << span.iType << " of size " << span.nSize << std::endl;
+	  return;
+	}
+
+	dc->records.push_back( new LAZYRECORD( source, span.position, span.iType,
+					       span.nSize ) );
+	dc->header->nBytes += span.nSize;
+	dc->header->nRecords++;
+      }, message );
+
+    if ( ! message.empty() )
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+		<< message
+		<< std::endl;
+  }
+
+  /*!
+   * Index the records of the metafile: for each, its type, size, offset
+   * and the bounds of what it paints. Lazily loaded records are decoded
+   * to find their bounds (within the metafile's budget).
+   * \param dc the metafile.
+   */
+  static void buildIndex ( METAFILEDEVICECONTEXT* dc )
+  {
+    std::vector< ::EMFRECORDINFO >& index = dc->record_index;
+    DWORD offset = 0;
+
+    index.clear();
+    index.reserve( dc->records.size() );
+
+    for ( auto r = dc->records.begin(); r != dc->records.end(); r++ ) {
+      ::EMFRECORDINFO info;
+      const LAZYRECORD* lazy = dynamic_cast<const LAZYRECORD*>( *r );
+
+      if ( lazy != 0 && lazy->position() >= 0 ) offset = lazy->position();
+
+      info.iType = (*r)->type();
+      info.nSize = (*r)->size();
+      info.offset = offset;
+      offset += info.nSize;
+
+      if ( ! ( (*r)->draws( info.rclBounds ) & METARECORD::DRAWS ) ) {
+	RECTL empty = { 0, 0, -1, -1 };
+	info.rclBounds = empty;
+      }
+
+      index.push_back( info );
+    }
+  }
+
+  //! Identifies a record index cache file (and its layout).
+  static const DWORD INDEX_SIGNATURE = 0x58444945; // "EIDX"
+  static const DWORD INDEX_VERSION = 1;
+
+  /*!
+   * \param filename the metafile.
+   * \return the file in which its record index is cached.
+   */
+  static std::string indexName ( const std::string& filename )
+  {
+    return filename + ".idx";
+  }
+
+  /*!
+   * Load a metafile lazily, taking the records from the index cached
+   * next to it, if there is one for this version of the file.
+   * \param dc the metafile, with its header read.
+   * \param fp the metafile, positioned after its header (if this
+   * succeeds, the metafile keeps it open).
+   * \param filename the metafile.
+   * \param budget the most bytes of decoded records to keep; 0 for no limit.
+   * \return true if the index was used.
+   */
+  static bool indexFromCache ( METAFILEDEVICECONTEXT* dc, ::FILE* fp,
+			       const std::string& filename, size_t budget )
+  {
+    struct stat st;
+
+    if ( ::stat( filename.c_str(), &st ) != 0 ) return false;
+
+    ::FILE* cache = ::fopen( indexName( filename ).c_str(), "rb" );
+
+    if ( cache == 0 ) return false;
+
+    // Read it all at once; it is parsed from memory
+    std::vector<BYTE> bytes;
+    ::fseek( cache, 0, SEEK_END );
+    long cache_size = ::ftell( cache );
+    ::rewind( cache );
+
+    if ( cache_size > 0 ) {
+      bytes.resize( cache_size );
+      if ( ::fread( bytes.data(), 1, bytes.size(), cache ) != bytes.size() )
+	bytes.clear();
+    }
+
+    ::fclose( cache );
+
+    std::vector< ::EMFRECORDINFO > index;
+
+    try {
+      DATASTREAM ds( bytes.data(), bytes.size() );
+      DWORD signature, version, size_lo, size_hi, mtime_lo, mtime_hi, count;
+
+      ds >> signature >> version >> size_lo >> size_hi >> mtime_lo >> mtime_hi
+	 >> count;
+
+      if ( signature != INDEX_SIGNATURE || version != INDEX_VERSION ||
+	   size_lo != (DWORD)st.st_size || size_hi != (DWORD)( (long long)st.st_size >> 32 ) ||
+	   mtime_lo != (DWORD)st.st_mtime || mtime_hi != (DWORD)( (long long)st.st_mtime >> 32 ) ||
+	   count == 0 || count > bytes.size() / ( 7 * sizeof(DWORD) ) ) {
+	return false;
+      }
+
+      index.resize( count );
+
+      for ( auto i = index.begin(); i != index.end(); i++ )
+	ds >> i->iType >> i->nSize >> i->offset >> i->rclBounds;
+    }
+    catch ( const std::runtime_error& ) {
+      return false;
+    }
+
+    if ( index[0].iType != EMR_HEADER || index[0].nSize != dc->header->nSize )
+      return false;
+
+    // A damaged (or stale) cache is rebuilt rather than trusted
+    for ( auto i = index.begin() + 1; i != index.end(); i++ )
+      if ( globalObjects.newRecord( i->iType ) == 0 || i->nSize < 2 * sizeof(DWORD) ||
+	   i->nSize % sizeof(DWORD) != 0 || i->offset < index[0].nSize ||
+	   (unsigned long long)i->offset + i->nSize > (unsigned long long)st.st_size )
+	return false;
+
+    RECORDSOURCE* source = new RECORDSOURCE( fp, budget );
+
+    dc->record_source.reset( source );
+
+    for ( auto i = index.begin() + 1; i != index.end(); i++ ) {
+      dc->records.push_back( new LAZYRECORD( source, i->offset, i->iType, i->nSize ) );
+      dc->header->nBytes += i->nSize;
+      dc->header->nRecords++;
+    }
+
+    dc->record_index.swap( index );
+
+    return true;
+  }
+
+  /*!
+   * Index the records of the metafile and cache the index next to the
+   * file. If the cache can't be written, it is simply not there.
+   * \param dc the metafile.
+   * \param filename the file from which it was read.
+   */
+  static void cacheIndex ( METAFILEDEVICECONTEXT* dc, const std::string& filename )
+  {
+    struct stat st;
+
+    if ( ::stat( filename.c_str(), &st ) != 0 ) return;
+
+    buildIndex( dc );
+
+    // Written aside and renamed into place, so that an interrupted write
+    // doesn't leave a truncated index behind
+    std::string name = indexName( filename );
+    std::string temp = name + ".tmp";
+    ::FILE* cache = ::fopen( temp.c_str(), "wb" );
+
+    if ( cache == 0 ) return;
+
+    try {
+      DATASTREAM ds( cache );
+
+      ds << INDEX_SIGNATURE << INDEX_VERSION
+	 << (DWORD)st.st_size << (DWORD)( (long long)st.st_size >> 32 )
+	 << (DWORD)st.st_mtime << (DWORD)( (long long)st.st_mtime >> 32 )
+	 << (DWORD)dc->record_index.size();
+
+      for ( auto i = dc->record_index.begin(); i != dc->record_index.end(); i++ )
+	ds << i->iType << i->nSize << i->offset << i->rclBounds;
+    }
+    catch ( const std::runtime_error& ) {
+      ::fclose( cache );
+      ::remove( temp.c_str() );
+      return;
+    }
+
+    if ( ::fclose( cache ) != 0 ) {
+      ::remove( temp.c_str() );
+      return;
+    }
+
+    // (Windows won't rename over an existing file)
+    if ( ::rename( temp.c_str(), name.c_str() ) != 0 ) {
+      ::remove( name.c_str() );
+      if ( ::rename( temp.c_str(), name.c_str() ) != 0 )
+	::remove( temp.c_str() );
+    }
+  }
+
+  /*!
+   * Read the records of a metafile in memory, as GetEnhMetaFileW reads
+   * them from a file.
+   * \param dc the metafile, with its header read.
+   * \param bits the metafile.
+   * \param size its size.
+   * \param position the offset of the first record after the header.
+   * \param source if not null, only find where the records lie, and let
+   * them be decoded from source as they are used.
+   */
+  static void readBits ( METAFILEDEVICECONTEXT* dc, const BYTE* bits, size_t size,
+			 size_t position, RECORDSOURCE* source )
+  {
+    std::string message;
+
+    // As when reading a file, the end is only expected in place of a
+    // record type
+    while ( position < size && size - position >= sizeof(DWORD) ) {
+      if ( size - position < 2 * sizeof(DWORD) ) {
+	message = "Premature EOF on EMF stream";
+	break;
+      }
+
+      DWORD iType, nSize;
+      memcpy( &iType, bits + position, sizeof(DWORD) );
+      memcpy( &nSize, bits + position + sizeof(DWORD), sizeof(DWORD) );
+      iType = swab( iType );
+      nSize = swab( nSize );
+
+      // A record must lie wholly within the buffer (a lazy record is only
+      // decoded later, and would otherwise be read past its end)
+      if ( nSize < 2 * sizeof(DWORD) || nSize % sizeof(DWORD) != 0 ||
+	   nSize > size - position ) {
+	message = "Invalid record size";
+	break;
+      }
+
+      METARECORDCTOR new_record = globalObjects.newRecord( iType );
+
+      if ( new_record == 0 ) {
+	std::cerr << "SetEnhMetaFileBits warning: read unknown record type "
+		  << iType << " of size " << nSize << std::endl;
+      }
+      else if ( source != 0 ) {
+	dc->records.push_back( new LAZYRECORD( source, position, iType, nSize ) );
+	dc->header->nBytes += nSize;
+	dc->header->nRecords++;
+      }
+      else {
+	DATASTREAM ds( bits + position, size - position );
+
+	try {
+	  dc->appendRecord( new_record( ds ) );
+	}
+	catch ( const std::runtime_error& e ) {
+	  message = e.what();
+	  break;
+	}
+	catch ( const std::bad_alloc& ) {
+	  std::cerr << "SetEnhMetaFileBits out of memory. cannot continue"
+		    << std::endl;
+	  return;
+	}
+      }
+
+      position += nSize;
+    }
+
+    if ( ! message.empty() )
+      std::cerr << "SetEnhMetaFileBits read error. cannot continue: "
+		<< message
+		<< std::endl;
+  }
+
+  /*!
+   * Read just the header of a metafile and copy it out. Nothing else is
+   * created, so this is much cheaper than opening the metafile.
+   * \param ds the metafile, positioned at its header.
+   * \param size the size of the header buffer.
+   * \param header the header buffer (may be null).
+   * \param length the size of the description buffer in WCHARs.
+   * \param description the description buffer (may be null).
+   * \return the number of bytes copied into header (or which would be,
+   * if header is null); 0 if this is not a metafile.
+   */
+  static UINT probeHeader ( DATASTREAM ds, UINT size, LPENHMETAHEADER header,
+			    UINT length, LPWSTR description )
+  {
+    ENHMETAHEADER probe;
+
+    // Called straight from the C API, so nothing may escape: a truncated
+    // header throws runtime_error, a huge description bad_alloc.
+    try {
+      probe.unserialize( ds );
+    }
+    catch ( const std::exception& ) {
+      return 0;
+    }
+    catch ( ... ) {
+      return 0;
+    }
+
+    if ( probe.iType != EMR_HEADER || probe.dSignature != ENHMETA_SIGNATURE )
+      return 0;
+
+    size = min( size, sizeof(::ENHMETAHEADER) );
+
+    if ( header == 0 ) return sizeof(::ENHMETAHEADER);
+
+    memcpy( header, static_cast<::ENHMETAHEADER*>( &probe ), size );
+
+    if ( description != 0 && probe.description() != 0 ) {
+      length = min( length, probe.nDescription );
+      std::copy( probe.description(), probe.description() + length, description );
+    }
+
+    return size;
+  }
+
+  /*!
+   * Hand each record of a metafile in turn to a callback, as
+   * EnumEnhMetaFile does. The records are read one at a time into the same
+   * buffer, so the memory used depends only on the largest record.
+   * \param read reads up to n bytes into a buffer and returns how many it
+   * read (fewer only at the end of the metafile).
+   * \param proc the callback; the enumeration stops if it returns 0.
+   * \param data passed on to proc.
+   * \return TRUE if every record, up to EMR_EOF or the end of the
+   * metafile, was enumerated.
+   */
+  template<class READ>
+  static BOOL streamRecords ( READ read, ENHMFENUMPROC proc, LPVOID data )
+  {
+    std::vector<DWORD> buffer( 2 ); // DWORDs, so the records are aligned
+    INT handles = 0;
+    std::string message;
+
+    for ( bool first = true; ; first = false ) {
+      size_t have = read( buffer.data(), 2 * sizeof(DWORD) );
+
+      // As when reading the metafile, the end is only expected in place
+      // of a record type
+      if ( have == 0 && ! first ) return TRUE;
+
+      if ( have < 2 * sizeof(DWORD) ) {
+	message = "Premature EOF on EMF stream";
+	break;
+      }
+
+      DWORD iType = swab( buffer[0] );
+      DWORD nSize = swab( buffer[1] );
+
+      // (88 bytes is the original header, up to szlMillimeters)
+      if ( first && ( iType != EMR_HEADER || nSize < 88 ) ) {
+	message = "Not an EMF";
+	break;
+      }
+      if ( nSize < 2 * sizeof(DWORD) || nSize % sizeof(DWORD) != 0 ) {
+	message = "Invalid record size";
+	break;
+      }
+
+      // Only grow the buffer as the record actually arrives, so that a
+      // damaged size doesn't cost memory for nothing
+      try {
+	while ( have < nSize ) {
+	  size_t want = min( (size_t)nSize, max( 2 * have, (size_t)1 << 16 ) );
+
+	  if ( buffer.size() * sizeof(DWORD) < want )
+	    buffer.resize( want / sizeof(DWORD) );
+
+	  size_t got = read( reinterpret_cast<BYTE*>( buffer.data() ) + have,
+			     want - have );
+	  have += got;
+
+	  if ( have < want ) break;
+	}
+      }
+      catch ( const std::bad_alloc& ) {
+	message = "out of memory";
+	break;
+      }
+
+      if ( have < nSize ) {
+	message = "Premature EOF on EMF stream";
+	break;
+      }
+
+      buffer[0] = iType;
+      buffer[1] = nSize;
+
+      // nHandles is the low word of the 15th DWORD of the header
+      if ( first ) handles = swab( buffer[14] ) & 0xffff;
+
+      if ( proc( 0, 0, reinterpret_cast<LPENHMETARECORD>( buffer.data() ), handles,
+		 data ) == 0 )
+	return FALSE;
+
+      if ( iType == EMR_EOF ) return TRUE;
+    }
+
+    std::cerr << "StreamEnhMetaFile read error. cannot continue: "
+	      << message
+	      << std::endl;
+    return FALSE;
+  }
+
+  /*!
+   * \param p four bytes of a metafile.
+   * \return the (little-endian) DWORD they hold.
+   */
+  static inline DWORD getDWORD ( const BYTE* p )
+  {
+    return p[0] | p[1] << 8 | p[2] << 16 | (DWORD)p[3] << 24;
+  }
+
+  /*!
+   * \param p where to put four bytes of a metafile.
+   * \param value the DWORD to store there (little-endian).
+   */
+  static inline void putDWORD ( BYTE* p, DWORD value )
+  {
+    p[0] = value & 0xff;
+    p[1] = value >> 8 & 0xff;
+    p[2] = value >> 16 & 0xff;
+    p[3] = value >> 24;
+  }
+
+  /*!
+   * \param p the 24 bytes of a transform in a metafile.
+   * \return the transform.
+   */
+  static XFORM getXFORM ( const BYTE* p )
+  {
+    FLOAT e[6];
+
+    for ( int i = 0; i < 6; i++ ) {
+      DWORD d = getDWORD( p + 4 * i );
+      memcpy( &e[i], &d, sizeof d );
+    }
+
+    XFORM transform = { e[0], e[1], e[2], e[3], e[4], e[5] };
+    return transform;
+  }
+
+  /*!
+   * Where the metafile handle is in a record which refers to an object.
+   * \param iType the record type.
+   * \return its offset in the record; 0 if there is none.
+   */
+  static size_t handleOffset ( DWORD iType )
+  {
+    switch ( iType ) {
+    case EMR_SELECTOBJECT: case EMR_CREATEPEN: case EMR_CREATEBRUSHINDIRECT:
+    case EMR_DELETEOBJECT: case EMR_SELECTPALETTE: case EMR_CREATEPALETTE:
+    case EMR_SETPALETTEENTRIES: case EMR_RESIZEPALETTE:
+    case EMR_EXTCREATEFONTINDIRECTW: case EMR_CREATEMONOBRUSH:
+    case EMR_CREATEDIBPATTERNBRUSHPT: case EMR_EXTCREATEPEN:
+    case EMR_CREATECOLORSPACE: case EMR_SETCOLORSPACE:
+    case EMR_DELETECOLORSPACE: case EMR_COLORCORRECTPALETTE:
+    case EMR_CREATECOLORSPACEW:
+      return 8;
+    case EMR_FILLRGN: case EMR_FRAMERGN:
+      return 28;			// after rclBounds and cbRgnData
+    default:
+      return 0;
+    }
+  }
+
+  /*!
+   * Splice the records of several metafiles into one without decoding
+   * them (see MergeEnhMetaFileBits). Each is copied between a SaveDC and
+   * a RestoreDC, after a SetWorldTransform placing it; its object handles
+   * follow those of the metafiles before it. Its own world transforms are
+   * rewritten to apply before the placement, its absolute RestoreDCs to
+   * allow for the extra level, and RestoreDCs past its own SaveDCs are
+   * dropped.
+   *
+   * The placement is a world transform, so it applies in each metafile's
+   * logical units, before its page mapping. Its bounds and frame (which are
+   * in device units) are placed through each page mapping it sets; if it
+   * sets more than one, the merged bounds may be larger than what it draws.
+   * \param count the number of metafiles.
+   * \param bits the bytes of each metafile.
+   * \param sizes the size of each metafile.
+   * \param xforms where to place each metafile (may be null).
+   * \param out the merged metafile (may be null, to only work out its size).
+   * \return the size of the merged metafile; 0 if it can't be made.
+   */
+  static size_t mergeBits ( UINT count, const BYTE* const* bits, const UINT* sizes,
+			    const XFORM* xforms, BYTE* out )
+  {
+    const size_t HEADER_SIZE = 108; // up to szlMicrometers
+    const XFORM identity = { 1, 0, 0, 1, 0, 0 };
+    size_t at = HEADER_SIZE;
+    DWORD records = 1, handles = 1;
+    double bounds[4] = { HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+    double frame[4] = { HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+    const METAFILEDEVICECONTEXT::PLAYMAPPING unmapped =
+      { MM_TEXT, { 0, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 1, 0, 0, 1, 0, 0 } };
+    std::vector< METAFILEDEVICECONTEXT::PLAYMAPPING > saved;
+    std::vector< XFORM > pages;
+    std::string message;
+
+    // Write a record (when there is somewhere to write it)
+    auto emit = [&]( const BYTE* record, size_t n ) {
+      if ( out ) memcpy( out + at, record, n );
+      at += n;
+      records++;
+    };
+    auto emitTransform = [&]( const XFORM& transform ) {
+      BYTE record[32];
+      const FLOAT e[6] = { transform.eM11, transform.eM12, transform.eM21,
+			   transform.eM22, transform.eDx, transform.eDy };
+      putDWORD( record, EMR_SETWORLDTRANSFORM );
+      putDWORD( record + 4, sizeof record );
+      for ( int i = 0; i < 6; i++ ) {
+	DWORD d;
+	memcpy( &d, &e[i], sizeof d );
+	putDWORD( record + 8 + 4 * i, d );
+      }
+      emit( record, sizeof record );
+    };
+    // Take in a rectangle (in device units of its metafile), as placed
+    // under each of its page mappings
+    auto extend = [&]( double* box, double left, double top, double right,
+		       double bottom, const XFORM& placement ) {
+      const double x[2] = { left, right }, y[2] = { top, bottom };
+      for ( const XFORM& page : pages ) {
+	XFORM logical, placed;
+	if ( !invert( page, logical ) ) continue;
+	placed = combine( combine( logical, placement ), page );
+	for ( int i = 0; i < 2; i++ )
+	  for ( int j = 0; j < 2; j++ ) {
+	    double u = x[i] * placed.eM11 + y[j] * placed.eM21 + placed.eDx;
+	    double v = x[i] * placed.eM12 + y[j] * placed.eM22 + placed.eDy;
+	    box[0] = (std::min)( box[0], u );
+	    box[1] = (std::min)( box[1], v );
+	    box[2] = (std::max)( box[2], u );
+	    box[3] = (std::max)( box[3], v );
+	  }
+      }
+    };
+
+    for ( UINT i = 0; i < count && message.empty(); i++ ) {
+      const BYTE* source = bits[i];
+      const size_t size = sizes[i];
+
+      // (88 bytes is the original header, up to szlMillimeters)
+      if ( source == 0 || size < 88 || getDWORD( source ) != EMR_HEADER ||
+	   getDWORD( source + 40 ) != ENHMETA_SIGNATURE ) {
+	message = "Not an EMF";
+	break;
+      }
+
+      size_t next = getDWORD( source + 4 );
+
+      if ( next < 88 || next > size || next % sizeof(DWORD) != 0 ) {
+	message = "Invalid record size";
+	break;
+      }
+
+      const XFORM& placement = xforms ? xforms[i] : identity;
+      const bool placed = !isIdentity( &placement );
+      const DWORD offset = handles - 1;
+      const SIZEL device = { (LONG)getDWORD( source + 72 ), (LONG)getDWORD( source + 76 ) };
+      const SIZEL millimeters = { (LONG)getDWORD( source + 80 ),
+				  (LONG)getDWORD( source + 84 ) };
+
+      // nHandles is the low word of the 15th DWORD; handle 0 is reserved
+      const DWORD source_handles = getDWORD( source + 56 ) & 0xffff;
+      handles += (std::max)( source_handles, (DWORD)1 ) - 1;
+
+      BYTE savedc[8];
+      putDWORD( savedc, EMR_SAVEDC );
+      putDWORD( savedc + 4, sizeof savedc );
+      emit( savedc, sizeof savedc );
+
+      if ( placed ) emitTransform( placement );
+
+      METAFILEDEVICECONTEXT::PLAYMAPPING mapping = unmapped;
+      XFORM& world = mapping.world;
+      saved.clear();
+      pages.assign( 1, identity );
+
+      while ( next < size ) {
+	const BYTE* record = source + next;
+
+	if ( size - next < 8 ) {
+	  message = "Premature EOF on EMF stream";
+	  break;
+	}
+
+	DWORD iType = getDWORD( record );
+	DWORD nSize = getDWORD( record + 4 );
+
+	if ( nSize < 8 || nSize % sizeof(DWORD) != 0 || nSize > size - next ) {
+	  message = "Invalid record size";
+	  break;
+	}
+
+	next += nSize;
+
+	if ( iType == EMR_EOF ) break;
+
+	// The metafile's own transforms go before its placement
+	if ( placed && ( ( iType == EMR_SETWORLDTRANSFORM && nSize >= 32 ) ||
+			 ( iType == EMR_MODIFYWORLDTRANSFORM && nSize >= 36 ) ) ) {
+	  XFORM transform = getXFORM( record + 8 );
+
+	  if ( iType == EMR_SETWORLDTRANSFORM )
+	    world = transform;
+	  else
+	    switch ( getDWORD( record + 32 ) ) {
+	    case MWT_IDENTITY: world = identity; break;
+	    case MWT_LEFTMULTIPLY: world = combine( transform, world ); break;
+	    case MWT_RIGHTMULTIPLY: world = combine( world, transform ); break;
+	    default: emit( record, nSize ); continue;
+	    }
+
+	  emitTransform( combine( world, placement ) );
+	  continue;
+	}
+
+	// (A restore past the metafile's own saves would pop the wrapper)
+	if ( iType == EMR_RESTOREDC && nSize >= 12 ) {
+	  LONG level = (LONG)getDWORD( record + 8 );
+	  LONG depth = (LONG)saved.size();
+
+	  if ( level < 0 ) level += depth + 1;
+
+	  if ( level < 1 || level > depth ) continue;
+
+	  mapping = saved[level-1];
+	  saved.resize( level-1 );
+	}
+
+	size_t start = at;
+	emit( record, nSize );
+
+	size_t ih_at = handleOffset( iType );
+	bool paged = false;
+
+	if ( ih_at != 0 && nSize >= ih_at + 4 ) {
+	  DWORD ih = getDWORD( record + ih_at );
+
+	  if ( ih != 0 && !( ih & ENHMETA_STOCK_OBJECT ) ) {
+	    if ( ih >= source_handles ) {
+	      message = "Invalid object handle";
+	      break;
+	    }
+	    if ( out ) putDWORD( out + start + ih_at, ih + offset );
+	  }
+	}
+	else if ( iType == EMR_SAVEDC )
+	  saved.push_back( mapping );
+	else if ( iType == EMR_RESTOREDC && nSize >= 12 ) {
+	  LONG level = (LONG)getDWORD( record + 8 );
+	  if ( level > 0 && out ) putDWORD( out + start + 8, level + 1 );
+	}
+	else if ( iType == EMR_SETMAPMODE && nSize >= 12 )
+	  paged = mapping.setMapMode( (INT)getDWORD( record + 8 ), device, millimeters );
+	else if ( ( iType == EMR_SETWINDOWEXTEX || iType == EMR_SETVIEWPORTEXTEX ) &&
+		  nSize >= 16 )
+	  paged = mapping.setExtent( iType == EMR_SETWINDOWEXTEX,
+				     (LONG)getDWORD( record + 8 ),
+				     (LONG)getDWORD( record + 12 ), device, millimeters );
+	else if ( ( iType == EMR_SCALEWINDOWEXTEX || iType == EMR_SCALEVIEWPORTEXTEX ) &&
+		  nSize >= 24 ) {
+	  const bool window = iType == EMR_SCALEWINDOWEXTEX;
+	  const SIZEL& extent = window ? mapping.window_ext : mapping.viewport_ext;
+	  LONG x_num = getDWORD( record + 8 ), x_denom = getDWORD( record + 12 );
+	  LONG y_num = getDWORD( record + 16 ), y_denom = getDWORD( record + 20 );
+
+	  if ( x_denom != 0 && y_denom != 0 )
+	    paged = mapping.setExtent( window,
+				       (LONG)( (long long)extent.cx * x_num / x_denom ),
+				       (LONG)( (long long)extent.cy * y_num / y_denom ),
+				       device, millimeters );
+	}
+	else if ( ( iType == EMR_SETWINDOWORGEX || iType == EMR_SETVIEWPORTORGEX ) &&
+		  nSize >= 16 ) {
+	  POINTL& origin = iType == EMR_SETWINDOWORGEX ?
+	    mapping.window_org : mapping.viewport_org;
+	  origin.x = (LONG)getDWORD( record + 8 );
+	  origin.y = (LONG)getDWORD( record + 12 );
+	  paged = true;
+	}
+
+	if ( paged ) {
+	  XFORM page = mapping.page();
+	  if ( memcmp( &page, &pages.back(), sizeof page ) != 0 )
+	    pages.push_back( page );
+	}
+      }
+
+      // Back to the level of the wrapping SaveDC, however many the metafile
+      // left unrestored
+      BYTE restoredc[12];
+      putDWORD( restoredc, EMR_RESTOREDC );
+      putDWORD( restoredc + 4, sizeof restoredc );
+      putDWORD( restoredc + 8, 1 );
+      emit( restoredc, sizeof restoredc );
+
+      // Bounds are in device units already; the frame is in .01 mm
+      LONG b[4], f[4];
+      for ( int k = 0; k < 4; k++ ) {
+	b[k] = (LONG)getDWORD( source + 8 + 4 * k );
+	f[k] = (LONG)getDWORD( source + 24 + 4 * k );
+      }
+
+      if ( b[2] >= b[0] && b[3] >= b[1] )
+	extend( bounds, b[0], b[1], b[2], b[3], placement );
+
+      if ( device.cx > 0 && device.cy > 0 && millimeters.cx > 0 && millimeters.cy > 0 ) {
+	double px = device.cx / ( millimeters.cx * 100. );
+	double py = device.cy / ( millimeters.cy * 100. );
+	extend( frame, f[0] * px, f[1] * py, f[2] * px, f[3] * py, placement );
+      }
+    }
+
+    if ( message.empty() && at + sizeof(::EMREOF) > 0xffffffffUL )
+      message = "Merged metafile too large";
+    else if ( message.empty() && handles > 0xffff )
+      message = "Too many object handles";
+
+    if ( ! message.empty() ) {
+      std::cerr << "MergeEnhMetaFile read error. cannot continue: "
+		<< message
+		<< std::endl;
+      return 0;
+    }
+
+    BYTE eof[sizeof(::EMREOF)] = { 0 };
+    putDWORD( eof, EMR_EOF );
+    putDWORD( eof + 4, sizeof eof );
+    emit( eof, sizeof eof );
+
+    if ( out == 0 ) return at;
+
+    // The header is the first metafile's, less its description and
+    // palette, with the totals of all of them
+    const BYTE* first = bits[0];
+    BYTE* header = out;
+
+    memset( header, 0, HEADER_SIZE );
+    memcpy( header + 72, first + 72, 16 ); // szlDevice and szlMillimeters
+    putDWORD( header, EMR_HEADER );
+    putDWORD( header + 4, HEADER_SIZE );
+    putDWORD( header + 40, ENHMETA_SIGNATURE );
+    putDWORD( header + 44, 0x10000 );
+    putDWORD( header + 48, at );
+    putDWORD( header + 52, records );
+    putDWORD( header + 56, handles );
+
+    if ( getDWORD( first + 4 ) >= HEADER_SIZE )
+      memcpy( header + 100, first + 100, 8 );
+    else {
+      putDWORD( header + 100, getDWORD( first + 80 ) * 1000 );
+      putDWORD( header + 104, getDWORD( first + 84 ) * 1000 );
+    }
+
+    if ( bounds[0] <= bounds[2] ) {
+      putDWORD( header + 8, (LONG)std::floor( bounds[0] ) );
+      putDWORD( header + 12, (LONG)std::floor( bounds[1] ) );
+      putDWORD( header + 16, (LONG)std::ceil( bounds[2] ) );
+      putDWORD( header + 20, (LONG)std::ceil( bounds[3] ) );
+    }
+    else {
+      putDWORD( header + 16, (DWORD)-1 );
+      putDWORD( header + 20, (DWORD)-1 );
+    }
+
+    LONG device_x = getDWORD( first + 72 ), device_y = getDWORD( first + 76 );
+    LONG mm_x = getDWORD( first + 80 ), mm_y = getDWORD( first + 84 );
+
+    if ( frame[0] <= frame[2] && device_x > 0 && device_y > 0 &&
+	 mm_x > 0 && mm_y > 0 ) {
+      double px = device_x / ( mm_x * 100. ), py = device_y / ( mm_y * 100. );
+      putDWORD( header + 24, (LONG)std::floor( frame[0] / px ) );
+      putDWORD( header + 28, (LONG)std::floor( frame[1] / py ) );
+      putDWORD( header + 32, (LONG)std::ceil( frame[2] / px ) );
+      putDWORD( header + 36, (LONG)std::ceil( frame[3] / py ) );
+    }
+    else
+      memcpy( header + 24, first + 24, 16 );
+
+    return at;
+  }
+
+  /*!
+   * Decode the record, unless that has been done already. This makes it
+   * the most recently used record; if the decoded records are now over
+   * budget, the least recently used others are dropped.
+   * \return the decoded record; null if it can't be read.
+   */
+  METARECORD* LAZYRECORD::record ( void ) const
+  {
+    RECORDSOURCE* source = source_;
+
+    if ( record_ == 0 ) {
+      if ( position_ < 0 ) return 0;
+
+      METARECORDCTOR ctor = globalObjects.newRecord( iType_ );
+
+      if ( ctor == 0 ) {
+	std::cerr << "LAZYRECORD read error. record skipped: unknown record type"
+		  << std::endl;
+	position_ = -1;
+	return 0;
+      }
+
+      try {
+	record_ = ctor( source->at( position_ ) );
+      }
+      catch ( const std::runtime_error& e ) {
+	std::cerr << "LAZYRECORD read error. record skipped: "
+		  << e.what()
+		  << std::endl;
+	position_ = -1;
+	return 0;
+      }
+      catch ( const std::bad_alloc& ) {
+	std::cerr << "LAZYRECORD out of memory. record skipped"
+		  << std::endl;
+	return 0;
+      }
+
+      source->held_ += nSize_;
+    }
+    else if ( source->newest_ == this )
+      return record_;
+    else {
+      // Unlink it from where it was in the list
+      ( newer_ != 0 ? newer_->older_ : source->newest_ ) = older_;
+      ( older_ != 0 ? older_->newer_ : source->oldest_ ) = newer_;
+    }
+
+    newer_ = 0;
+    older_ = source->newest_;
+    ( older_ != 0 ? older_->newer_ : source->oldest_ ) = this;
+    source->newest_ = this;
+
+    while ( source->budget_ != 0 && source->held_ > source->budget_ &&
+	    source->oldest_ != this )
+      source->oldest_->drop();
+
+    return record_;
+  }
+
+  /*!
+   * Release the decoded record, if any. It is decoded again if it is used
+   * again.
+   */
+  void LAZYRECORD::drop ( void ) const
+  {
+    if ( record_ == 0 ) return;
+
+    RECORDSOURCE* source = source_;
+
+    ( newer_ != 0 ? newer_->older_ : source->newest_ ) = older_;
+    ( older_ != 0 ? older_->newer_ : source->oldest_ ) = newer_;
+    newer_ = older_ = 0;
+
+    delete record_;
+    record_ = 0;
+    source->held_ -= nSize_;
+  }
+} // close EMF namespace
+
+extern "C" {
+  /*!
+   * Delete a device context. (Have to check to see if there is any reason
+   * to ever call this.)
+   * \param context device context to delete.
+   * \return true if context successfully deleted.
+   */
+  EMF_DECLARE(BOOL) DeleteDC ( HDC context )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return FALSE;
+
+    EMF::globalObjects.remove( dc );
+
+    return TRUE;
+  }
+  /*!
+   * Create an enhanced metafile on disk.
+   * \param context pseudo device context.
+   * \param filename ASCII filename of metafile.
+   * \param size the size (really the position on the paper) of the plot image.
+   * \param description description string for metafile (see EMF::METAFILE
+   * constructor for details).
+   * \return handle to a metafile device context.
+   */
+  EMF_DECLARE(HDC) CreateEnhMetaFileA ( HDC referenceContext, LPCSTR filename, const RECT* size,
+			   LPCSTR description )
+  {
+    // In this version, the library handles the file operations itself.
+    // Note: No effort is made to preserve the contents of an existing
+    // metafile!
+
+    ::FILE* fp = 0;
+
+    if ( filename ) {
+      fp = ::fopen( filename, "w" );
+      if ( fp == 0 ) return 0;
+    }
+
+    LPWSTR description_w = 0;
+
+    if ( description ) {
+      int description1_count = ::strlen( description );
+      int description2_count = ::strlen( description + (description1_count + 1) );
+
+      description_w = new WCHAR[ description1_count + description2_count + 3 ];
+
+      for ( int i=0; i<=(description1_count + description2_count + 2); i++ )
+	description_w[i] = (WCHAR)*description++;
+    }
+
+    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size,
+					  description_w );
+
+    if ( description_w ) delete[] description_w;
+
+    return dc;
+  }
+  /*!
+   * Create an enhanced metafile on disk. This differs from CreateEnhMetaFileA
+   * only in that the filename and description are made of wide characters.
+   *
+   * \param context pseudo device context.
+   * \param filename ASCII filename of metafile.
+   * \param size the size (really the position on the paper) of the plot image.
+   * \param description description string for metafile (see EMF::METAFILE
+   * constructor for details).
+   * \return handle to a metafile device context.
+   */
+  EMF_DECLARE(HDC) CreateEnhMetaFileW ( HDC referenceContext, LPCWSTR filename,
+			   const RECT* size, LPCWSTR description )
+  {
+    ::FILE* fp = 0;
+
+    if ( filename ) {
+      // Well, the ANSI C library doesn't have any routines for
+      // opening a file with a wide character filename, so, we have to
+      // convert it back to ASCII and hope for the best.
+      LPCWSTR w_tmp = filename;
+      int n_char_w = 0;
+      while ( *w_tmp++ ) n_char_w++;
+      std::string filename_a( filename, filename + n_char_w );
+
+      fp = ::fopen( filename_a.c_str(), "w" );
+
+      if ( fp == 0 ) return 0;
+    }
+
+    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size,
+					  description );
+    return dc;
+  }
+
+  /*!
+   * Many graphics programs want to open and close output files themselves. At
+   * least, gnuplot and Grace do. So, supply the FILE pointer when creating
+   * a metafile and let the plotting program's driver handle it.
+   *
+   * \param context pseudo device context.
+   * \param fp open FILE pointer.
+   * \param size the size (really the position on the paper) of the plot image.
+   * \param description description string for metafile (see EMF::METAFILE
+   * constructor for details).
+   * \return handle to a metafile device context.
+   */
+  EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEA ( HDC referenceContext, ::FILE* fp,
+				   const RECT* size, LPCSTR description )
+  {
+    // All this does is promote the ASCII strings to UNICODE (after a fashion)
+    // and then use CreateEnhMetaFileWithFILEW
+
+    LPWSTR description_w;
+
+    if ( description ) {
+      int description1_count = ::strlen( description );
+      int description2_count = ::strlen( description + (description1_count + 1) );
+
+      description_w = new WCHAR[ description1_count + description2_count + 3 ];
+
+      for ( int i=0; i<=(description1_count + description2_count + 2); i++ )
+	description_w[i] = (WCHAR)*description++;
+    }
+    else
+      description_w = 0;
+
+    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size, description_w );
+
+    if ( description_w ) delete[] description_w;
+
+    return dc;
+  }
+  /*!
+   * Many graphics programs want to open and close output files themselves. At
+   * least, gnuplot and Grace do. So, supply the FILE pointer when creating
+   * a metafile and let the plotting program's driver handle it. This differs
+   * from CreateEnhMetaFileWithFILEA only in that the description string uses
+   * wide characters.
+   *
+   * \param context pseudo device context.
+   * \param fp open FILE pointer.
+   * \param size the size (really the position on the paper) of the plot image.
+   * \param description description string for metafile (see EMF::METAFILE
+   * constructor for details).
+   * \return handle to a metafile device context.
+   */
+  EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEW ( HDC referenceContext, ::FILE* fp,
+				   const RECT* size, LPCWSTR description )
+  {
+    (void)referenceContext;
+    EMF::METAFILEDEVICECONTEXT* dc =
+      new EMF::METAFILEDEVICECONTEXT ( fp, size, description );
+
+    return dc->handle;
+  }
+
+  /*!
+   * The old 16-bit metafile constructor. Actually creates an Enhanced Metafile
+   * anyway.
+   * \param filename ASCII filename of metafile.
+   * \return a handle to the metafile
+   */
+  EMF_DECLARE(HMETAFILE) CreateMetaFileA ( LPCSTR filename )
+  {
+    return CreateEnhMetaFileA( 0, filename, 0, 0 );
+  }
+  /*!
+   * If the metafile was opened with CreateEnhMetaFileA or CreateEnhMetaFileW,
+   * use this routine to close the metafile.
+   * \param context metafile device context.
+   * \return a handle to the metafile.
+   */
+  EMF_DECLARE(HENHMETAFILE) CloseEnhMetaFile ( HDC context )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    dc->groupObjects();
+    dc->pruneRecords();
+
+    EMF::EMREOF* eof = new EMF::EMREOF;
+
+    dc->appendRecord( eof );
+
+    // If it's a disk-based metafile, actually write it to disk
+
+    if ( dc->fp ) {
+      std::for_each( dc->records.begin(), dc->records.end(),
+		     std::bind2nd( std::mem_fun( &EMF::METARECORD::serialize ),
+				   dc->ds ) );
+
+      ::fclose( dc->fp );
+
+      dc->fp = 0;
+    }
+
+    dc->adoptDIBs();
+
+    // There's no particular reason to distinguish between the context and
+    // the metafile
+
+    return (HENHMETAFILE)context;
+  }
+
+  /*!
+   * If the metafile was opened with CreateEnhMetaFileA or CreateEnhMetaFileW,
+   * use this routine to close the metafile (same as CloseEnhMetaFile)
+   * \param context metafile device context.
+   * \return a handle to the metafile.
+   */
+  EMF_DECLARE(HMETAFILE) CloseMetaFile ( HDC context )
+  {
+    return CloseEnhMetaFile( context );
+  }
+
+  /*!
+   * Close a metafile which was created with an already open FILE pointer.
+   *
+   * \param context handle of metafile context
+   * \return handle to a metafile. I don't think there's anything you can do with
+   * it, though.
+   */
+  EMF_DECLARE(HENHMETAFILE) CloseEnhMetaFileWithFILE ( HDC context )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    dc->groupObjects();
+    dc->pruneRecords();
+
+    EMF::EMREOF* eof = new EMF::EMREOF;
+
+    dc->appendRecord( eof );
+
+    // If it's a disk-based metafile, actually write it to disk
+
+    if ( dc->fp ) {
+      std::for_each( dc->records.begin(), dc->records.end(),
+		     std::bind2nd( std::mem_fun( &EMF::METARECORD::serialize ),
+				   dc->ds ) );
+    }
+
+    dc->adoptDIBs();
+
+    // There's no particular reason to distinguish between the context and
+    // the metafile
+
+    return (HENHMETAFILE)context;
+  }
+  /*!
+   * Enable optional optimizations of the records written to the metafile.
+   * The value is the sum of:
+   * \li EMF_OPTION_ELIDE_STATE
+   * \li EMF_OPTION_INTERN_OBJECTS
+   * \li EMF_OPTION_COALESCE_PIXELS
+   * \li EMF_OPTION_COMPRESS_PIXELS (with EMF_OPTION_COALESCE_PIXELS)
+   * \li EMF_OPTION_BORROW_BITS
+   * \li EMF_OPTION_CLIP_TO_FRAME (only if a frame was given to
+   * CreateEnhMetaFile)
+   * \li EMF_OPTION_GROUP_OBJECTS (applies to the figures drawn while it is
+   * set; the number of SelectObject records saved is known after
+   * CloseEnhMetaFile)
+   * \li EMF_OPTION_PRUNE_RECORDS (at CloseEnhMetaFile)
+   * \li EMF_OPTION_BAKE_TRANSFORMS
+   * \param context handle of metafile context.
+   * \param options the new set of options.
+   * \return the previous set of options.
+   */
+  EMF_DECLARE(DWORD) SetEnhMetaFileOptions ( HDC context, DWORD options )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    DWORD old_options = dc->options;
+
+    dc->options = options;
+
+    return old_options;
+  }
+  /*!
+   * \param context handle of metafile context.
+   * \return the current set of optimization options.
+   */
+  EMF_DECLARE(DWORD) GetEnhMetaFileOptions ( HDC context )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    return dc->options;
+  }
+  /*!
+   * Report what the optional optimizations have done to the metafile so far.
+   * \param context handle of metafile context.
+   * \param stats returns the counters.
+   * \return true if successful.
+   */
+  EMF_DECLARE(BOOL) GetEnhMetaFileStats ( HDC context, LPEMFSTATS stats )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 || stats == 0 ) return FALSE;
+
+    *stats = dc->stats;
+
+    return TRUE;
+  }
+  /*!
+   * Thin out the points given to subsequent Polyline, PolylineTo and Polygon
+   * calls. This is lossy, but with a tolerance of about a pixel, the
+   * rendered result is indistinguishable while the size of the metafile
+   * depends on the output resolution rather than on the input density.
+   * (Bezier control points are always written verbatim.) The method is one of:
+   * \li EMF_SIMPLIFY_NONE
+   * \li EMF_SIMPLIFY_DOUGLAS_PEUCKER
+   * \li EMF_SIMPLIFY_VISVALINGAM
+   * \li EMF_SIMPLIFY_M4 (polylines whose x is monotone, e.g. time series;
+   * the tolerance is the column width, 1 for pixel-exact output)
+   * \param context handle of metafile context.
+   * \param method simplification algorithm.
+   * \param tolerance the allowed error in device units.
+   * \return true if successful.
+   */
+  EMF_DECLARE(BOOL) SetPolylineSimplification ( HDC context, DWORD method,
+						FLOAT tolerance )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 || method > EMF_SIMPLIFY_M4 || tolerance < 0 )
+      return FALSE;
+
+    dc->simplify_method = method;
+    dc->simplify_tolerance = tolerance;
+
+    return TRUE;
+  }
+  /*!
+   * Delete the metafile. Well, you can call this to clear out the memory
+   * used by the metafile, but it's already been written to disk by the
+   * time this is callable.
+   * \param metafile handle to the metafile.
+   * \return true if metafile successfully deleted.
+   */
+  EMF_DECLARE(BOOL) DeleteEnhMetaFile ( HENHMETAFILE metafile )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
+
+    if ( dc == 0 ) return FALSE;
+
+    dc->deleteMetafile( );
+    dc->releasePlayCache( );
+
+    return TRUE;
+  }
+  /*!
+   * Delete the metafile. Well, you can call this to clear out the memory
+   * used by the metafile, but it's already been written to disk by the
+   * time this is callable. Just calls DeleteEnhMetafile.
+   * \param metafile handle to the metafile.
+   * \return true if metafile successfully deleted.
+   */
+  EMF_DECLARE(BOOL) DeleteMetaFile ( HMETAFILE metafile )
+  {
+    return DeleteEnhMetaFile( metafile );
+  }
+
+  /*!
+   * Read an enhanced metafile from the given file.
+   * \param filename ASCII file name.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileA ( LPCSTR filename )
+  {
+    return GetEnhMetaFileWithThreadsA( filename, 0 );
+  }
+
+  /*!
+   * Read an enhanced metafile from the given file.
+   * \param filename WCHAR file name.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileW ( LPCWSTR filename )
+  {
+    return GetEnhMetaFileWithThreadsW( filename, 0 );
+  }
+
+  /*!
+   * Read an enhanced metafile from the given file, constructing its
+   * records with several threads.
+   * \param filename ASCII file name.
+   * \param threads the number of threads; 0 for one per processor if the
+   * metafile is big enough to be worth it, 1 to read it sequentially.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileWithThreadsA ( LPCSTR filename, UINT threads )
+  {
+    // All this does is promote the ASCII strings to UNICODE (after a fashion)
+    // and then use GetEnhMetaFileWithThreadsW
+
+    if ( filename == 0 || *filename == '\0' ) return 0;
+
+    int filename_count = ::strlen( filename );
+
+    std::basic_string<WCHAR> filename_w( filename, filename + filename_count );
+
+    HENHMETAFILE handle =  GetEnhMetaFileWithThreadsW( filename_w.c_str(), threads );
+
+    return handle;
+  }
+
+  /*!
+   * Read an enhanced metafile from the given file. With several threads,
+   * the first pass only finds where each record lies; then each thread
+   * constructs the records in a slice of the file. Loading lazily stops
+   * after the first pass.
+   * \param filename WCHAR file name.
+   * \param threads the number of threads; 0 for one per processor if the
+   * metafile is big enough to be worth it, 1 to read it sequentially.
+   * \param lazy decode the records only as they are used?
+   * \param budget with lazy, the most bytes of decoded records to keep.
+   * \param cache with lazy, use (or make) the record index cached next to
+   * the file.
+   * \return metafile handle.
+   */
+  static HENHMETAFILE readMetaFile ( LPCWSTR filename, UINT threads, bool lazy,
+				     DWORD budget, bool cache )
+  {
+    if ( filename == 0 || *filename == 0 ) return 0;
+
+    // Unfortunately, the ANSI C library doesn't have a "wide" character
+    // file fopen call, so we convert the file name back to ASCII and
+    // hope for the best.
+    LPCWSTR w_tmp = filename;
+    int n_char_w = 0;
+    while ( *w_tmp++ ) n_char_w++;
+    std::string filename_a( filename, filename + n_char_w );
+
+    ::FILE* fp;
+
+    fp = ::fopen( filename_a.c_str(), "rb" );
+
+    if ( fp == 0 ) {
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+                << strerror( errno ) 
+                << std::endl;
+      return 0;
+    }
+
+    // Create an implicit device context for this metafile. This
+    // also creates an implicit metafile header.
+
+    EMF::METAFILEDEVICECONTEXT* dc =
+      new EMF::METAFILEDEVICECONTEXT ( fp, 0, 0 );
+
+    // Read the header a little bit at a time.
+
+    ::EMR emr;
+
+    // Peek at the first word to determine the file type.
+    size_t ret = ::fread( &emr.iType, sizeof(emr.iType), 1, fp );
+
+    emr.iType = EMF::swab( emr.iType );
+
+    if ( ret == 0 || emr.iType != EMR_HEADER ) {
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: Not an EMF"
+                << std::endl;
+      ::fclose( fp );
+      DeleteDC( dc->handle );
+      return 0;
+    }
+
+    ret = ::fread( &emr.nSize, sizeof(emr.nSize), 1, fp );
+
+    emr.nSize = EMF::swab( emr.nSize );
+
+    if ( ret == 0 ) {
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: Header too short"
+                << std::endl;
+      ::fclose( fp );
+      DeleteDC( dc->handle );
+      return 0;
+    }
+
+    ::rewind( fp );
+
+    try {
+      dc->header->unserialize( dc->ds );
+    }
+    catch ( const std::runtime_error& e ) {
+      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+                << e.what()
+                << std::endl;
+      ::fclose( fp );
+      DeleteDC( dc->handle );
+      return 0;
+    }
+
+    // Strictly, the records are reattached so these must be recomputed:
+    dc->header->nBytes = dc->header->nSize;
+    dc->header->nRecords = 1;
+
+    ::fseek( fp, emr.nSize, SEEK_SET );
+
+    if ( lazy ) {
+      if ( ! cache || ! EMF::indexFromCache( dc, fp, filename_a, budget ) ) {
+	EMF::indexRecords( dc, fp, budget );
+
+	if ( cache ) EMF::cacheIndex( dc, filename_a );
+      }
+
+      return dc->handle;
+    }
+
+    threads = EMF::readerThreads( fp, threads );
+
+    if ( threads > 1 ) {
+      bool read = EMF::readRecords( dc, fp, filename_a, threads );
+
+      ::fclose( fp );
+
+      if ( !read ) {
+	DeleteDC( dc->handle );
+	return 0;
+      }
+
+      return dc->handle;
+    }
+
+    while ( true ) {
+      long position = ::ftell( fp );
+
+      // Peek at the next record type. This is the only context where
+      // EOF is not an error.
+
+      ret = ::fread( &emr.iType, sizeof(emr.iType), 1, fp );
+
+      emr.iType = EMF::swab( emr.iType );
+
+      if ( ret == 0 ) {
+        if ( ! feof( fp ) ) {
+          std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+                    << strerror( errno )
+                    << std::endl;
+        }
+        break;
+      }
+
+      // Peek at the record size.
+
+      ret = ::fread( &emr.nSize, sizeof(emr.nSize), 1, fp );
+
+      emr.nSize = EMF::swab( emr.nSize );
+
+      if ( ret == 0 || emr.nSize == 0 ) {
+        std::string message;
+        if ( ret == 0 ) {
+          message = strerror( errno );
+        }
+        else {
+          message = "record size == 0";
+        }
+	std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+                  << message
+		  << std::endl;
+        break;
+      }
+
+      long next_position = position + emr.nSize;
+
+      // Avoid a giant switch statement here by using a map<> to store
+      // the "virtual" constructors for each of the record types.
+      EMF::METARECORDCTOR new_record = EMF::globalObjects.newRecord( emr.iType );
+
+      if ( new_record != 0 ) {
+	::fseek( fp, position, SEEK_SET );
+        try {
+          EMF::METARECORD* record = new_record( dc->ds );
+
+          dc->appendRecord( record );
+        }
+        catch ( const std::runtime_error& e ) {
+          std::cerr << "GetEnhMetaFileW read error. cannot continue: "
+                    << e.what()
+                    << std::endl;
+          break;
+        }
+        catch ( const std::bad_alloc& e ) {
+          std::cerr << "GetEnhMetaFileW out of memory. cannot continue"
+                    << std::endl;
+          break;
+        }
+      }
+      else {
+	std::cerr << "GetEnhMetaFileW warning: read unknown record type "
+		  << emr.iType << " of size " << emr.nSize << std::endl;
+      }
+
+      // Regardless, position ourselves at the next record.
+      ::fseek( fp, next_position, SEEK_SET );
+    }
+
+    ::fclose( fp );
+
+    return dc->handle;
+  }
+
+  /*!
+   * Read an enhanced metafile from the given file, constructing its
+   * records with several threads. The first pass only finds where each
+   * record lies; then each thread constructs the records in a slice of
+   * the file.
+   * \param filename WCHAR file name.
+   * \param threads the number of threads; 0 for one per processor if the
+   * metafile is big enough to be worth it, 1 to read it sequentially.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileWithThreadsW ( LPCWSTR filename, UINT threads )
+  {
+    return readMetaFile( filename, threads, false, 0, false );
+  }
+
+  /*!
+   * Open an enhanced metafile from the given file, decoding each record
+   * only when it is used (by PlayEnhMetaFile, say). The file stays open
+   * until the metafile is deleted.
+   * \param filename ASCII file name.
+   * \param budget the most bytes of decoded records to keep; past that,
+   * the least recently used are dropped. 0 keeps every record once used.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileLazyA ( LPCSTR filename, DWORD budget )
+  {
+    if ( filename == 0 || *filename == '\0' ) return 0;
+
+    int filename_count = ::strlen( filename );
+
+    std::basic_string<WCHAR> filename_w( filename, filename + filename_count );
+
+    return GetEnhMetaFileLazyW( filename_w.c_str(), budget );
+  }
+
+  /*!
+   * Open an enhanced metafile from the given file, decoding each record
+   * only when it is used (by PlayEnhMetaFile, say). The file stays open
+   * until the metafile is deleted. Unlike reading the whole metafile, a
+   * damaged record is only found (and skipped) when it is used.
+   * \param filename WCHAR file name.
+   * \param budget the most bytes of decoded records to keep; past that,
+   * the least recently used are dropped. 0 keeps every record once used.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileLazyW ( LPCWSTR filename, DWORD budget )
+  {
+    return readMetaFile( filename, 1, true, budget, false );
+  }
+
+  /*!
+   * Open an enhanced metafile from the given file as GetEnhMetaFileLazyA
+   * does, and index its records (see GetEnhMetaFileRecordIndex). The index
+   * is cached in a file next to the metafile (its name plus ".idx"), so
+   * reopening the same version of the metafile doesn't read it again.
+   * \param filename ASCII file name.
+   * \param budget the most bytes of decoded records to keep; 0 for no limit.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileIndexedA ( LPCSTR filename, DWORD budget )
+  {
+    if ( filename == 0 || *filename == '\0' ) return 0;
+
+    int filename_count = ::strlen( filename );
+
+    std::basic_string<WCHAR> filename_w( filename, filename + filename_count );
+
+    return GetEnhMetaFileIndexedW( filename_w.c_str(), budget );
+  }
+
+  /*!
+   * Open an enhanced metafile from the given file as GetEnhMetaFileLazyW
+   * does, and index its records (see GetEnhMetaFileRecordIndex). The index
+   * is cached in a file next to the metafile (its name plus ".idx"), keyed
+   * by the size and modification time of the metafile, so reopening the
+   * same version of the metafile doesn't read it again.
+   * \param filename WCHAR file name.
+   * \param budget the most bytes of decoded records to keep; 0 for no limit.
+   * \return metafile handle.
+   */
+  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileIndexedW ( LPCWSTR filename, DWORD budget )
+  {
+    return readMetaFile( filename, 1, true, budget, true );
+  }
+
+  /*!
+   * Describe the records of a metafile: for each, its type, size, offset
+   * and the bounds of what it paints. The index is built the first time
+   * it is asked for (which decodes every record of a lazily loaded
+   * metafile).
+   * \param metafile the metafile.
+   * \param first the first record to describe (the header is record 0).
+   * \param n the number of records to describe.
+   * \param info the descriptions; if null, just count the records.
+   * \return the number of records described; the number of records in
+   * the metafile if info is null.
+   */
+  EMF_DECLARE(UINT) GetEnhMetaFileRecordIndex ( HENHMETAFILE metafile, UINT first, UINT n,
+						LPEMFRECORDINFO info )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
 
-    LPWSTR description_w;
+    if ( dc == 0 ) return 0;
 
-    if ( description ) {
-      int description1_count = ::strlen( description );
-      int description2_count = ::strlen( description + (description1_count + 1) );
+    if ( info == 0 ) return dc->records.size();
 
-      description_w = new WCHAR[ description1_count + description2_count + 3 ];
+    if ( dc->record_index.size() != dc->records.size() )
+      EMF::buildIndex( dc );
 
-      for ( int i=0; i<=(description1_count + description2_count + 2); i++ )
-	description_w[i] = (WCHAR)*description++;
-    }
-    else
-      description_w = 0;
+    if ( first >= dc->record_index.size() ) return 0;
 
-    HDC dc = CreateEnhMetaFileWithFILEW ( referenceContext, fp, size, description_w );
+    n = min( n, dc->record_index.size() - first );
 
-    if ( description_w ) delete[] description_w;
+    std::copy( dc->record_index.begin() + first, dc->record_index.begin() + first + n,
+	       info );
 
-    return dc;
+    return n;
   }
+
   /*!
-   * Many graphics programs want to open and close output files themselves. At
-   * least, gnuplot and Grace do. So, supply the FILE pointer when creating
-   * a metafile and let the plotting program's driver handle it. This differs
-   * from CreateEnhMetaFileWithFILEA only in that the description string uses
-   * wide characters.
-   *
-   * \param context pseudo device context.
-   * \param fp open FILE pointer.
-   * \param size the size (really the position on the paper) of the plot image.
-   * \param description description string for metafile (see EMF::METAFILE
-   * constructor for details).
-   * \return handle to a metafile device context.
+   * Copy one record of a metafile, as it would be written to a file,
+   * into the buffer. As with StreamEnhMetaFile, only the record type and
+   * size are in the host's byte order.
+   * \param metafile the metafile.
+   * \param index the record (the header is record 0).
+   * \param size the size of the buffer.
+   * \param record the buffer; if null, just return the size of the record.
+   * \return the size of the record; 0 if there is no such record, it
+   * can't be read or it doesn't fit in the buffer.
    */
-  EMF_DECLARE(HDC) CreateEnhMetaFileWithFILEW ( HDC referenceContext, ::FILE* fp,
-				   const RECT* size, LPCWSTR description )
+  EMF_DECLARE(UINT) GetEnhMetaFileRecord ( HENHMETAFILE metafile, UINT index, UINT size,
+					   LPENHMETARECORD record )
   {
-    (void)referenceContext;
     EMF::METAFILEDEVICECONTEXT* dc =
-      new EMF::METAFILEDEVICECONTEXT ( fp, size, description );
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
 
-    return dc->handle;
-  }
+    if ( dc == 0 || index >= dc->records.size() ) return 0;
 
-  /*!
-   * The old 16-bit metafile constructor. Actually creates an Enhanced Metafile
-   * anyway.
-   * \param filename ASCII filename of metafile.
-   * \return a handle to the metafile
-   */
-  EMF_DECLARE(HMETAFILE) CreateMetaFileA ( LPCSTR filename )
-  {
-    return CreateEnhMetaFileA( 0, filename, 0, 0 );
+    EMF::METARECORD* r = dc->records[index];
+
+    if ( record == 0 ) return r->size();
+
+    if ( size < (UINT)r->size() ) return 0;
+
+    std::vector<BYTE> bytes;
+
+    try {
+      if ( ! r->serialize( EMF::DATASTREAM( bytes ) ) ) return 0;
+    }
+    catch ( const std::bad_alloc& ) {
+      return 0;
+    }
+
+    if ( bytes.size() < 2 * sizeof(DWORD) || bytes.size() > size ) return 0;
+
+    memcpy( record, bytes.data(), bytes.size() );
+    record->iType = EMF::swab( record->iType );
+    record->nSize = EMF::swab( record->nSize );
+
+    return bytes.size();
   }
+
   /*!
-   * If the metafile was opened with CreateEnhMetaFileA or CreateEnhMetaFileW,
-   * use this routine to close the metafile.
-   * \param context metafile device context.
-   * \return a handle to the metafile.
+   * Read an enhanced metafile from memory. With lazy, the records are only
+   * decoded as they are used.
+   * \param n the size of the metafile.
+   * \param data the metafile.
+   * \param lazy decode the records only as they are used?
+   * \param borrow with lazy, read the records from data itself, rather
+   * than from a copy.
+   * \param budget with lazy, the most bytes of decoded records to keep.
+   * \return metafile handle.
    */
-  EMF_DECLARE(HENHMETAFILE) CloseEnhMetaFile ( HDC context )
+  static HENHMETAFILE readMetaFileBits ( UINT n, const BYTE* data, bool lazy,
+					 bool borrow, DWORD budget )
   {
-    EMF::METAFILEDEVICECONTEXT* dc =
-      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+    if ( data == 0 ) return 0;
 
-    if ( dc == 0 ) return 0;
+    // Create an implicit device context for this metafile. This
+    // also creates an implicit metafile header.
 
-    EMF::EMREOF* eof = new EMF::EMREOF;
+    EMF::METAFILEDEVICECONTEXT* dc =
+      new EMF::METAFILEDEVICECONTEXT ( 0, 0, 0 );
 
-    dc->appendRecord( eof );
+    try {
+      dc->header->unserialize( EMF::DATASTREAM( data, n ) );
 
-    // If it's a disk-based metafile, actually write it to disk
+      if ( dc->header->iType != EMR_HEADER )
+	throw std::runtime_error( "Not an EMF" );
+    }
+    catch ( const std::runtime_error& e ) {
+      std::cerr << "SetEnhMetaFileBits read error. cannot continue: "
+                << e.what()
+                << std::endl;
+      DeleteDC( dc->handle );
+      return 0;
+    }
 
-    if ( dc->fp ) {
-      std::for_each( dc->records.begin(), dc->records.end(),
-		     std::bind2nd( std::mem_fun( &EMF::METARECORD::serialize ),
-				   dc->ds ) );
+    // Strictly, the records are reattached so these must be recomputed:
+    dc->header->nBytes = dc->header->nSize;
+    dc->header->nRecords = 1;
 
-      ::fclose( dc->fp );
+    EMF::RECORDSOURCE* source = 0;
 
-      dc->fp = 0;
+    if ( lazy ) {
+      try {
+	source = new EMF::RECORDSOURCE( data, n, borrow, budget );
+      }
+      catch ( const std::bad_alloc& ) {
+	std::cerr << "SetEnhMetaFileBits out of memory. cannot continue"
+		  << std::endl;
+	DeleteDC( dc->handle );
+	return 0;
+      }
+
+      dc->record_source.reset( source );
+      data = source->bits();
     }
 
-    // There's no particular reason to distinguish between the context and
-    // the metafile
+    EMF::readBits( dc, data, n, dc->header->nSize, source );
 
-    return (HENHMETAFILE)context;
+    return dc->handle;
   }
 
   /*!
-   * If the metafile was opened with CreateEnhMetaFileA or CreateEnhMetaFileW,
-   * use this routine to close the metafile (same as CloseEnhMetaFile)
-   * \param context metafile device context.
-   * \return a handle to the metafile.
+   * Create an enhanced metafile from the bytes of one, as if it had been
+   * read from a file. The records are all decoded at once, so data is no
+   * longer needed afterwards.
+   * \param n the size of the metafile.
+   * \param data the metafile.
+   * \return metafile handle.
    */
-  EMF_DECLARE(HMETAFILE) CloseMetaFile ( HDC context )
+  EMF_DECLARE(HENHMETAFILE) SetEnhMetaFileBits ( UINT n, const BYTE* data )
   {
-    return CloseEnhMetaFile( context );
+    return readMetaFileBits( n, data, false, false, 0 );
   }
 
   /*!
-   * Close a metafile which was created with an already open FILE pointer.
-   *
-   * \param context handle of metafile context
-   * \return handle to a metafile. I don't think there's anything you can do with
-   * it, though.
+   * Create an enhanced metafile from the bytes of one, decoding each record
+   * only when it is used (by PlayEnhMetaFile, say).
+   * \param n the size of the metafile.
+   * \param data the metafile.
+   * \param borrow if true, the records are decoded from data itself, which
+   * must be kept until the metafile is deleted; otherwise, the metafile
+   * keeps a copy of data.
+   * \param budget the most bytes of decoded records to keep; past that,
+   * the least recently used are dropped. 0 keeps every record once used.
+   * \return metafile handle.
    */
-  EMF_DECLARE(HENHMETAFILE) CloseEnhMetaFileWithFILE ( HDC context )
+  EMF_DECLARE(HENHMETAFILE) SetEnhMetaFileBitsLazy ( UINT n, const BYTE* data,
+						     BOOL borrow, DWORD budget )
   {
-    EMF::METAFILEDEVICECONTEXT* dc =
-      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
-
-    if ( dc == 0 ) return 0;
+    return readMetaFileBits( n, data, true, borrow, budget );
+  }
 
-    EMF::EMREOF* eof = new EMF::EMREOF;
+  /*!
+   * Read only the header of the metafile in the given file, without
+   * opening the metafile.
+   * \param filename ASCII file name.
+   * \param size the size of the header buffer.
+   * \param header the header buffer (may be null).
+   * \param length the size of the description buffer in WCHARs.
+   * \param description the description buffer (may be null).
+   * \return the number of bytes copied into header (or which would be,
+   * if header is null); 0 if the file can't be read or is not a metafile.
+   */
+  EMF_DECLARE(UINT) ProbeEnhMetaFileA ( LPCSTR filename, UINT size,
+					LPENHMETAHEADER header, UINT length,
+					LPWSTR description )
+  {
+    if ( filename == 0 || *filename == '\0' ) return 0;
 
-    dc->appendRecord( eof );
+    ::FILE* fp = ::fopen( filename, "rb" );
 
-    // If it's a disk-based metafile, actually write it to disk
+    if ( fp == 0 ) return 0;
 
-    if ( dc->fp ) {
-      std::for_each( dc->records.begin(), dc->records.end(),
-		     std::bind2nd( std::mem_fun( &EMF::METARECORD::serialize ),
-				   dc->ds ) );
-    }
+    UINT ret = ProbeEnhMetaFileWithFILE( fp, size, header, length, description );
 
-    // There's no particular reason to distinguish between the context and
-    // the metafile
+    ::fclose( fp );
 
-    return (HENHMETAFILE)context;
+    return ret;
   }
+
   /*!
-   * Delete the metafile. Well, you can call this to clear out the memory
-   * used by the metafile, but it's already been written to disk by the
-   * time this is callable.
-   * \param metafile handle to the metafile.
-   * \return true if metafile successfully deleted.
+   * Read only the header of the metafile in the given file, without
+   * opening the metafile.
+   * \param filename WCHAR file name.
+   * \param size the size of the header buffer.
+   * \param header the header buffer (may be null).
+   * \param length the size of the description buffer in WCHARs.
+   * \param description the description buffer (may be null).
+   * \return the number of bytes copied into header (or which would be,
+   * if header is null); 0 if the file can't be read or is not a metafile.
    */
-  EMF_DECLARE(BOOL) DeleteEnhMetaFile ( HENHMETAFILE metafile )
+  EMF_DECLARE(UINT) ProbeEnhMetaFileW ( LPCWSTR filename, UINT size,
+					LPENHMETAHEADER header, UINT length,
+					LPWSTR description )
   {
-    EMF::METAFILEDEVICECONTEXT* dc =
-      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
+    if ( filename == 0 || *filename == 0 ) return 0;
 
-    if ( dc == 0 ) return FALSE;
+    // As with GetEnhMetaFileW, convert the file name back to ASCII.
+    LPCWSTR w_tmp = filename;
+    int n_char_w = 0;
+    while ( *w_tmp++ ) n_char_w++;
+    std::string filename_a( filename, filename + n_char_w );
 
-    dc->deleteMetafile( );
+    return ProbeEnhMetaFileA( filename_a.c_str(), size, header, length, description );
+  }
 
-    return TRUE;
+  /*!
+   * Read only the header of a metafile from the given stream.
+   * \param fp the stream, positioned at the start of the metafile. It need
+   * not be seekable; afterwards, it is positioned somewhere in the header.
+   * \param size the size of the header buffer.
+   * \param header the header buffer (may be null).
+   * \param length the size of the description buffer in WCHARs.
+   * \param description the description buffer (may be null).
+   * \return the number of bytes copied into header (or which would be,
+   * if header is null); 0 if the stream is not a metafile.
+   */
+  EMF_DECLARE(UINT) ProbeEnhMetaFileWithFILE ( FILE* fp, UINT size,
+					       LPENHMETAHEADER header, UINT length,
+					       LPWSTR description )
+  {
+    if ( fp == 0 ) return 0;
+
+    return EMF::probeHeader( EMF::DATASTREAM( fp ), size, header, length, description );
   }
+
   /*!
-   * Delete the metafile. Well, you can call this to clear out the memory
-   * used by the metafile, but it's already been written to disk by the
-   * time this is callable. Just calls DeleteEnhMetafile.
-   * \param metafile handle to the metafile.
-   * \return true if metafile successfully deleted.
+   * Read only the header of a metafile in memory.
+   * \param data the metafile bytes.
+   * \param n the number of bytes.
+   * \param size the size of the header buffer.
+   * \param header the header buffer (may be null).
+   * \param length the size of the description buffer in WCHARs.
+   * \param description the description buffer (may be null).
+   * \return the number of bytes copied into header (or which would be,
+   * if header is null); 0 if the bytes are not a metafile.
    */
-  EMF_DECLARE(BOOL) DeleteMetaFile ( HMETAFILE metafile )
+  EMF_DECLARE(UINT) ProbeEnhMetaFileBits ( const BYTE* data, UINT n, UINT size,
+					   LPENHMETAHEADER header, UINT length,
+					   LPWSTR description )
   {
-    return DeleteEnhMetaFile( metafile );
+    if ( data == 0 ) return 0;
+
+    return EMF::probeHeader( EMF::DATASTREAM( data, n ), size, header, length,
+			     description );
   }
 
   /*!
-   * Read an enhanced metafile from the given file.
+   * Walk the records of the metafile in the given file, handing each in
+   * turn to a callback, without opening the metafile.
+   * Only the record type and size are in the host's byte order; the rest
+   * of each record is as in the file (little-endian). The callback gets
+   * no device context or handle table.
    * \param filename ASCII file name.
-   * \return metafile handle.
+   * \param proc the callback; the walk stops if it returns 0.
+   * \param data passed on to proc.
+   * \return TRUE if every record was handed to proc.
    */
-  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileA ( LPCSTR filename )
+  EMF_DECLARE(BOOL) StreamEnhMetaFileA ( LPCSTR filename, ENHMFENUMPROC proc,
+					 LPVOID data )
   {
-    // All this does is promote the ASCII strings to UNICODE (after a fashion)
-    // and then use GetEnhMetaFileW
+    if ( filename == 0 || *filename == '\0' ) return FALSE;
 
-    if ( filename == 0 || *filename == '\0' ) return 0;
+    ::FILE* fp = ::fopen( filename, "rb" );
 
-    int filename_count = ::strlen( filename );
+    if ( fp == 0 ) {
+      std::cerr << "StreamEnhMetaFile read error. cannot continue: "
+		<< strerror( errno )
+		<< std::endl;
+      return FALSE;
+    }
 
-    std::basic_string<WCHAR> filename_w( filename, filename + filename_count );
+    BOOL ret = StreamEnhMetaFileWithFILE( fp, proc, data );
 
-    HENHMETAFILE handle =  GetEnhMetaFileW( filename_w.c_str() );
+    ::fclose( fp );
 
-    return handle;
+    return ret;
   }
 
   /*!
-   * Read an enhanced metafile from the given file.
+   * Walk the records of the metafile in the given file, handing each in
+   * turn to a callback, without opening the metafile.
+   * Only the record type and size are in the host's byte order; the rest
+   * of each record is as in the file (little-endian). The callback gets
+   * no device context or handle table.
    * \param filename WCHAR file name.
-   * \return metafile handle.
+   * \param proc the callback; the walk stops if it returns 0.
+   * \param data passed on to proc.
+   * \return TRUE if every record was handed to proc.
    */
-  EMF_DECLARE(HENHMETAFILE) GetEnhMetaFileW ( LPCWSTR filename )
+  EMF_DECLARE(BOOL) StreamEnhMetaFileW ( LPCWSTR filename, ENHMFENUMPROC proc,
+					 LPVOID data )
   {
-    if ( filename == 0 || *filename == 0 ) return 0;
+    if ( filename == 0 || *filename == 0 ) return FALSE;
 
-    // Unfortunately, the ANSI C library doesn't have a "wide" character
-    // file fopen call, so we convert the file name back to ASCII and
-    // hope for the best.
+    // As with GetEnhMetaFileW, convert the file name back to ASCII.
     LPCWSTR w_tmp = filename;
     int n_char_w = 0;
     while ( *w_tmp++ ) n_char_w++;
     std::string filename_a( filename, filename + n_char_w );
 
-    ::FILE* fp;
-
-    fp = ::fopen( filename_a.c_str(), "r" );
-
-    if ( fp == 0 ) {
-      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
-                << strerror( errno ) 
-                << std::endl;
-      return 0;
-    }
-
-    // Create an implicit device context for this metafile. This
-    // also creates an implicit metafile header.
+    return StreamEnhMetaFileA( filename_a.c_str(), proc, data );
+  }
 
-    EMF::METAFILEDEVICECONTEXT* dc =
-      new EMF::METAFILEDEVICECONTEXT ( fp, 0, 0 );
+  /*!
+   * Walk the records of a metafile read from the given stream, handing
+   * each in turn to a callback. The stream is only read forward, so it
+   * may be a pipe (stdin, say).
+   * Only the record type and size are in the host's byte order; the rest
+   * of each record is as in the file (little-endian). The callback gets
+   * no device context or handle table.
+   * \param fp the stream, positioned at the start of the metafile.
+   * \param proc the callback; the walk stops if it returns 0.
+   * \param data passed on to proc.
+   * \return TRUE if every record was handed to proc.
+   */
+  EMF_DECLARE(BOOL) StreamEnhMetaFileWithFILE ( FILE* fp, ENHMFENUMPROC proc,
+						LPVOID data )
+  {
+    if ( fp == 0 || proc == 0 ) return FALSE;
 
-    // Read the header a little bit at a time.
+    return EMF::streamRecords( [fp]( void* buffer, size_t n ) {
+	return ::fread( buffer, 1, n, fp );
+      }, proc, data );
+  }
 
-    ::EMR emr;
+  /*!
+   * Walk the records of a metafile in memory, handing each in turn to a
+   * callback.
+   * Only the record type and size are in the host's byte order; the rest
+   * of each record is as in the file (little-endian). The callback gets
+   * no device context or handle table.
+   * \param bits the metafile bytes.
+   * \param n the number of bytes.
+   * \param proc the callback; the walk stops if it returns 0.
+   * \param data passed on to proc.
+   * \return TRUE if every record was handed to proc.
+   */
+  EMF_DECLARE(BOOL) StreamEnhMetaFileBits ( const BYTE* bits, UINT n,
+					    ENHMFENUMPROC proc, LPVOID data )
+  {
+    if ( bits == 0 || proc == 0 ) return FALSE;
 
-    // Peek at the first word to determine the file type.
-    size_t ret = ::fread( &emr.iType, sizeof(emr.iType), 1, fp );
+    const BYTE* end = bits + n;
 
-    emr.iType = EMF::swab( emr.iType );
+    return EMF::streamRecords( [&bits, end]( void* buffer, size_t count ) {
+	count = min( count, (size_t)( end - bits ) );
+	memcpy( buffer, bits, count );
+	bits += count;
+	return count;
+      }, proc, data );
+  }
 
-    if ( ret == 0 || emr.iType != EMR_HEADER ) {
-      std::cerr << "GetEnhMetaFileW read error. cannot continue: Not an EMF"
-                << std::endl;
-      ::fclose( fp );
-      DeleteDC( dc->handle );
-      return 0;
-    }
+  /*!
+   * This is not a ECMA-234 standard function. Combine several metafiles
+   * into one by copying their records, which are not decoded: each is
+   * placed with a world transform, between a SaveDC and a RestoreDC, and
+   * its object handles are moved past those of the metafiles before it.
+   * The header is the first metafile's (without its description), with
+   * the bounds and frame of all of them.
+   * \param count the number of metafiles.
+   * \param bits the bytes of each metafile.
+   * \param sizes the size of each metafile in bytes.
+   * \param xforms where to put each metafile (in logical coordinates); if
+   * null, they all stay where they are.
+   * \param size the size of buffer.
+   * \param buffer the merged metafile (may be null).
+   * \return the size of the merged metafile (which would be copied into
+   * buffer, if it is null); 0 if buffer is too small or a metafile is
+   * damaged.
+   */
+  EMF_DECLARE(UINT) MergeEnhMetaFileBits ( UINT count, const BYTE* const* bits,
+					   const UINT* sizes, const XFORM* xforms,
+					   UINT size, LPBYTE buffer )
+  {
+    if ( count == 0 || bits == 0 || sizes == 0 ) return 0;
 
-    ret = ::fread( &emr.nSize, sizeof(emr.nSize), 1, fp );
+    size_t n = EMF::mergeBits( count, bits, sizes, xforms, 0 );
 
-    emr.nSize = EMF::swab( emr.nSize );
+    if ( n == 0 || buffer == 0 ) return n;
 
-    if ( ret == 0 ) {
-      std::cerr << "GetEnhMetaFileW read error. cannot continue: Header too short"
-                << std::endl;
-      ::fclose( fp );
-      DeleteDC( dc->handle );
-      return 0;
-    }
+    if ( size < n ) return 0;
 
-    ::rewind( fp );
+    return EMF::mergeBits( count, bits, sizes, xforms, buffer );
+  }
 
-    try {
-      dc->header->unserialize( dc->ds );
-    }
-    catch ( const std::runtime_error& e ) {
-      std::cerr << "GetEnhMetaFileW read error. cannot continue: "
-                << e.what()
-                << std::endl;
-      ::fclose( fp );
-      DeleteDC( dc->handle );
-      return 0;
-    }
+  /*!
+   * This is not a ECMA-234 standard function. Combine several metafile
+   * files into one, as MergeEnhMetaFileBits does.
+   * \param filename ASCII name of the merged file.
+   * \param count the number of metafiles.
+   * \param sources ASCII name of each metafile.
+   * \param xforms where to put each metafile (may be null).
+   * \return true if the merged file was written.
+   */
+  EMF_DECLARE(BOOL) MergeEnhMetaFilesA ( LPCSTR filename, UINT count,
+					 const LPCSTR* sources, const XFORM* xforms )
+  {
+    if ( filename == 0 || count == 0 || sources == 0 ) return FALSE;
 
-    // Strictly, the records are reattached so these must be recomputed:
-    dc->header->nBytes = dc->header->nSize;
-    dc->header->nRecords = 1;
+    std::vector< std::vector<BYTE> > contents( count );
+    std::vector< const BYTE* > bits( count );
+    std::vector< UINT > sizes( count );
 
-    ::fseek( fp, emr.nSize, SEEK_SET );
+    for ( UINT i = 0; i < count; i++ ) {
+      struct stat st;
 
-    while ( true ) {
-      long position = ::ftell( fp );
+      if ( sources[i] == 0 || ::stat( sources[i], &st ) != 0 ||
+	   st.st_size > 0xffffffffL )
+	return FALSE;
 
-      // Peek at the next record type. This is the only context where
-      // EOF is not an error.
+      FILE* fp = ::fopen( sources[i], "rb" );
 
-      ret = ::fread( &emr.iType, sizeof(emr.iType), 1, fp );
+      if ( fp == 0 ) return FALSE;
 
-      emr.iType = EMF::swab( emr.iType );
+      bool read = true;
 
-      if ( ret == 0 ) {
-        if ( ! feof( fp ) ) {
-          std::cerr << "GetEnhMetaFileW read error. cannot continue: "
-                    << strerror( errno )
-                    << std::endl;
-        }
-        break;
+      if ( st.st_size > 0 ) {
+	contents[i].resize( st.st_size );
+	read = ::fread( contents[i].data(), 1, st.st_size, fp ) == (size_t)st.st_size;
       }
 
-      // Peek at the record size.
+      ::fclose( fp );
 
-      ret = ::fread( &emr.nSize, sizeof(emr.nSize), 1, fp );
+      if ( ! read ) return FALSE;
 
-      emr.nSize = EMF::swab( emr.nSize );
+      bits[i] = contents[i].data();
+      sizes[i] = contents[i].size();
+    }
 
-      if ( ret == 0 || emr.nSize == 0 ) {
-        std::string message;
-        if ( ret == 0 ) {
-          message = strerror( errno );
-        }
-        else {
-          message = "record size == 0";
-        }
-	std::cerr << "GetEnhMetaFileW read error. cannot continue: "
-                  << message
-		  << std::endl;
-        break;
-      }
+    size_t n = EMF::mergeBits( count, bits.data(), sizes.data(), xforms, 0 );
 
-      long next_position = position + emr.nSize;
+    if ( n == 0 ) return FALSE;
 
-      // Avoid a giant switch statement here by using a map<> to store
-      // the "virtual" constructors for each of the record types.
-      EMF::METARECORDCTOR new_record = EMF::globalObjects.newRecord( emr.iType );
+    std::vector<BYTE> merged( n );
+    EMF::mergeBits( count, bits.data(), sizes.data(), xforms, merged.data() );
 
-      if ( new_record != 0 ) {
-	::fseek( fp, position, SEEK_SET );
-        try {
-          EMF::METARECORD* record = new_record( dc->ds );
+    FILE* fp = ::fopen( filename, "wb" );
 
-          dc->appendRecord( record );
-        }
-        catch ( const std::runtime_error& e ) {
-          std::cerr << "GetEnhMetaFileW read error. cannot continue: "
-                    << e.what()
-                    << std::endl;
-          break;
-        }
-        catch ( const std::bad_alloc& e ) {
-          std::cerr << "GetEnhMetaFileW out of memory. cannot continue"
-                    << std::endl;
-          break;
-        }
-      }
-      else {
-	std::cerr << "GetEnhMetaFileW warning: read unknown record type "
-		  << emr.iType << " of size " << emr.nSize << std::endl;
-      }
+    if ( fp == 0 ) return FALSE;
 
-      // Regardless, position ourselves at the next record.
-      ::fseek( fp, next_position, SEEK_SET );
-    }
+    bool written = ::fwrite( merged.data(), 1, n, fp ) == n;
 
-    ::fclose( fp );
+    return ::fclose( fp ) == 0 && written;
+  }
 
-    return dc->handle;
+  /*!
+   * This is not a ECMA-234 standard function. Combine several metafile
+   * files into one, as MergeEnhMetaFileBits does.
+   * \param filename W file name of the merged file.
+   * \param count the number of metafiles.
+   * \param sources W file name of each metafile.
+   * \param xforms where to put each metafile (may be null).
+   * \return true if the merged file was written.
+   */
+  EMF_DECLARE(BOOL) MergeEnhMetaFilesW ( LPCWSTR filename, UINT count,
+					 const LPCWSTR* sources, const XFORM* xforms )
+  {
+    if ( filename == 0 || count == 0 || sources == 0 ) return FALSE;
+
+    // As with GetEnhMetaFileW, convert the file names back to ASCII.
+    auto ascii = []( LPCWSTR name ) {
+      LPCWSTR w_tmp = name;
+      int n_char_w = 0;
+      while ( w_tmp && *w_tmp++ ) n_char_w++;
+      return std::string( name, name + n_char_w );
+    };
+
+    std::string filename_a = ascii( filename );
+    std::vector< std::string > sources_a( count );
+    std::vector< LPCSTR > names( count );
+
+    for ( UINT i = 0; i < count; i++ ) {
+      if ( sources[i] == 0 ) return FALSE;
+      sources_a[i] = ascii( sources[i] );
+      names[i] = sources_a[i].c_str();
+    }
+
+    return MergeEnhMetaFilesA( filename_a.c_str(), count, names.data(), xforms );
   }
 
   /*!
@@ -1188,21 +5610,125 @@ extern "C" {
    * \param true if successfully copied.
    */
   EMF_DECLARE(BOOL) PlayEnhMetaFile ( HDC context, HENHMETAFILE metafile,
-			 const RECT* /*frame*/ )
+			 const RECT* frame )
   {
     EMF::METAFILEDEVICECONTEXT* source =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
 
     if ( source == 0 ) return FALSE;
 
-    source->emf_handles.clear();
+    // Every record draws into the destination, so make sure once that
+    // there is one
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(context));
+
+    if ( dc == 0 ) return FALSE;
+
+    // The handle table keeps its space from one playback to the next
+    source->emf_handles.assign( source->handleTableSize(), 0 );
+
+    // As do the compiled records, unless the records have changed
+    if ( source->play_ops.size() != source->records.size() )
+      source->compilePlayback();
+
+    // A frame is honored with a world transform, which only scales and
+    // moves the metafile's reference device onto it. The metafile's own page
+    // mapping and world transform are folded into it as they change (see
+    // playMapping), so the destination's page mapping is left alone
+    XFORM transform;
+    INT level = 0;
+
+    source->play_framed = frame != 0 &&
+      EMF::frameTransform( *source->header, *frame, transform );
+
+    if ( source->play_framed ) {
+      const EMF::METAFILEDEVICECONTEXT::PLAYMAPPING unmapped =
+	{ MM_TEXT, { 0, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 1, 0, 0, 1, 0, 0 } };
+
+      level = EMF::saveDC( dc );
+      source->play_level = level;
+      source->play_mapping = unmapped;
+      source->play_saved.clear();
+      source->play_transform = EMF::combine( transform, dc->world );
+      EMF::setWorldTransform( dc, &source->play_transform );
+    }
+
+    // Each record goes straight to its execute() with the destination
+    // already in hand: no handle lookup or dynamic_cast per record
+    for ( size_t i = 0; i < source->play_ops.size(); i++ ) {
+      EMF::METAFILEDEVICECONTEXT::PLAYOP& op = source->play_ops[i];
+
+      source->play_position = i;
 
-    for ( auto r = source->records.begin(); r != source->records.end(); r++ ) {
-      (*r)->execute( source, context );
+      if ( source->play_framed ) {
+	// What a record draws never changes, so it is only asked once
+	if ( !op.measured ) {
+	  op.bounds = RECTL();
+	  op.draws = op.record->draws( op.bounds );
+	  op.measured = true;
+	}
+
+	if ( ( op.draws & EMF::METARECORD::DRAWS ) &&
+	     EMF::outsideFrame( dc, source->play_transform, transform, *frame,
+				op.bounds ) ) {
+	  dc->stats.nPrimitivesCulled++;
+	  continue;
+	}
+      }
+
+      op.play( op.record, source, dc );
+    }
+
+    if ( source->play_framed ) {
+      EMF::restoreDC( dc, level );
+      source->play_framed = false;
     }
 
     return TRUE;
   }
+  /*!
+   * This is not a ECMA-234 standard function. Keep the pens, brushes and
+   * fonts which playing the metafile back creates, so that playing it
+   * again selects the same objects instead of creating new ones. The
+   * destination gets the same records either way. The objects are held
+   * until the cache is released, turned off or the metafile is deleted.
+   * \param metafile The (loaded) metafile.
+   * \param enable true to keep the objects; false also releases them.
+   * \return the previous setting.
+   */
+  EMF_DECLARE(BOOL) SetEnhMetaFilePlayCache ( HENHMETAFILE metafile, BOOL enable )
+  {
+    EMF::METAFILEDEVICECONTEXT* source =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
+
+    if ( source == 0 ) return FALSE;
+
+    BOOL old_enable = source->play_caching;
+
+    if ( !enable ) source->releasePlayCache();
+
+    source->play_caching = enable;
+
+    return old_enable;
+  }
+
+  /*!
+   * This is not a ECMA-234 standard function. Delete the objects kept by
+   * the play cache of a metafile (which stays on).
+   * \param metafile The (loaded) metafile.
+   * \return true if metafile is a metafile.
+   */
+  EMF_DECLARE(BOOL) ReleaseEnhMetaFilePlayCache ( HENHMETAFILE metafile )
+  {
+    EMF::METAFILEDEVICECONTEXT* source =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(metafile));
+
+    if ( source == 0 ) return FALSE;
+
+    source->releasePlayCache();
+
+    return TRUE;
+  }
 
   /*!
    * This is not a ECMA-234 standard function. Edit (print) the contents of the
@@ -1238,6 +5764,11 @@ extern "C" {
   {
     return NO_ERROR;
   }
+} // extern "C"
+
+// The drawing calls below keep the C linkage emf.h gives them; leaving the
+// block lets each one sit beside the EMF:: core it hands its context to.
+
   /*!
    * Move the current point to the given position.
    * \param context handle to metafile context
@@ -1253,7 +5784,18 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
-    EMF::EMRMOVETOEX* movetoex = new EMF::EMRMOVETOEX( x, y );
+    return EMF::moveToEx( dc, x, y, point );
+  }
+
+  BOOL EMF::moveToEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+		       LPPOINT point )
+  {
+    POINT p = { x, y };
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, false, p.x, p.y ) )
+      dc->bake( p.x, p.y );
+
+    EMF::EMRMOVETOEX* movetoex = new EMF::EMRMOVETOEX( p.x, p.y );
 
     dc->appendRecord( movetoex );
 
@@ -1265,8 +5807,10 @@ extern "C" {
 
     dc->point.x = x;
     dc->point.y = y;
+    dc->position_stale = false;
+    dc->position_unknown = false;
 
-    dc->mergePoint( dc->point );
+    dc->mergePoint( p );
 
     return TRUE;
   }
@@ -1285,14 +5829,28 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
-    EMF::EMRLINETO* lineto = new EMF::EMRLINETO( x, y );
+    return EMF::lineTo( dc, x, y );
+  }
+
+  BOOL EMF::lineTo ( METAFILEDEVICECONTEXT* dc, INT x, INT y )
+  {
+    POINT p = { x, y };
+    bool baked = dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+				p.x, p.y, dc->point.x, dc->point.y );
+
+    dc->syncPosition();
+
+    if ( baked ) dc->bake( p.x, p.y );
+
+    EMF::EMRLINETO* lineto = new EMF::EMRLINETO( p.x, p.y );
 
     dc->appendRecord( lineto );
 
     dc->point.x = x;
     dc->point.y = y;
+    dc->position_unknown = false;
 
-    dc->mergePoint( dc->point );
+    dc->mergePoint( p );
 
     return TRUE;
   }
@@ -1346,6 +5904,18 @@ extern "C" {
 
     if ( gobj == 0 ) return 0;
 
+    return EMF::selectObject( dc, gobj );
+  }
+
+  HGDIOBJ EMF::selectObject ( METAFILEDEVICECONTEXT* dc,
+			      GRAPHICSOBJECT* gobj )
+  {
+    HGDIOBJ obj = gobj->handle;
+
+    // Selecting the object which is already current is a no-op
+
+    if ( dc->redundantSelect( gobj ) ) return obj;
+
     // Note: when an object is created, it cannot be written to the metafile
     // since those graphics calls don't have a device context associated with
     // them (why?). So, it is up to SelectObject to add a record for the object
@@ -1363,14 +5933,16 @@ extern "C" {
 
     if ( !( obj & ENHMETA_STOCK_OBJECT ) ) {
       // Has this object been written to the (metafile) device context before?
-      auto c = gobj->contexts.find( context );
+      auto c = gobj->contexts.find( dc->handle );
 
       if ( c != gobj->contexts.end() ) {
 	handle = c->second;
       }
-      else {
+      // Or has an identical object been written to it?
+      else if ( ( handle = dc->findInterned( gobj ) ) == 0 ) {
 	handle = dc->nextHandle();
-	dc->appendHandle( gobj->newEMR( context, handle ) );
+	dc->appendHandle( gobj->newEMR( dc->handle, handle ) );
+	dc->addInterned( gobj, handle );
       }
     }
     else {
@@ -1380,6 +5952,7 @@ extern "C" {
     EMF::EMRSELECTOBJECT* selectobject = new EMF::EMRSELECTOBJECT( handle );
 
     dc->appendRecord( selectobject );
+    dc->describeSelect( gobj->getType(), handle );
 
     // Supposed to return the current value of whatever kind of object is selected
 
@@ -1393,8 +5966,13 @@ extern "C" {
       dc->font = dynamic_cast< EMF::FONT* >( gobj );
       return handle;
     case EMF::O_PEN:
-      handle = dc->pen->handle;
+      handle = dc->extpen ? dc->extpen->handle : dc->pen->handle;
       dc->pen = dynamic_cast< EMF::PEN* >( gobj );
+      dc->extpen = 0;
+      return handle;
+    case EMF::O_EXTPEN:
+      handle = dc->extpen ? dc->extpen->handle : dc->pen->handle;
+      dc->extpen = dynamic_cast< EMF::EXTPEN* >( gobj );
       return handle;
     case EMF::O_PALETTE:
       handle = dc->palette->handle;
@@ -1514,50 +6092,7 @@ extern "C" {
 
     // Add a deletion record for this object to every device context
     // into which it has been selected(!) [Now this makes sense.]
-
-    for ( auto c = gobj->contexts.begin(); c != gobj->contexts.end(); c++ ) {
-
-      HDC context = c->first;
-
-      EMF::METAFILEDEVICECONTEXT* dc =
-	dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find(context));
-
-      if ( dc == 0 ) continue;
-
-      EMF::EMRDELETEOBJECT* deleteobject = new EMF::EMRDELETEOBJECT( c->second );
-	
-      dc->appendRecord( deleteobject );
-
-      // Reuse its metafile handle
-      dc->clearHandle( c->second );
-
-      // If this graphics object is current, then restore the default!
-
-      switch ( gobj->getType( ) ) {
-      case EMF::O_BRUSH:
-	if ( (EMF::BRUSH*)gobj == dc->brush )
-	  dc->brush = (EMF::BRUSH*)EMF::globalObjects.
-	    find( BLACK_BRUSH | ENHMETA_STOCK_OBJECT );
-	break;
-      case EMF::O_FONT:
-	if ( (EMF::FONT*)gobj == dc->font )
-	  dc->font = (EMF::FONT*)EMF::globalObjects.
-	    find( DEVICE_DEFAULT_FONT | ENHMETA_STOCK_OBJECT );
-	break;
-      case EMF::O_PEN:
-	if ( (EMF::PEN*)gobj == dc->pen )
-	  dc->pen = (EMF::PEN*)EMF::globalObjects.
-	    find( BLACK_PEN | ENHMETA_STOCK_OBJECT );
-	break;
-      case EMF::O_PALETTE:
-	if ( (EMF::PALETTE*)gobj == dc->palette )
-	  dc->palette = (EMF::PALETTE*)EMF::globalObjects.
-	    find( DEFAULT_PALETTE | ENHMETA_STOCK_OBJECT );
-	break;
-      default:
-	break;
-      }
-    }
+    EMF::detachObject( gobj );
 
     EMF::globalObjects.remove( gobj );
 
@@ -1574,13 +6109,19 @@ extern "C" {
    */
   EMF_DECLARE(BOOL) SetViewportOrgEx ( HDC context, INT x, INT y, LPPOINT point )
   {
-    (void)point;
-
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setViewportOrgEx( dc, x, y, point );
+  }
+
+  BOOL EMF::setViewportOrgEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+			       LPPOINT point )
+  {
+    (void)point;
+
     EMF::EMRSETVIEWPORTORGEX* setviewportorgex =
       new EMF::EMRSETVIEWPORTORGEX( x, y );
 
@@ -1631,6 +6172,12 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setWindowOrgEx( dc, x, y, point );
+  }
+
+  BOOL EMF::setWindowOrgEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+			     LPPOINT point )
+  {
     EMF::EMRSETWINDOWORGEX* setwindoworgex =
       new EMF::EMRSETWINDOWORGEX( x, y );
 
@@ -1679,6 +6226,12 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setViewportExtEx( dc, cx, cy, size );
+  }
+
+  BOOL EMF::setViewportExtEx ( METAFILEDEVICECONTEXT* dc, INT cx, INT cy,
+			       LPSIZE size )
+  {
     EMF::EMRSETVIEWPORTEXTEX* setviewportextex =
       new EMF::EMRSETVIEWPORTEXTEX( cx, cy );
 
@@ -1704,14 +6257,21 @@ extern "C" {
   EMF_DECLARE(BOOL) ScaleViewportExtEx ( HDC context, INT x_num, INT x_den,
 			    INT y_num, INT y_den, LPSIZE size )
   {
-    // Avoid obvious nonsense results.
-    if ( x_num == 0 or x_den == 0 or y_num == 0 or y_den == 0 ) return FALSE;
-
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::scaleViewportExtEx( dc, x_num, x_den, y_num, y_den, size );
+  }
+
+  BOOL EMF::scaleViewportExtEx ( METAFILEDEVICECONTEXT* dc, INT x_num,
+				 INT x_den, INT y_num, INT y_den,
+				 LPSIZE size )
+  {
+    // Avoid obvious nonsense results.
+    if ( x_num == 0 or x_den == 0 or y_num == 0 or y_den == 0 ) return FALSE;
+
     // Documentation says the numerator is computed first.
     // Can we perform this operation? Numerator must not overflow and
     // if it is negative, division must not overflow.
@@ -1781,6 +6341,12 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setWindowExtEx( dc, cx, cy, size );
+  }
+
+  BOOL EMF::setWindowExtEx ( METAFILEDEVICECONTEXT* dc, INT cx, INT cy,
+			     LPSIZE size )
+  {
     EMF::EMRSETWINDOWEXTEX* setwindowextex =
       new EMF::EMRSETWINDOWEXTEX( cx, cy );
 
@@ -1806,14 +6372,20 @@ extern "C" {
   EMF_DECLARE(BOOL) ScaleWindowExtEx ( HDC context, INT x_num, INT x_den,
 			  INT y_num, INT y_den, LPSIZE size )
   {
-    // Avoid obvious nonsense results.
-    if ( x_num == 0 or x_den == 0 or y_num == 0 or y_den == 0 ) return FALSE;
-
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::scaleWindowExtEx( dc, x_num, x_den, y_num, y_den, size );
+  }
+
+  BOOL EMF::scaleWindowExtEx ( METAFILEDEVICECONTEXT* dc, INT x_num,
+			       INT x_den, INT y_num, INT y_den, LPSIZE size )
+  {
+    // Avoid obvious nonsense results.
+    if ( x_num == 0 or x_den == 0 or y_num == 0 or y_den == 0 ) return FALSE;
+
     // Documentation says the numerator is computed first.
     // Can we perform this operation? Numerator must not overflow and
     // if it is negative, division must not overflow.
@@ -1882,10 +6454,45 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
-    EMF::EMRMODIFYWORLDTRANSFORM* modifyworldtransform =
-      new EMF::EMRMODIFYWORLDTRANSFORM( transform, mode );
+    return EMF::modifyWorldTransform( dc, transform, mode );
+  }
+
+  BOOL EMF::modifyWorldTransform ( METAFILEDEVICECONTEXT* dc,
+				   const XFORM *transform, DWORD mode )
+  {
+    XFORM identity = { 1, 0, 0, 1, 0, 0 };
+    XFORM world;
+
+    switch ( mode ) {
+    case MWT_IDENTITY:
+      transform = &identity;
+      world = identity;
+      break;
+    case MWT_LEFTMULTIPLY:
+      if ( transform == 0 ) return FALSE;
+      world = EMF::combine( *transform, dc->world );
+      break;
+    case MWT_RIGHTMULTIPLY:
+      if ( transform == 0 ) return FALSE;
+      world = EMF::combine( dc->world, *transform );
+      break;
+    default:
+      return FALSE;
+    }
+
+    // If the metafile's transform isn't the caller's, replace it outright
+    bool written = !dc->world_baked;
+
+    if ( !dc->setWorld( world ) ) return TRUE;
 
-    dc->appendRecord( modifyworldtransform );
+    if ( written ) {
+      EMF::EMRMODIFYWORLDTRANSFORM* modifyworldtransform =
+	new EMF::EMRMODIFYWORLDTRANSFORM( transform, mode );
+
+      dc->appendRecord( modifyworldtransform );
+    }
+    else
+      dc->appendRecord( new EMF::EMRSETWORLDTRANSFORM( &world ) );
 
     return TRUE;
   }
@@ -1903,6 +6510,16 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setWorldTransform( dc, transform );
+  }
+
+  BOOL EMF::setWorldTransform ( METAFILEDEVICECONTEXT* dc,
+				const XFORM *transform )
+  {
+    if ( transform == 0 ) return FALSE;
+
+    if ( !dc->setWorld( *transform ) ) return TRUE;
+
     EMF::EMRSETWORLDTRANSFORM* setworldtransform =
       new EMF::EMRSETWORLDTRANSFORM( transform );
 
@@ -2026,9 +6643,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETTEXTALIGN* settextalign = new EMF::EMRSETTEXTALIGN( alignment );
+    return EMF::setTextAlign( dc, alignment );
+  }
+
+  UINT EMF::setTextAlign ( METAFILEDEVICECONTEXT* dc, UINT alignment )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_TEXT_ALIGN, dc->text_alignment == alignment ) ) {
+      EMF::EMRSETTEXTALIGN* settextalign = new EMF::EMRSETTEXTALIGN( alignment );
 
-    dc->appendRecord( settextalign );
+      dc->appendRecord( settextalign );
+    }
 
     UINT old_alignment = dc->text_alignment;
 
@@ -2049,9 +6673,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETTEXTCOLOR* settextcolor = new EMF::EMRSETTEXTCOLOR( color );
+    return EMF::setTextColor( dc, color );
+  }
+
+  COLORREF EMF::setTextColor ( METAFILEDEVICECONTEXT* dc, COLORREF color )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_TEXT_COLOR, dc->text_color == color ) ) {
+      EMF::EMRSETTEXTCOLOR* settextcolor = new EMF::EMRSETTEXTCOLOR( color );
 
-    dc->appendRecord( settextcolor );
+      dc->appendRecord( settextcolor );
+    }
 
     COLORREF old_color = dc->text_color;
 
@@ -2073,9 +6704,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETBKCOLOR* setbkcolor = new EMF::EMRSETBKCOLOR( color );
+    return EMF::setBkColor( dc, color );
+  }
+
+  COLORREF EMF::setBkColor ( METAFILEDEVICECONTEXT* dc, COLORREF color )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_BK_COLOR, dc->bk_color == color ) ) {
+      EMF::EMRSETBKCOLOR* setbkcolor = new EMF::EMRSETBKCOLOR( color );
 
-    dc->appendRecord( setbkcolor );
+      dc->appendRecord( setbkcolor );
+    }
 
     COLORREF old_color = dc->bk_color;
 
@@ -2099,9 +6737,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETBKMODE* setbkmode = new EMF::EMRSETBKMODE( mode );
+    return EMF::setBkMode( dc, mode );
+  }
+
+  INT EMF::setBkMode ( METAFILEDEVICECONTEXT* dc, INT mode )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_BK_MODE, dc->bk_mode == mode ) ) {
+      EMF::EMRSETBKMODE* setbkmode = new EMF::EMRSETBKMODE( mode );
 
-    dc->appendRecord( setbkmode );
+      dc->appendRecord( setbkmode );
+    }
 
     UINT old_bk_mode = dc->bk_mode;
 
@@ -2131,9 +6776,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETMAPMODE* setmapmode = new EMF::EMRSETMAPMODE( mode );
+    return EMF::setMapMode( dc, mode );
+  }
+
+  INT EMF::setMapMode ( METAFILEDEVICECONTEXT* dc, INT mode )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_MAP_MODE, dc->map_mode == mode ) ) {
+      EMF::EMRSETMAPMODE* setmapmode = new EMF::EMRSETMAPMODE( mode );
 
-    dc->appendRecord( setmapmode );
+      dc->appendRecord( setmapmode );
+    }
 
     UINT old_map_mode = dc->map_mode;
 
@@ -2457,6 +7109,36 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::extTextOutA( dc, x, y, flags, rect, string, count, dx );
+  }
+
+  BOOL EMF::extTextOutA ( METAFILEDEVICECONTEXT* dc, INT x, INT y, UINT flags,
+			  const RECT* rect, LPCSTR string, UINT count,
+			  const INT* dx )
+  {
+    RECT baked_rect;
+
+    // A font is scaled by the world transform, so only a translation can be
+    // applied to the position instead; text drawn from the current position
+    // leaves it somewhere only GDI knows
+    if ( dc->text_alignment & TA_UPDATECP ) {
+      dc->writeWorld();
+      dc->syncPosition();
+      dc->position_unknown = true;
+    }
+    else if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_TRANSLATION, false,
+			     x, y, rect ? rect->left : 0, rect ? rect->top : 0,
+			     rect ? rect->right : 0, rect ? rect->bottom : 0 ) ) {
+      dc->bake( x, y );
+
+      if ( rect ) {
+	baked_rect = *rect;
+	dc->bake( baked_rect.left, baked_rect.top );
+	dc->bake( baked_rect.right, baked_rect.bottom );
+	rect = &baked_rect;
+      }
+    }
+
     RECTL bounds = { 0, 0, -1, -1 };
 
     EMRTEXT text;
@@ -2509,6 +7191,36 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::extTextOutW( dc, x, y, flags, rect, string, count, dx );
+  }
+
+  BOOL EMF::extTextOutW ( METAFILEDEVICECONTEXT* dc, INT x, INT y, UINT flags,
+			  const RECT* rect, LPCWSTR string, UINT count,
+			  const INT* dx )
+  {
+    RECT baked_rect;
+
+    // A font is scaled by the world transform, so only a translation can be
+    // applied to the position instead; text drawn from the current position
+    // leaves it somewhere only GDI knows
+    if ( dc->text_alignment & TA_UPDATECP ) {
+      dc->writeWorld();
+      dc->syncPosition();
+      dc->position_unknown = true;
+    }
+    else if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_TRANSLATION, false,
+			     x, y, rect ? rect->left : 0, rect ? rect->top : 0,
+			     rect ? rect->right : 0, rect ? rect->bottom : 0 ) ) {
+      dc->bake( x, y );
+
+      if ( rect ) {
+	baked_rect = *rect;
+	dc->bake( baked_rect.left, baked_rect.top );
+	dc->bake( baked_rect.right, baked_rect.bottom );
+	rect = &baked_rect;
+      }
+    }
+
     RECTL bounds = { 0, 0, -1, -1 };
 
     EMRTEXT text;
@@ -2569,6 +7281,23 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::arc( dc, left, top, right, bottom, xstart, ystart, xend,
+		     yend );
+  }
+
+  BOOL EMF::arc ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+		  INT bottom, INT xstart, INT ystart, INT xend, INT yend )
+  {
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_UNMIRRORED, true,
+			left, top, right, bottom, xstart, ystart, xend, yend ) ) {
+      dc->bake( left, top );
+      dc->bake( right, bottom );
+      dc->bake( xstart, ystart );
+      dc->bake( xend, yend );
+    }
+
+    if ( dc->culled( left, top, right, bottom ) ) return TRUE;
+
     EMF::EMRARC* arc = new EMF::EMRARC( left, top, right, bottom, xstart,
 					ystart, xend, yend );
 
@@ -2600,11 +7329,36 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::arcTo( dc, left, top, right, bottom, xstart, ystart, xend,
+		       yend );
+  }
+
+  BOOL EMF::arcTo ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+		    INT bottom, INT xstart, INT ystart, INT xend, INT yend )
+  {
+    // The arc leaves the current position where it ends on the ellipse
+    POINT end = EMF::arcEnd( left, top, right, bottom, xend, yend );
+    bool baked = dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_UNMIRRORED, true,
+				left, top, right, bottom, xstart, ystart,
+				xend, yend, dc->point.x, dc->point.y );
+
+    dc->syncPosition();
+
+    if ( baked ) {
+      dc->bake( left, top );
+      dc->bake( right, bottom );
+      dc->bake( xstart, ystart );
+      dc->bake( xend, yend );
+    }
+
     EMF::EMRARCTO* arcto = new EMF::EMRARCTO( left, top, right, bottom, xstart,
 					      ystart, xend, yend );
 
     dc->appendRecord( arcto );
 
+    dc->point = end;
+    dc->position_unknown = false;
+
     // Update graphics state
     dc->mergePoint( left, top );
     dc->mergePoint( right, bottom );
@@ -2625,7 +7379,21 @@ extern "C" {
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
-    if ( dc == 0 ) return FALSE;
+    if ( dc == 0 ) return FALSE;
+
+    return EMF::rectangle( dc, left, top, right, bottom );
+  }
+
+  BOOL EMF::rectangle ( METAFILEDEVICECONTEXT* dc, INT left, INT top,
+			INT right, INT bottom )
+  {
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+			left, top, right, bottom ) ) {
+      dc->bake( left, top );
+      dc->bake( right, bottom );
+    }
+
+    if ( dc->culled( left, top, right, bottom ) ) return TRUE;
 
     EMF::EMRRECTANGLE* rectangle = new EMF::EMRRECTANGLE( left, top, right, bottom);
 
@@ -2653,6 +7421,20 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::ellipse( dc, left, top, right, bottom );
+  }
+
+  BOOL EMF::ellipse ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+		      INT bottom )
+  {
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+			left, top, right, bottom ) ) {
+      dc->bake( left, top );
+      dc->bake( right, bottom );
+    }
+
+    if ( dc->culled( left, top, right, bottom ) ) return TRUE;
+
     EMF::EMRELLIPSE* ellipse = new EMF::EMRELLIPSE( left, top, right, bottom );
 
     dc->appendRecord( ellipse );
@@ -2677,6 +7459,18 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyBezier( dc, points, n );
+  }
+
+  BOOL EMF::polyBezier ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+			 DWORD n )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      points = dc->bake( points, n, baked );
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
     // An optimization: if all the values in points are representable in
@@ -2696,9 +7490,16 @@ extern "C" {
       if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
       if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
 
-      dc->mergePoint( *pnt_ptr++ );
+      pnt_ptr++;
     }
 
+    // The curve stays inside the bounds of its control points
+    if ( n > 0 && dc->culled( bounds ) ) return TRUE;
+
+    // Only a curve which is kept may enlarge the metafile's bounds
+    for ( DWORD i = 0; i < n; i++ )
+      dc->mergePoint( points[i] );
+
     if ( shorts_only ) {
       EMF::EMRPOLYBEZIER16* polybezier16 =
 	new EMF::EMRPOLYBEZIER16( &bounds, points, n );
@@ -2727,6 +7528,21 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyBezier16( dc, points, n );
+  }
+
+  BOOL EMF::polyBezier16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			   INT16 n )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      return EMF::polyBezier( dc, EMF::widen( points, n, wide ), n );
+
+    dc->writeWorld();
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
     const POINT16* pnt_ptr = points;
 
@@ -2735,10 +7551,11 @@ extern "C" {
       if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
       if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
       if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
-
-      dc->mergePoint( pnt_ptr->x, pnt_ptr->y );
     }
 
+    // The curve stays inside the bounds of its control points
+    if ( n > 0 && dc->culled( bounds ) ) return TRUE;
+
     EMF::EMRPOLYBEZIER16* polybezier16 =
       new EMF::EMRPOLYBEZIER16( &bounds, points, n );
 
@@ -2773,7 +7590,7 @@ extern "C" {
     if ( metaheader ) {
       UINT size = min( sizeof_enhmetaheader, sizeof(::ENHMETAHEADER) );
 
-      memcpy( metaheader, dc->header, size );
+      memcpy( metaheader, static_cast<::ENHMETAHEADER*>( dc->header ), size );
 
       return size;
     }
@@ -2837,6 +7654,37 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyline( dc, points, n );
+  }
+
+  BOOL EMF::polyline ( METAFILEDEVICECONTEXT* dc, const POINT* points, INT n )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      points = dc->bake( points, n, baked );
+
+    // Optionally leave out what can't be seen in the frame
+    std::vector<POINT> clipped;
+    EMF::METAFILEDEVICECONTEXT::CLIPRESULT clipping =
+      dc->clip( points, n, false, false, clipped );
+
+    if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_CULLED )
+      return TRUE;
+    else if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_TRIMMED ) {
+      points = clipped.data();
+      n = (INT)clipped.size();
+    }
+
+    // Optionally drop points which make no visible difference
+    std::vector<POINT> simplified;
+
+    if ( dc->simplify( points, n, false, simplified ) ) {
+      points = simplified.data();
+      n = (INT)simplified.size();
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
     // An optimization: if all the values in points are representable in
@@ -2887,6 +7735,21 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyline16( dc, points, n );
+  }
+
+  BOOL EMF::polyline16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			 INT16 n )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      return EMF::polyline( dc, EMF::widen( points, n, wide ), n );
+
+    dc->writeWorld();
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
     const POINT16* pnt_ptr = points;
 
@@ -2921,6 +7784,37 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polygon( dc, points, n );
+  }
+
+  BOOL EMF::polygon ( METAFILEDEVICECONTEXT* dc, const POINT* points, INT n )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      points = dc->bake( points, n, baked );
+
+    // Optionally leave out what can't be seen in the frame
+    std::vector<POINT> clipped;
+    EMF::METAFILEDEVICECONTEXT::CLIPRESULT clipping =
+      dc->clip( points, n, true, false, clipped );
+
+    if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_CULLED )
+      return TRUE;
+    else if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_TRIMMED ) {
+      points = clipped.data();
+      n = (INT)clipped.size();
+    }
+
+    // Optionally drop points which make no visible difference
+    std::vector<POINT> simplified;
+
+    if ( dc->simplify( points, n, true, simplified ) ) {
+      points = simplified.data();
+      n = (INT)simplified.size();
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
     // An optimization: if all the values in points are representable in
@@ -2970,122 +7864,543 @@ extern "C" {
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
-    if ( dc == 0 ) return FALSE;
+    if ( dc == 0 ) return FALSE;
+
+    return EMF::polygon16( dc, points, n );
+  }
+
+  BOOL EMF::polygon16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			INT16 n )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      return EMF::polygon( dc, EMF::widen( points, n, wide ), n );
+
+    dc->writeWorld();
+
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+    const POINT16* pnt_ptr = points;
+
+    for ( INT i = 0; i < n; i++, pnt_ptr++ ) {
+
+      if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
+      if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
+      if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
+      if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+
+      dc->mergePoint( pnt_ptr->x, pnt_ptr->y );
+    }
+
+    EMF::EMRPOLYGON16* polygon16 = new EMF::EMRPOLYGON16( &bounds, points, n );
+
+    dc->appendRecord( polygon16 );
+
+    return TRUE;
+  }
+  /*!
+   * Draw a series of sequences of connected straight line segments where
+   * the end of the last line segment is connect to the beginning of the
+   * first line segment.
+   * \param context handle to metafile context.
+   * \param points array of points to draw.
+   * \param counts array of number of points in each polygon.
+   * \param polygons number of polygons (i.e. number of values in counts array).
+   * \return true if the polygons are successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyPolygon ( HDC context, const POINT* points, const INT* counts,
+		     UINT polygons )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return FALSE;
+
+    return EMF::polyPolygon( dc, points, counts, polygons );
+  }
+
+  BOOL EMF::polyPolygon ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+			  const INT* counts, UINT polygons )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) ) {
+      size_t n = 0;
+      for ( UINT i = 0; i < polygons; i++ ) n += counts[i];
+      points = dc->bake( points, n, baked );
+    }
+
+    // Optionally leave out what can't be seen in the frame, polygon by
+    // polygon. (Each keeps its winding numbers inside the frame, so the
+    // fill comes out the same in either fill mode.)
+    EMF::METAFILEDEVICECONTEXT::CLIPRECT clip_rect;
+    std::vector<POINT> clipped_points, clipped;
+    std::vector<INT> clipped_counts;
+
+    if ( dc->clipRect( clip_rect ) ) {
+      const POINT* polygon = points;
+
+      for ( UINT i = 0; i < polygons; polygon += counts[i++] ) {
+	switch ( dc->clip( polygon, counts[i], true, false, clipped ) ) {
+	case EMF::METAFILEDEVICECONTEXT::CLIP_CULLED:
+	  break;
+	case EMF::METAFILEDEVICECONTEXT::CLIP_TRIMMED:
+	  clipped_points.insert( clipped_points.end(), clipped.begin(), clipped.end() );
+	  clipped_counts.push_back( (INT)clipped.size() );
+	  break;
+	default:
+	  clipped_points.insert( clipped_points.end(), polygon, polygon + counts[i] );
+	  clipped_counts.push_back( counts[i] );
+	  break;
+	}
+      }
+
+      if ( clipped_counts.empty() ) return TRUE;
+
+      points = clipped_points.data();
+      counts = clipped_counts.data();
+      polygons = (UINT)clipped_counts.size();
+    }
+
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+    // An optimization: if all the values in points are representable in
+    // 16-bits, then we can use the smaller 16-bit POLYPOLYGON structure.
+    // So, as we update graphics state, try to determine if we've only
+    // got short ints.
+    const POINT* pnt_ptr = points;
+    bool shorts_only = true;
+
+    for ( UINT i = 0; i < polygons; i++ )
+      for ( INT j = 0; j < counts[i]; j++ ) {
+	if ( pnt_ptr->x > SHRT_MAX || pnt_ptr->x < SHRT_MIN ||
+	     pnt_ptr->y > SHRT_MAX || pnt_ptr->y < SHRT_MIN )
+	  shorts_only = false;
+
+	if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
+	if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
+	if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
+	if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+
+	dc->mergePoint( *pnt_ptr++ );
+      }
+
+    if ( shorts_only ) {
+      EMF::EMRPOLYPOLYGON16* polypolygon16 =
+	new EMF::EMRPOLYPOLYGON16( &bounds, points, counts, polygons );
+
+      dc->appendRecord( polypolygon16 );
+    }
+    else {
+      EMF::EMRPOLYPOLYGON* polypolygon =
+	new EMF::EMRPOLYPOLYGON( &bounds, points, counts, polygons );
+
+      dc->appendRecord( polypolygon );
+    }
+
+    return TRUE;
+  }
+  /*!
+   * Draw a series of sequences of connected straight line segments where
+   * the end of the last line segment is connect to the beginning of the
+   * first line segment. Uses the 16-bit interface (not directly callable
+   * from a user-program, though).
+   * \param context handle to metafile context.
+   * \param points array of points to draw.
+   * \param counts array of number of points in each polygon.
+   * \param polygons number of polygons (i.e. number of values in counts array).
+   * \return true if the polygons are successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyPolygon16 ( HDC context, const POINT16* points, const INT* counts,
+		       UINT16 polygons )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return FALSE;
+
+    return EMF::polyPolygon16( dc, points, counts, polygons );
+  }
+
+  BOOL EMF::polyPolygon16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			    const INT* counts, UINT16 polygons )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) ) {
+      size_t n = 0;
+      for ( UINT i = 0; i < polygons; i++ ) n += counts[i];
+      return EMF::polyPolygon( dc, EMF::widen( points, n, wide ), counts,
+			       polygons );
+    }
+
+    dc->writeWorld();
+
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+    const POINT16* pnt_ptr = points;
+
+    for ( UINT i = 0; i < polygons; i++ )
+      for ( INT j = 0; j < counts[i]; j++, pnt_ptr++ ) {
+
+	if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
+	if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
+	if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
+	if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+
+	dc->mergePoint( pnt_ptr->x, pnt_ptr->y );
+      }
+
+    EMF::EMRPOLYPOLYGON16* polypolygon16 =
+      new EMF::EMRPOLYPOLYGON16( &bounds, points, counts, polygons );
+
+    dc->appendRecord( polypolygon16 );
+
+    return TRUE;
+  }
+  /*!
+   * Draw a sequence of connected lines from separate arrays of floating point
+   * coordinates. Each point is (x * xScale + xOffset, y * yScale + yOffset),
+   * rounded to the nearest logical unit.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if polyline is successfully rendered; false if any
+   * coordinate is out of range.
+   */
+  EMF_DECLARE(BOOL) PolylineF ( HDC context, const FLOAT* x, const FLOAT* y,
+				INT n, const EMFSCALE* scale )
+  {
+    if ( n < 0 ) return FALSE;
+    return EMF::appendFloatPoints<EMF::EMRPOLYLINE,EMF::EMRPOLYLINE16>
+      ( context, x, y, n, scale, EMF::F_POLYLINE );
+  }
+  /*!
+   * Double precision version of PolylineF.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if polyline is successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolylineD ( HDC context, const DOUBLE* x, const DOUBLE* y,
+				INT n, const EMFSCALE* scale )
+  {
+    if ( n < 0 ) return FALSE;
+    return EMF::appendFloatPoints<EMF::EMRPOLYLINE,EMF::EMRPOLYLINE16>
+      ( context, x, y, n, scale, EMF::F_POLYLINE );
+  }
+  /*!
+   * Draw a closed polygon from separate arrays of floating point coordinates.
+   * See PolylineF for the coordinate mapping.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if polygon is successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolygonF ( HDC context, const FLOAT* x, const FLOAT* y,
+			       INT n, const EMFSCALE* scale )
+  {
+    if ( n < 0 ) return FALSE;
+    return EMF::appendFloatPoints<EMF::EMRPOLYGON,EMF::EMRPOLYGON16>
+      ( context, x, y, n, scale, EMF::F_POLYGON );
+  }
+  /*!
+   * Double precision version of PolygonF.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if polygon is successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolygonD ( HDC context, const DOUBLE* x, const DOUBLE* y,
+			       INT n, const EMFSCALE* scale )
+  {
+    if ( n < 0 ) return FALSE;
+    return EMF::appendFloatPoints<EMF::EMRPOLYGON,EMF::EMRPOLYGON16>
+      ( context, x, y, n, scale, EMF::F_POLYGON );
+  }
+  /*!
+   * Draw a series of cubic Bezier curves from separate arrays of floating
+   * point coordinates. See PolylineF for the coordinate mapping.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if the curves are successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyBezierF ( HDC context, const FLOAT* x, const FLOAT* y,
+				  DWORD n, const EMFSCALE* scale )
+  {
+    return EMF::appendFloatPoints<EMF::EMRPOLYBEZIER,EMF::EMRPOLYBEZIER16>
+      ( context, x, y, n, scale, EMF::F_POLYBEZIER );
+  }
+  /*!
+   * Double precision version of PolyBezierF.
+   * \param context handle to metafile context.
+   * \param x array of x coordinates.
+   * \param y array of y coordinates.
+   * \param n number of points in the arrays.
+   * \param scale coordinate scale and offset; may be null for none.
+   * \return true if the curves are successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyBezierD ( HDC context, const DOUBLE* x, const DOUBLE* y,
+				  DWORD n, const EMFSCALE* scale )
+  {
+    return EMF::appendFloatPoints<EMF::EMRPOLYBEZIER,EMF::EMRPOLYBEZIER16>
+      ( context, x, y, n, scale, EMF::F_POLYBEZIER );
+  }
+  /*!
+   * Draw a batch of rectangles, each as Rectangle would. When the current
+   * pen is PS_NULL, so that only the fills show, each run of rectangles
+   * sharing a color is written as a single PolyPolygon (in WINDING mode, so
+   * that overlaps are filled as they would be by separate rectangles).
+   * \param context handle to metafile context.
+   * \param rects array of rectangles.
+   * \param n number of rectangles.
+   * \param colors array of fill colors; null to use the current brush.
+   * \return true if the rectangles were successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyRectangle ( HDC context, const RECT* rects, UINT n,
+				    const COLORREF* colors )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 || ( rects == 0 && n > 0 ) ) return FALSE;
+
+    // With a visible pen, each outline must be drawn before the next
+    // rectangle is filled, so there is no more compact form
+    if ( dc->extpen != 0 || dc->pen->lopnStyle != PS_NULL || n < 2 )
+      return EMF::appendBoxes<EMF::EMRRECTANGLE>( context, rects, n, colors );
+
+    // Optionally apply a scaling world transform to the rectangles themselves
+    std::vector<RECT> baked;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, false ) )
+      rects = dc->bake( rects, n, baked );
+
+    // Optionally leave out the ones which can't be seen in the frame
+    EMF::METAFILEDEVICECONTEXT::CLIPRECT clip_rect;
+    std::vector<RECT> visible_rects;
+    std::vector<COLORREF> visible_colors;
+
+    if ( dc->clipRect( clip_rect ) ) {
+      for ( UINT i = 0; i < n; i++ ) {
+	if ( dc->culled( rects[i].left, rects[i].top, rects[i].right, rects[i].bottom ) )
+	  continue;
+
+	visible_rects.push_back( rects[i] );
+	if ( colors ) visible_colors.push_back( colors[i] );
+      }
+
+      if ( visible_rects.empty() ) return TRUE;
+
+      rects = visible_rects.data();
+      colors = colors ? visible_colors.data() : 0;
+      n = (UINT)visible_rects.size();
+    }
+
+    EMF::BATCHBRUSHES brushes( context );
+    INT polyfill_mode = dc->polyfill_mode;
+    RECTL all_bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+    std::vector<POINT> points;
+    std::vector<INT> counts;
+
+    for ( UINT i = 0, j; i < n; i = j ) {
+      // Find the run of rectangles with the same color
+      for ( j = i + 1; j < n && ( colors == 0 || colors[j] == colors[i] ); j++ );
+
+      if ( colors ) brushes.select( colors[i] );
+
+      if ( j - i == 1 ) {
+	dc->appendRecord( new EMF::EMRRECTANGLE( rects[i].left, rects[i].top,
+						 rects[i].right, rects[i].bottom ) );
+	EMF::mergeBox( all_bounds, rects[i] );
+	continue;
+      }
+
+      // Every rectangle is wound the same way, so WINDING fills their union
+      if ( dc->polyfill_mode != WINDING )
+	SetPolyFillMode( context, WINDING );
+
+      RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
-    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+      points.resize( 4 * ( j - i ) );
+      counts.assign( j - i, 4 );
 
-    const POINT16* pnt_ptr = points;
+      for ( UINT k = i; k < j; k++ ) {
+	POINT* corner = &points[4 * ( k - i )];
+	LONG left = (std::min)( rects[k].left, rects[k].right );
+	LONG right = (std::max)( rects[k].left, rects[k].right );
+	LONG top = (std::min)( rects[k].top, rects[k].bottom );
+	LONG bottom = (std::max)( rects[k].top, rects[k].bottom );
 
-    for ( INT i = 0; i < n; i++, pnt_ptr++ ) {
+	corner[0].x = left;  corner[0].y = top;
+	corner[1].x = right; corner[1].y = top;
+	corner[2].x = right; corner[2].y = bottom;
+	corner[3].x = left;  corner[3].y = bottom;
 
-      if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
-      if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
-      if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
-      if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+	EMF::mergeBox( bounds, rects[k] );
+      }
 
-      dc->mergePoint( pnt_ptr->x, pnt_ptr->y );
+      if ( bounds.left >= SHRT_MIN && bounds.right <= SHRT_MAX &&
+	   bounds.top >= SHRT_MIN && bounds.bottom <= SHRT_MAX )
+	dc->appendRecord( new EMF::EMRPOLYPOLYGON16( &bounds, points.data(),
+						     counts.data(), j - i ) );
+      else
+	dc->appendRecord( new EMF::EMRPOLYPOLYGON( &bounds, points.data(),
+						   counts.data(), j - i ) );
+
+      all_bounds.left = (std::min)( all_bounds.left, bounds.left );
+      all_bounds.right = (std::max)( all_bounds.right, bounds.right );
+      all_bounds.top = (std::min)( all_bounds.top, bounds.top );
+      all_bounds.bottom = (std::max)( all_bounds.bottom, bounds.bottom );
     }
 
-    EMF::EMRPOLYGON16* polygon16 = new EMF::EMRPOLYGON16( &bounds, points, n );
+    if ( dc->polyfill_mode != polyfill_mode )
+      SetPolyFillMode( context, polyfill_mode );
 
-    dc->appendRecord( polygon16 );
+    dc->mergePoint( all_bounds.left, all_bounds.top );
+    dc->mergePoint( all_bounds.right, all_bounds.bottom );
 
     return TRUE;
   }
   /*!
-   * Draw a series of sequences of connected straight line segments where
-   * the end of the last line segment is connect to the beginning of the
-   * first line segment.
+   * Draw a batch of ellipses, each as Ellipse would.
    * \param context handle to metafile context.
-   * \param points array of points to draw.
-   * \param counts array of number of points in each polygon.
-   * \param polygons number of polygons (i.e. number of values in counts array).
-   * \return true if the polygons are successfully rendered.
+   * \param boxes array of bounding boxes of the ellipses.
+   * \param n number of ellipses.
+   * \param colors array of fill colors; null to use the current brush.
+   * \return true if the ellipses were successfully rendered.
    */
-  EMF_DECLARE(BOOL) PolyPolygon ( HDC context, const POINT* points, const INT* counts,
-		     UINT polygons )
+  EMF_DECLARE(BOOL) PolyEllipse ( HDC context, const RECT* boxes, UINT n,
+				  const COLORREF* colors )
+  {
+    return EMF::appendBoxes<EMF::EMRELLIPSE>( context, boxes, n, colors );
+  }
+  /*!
+   * Draw a batch of arcs, each as Arc would.
+   * \param context handle to metafile context.
+   * \param boxes array of bounding boxes of the arcs.
+   * \param starts array of arc start points.
+   * \param ends array of arc end points.
+   * \param n number of arcs.
+   * \return true if the arcs were successfully rendered.
+   */
+  EMF_DECLARE(BOOL) PolyArc ( HDC context, const RECT* boxes, const POINT* starts,
+			      const POINT* ends, UINT n )
   {
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
     if ( dc == 0 ) return FALSE;
 
-    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+    if ( n == 0 ) return TRUE;
 
-    // An optimization: if all the values in points are representable in
-    // 16-bits, then we can use the smaller 16-bit POLYPOLYGON structure.
-    // So, as we update graphics state, try to determine if we've only
-    // got short ints.
-    const POINT* pnt_ptr = points;
-    bool shorts_only = true;
+    if ( boxes == 0 || starts == 0 || ends == 0 ) return FALSE;
 
-    for ( UINT i = 0; i < polygons; i++ )
-      for ( INT j = 0; j < counts[i]; j++ ) {
-	if ( pnt_ptr->x > SHRT_MAX || pnt_ptr->x < SHRT_MIN ||
-	     pnt_ptr->y > SHRT_MAX || pnt_ptr->y < SHRT_MIN )
-	  shorts_only = false;
+    // Optionally apply a scaling world transform to the arcs themselves
+    std::vector<RECT> baked_boxes;
+    std::vector<POINT> baked_starts, baked_ends;
 
-	if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
-	if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
-	if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
-	if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_UNMIRRORED, true ) ) {
+      const RECT* b = dc->bake( boxes, n, baked_boxes );
+      const POINT* s = dc->bake( starts, n, baked_starts );
+      const POINT* e = dc->bake( ends, n, baked_ends );
 
-	dc->mergePoint( *pnt_ptr++ );
+      // (Unless one of them didn't fit, and the transform was written instead)
+      if ( dc->world_baked ) {
+	boxes = b;
+	starts = s;
+	ends = e;
       }
+    }
 
-    if ( shorts_only ) {
-      EMF::EMRPOLYPOLYGON16* polypolygon16 =
-	new EMF::EMRPOLYPOLYGON16( &bounds, points, counts, polygons );
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
-      dc->appendRecord( polypolygon16 );
-    }
-    else {
-      EMF::EMRPOLYPOLYGON* polypolygon =
-	new EMF::EMRPOLYPOLYGON( &bounds, points, counts, polygons );
+    dc->records.reserve( dc->records.size() + n );
 
-      dc->appendRecord( polypolygon );
+    for ( UINT i = 0; i < n; i++ ) {
+      if ( dc->culled( boxes[i].left, boxes[i].top, boxes[i].right, boxes[i].bottom ) )
+	continue;
+
+      dc->appendRecord( new EMF::EMRARC( boxes[i].left, boxes[i].top,
+					 boxes[i].right, boxes[i].bottom,
+					 starts[i].x, starts[i].y,
+					 ends[i].x, ends[i].y ) );
+
+      EMF::mergeBox( bounds, boxes[i] );
     }
 
+    if ( bounds.left > bounds.right ) return TRUE; // All culled
+
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
+
     return TRUE;
   }
   /*!
-   * Draw a series of sequences of connected straight line segments where
-   * the end of the last line segment is connect to the beginning of the
-   * first line segment. Uses the 16-bit interface (not directly callable
-   * from a user-program, though).
+   * Set a batch of pixels, each as SetPixel would.
    * \param context handle to metafile context.
-   * \param points array of points to draw.
-   * \param counts array of number of points in each polygon.
-   * \param polygons number of polygons (i.e. number of values in counts array).
-   * \return true if the polygons are successfully rendered.
+   * \param points array of pixel positions.
+   * \param n number of pixels.
+   * \param colors array of pixel colors; if null, every pixel is set to color.
+   * \param color the color of every pixel when colors is null.
+   * \return true if the pixels were successfully rendered.
    */
-  EMF_DECLARE(BOOL) PolyPolygon16 ( HDC context, const POINT16* points, const INT* counts,
-		       UINT16 polygons )
+  EMF_DECLARE(BOOL) SetPixels ( HDC context, const POINT* points, UINT n,
+				const COLORREF* colors, COLORREF color )
   {
     EMF::METAFILEDEVICECONTEXT* dc =
       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
 
-    if ( dc == 0 ) return FALSE;
+    if ( dc == 0 || ( points == 0 && n > 0 ) ) return FALSE;
+
+    if ( n == 0 ) return TRUE;
+
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, false ) )
+      points = dc->bake( points, n, baked );
 
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
-    const POINT16* pnt_ptr = points;
+    if ( dc->options & EMF_OPTION_COALESCE_PIXELS )
+      dc->pixels.reserve( dc->pixels.size() + n );
+    else
+      dc->records.reserve( dc->records.size() + n );
 
-    for ( UINT i = 0; i < polygons; i++ )
-      for ( INT j = 0; j < counts[i]; j++, pnt_ptr++ ) {
+    for ( UINT i = 0; i < n; i++ ) {
+      if ( dc->culled( points[i].x, points[i].y, points[i].x, points[i].y ) )
+	continue;
 
-	if ( pnt_ptr->x < bounds.left ) bounds.left = pnt_ptr->x;
-	if ( pnt_ptr->x > bounds.right ) bounds.right = pnt_ptr->x;
-	if ( pnt_ptr->y < bounds.top ) bounds.top = pnt_ptr->y;
-	if ( pnt_ptr->y > bounds.bottom ) bounds.bottom = pnt_ptr->y;
+      dc->appendPixel( points[i].x, points[i].y, colors ? colors[i] : color );
 
-	dc->mergePoint( pnt_ptr->x, pnt_ptr->y );
-      }
+      bounds.left = (std::min)( bounds.left, points[i].x );
+      bounds.right = (std::max)( bounds.right, points[i].x );
+      bounds.top = (std::min)( bounds.top, points[i].y );
+      bounds.bottom = (std::max)( bounds.bottom, points[i].y );
+    }
 
-    EMF::EMRPOLYPOLYGON16* polypolygon16 =
-      new EMF::EMRPOLYPOLYGON16( &bounds, points, counts, polygons );
+    if ( bounds.left > bounds.right ) return TRUE; // All culled
 
-    dc->appendRecord( polypolygon16 );
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
 
     return TRUE;
   }
@@ -3128,9 +8443,16 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETPOLYFILLMODE* setpolyfillmode = new EMF::EMRSETPOLYFILLMODE( mode );
+    return EMF::setPolyFillMode( dc, mode );
+  }
+
+  INT EMF::setPolyFillMode ( METAFILEDEVICECONTEXT* dc, INT mode )
+  {
+    if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_POLYFILL_MODE, dc->polyfill_mode == mode ) ) {
+      EMF::EMRSETPOLYFILLMODE* setpolyfillmode = new EMF::EMRSETPOLYFILLMODE( mode );
 
-    dc->appendRecord( setpolyfillmode );
+      dc->appendRecord( setpolyfillmode );
+    }
 
     UINT old_polyfill_mode = dc->polyfill_mode;
 
@@ -3149,6 +8471,11 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::fillPath( dc );
+  }
+
+  BOOL EMF::fillPath ( METAFILEDEVICECONTEXT* dc )
+  {
     RECTL bounds = { 0, 0, -1, -1 };
 
     EMF::EMRFILLPATH* fillpath = new EMF::EMRFILLPATH( &bounds );
@@ -3168,6 +8495,14 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::strokePath( dc );
+  }
+
+  BOOL EMF::strokePath ( METAFILEDEVICECONTEXT* dc )
+  {
+    // A geometric pen is widened by the world transform
+    dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true );
+
     RECTL bounds = { 0, 0, -1, -1 };
 
     EMF::EMRSTROKEPATH* strokepath = new EMF::EMRSTROKEPATH( &bounds );
@@ -3187,6 +8522,14 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::strokeAndFillPath( dc );
+  }
+
+  BOOL EMF::strokeAndFillPath ( METAFILEDEVICECONTEXT* dc )
+  {
+    // A geometric pen is widened by the world transform
+    dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true );
+
     RECTL bounds = { 0, 0, -1, -1 };
 
     EMF::EMRSTROKEANDFILLPATH* strokeandfillpath =
@@ -3211,6 +8554,29 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyBezierTo( dc, points, n );
+  }
+
+  BOOL EMF::polyBezierTo ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+			   DWORD n )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+    const POINT* logical = points;
+
+    // (Baking may still give up, writing the transform, which moves the
+    // current position to where syncPosition has to write it again)
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+			dc->point.x, dc->point.y ) )
+      points = dc->bake( points, n, baked );
+
+    dc->syncPosition();
+
+    if ( n > 0 ) {
+      dc->point = logical[n-1];
+      dc->position_unknown = false;
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
     // An optimization: if all the values in points are representable in
@@ -3263,6 +8629,28 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polyBezierTo16( dc, points, n );
+  }
+
+  BOOL EMF::polyBezierTo16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			     INT16 n )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      return EMF::polyBezierTo( dc, EMF::widen( points, n, wide ), n );
+
+    dc->writeWorld();
+    dc->syncPosition();
+
+    if ( n > 0 ) {
+      dc->point.x = points[n-1].x;
+      dc->point.y = points[n-1].y;
+      dc->position_unknown = false;
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
     const POINT16* pnt_ptr = points;
 
@@ -3301,6 +8689,49 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polylineTo( dc, points, n );
+  }
+
+  BOOL EMF::polylineTo ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+			 DWORD n )
+  {
+    // Optionally apply a scaling world transform to the points themselves
+    std::vector<POINT> baked;
+    const POINT* logical = points;
+
+    // (Baking may still give up, writing the transform, which moves the
+    // current position to where syncPosition has to write it again)
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true,
+			dc->point.x, dc->point.y ) )
+      points = dc->bake( points, n, baked );
+
+    dc->syncPosition();
+
+    if ( n > 0 ) {
+      dc->point = logical[n-1];
+      dc->position_unknown = false;
+    }
+
+    // Optionally leave out what can't be seen in the frame
+    std::vector<POINT> clipped;
+    EMF::METAFILEDEVICECONTEXT::CLIPRESULT clipping =
+      dc->clip( points, n, false, true, clipped );
+
+    if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_CULLED )
+      return TRUE;
+    else if ( clipping == EMF::METAFILEDEVICECONTEXT::CLIP_TRIMMED ) {
+      points = clipped.data();
+      n = (DWORD)clipped.size();
+    }
+
+    // Optionally drop points which make no visible difference
+    std::vector<POINT> simplified;
+
+    if ( dc->simplify( points, n, false, simplified ) ) {
+      points = simplified.data();
+      n = (DWORD)simplified.size();
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
 
     // An optimization: if all the values in points are representable in
@@ -3352,6 +8783,28 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::polylineTo16( dc, points, n );
+  }
+
+  BOOL EMF::polylineTo16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			   INT16 n )
+  {
+    // A scale applied to the coordinates goes through the 32-bit form,
+    // which writes 16-bit points again if they still fit
+    std::vector<POINT> wide;
+
+    if ( n > 0 && dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, true ) )
+      return EMF::polylineTo( dc, EMF::widen( points, n, wide ), n );
+
+    dc->writeWorld();
+    dc->syncPosition();
+
+    if ( n > 0 ) {
+      dc->point.x = points[n-1].x;
+      dc->point.y = points[n-1].y;
+      dc->position_unknown = false;
+    }
+
     RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
     const POINT16* pnt_ptr = points;
 
@@ -3409,10 +8862,21 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::beginPath( dc );
+  }
+
+  BOOL EMF::beginPath ( METAFILEDEVICECONTEXT* dc )
+  {
+    // The path is transformed as it is defined, so the metafile needs the
+    // real world transform
+    dc->writeWorld();
+
     EMF::EMRBEGINPATH* beginpath = new EMF::EMRBEGINPATH();
 
     dc->appendRecord( beginpath );
 
+    dc->in_path = true;
+
     return TRUE;
   }
 
@@ -3428,10 +8892,17 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::endPath( dc );
+  }
+
+  BOOL EMF::endPath ( METAFILEDEVICECONTEXT* dc )
+  {
     EMF::EMRENDPATH* endpath = new EMF::EMRENDPATH();
 
     dc->appendRecord( endpath );
 
+    dc->in_path = false;
+
     return TRUE;
   }
 
@@ -3447,6 +8918,11 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::closeFigure( dc );
+  }
+
+  BOOL EMF::closeFigure ( METAFILEDEVICECONTEXT* dc )
+  {
     EMF::EMRCLOSEFIGURE* closefigure = new EMF::EMRCLOSEFIGURE();
 
     dc->appendRecord( closefigure );
@@ -3455,9 +8931,9 @@ extern "C" {
   }
 
   /*!
-   * Push the (contents of?) given Device Context on to a stack (?).
+   * Push the graphics state of the given Device Context on to a stack.
    * \param dc device context to save
-   * \return number of save'd contexts?
+   * \return number of save'd contexts.
    */
   EMF_DECLARE(INT) SaveDC (HDC context )
   {
@@ -3466,18 +8942,26 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::saveDC( dc );
+  }
+
+  INT EMF::saveDC ( METAFILEDEVICECONTEXT* dc )
+  {
     EMF::EMRSAVEDC* savedc = new EMF::EMRSAVEDC();
 
     dc->appendRecord( savedc );
 
-    return 0; // Not really implemented.
+    // Keep our copy of the graphics state in step with the player's
+
+    return dc->saveState();
   }
 
   /*!
-   * Get the (contents of?) given Device Context off a stack (?).
+   * Get the graphics state of the given Device Context off a stack.
    * \param dc device context to restore into
-   * \param n pushed context to restore
-   * \return number of save'd contexts?
+   * \param n pushed context to restore: if negative, relative to the top
+   * of the stack; if positive, the absolute level returned by SaveDC.
+   * \return true if there was such a saved context.
    */
   EMF_DECLARE(INT) RestoreDC (HDC context, INT n )
   {
@@ -3486,11 +8970,16 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::restoreDC( dc, n );
+  }
+
+  INT EMF::restoreDC ( METAFILEDEVICECONTEXT* dc, INT n )
+  {
     EMF::EMRRESTOREDC* restoredc = new EMF::EMRRESTOREDC( n );
 
     dc->appendRecord( restoredc );
 
-    return 0; // Not really implemented.
+    return dc->restoreState( n ) ? TRUE : FALSE;
   }
 
   /*!
@@ -3505,6 +8994,11 @@ extern "C" {
 
     if ( dc == 0 ) return FALSE;
 
+    return EMF::setMetaRgn( dc );
+  }
+
+  INT EMF::setMetaRgn ( METAFILEDEVICECONTEXT* dc )
+  {
     EMF::EMRSETMETARGN* setmetargn = new EMF::EMRSETMETARGN();
 
     dc->appendRecord( setmetargn );
@@ -3519,14 +9013,24 @@ extern "C" {
     */
    EMF_DECLARE(BOOL) SetMiterLimit ( HDC context, FLOAT eNewLimit, PFLOAT peOldLimit )
    {
-      EMF::METAFILEDEVICECONTEXT* dc =
-         dynamic_cast<EMF::METAFILEDEVICECONTEXT*>( EMF::globalObjects.find( context ) );
-      if ( dc == 0 ) return FALSE;
+     EMF::METAFILEDEVICECONTEXT* dc =
+       dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+     if ( dc == 0 ) return FALSE;
+
+     return EMF::setMiterLimit( dc, eNewLimit, peOldLimit );
+   }
 
-      EMF::EMRSETMITERLIMIT* setmiterlimit =
-         new EMF::EMRSETMITERLIMIT( eNewLimit );
+   BOOL EMF::setMiterLimit ( METAFILEDEVICECONTEXT* dc, FLOAT eNewLimit,
+			     PFLOAT peOldLimit )
+   {
+      if ( !dc->redundantState( EMF::METAFILEDEVICECONTEXT::STATE_MITER_LIMIT,
+                                dc->miter_limit == eNewLimit ) ) {
+         EMF::EMRSETMITERLIMIT* setmiterlimit =
+            new EMF::EMRSETMITERLIMIT( eNewLimit );
 
-      dc->appendRecord( setmiterlimit );
+         dc->appendRecord( setmiterlimit );
+      }
 
       if ( peOldLimit )
          *peOldLimit = dc->miter_limit;
@@ -3571,14 +9075,248 @@ extern "C" {
 
     if ( dc == 0 ) return 0;
 
-    EMF::EMRSETPIXELV* setpixelv = new EMF::EMRSETPIXELV( x, y, color );
+    return EMF::setPixel( dc, x, y, color );
+  }
+
+  COLORREF EMF::setPixel ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+			   COLORREF color )
+  {
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, false, x, y ) )
+      dc->bake( x, y );
+
+    if ( dc->culled( x, y, x, y ) ) return RGB(0,0,0);
 
-    dc->appendRecord( setpixelv );
+    dc->appendPixel( x, y, color );
 
     dc->mergePoint( x, y );
 
     return RGB(0,0,0);
   }
+  /*!
+   * Copy a device independent bitmap into a rectangle, stretching it to fit.
+   * Unless EMF_OPTION_BORROW_BITS is in effect, the bitmap is copied; an
+   * identical bitmap already in the metafile is shared rather than copied
+   * again.
+   * \param context the metafile device context.
+   * \param x_dest x position of destination rectangle.
+   * \param y_dest y position of destination rectangle.
+   * \param cx_dest width of destination rectangle.
+   * \param cy_dest height of destination rectangle.
+   * \param x_src x position of source rectangle in the bitmap.
+   * \param y_src y position of source rectangle in the bitmap.
+   * \param cx_src width of source rectangle.
+   * \param cy_src height of source rectangle.
+   * \param bits the bitmap bits.
+   * \param bmi the bitmap header and color table.
+   * \param usage DIB_RGB_COLORS or DIB_PAL_COLORS.
+   * \param rop the raster operation.
+   * \return the number of scan lines copied; zero on failure.
+   */
+  EMF_DECLARE(INT) StretchDIBits ( HDC context, INT x_dest, INT y_dest, INT cx_dest,
+				   INT cy_dest, INT x_src, INT y_src, INT cx_src,
+				   INT cy_src, const VOID* bits, const BITMAPINFO* bmi,
+				   UINT usage, DWORD rop )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    return EMF::stretchDIBits( dc, x_dest, y_dest, cx_dest, cy_dest, x_src,
+			       y_src, cx_src, cy_src, bits, bmi, usage, rop );
+  }
+
+  INT EMF::stretchDIBits ( METAFILEDEVICECONTEXT* dc, INT x_dest, INT y_dest,
+			   INT cx_dest, INT cy_dest, INT x_src, INT y_src,
+			   INT cx_src, INT cy_src, const VOID* bits,
+			   const BITMAPINFO* bmi, UINT usage, DWORD rop )
+  {
+    DWORD cb_bmi = 0, cb_bits = 0;
+
+    // (std::abs( INT_MIN ) is undefined, so that height is turned away first)
+    if ( bmi != 0 &&
+	 ( bmi->bmiHeader.biHeight == INT_MIN ||
+	   !EMF::dibSizes( bmi, usage, (std::abs)( bmi->bmiHeader.biHeight ),
+			   cb_bmi, cb_bits ) ) )
+      return 0;
+
+    if ( bits == 0 ) cb_bits = 0;
+
+    INT x_end = x_dest + cx_dest, y_end = y_dest + cy_dest;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_UNMIRRORED, false,
+			x_dest, y_dest, x_end, y_end ) ) {
+      dc->bake( x_dest, y_dest );
+      dc->bake( x_end, y_end );
+      cx_dest = x_end - x_dest;
+      cy_dest = y_end - y_dest;
+    }
+
+    RECTL bounds = { (std::min)( x_dest, x_dest + cx_dest ),
+		     (std::min)( y_dest, y_dest + cy_dest ),
+		     (std::max)( x_dest, x_dest + cx_dest ),
+		     (std::max)( y_dest, y_dest + cy_dest ) };
+
+    if ( dc->culled( bounds ) ) return (std::abs)( cy_src );
+
+    dc->appendRecord( new EMF::EMRSTRETCHDIBITS
+		      ( &bounds, x_dest, y_dest, cx_dest, cy_dest,
+			x_src, y_src, cx_src, cy_src,
+			dc->internDIB( bmi, cb_bmi, bits, cb_bits,
+				       dc->options & EMF_OPTION_BORROW_BITS ),
+			usage, rop ) );
+
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
+
+    return (std::abs)( cy_src );
+  }
+  /*!
+   * Copy some scan lines of a device independent bitmap into a rectangle
+   * without stretching. The bitmap is kept as by StretchDIBits.
+   * \param context the metafile device context.
+   * \param x_dest x position of destination rectangle.
+   * \param y_dest y position of destination rectangle.
+   * \param width width of the rectangle.
+   * \param height height of the rectangle.
+   * \param x_src x position of source rectangle in the bitmap.
+   * \param y_src y position of source rectangle in the bitmap.
+   * \param start_scan the first scan line in bits.
+   * \param lines the number of scan lines in bits.
+   * \param bits the bitmap bits.
+   * \param bmi the bitmap header and color table.
+   * \param usage DIB_RGB_COLORS or DIB_PAL_COLORS.
+   * \return the number of scan lines set; zero on failure.
+   */
+  EMF_DECLARE(INT) SetDIBitsToDevice ( HDC context, INT x_dest, INT y_dest,
+				       DWORD width, DWORD height, INT x_src,
+				       INT y_src, UINT start_scan, UINT lines,
+				       LPCVOID bits, const BITMAPINFO* bmi,
+				       UINT usage )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return 0;
+
+    return EMF::setDIBitsToDevice( dc, x_dest, y_dest, width, height, x_src,
+				   y_src, start_scan, lines, bits, bmi,
+				   usage );
+  }
+
+  INT EMF::setDIBitsToDevice ( METAFILEDEVICECONTEXT* dc, INT x_dest,
+			       INT y_dest, DWORD width, DWORD height,
+			       INT x_src, INT y_src, UINT start_scan,
+			       UINT lines, LPCVOID bits,
+			       const BITMAPINFO* bmi, UINT usage )
+  {
+    if ( bmi == 0 || bits == 0 ) return 0;
+
+    DWORD cb_bmi, cb_bits;
+
+    if ( !EMF::dibSizes( bmi, usage, lines, cb_bmi, cb_bits ) )
+      return 0;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_TRANSLATION, false,
+			x_dest, y_dest ) )
+      dc->bake( x_dest, y_dest );
+
+    RECTL bounds = { x_dest, y_dest, (LONG)( x_dest + width ),
+		     (LONG)( y_dest + height ) };
+
+    if ( dc->culled( bounds ) ) return lines;
+
+    dc->appendRecord( new EMF::EMRSETDIBITSTODEVICE
+		      ( &bounds, x_dest, y_dest, x_src, y_src, width, height,
+			start_scan, lines,
+			dc->internDIB( bmi, cb_bmi, bits, cb_bits,
+				       dc->options & EMF_OPTION_BORROW_BITS ),
+			usage ) );
+
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
+
+    return lines;
+  }
+  /*!
+   * Fill rectangles or triangles with colors shaded between those of their
+   * vertices. This takes one small record, where banding the gradient with
+   * solid rectangles takes several records (and a brush) per band.
+   * \param context the metafile device context.
+   * \param vertices array of vertices.
+   * \param n_vertices number of vertices.
+   * \param mesh array of GRADIENT_RECTs or GRADIENT_TRIANGLEs indexing
+   * vertices.
+   * \param n_mesh number of rectangles or triangles.
+   * \param mode GRADIENT_FILL_RECT_H, GRADIENT_FILL_RECT_V or
+   * GRADIENT_FILL_TRIANGLE.
+   * \return true if the gradient was successfully rendered.
+   */
+  EMF_DECLARE(BOOL) GradientFill ( HDC context, PTRIVERTEX vertices, ULONG n_vertices,
+				   PVOID mesh, ULONG n_mesh, ULONG mode )
+  {
+    EMF::METAFILEDEVICECONTEXT* dc =
+      dynamic_cast<EMF::METAFILEDEVICECONTEXT*>(EMF::globalObjects.find( context ));
+
+    if ( dc == 0 ) return FALSE;
+
+    return EMF::gradientFill( dc, vertices, n_vertices, mesh, n_mesh, mode );
+  }
+
+  BOOL EMF::gradientFill ( METAFILEDEVICECONTEXT* dc, PTRIVERTEX vertices,
+			   ULONG n_vertices, PVOID mesh, ULONG n_mesh,
+			   ULONG mode )
+  {
+    if ( mode > GRADIENT_FILL_TRIANGLE ) return FALSE;
+
+    if ( n_mesh == 0 ) return TRUE;
+
+    if ( vertices == 0 || mesh == 0 || n_vertices > INT_MAX / sizeof( TRIVERTEX ) ||
+	 n_mesh > INT_MAX / sizeof( GRADIENT_TRIANGLE ) )
+      return FALSE;
+
+    const ULONG* indices = static_cast<const ULONG*>( mesh );
+    const ULONG n_indices = n_mesh * ( mode == GRADIENT_FILL_TRIANGLE ? 3 : 2 );
+
+    for ( ULONG i = 0; i < n_indices; i++ )
+      if ( indices[i] >= n_vertices ) return FALSE;
+
+    // Optionally apply a scaling world transform to the vertices themselves
+    std::vector<TRIVERTEX> baked;
+
+    if ( dc->bakeWorld( EMF::METAFILEDEVICECONTEXT::BAKES_SCALE, false ) ) {
+      baked.assign( vertices, vertices + n_vertices );
+
+      auto vertex = baked.begin();
+
+      for ( ; vertex != baked.end() && dc->fits( vertex->x, vertex->y ); vertex++ )
+	dc->bake( vertex->x, vertex->y );
+
+      if ( vertex == baked.end() )
+	vertices = baked.data();
+      else
+	dc->writeWorld();
+    }
+
+    RECTL bounds = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+    for ( ULONG i = 0; i < n_vertices; i++ ) {
+      bounds.left = (std::min)( bounds.left, vertices[i].x );
+      bounds.right = (std::max)( bounds.right, vertices[i].x );
+      bounds.top = (std::min)( bounds.top, vertices[i].y );
+      bounds.bottom = (std::max)( bounds.bottom, vertices[i].y );
+    }
+
+    if ( dc->culled( bounds ) ) return TRUE;
+
+    dc->appendRecord( new EMF::EMRGRADIENTFILL( &bounds, vertices, n_vertices,
+						mesh, n_mesh, mode ) );
+
+    dc->mergePoint( bounds.left, bounds.top );
+    dc->mergePoint( bounds.right, bounds.bottom );
+
+    return TRUE;
+  }
 
   /*!
    * Return a dummy handle to the desktop window (graphics systems aren't
@@ -3612,7 +9350,6 @@ extern "C" {
   {
     return 1;
   }
-}
 
 
 /* W. Glunz */
@@ -3622,7 +9359,3 @@ extern "C" {
 /* not important */ INT EnumFontFamiliesExW(HDC,LPLOGFONTW,FONTENUMPROCEXW,LPARAM,DWORD) { return 1; }
 /* not important */ INT EnumFontsA(HDC,LPCSTR,FONTENUMPROCA,LPARAM) { return 1; }
 /* not important */ INT EnumFontsW(HDC,LPCWSTR,FONTENUMPROCW,LPARAM) { return 1; }
-
-/* important only for embedding bitmaps but could be avoided */ INT StretchDIBits(HDC,INT,INT,INT,INT,INT,INT, INT,INT,const void*,const BITMAPINFO*,UINT,DWORD) { return 1; }
-INT SetDIBitsToDevice(HDC,INT,INT,DWORD,DWORD,INT,
-  INT,UINT,UINT,LPCVOID,const BITMAPINFO*,UINT) { return 1; }
@@ -24,10 +24,12 @@
 #include <cmath>
 #include <vector>
 #include <map>
+#include <string>
 #include <functional>
 #include <algorithm>
 #include <stdexcept>
 #include <memory>
+#include <limits>
 
 #include <emf_config.h>
 #include <libEMF/emf.h>
@@ -225,13 +227,30 @@ namespace EMF {
   class DATASTREAM {
     bool swap_;
     ::FILE* fp_;
+    const BYTE* next_;		//!< Without a file, the next byte to read from memory.
+    const BYTE* end_;		//!< ...and the end of the memory.
+    std::vector<BYTE>* sink_;	//!< Without a file, where output is appended.
   public:
     /*!
      * Constructor for DATASTREAM.
      * \param fp optional file pointer (but must be assigned before
      * any output occurs.)
      */
-    DATASTREAM ( ::FILE* fp = 0 ) : swap_( bigEndian() ), fp_( fp ) {}
+    DATASTREAM ( ::FILE* fp = 0 )
+      : swap_( bigEndian() ), fp_( fp ), next_( 0 ), end_( 0 ), sink_( 0 ) {}
+    /*!
+     * Constructor for a DATASTREAM which reads from memory.
+     * \param data the bytes to read.
+     * \param size the number of bytes.
+     */
+    DATASTREAM ( const BYTE* data, size_t size )
+      : swap_( bigEndian() ), fp_( 0 ), next_( data ), end_( data + size ), sink_( 0 ) {}
+    /*!
+     * Constructor for a DATASTREAM which writes to memory.
+     * \param sink the output is appended to this.
+     */
+    DATASTREAM ( std::vector<BYTE>& sink )
+      : swap_( bigEndian() ), fp_( 0 ), next_( 0 ), end_( 0 ), sink_( &sink ) {}
     /*!
      * Use the given FILE stream as the input/output destination.
      * \param fp file point for i/o.
@@ -665,6 +684,26 @@ namespace EMF {
 	    >> xform.eDx >> xform.eDy;
       return *this;
     }
+    /*!
+     * Output a TRIVERTEX structure.
+     * \param vertex TRIVERTEX to output.
+     */
+    DATASTREAM& operator<< ( const TRIVERTEX& vertex )
+    {
+      *this << vertex.x << vertex.y << vertex.Red << vertex.Green << vertex.Blue
+	    << vertex.Alpha;
+      return *this;
+    }
+    /*!
+     * Input a TRIVERTEX structure.
+     * \param vertex destination of input TRIVERTEX.
+     */
+    DATASTREAM& operator>> ( TRIVERTEX& vertex )
+    {
+      *this >> vertex.x >> vertex.y >> vertex.Red >> vertex.Green >> vertex.Blue
+	    >> vertex.Alpha;
+      return *this;
+    }
     /*!
      * Output an array of BYTEs.
      * \param array array of BYTEs to output.
@@ -954,6 +993,14 @@ namespace EMF {
      */
     void fread ( void* ptr, size_t size, size_t nmemb, FILE* stream )
     {
+      if ( stream == 0 ) {
+	if ( nmemb > 0 && (size_t)( end_ - next_ ) / nmemb < size ) {
+	  throw std::runtime_error( "Premature EOF on EMF stream" );
+	}
+	memcpy( ptr, next_, size * nmemb );
+	next_ += size * nmemb;
+	return;
+      }
       size_t res = ::fread( ptr, size, nmemb, stream );
       if ( res < nmemb ) {
         throw std::runtime_error( "Premature EOF on EMF stream" );
@@ -970,6 +1017,11 @@ namespace EMF {
      */
     void fwrite ( const void* ptr, size_t size, size_t nmemb, FILE* stream )
     {
+      if ( stream == 0 && sink_ != 0 ) {
+	const BYTE* bytes = static_cast<const BYTE*>( ptr );
+	sink_->insert( sink_->end(), bytes, bytes + size * nmemb );
+	return;
+      }
       size_t res = ::fwrite( ptr, size, nmemb, stream );
       if ( res < nmemb ) {
         throw std::runtime_error( "error writing EMF stream" );
@@ -979,6 +1031,101 @@ namespace EMF {
 
   class METAFILEDEVICECONTEXT;
 
+  class GRAPHICSOBJECT;
+
+  /*!
+   * \name Drawing calls on a context already looked up.
+   * Each public drawing call finds its METAFILEDEVICECONTEXT from the
+   * handle and hands it to one of these; PlayEnhMetaFile calls them directly
+   * so that copying a record costs no handle lookup. The arguments and
+   * return values are those of the public call of the same name.
+   */
+  //@{
+  BOOL moveToEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y, LPPOINT point );
+  BOOL lineTo ( METAFILEDEVICECONTEXT* dc, INT x, INT y );
+  HGDIOBJ selectObject ( METAFILEDEVICECONTEXT* dc, GRAPHICSOBJECT* gobj );
+  BOOL setViewportOrgEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+			  LPPOINT point );
+  BOOL setWindowOrgEx ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+			LPPOINT point );
+  BOOL setViewportExtEx ( METAFILEDEVICECONTEXT* dc, INT cx, INT cy,
+			  LPSIZE size );
+  BOOL scaleViewportExtEx ( METAFILEDEVICECONTEXT* dc, INT x_num, INT x_den,
+			    INT y_num, INT y_den, LPSIZE size );
+  BOOL setWindowExtEx ( METAFILEDEVICECONTEXT* dc, INT cx, INT cy,
+			LPSIZE size );
+  BOOL scaleWindowExtEx ( METAFILEDEVICECONTEXT* dc, INT x_num, INT x_den,
+			  INT y_num, INT y_den, LPSIZE size );
+  BOOL modifyWorldTransform ( METAFILEDEVICECONTEXT* dc,
+			      const XFORM *transform, DWORD mode );
+  BOOL setWorldTransform ( METAFILEDEVICECONTEXT* dc,
+			   const XFORM *transform );
+  UINT setTextAlign ( METAFILEDEVICECONTEXT* dc, UINT alignment );
+  COLORREF setTextColor ( METAFILEDEVICECONTEXT* dc, COLORREF color );
+  COLORREF setBkColor ( METAFILEDEVICECONTEXT* dc, COLORREF color );
+  INT setBkMode ( METAFILEDEVICECONTEXT* dc, INT mode );
+  INT setMapMode ( METAFILEDEVICECONTEXT* dc, INT mode );
+  BOOL extTextOutA ( METAFILEDEVICECONTEXT* dc, INT x, INT y, UINT flags,
+		     const RECT* rect, LPCSTR string, UINT count,
+		     const INT* dx );
+  BOOL extTextOutW ( METAFILEDEVICECONTEXT* dc, INT x, INT y, UINT flags,
+		     const RECT* rect, LPCWSTR string, UINT count,
+		     const INT* dx );
+  BOOL arc ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+	     INT bottom, INT xstart, INT ystart, INT xend, INT yend );
+  BOOL arcTo ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+	       INT bottom, INT xstart, INT ystart, INT xend, INT yend );
+  BOOL rectangle ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+		   INT bottom );
+  BOOL ellipse ( METAFILEDEVICECONTEXT* dc, INT left, INT top, INT right,
+		 INT bottom );
+  BOOL polyBezier ( METAFILEDEVICECONTEXT* dc, const POINT* points, DWORD n );
+  BOOL polyBezier16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+		      INT16 n );
+  BOOL polyline ( METAFILEDEVICECONTEXT* dc, const POINT* points, INT n );
+  BOOL polyline16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+		    INT16 n );
+  BOOL polygon ( METAFILEDEVICECONTEXT* dc, const POINT* points, INT n );
+  BOOL polygon16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+		   INT16 n );
+  BOOL polyPolygon ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+		     const INT* counts, UINT polygons );
+  BOOL polyPolygon16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+		       const INT* counts, UINT16 polygons );
+  INT setPolyFillMode ( METAFILEDEVICECONTEXT* dc, INT mode );
+  BOOL fillPath ( METAFILEDEVICECONTEXT* dc );
+  BOOL strokePath ( METAFILEDEVICECONTEXT* dc );
+  BOOL strokeAndFillPath ( METAFILEDEVICECONTEXT* dc );
+  BOOL polyBezierTo ( METAFILEDEVICECONTEXT* dc, const POINT* points,
+		      DWORD n );
+  BOOL polyBezierTo16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+			INT16 n );
+  BOOL polylineTo ( METAFILEDEVICECONTEXT* dc, const POINT* points, DWORD n );
+  BOOL polylineTo16 ( METAFILEDEVICECONTEXT* dc, const POINT16* points,
+		      INT16 n );
+  BOOL beginPath ( METAFILEDEVICECONTEXT* dc );
+  BOOL endPath ( METAFILEDEVICECONTEXT* dc );
+  BOOL closeFigure ( METAFILEDEVICECONTEXT* dc );
+  INT saveDC ( METAFILEDEVICECONTEXT* dc );
+  INT restoreDC ( METAFILEDEVICECONTEXT* dc, INT n );
+  INT setMetaRgn ( METAFILEDEVICECONTEXT* dc );
+  BOOL setMiterLimit ( METAFILEDEVICECONTEXT* dc, FLOAT eNewLimit,
+		       PFLOAT peOldLimit );
+  COLORREF setPixel ( METAFILEDEVICECONTEXT* dc, INT x, INT y,
+		      COLORREF color );
+  INT stretchDIBits ( METAFILEDEVICECONTEXT* dc, INT x_dest, INT y_dest,
+		      INT cx_dest, INT cy_dest, INT x_src, INT y_src,
+		      INT cx_src, INT cy_src, const VOID* bits,
+		      const BITMAPINFO* bmi, UINT usage, DWORD rop );
+  INT setDIBitsToDevice ( METAFILEDEVICECONTEXT* dc, INT x_dest, INT y_dest,
+			  DWORD width, DWORD height, INT x_src, INT y_src,
+			  UINT start_scan, UINT lines, LPCVOID bits,
+			  const BITMAPINFO* bmi, UINT usage );
+  BOOL gradientFill ( METAFILEDEVICECONTEXT* dc, PTRIVERTEX vertices,
+		      ULONG n_vertices, PVOID mesh, ULONG n_mesh,
+		      ULONG mode );
+  //@}
+
   //! The base class of all metafile records
   /*!
    * A metafile consists off a sequence of graphics records "executed"
@@ -994,7 +1141,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc the destination context.
      */
-    virtual void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const = 0;
+    virtual void execute ( METAFILEDEVICECONTEXT* source,
+			   METAFILEDEVICECONTEXT* dc ) const = 0;
     /*!
      * Write yourself to the given file. This is virtual since some records
      * are of arbitrary length and need to write additional information
@@ -1008,6 +1156,31 @@ namespace EMF {
      * total size.
      */
     virtual int size ( void ) const = 0;
+    //! What a figure is drawn with (see draws()).
+    enum { DRAWS = 0x1, USES_PEN = 0x2, USES_BRUSH = 0x4, USES_FONT = 0x8 };
+    /*!
+     * Records which paint something describe it, so that they may be
+     * reordered by EMF_OPTION_GROUP_OBJECTS. Anything else stays put.
+     * \param bounds returns the logical bounds of what is painted.
+     * \return DRAWS plus the USES_* objects it is drawn with; or zero.
+     */
+    virtual DWORD draws ( RECTL& bounds ) const
+    {
+      EMF_UNUSED(bounds);
+      return 0;
+    }
+    /*!
+     * \return the EMR_* type of the record (found from the
+     * EMF_RECORD_TYPES registry); 0 if it isn't known.
+     */
+    virtual DWORD type ( void ) const;
+    /*!
+     * Records which create, select or delete a metafile object give
+     * access to its handle, so that EMF_OPTION_PRUNE_RECORDS may renumber
+     * the objects.
+     * \return where the record keeps the handle; or null.
+     */
+    virtual DWORD* objectHandle ( void ) { return 0; }
     /*!
      * The virtual destructor allows records which allocated additional memory
      * to release it when they are deleted. Simple records just use the default
@@ -1266,29 +1439,108 @@ namespace EMF {
      * assigned at serialization time.)
      */
     virtual METARECORD* newEMR ( HDC dc, HGDIOBJ handle ) = 0;
+    /*!
+     * Return a string which is the same for any two objects which would
+     * produce identical metafile records, or an empty string if this kind
+     * of object is not shared (interned) within a metafile.
+     */
+    virtual std::string key ( void ) const { return std::string(); }
+  protected:
+    /*!
+     * Append the bytes of a (plain) value to an object key.
+     * \param k the key being built.
+     * \param value the value to append.
+     */
+    template<class T> static void appendKey ( std::string& k, const T& value )
+    {
+      k.append( (const char*)&value, sizeof value );
+    }
   };
 
   typedef METARECORD*(*METARECORDCTOR)(DATASTREAM&);
+  typedef void(*METARECORDPLAY)(const METARECORD*, METAFILEDEVICECONTEXT*,
+				METAFILEDEVICECONTEXT*);
+
+  /*!
+   * The registry of record types which can be read from a metafile. Each
+   * entry pairs an EMR_* type with the record class which reads it (from
+   * its DATASTREAM constructor). This is the one place to add a new
+   * record type: the dispatch table behind GLOBALOBJECTS::newRecord is
+   * generated from it at compile time.
+   */
+#define EMF_RECORD_TYPES(RECORD) \
+  RECORD( EMR_EOF, EMREOF )                                       \
+  RECORD( EMR_SETVIEWPORTORGEX, EMRSETVIEWPORTORGEX )             \
+  RECORD( EMR_SETWINDOWORGEX, EMRSETWINDOWORGEX )                 \
+  RECORD( EMR_SETVIEWPORTEXTEX, EMRSETVIEWPORTEXTEX )             \
+  RECORD( EMR_SETWINDOWEXTEX, EMRSETWINDOWEXTEX )                 \
+  RECORD( EMR_SCALEVIEWPORTEXTEX, EMRSCALEVIEWPORTEXTEX )         \
+  RECORD( EMR_SCALEWINDOWEXTEX, EMRSCALEWINDOWEXTEX )             \
+  RECORD( EMR_MODIFYWORLDTRANSFORM, EMRMODIFYWORLDTRANSFORM )     \
+  RECORD( EMR_SETWORLDTRANSFORM, EMRSETWORLDTRANSFORM )           \
+  RECORD( EMR_SETTEXTALIGN, EMRSETTEXTALIGN )                     \
+  RECORD( EMR_SETTEXTCOLOR, EMRSETTEXTCOLOR )                     \
+  RECORD( EMR_SETBKCOLOR, EMRSETBKCOLOR )                         \
+  RECORD( EMR_SETBKMODE, EMRSETBKMODE )                           \
+  RECORD( EMR_SETPOLYFILLMODE, EMRSETPOLYFILLMODE )               \
+  RECORD( EMR_SETMAPMODE, EMRSETMAPMODE )                         \
+  RECORD( EMR_SELECTOBJECT, EMRSELECTOBJECT )                     \
+  RECORD( EMR_DELETEOBJECT, EMRDELETEOBJECT )                     \
+  RECORD( EMR_MOVETOEX, EMRMOVETOEX )                             \
+  RECORD( EMR_LINETO, EMRLINETO )                                 \
+  RECORD( EMR_ARC, EMRARC )                                       \
+  RECORD( EMR_ARCTO, EMRARCTO )                                   \
+  RECORD( EMR_RECTANGLE, EMRRECTANGLE )                           \
+  RECORD( EMR_ELLIPSE, EMRELLIPSE )                               \
+  RECORD( EMR_POLYLINE, EMRPOLYLINE )                             \
+  RECORD( EMR_POLYLINE16, EMRPOLYLINE16 )                         \
+  RECORD( EMR_POLYGON, EMRPOLYGON )                               \
+  RECORD( EMR_POLYGON16, EMRPOLYGON16 )                           \
+  RECORD( EMR_POLYPOLYGON, EMRPOLYPOLYGON )                       \
+  RECORD( EMR_POLYPOLYGON16, EMRPOLYPOLYGON16 )                   \
+  RECORD( EMR_POLYBEZIER, EMRPOLYBEZIER )                         \
+  RECORD( EMR_POLYBEZIER16, EMRPOLYBEZIER16 )                     \
+  RECORD( EMR_POLYBEZIERTO, EMRPOLYBEZIERTO )                     \
+  RECORD( EMR_POLYBEZIERTO16, EMRPOLYBEZIERTO16 )                 \
+  RECORD( EMR_POLYLINETO, EMRPOLYLINETO )                         \
+  RECORD( EMR_POLYLINETO16, EMRPOLYLINETO16 )                     \
+  RECORD( EMR_EXTTEXTOUTA, EMREXTTEXTOUTA )                       \
+  RECORD( EMR_EXTTEXTOUTW, EMREXTTEXTOUTW )                       \
+  RECORD( EMR_SETPIXELV, EMRSETPIXELV )                           \
+  RECORD( EMR_STRETCHDIBITS, EMRSTRETCHDIBITS )                   \
+  RECORD( EMR_SETDIBITSTODEVICE, EMRSETDIBITSTODEVICE )           \
+  RECORD( EMR_GRADIENTFILL, EMRGRADIENTFILL )                     \
+  RECORD( EMR_CREATEPEN, EMRCREATEPEN )                           \
+  RECORD( EMR_EXTCREATEPEN, EMREXTCREATEPEN )                     \
+  RECORD( EMR_CREATEBRUSHINDIRECT, EMRCREATEBRUSHINDIRECT )       \
+  RECORD( EMR_EXTCREATEFONTINDIRECTW, EMREXTCREATEFONTINDIRECTW ) \
+  RECORD( EMR_FILLPATH, EMRFILLPATH )                             \
+  RECORD( EMR_STROKEPATH, EMRSTROKEPATH )                         \
+  RECORD( EMR_STROKEANDFILLPATH, EMRSTROKEANDFILLPATH )           \
+  RECORD( EMR_BEGINPATH, EMRBEGINPATH )                           \
+  RECORD( EMR_ENDPATH, EMRENDPATH )                               \
+  RECORD( EMR_CLOSEFIGURE, EMRCLOSEFIGURE )                       \
+  RECORD( EMR_SAVEDC, EMRSAVEDC )                                 \
+  RECORD( EMR_RESTOREDC, EMRRESTOREDC )                           \
+  RECORD( EMR_SETMETARGN, EMRSETMETARGN )                         \
+  RECORD( EMR_SETMITERLIMIT, EMRSETMITERLIMIT )
 
   /*!
    * Stores all the objects in a single database within a process.
    */
   class GLOBALOBJECTS {
     /*!
-     * A vector of all objects created by the program.
+     * A vector of all objects created by the program. It is only created
+     * (with the stock objects in its first slots) when first needed, so
+     * that globalObjects itself is initialized at compile time.
      */
-    std::vector<OBJECT*> objects;
+    mutable std::vector<OBJECT*>* objects;
 
-    /*!
-     * (The code for) reading a metafile is somewhat simplified by
-     * having the constructors for each record type stored in this
-     * map. The "virtual" constructors can then be invoked via
-     * indexing.
-     */
-    std::map< DWORD, METARECORDCTOR > new_records;
+    std::vector<OBJECT*>& table ( void ) const;
 
   public:
-    GLOBALOBJECTS ( void );
+    //! Nothing is allocated until the first object is wanted.
+    constexpr GLOBALOBJECTS ( void ) : objects( nullptr ) {}
     ~GLOBALOBJECTS ( void );
     HGDIOBJ add ( OBJECT* object );
     OBJECT* find ( const HGDIOBJ handle );
@@ -1297,123 +1549,175 @@ namespace EMF {
     /*!
      * \return an iterator pointing to the first global object.
      */
-    auto begin ( void ) const { return objects.begin(); }
+    auto begin ( void ) const { return table().begin(); }
 
     /*!
      * \return an iterator pointing to (one past) the final global object.
      */
-    auto end ( void ) const { return objects.end(); }
+    auto end ( void ) const { return table().end(); }
 
     METARECORDCTOR newRecord ( DWORD iType ) const;
-
-    //! Create a new EMREOF record.
-    static EMF::METARECORD* new_eof ( DATASTREAM& ds );
-    //! Create a new EMRSETVIEWPORTORGEX record.
-    static EMF::METARECORD* new_setviewportorgex ( DATASTREAM& ds );
-    //! Create a new EMRSETWINDOWORGEX record.
-    static EMF::METARECORD* new_setwindoworgex ( DATASTREAM& ds );
-    //! Create a new EMRSETVIEWPORTEXTEX record.
-    static EMF::METARECORD* new_setviewportextex ( DATASTREAM& ds );
-    //! Create a new EMRSETWINDOWEXTEX record.
-    static EMF::METARECORD* new_setwindowextex ( DATASTREAM& ds );
-    //! Create a new SCALEVIEWPORTEXTEX record.
-    static EMF::METARECORD* new_scaleviewportextex ( DATASTREAM& ds );
-    //! Create a new SCALEWINDOWEXTEX record.
-    static EMF::METARECORD* new_scalewindowextex ( DATASTREAM& ds );
-    //! Create a new MODIFYWORLDTRANSFORM record.
-    static EMF::METARECORD* new_modifyworldtransform ( DATASTREAM& ds );
-    //! Create a new SETWORLDTRANSFORM record.
-    static EMF::METARECORD* new_setworldtransform ( DATASTREAM& ds );
-    //! Create a new SETTEXTALIGN record.
-    static EMF::METARECORD* new_settextalign ( DATASTREAM& ds );
-    //! Create a new SETTEXTCOLOR record.
-    static EMF::METARECORD* new_settextcolor ( DATASTREAM& ds );
-    //! Create a new SETBKCOLOR record.
-    static EMF::METARECORD* new_setbkcolor ( DATASTREAM& ds );
-    //! Create a new SETBKMODE record.
-    static EMF::METARECORD* new_setbkmode ( DATASTREAM& ds );
-    //! Create a new SETPOLYFILLMODE record.
-    static EMF::METARECORD* new_setpolyfillmode ( DATASTREAM& ds );
-    //! Create a new SETMAPMODE record.
-    static EMF::METARECORD* new_setmapmode ( DATASTREAM& ds );
-    //! Create a new SELECTOBJECT record.
-    static EMF::METARECORD* new_selectobject ( DATASTREAM& ds );
-    //! Create a new DELETEOBJECT record.
-    static EMF::METARECORD* new_deleteobject ( DATASTREAM& ds );
-    //! Create a new MOVETOEX record.
-    static EMF::METARECORD* new_movetoex ( DATASTREAM& ds );
-    //! Create a new LINETO record.
-    static EMF::METARECORD* new_lineto ( DATASTREAM& ds );
-    //! Create a new ARC record.
-    static EMF::METARECORD* new_arc ( DATASTREAM& ds );
-    //! Create a new ARCTO record.
-    static EMF::METARECORD* new_arcto ( DATASTREAM& ds );
-    //! Create a new RECTANGLE record.
-    static EMF::METARECORD* new_rectangle ( DATASTREAM& ds );
-    //! Create a new ELLIPSE record.
-    static EMF::METARECORD* new_ellipse ( DATASTREAM& ds );
-    //! Create a new POLYLINE record.
-    static EMF::METARECORD* new_polyline ( DATASTREAM& ds );
-    //! Create a new POLYLINE16 record.
-    static EMF::METARECORD* new_polyline16 ( DATASTREAM& ds );
-    //! Create a new POLYGON record.
-    static EMF::METARECORD* new_polygon ( DATASTREAM& ds );
-    //! Create a new POLYGON16 record.
-    static EMF::METARECORD* new_polygon16 ( DATASTREAM& ds );
-    //! Create a new POLYPOLYGON record.
-    static EMF::METARECORD* new_polypolygon ( DATASTREAM& ds );
-    //! Create a new POLYPOLYGON16 record.
-    static EMF::METARECORD* new_polypolygon16 ( DATASTREAM& ds );
-    //! Create a new POLYBEZIER record.
-    static EMF::METARECORD* new_polybezier ( DATASTREAM& ds );
-    //! Create a new POLYBEZIER16 record.
-    static EMF::METARECORD* new_polybezier16 ( DATASTREAM& ds );
-    //! Create a new POLYBEZIERTO record.
-    static EMF::METARECORD* new_polybezierto ( DATASTREAM& ds );
-    //! Create a new POLYBEZIERTO16 record.
-    static EMF::METARECORD* new_polybezierto16 ( DATASTREAM& ds );
-    //! Create a new POLYLINETO record.
-    static EMF::METARECORD* new_polylineto ( DATASTREAM& ds );
-    //! Create a new POLYLINETO16 record.
-    static EMF::METARECORD* new_polylineto16 ( DATASTREAM& ds );
-    //! Create a new EXTTEXTOUTA record.
-    static EMF::METARECORD* new_exttextouta ( DATASTREAM& ds );
-    //! Create a new EXTTEXTOUTW record.
-    static EMF::METARECORD* new_exttextoutw ( DATASTREAM& ds );
-    //! Create a new SETPIXELV record.
-    static EMF::METARECORD* new_setpixelv ( DATASTREAM& ds );
-    //! Create a new CREATEPEN record.
-    static EMF::METARECORD* new_createpen ( DATASTREAM& ds );
-    //! Create a new EXTCREATEPEN record.
-    static EMF::METARECORD* new_extcreatepen ( DATASTREAM& ds );
-    //! Create a new CREATEBRUSHINDIRECT record.
-    static EMF::METARECORD* new_createbrushindirect ( DATASTREAM& ds );
-    //! Create a new EXTCREATEFONTINDIRECTW record.
-    static EMF::METARECORD* new_extcreatefontindirectw ( DATASTREAM& ds );
-    //! Create a new FILLPATH record.
-    static EMF::METARECORD* new_fillpath ( DATASTREAM& ds );
-    //! Create a new STROKEPATH record.
-    static EMF::METARECORD* new_strokepath ( DATASTREAM& ds );
-    //! Create a new STROKEANDFILLPATH record.
-    static EMF::METARECORD* new_strokeandfillpath ( DATASTREAM& ds );
-    //! Create a new BEGINPATH record.
-    static EMF::METARECORD* new_beginpath ( DATASTREAM& ds );
-    //! Create a new ENDPATH record.
-    static EMF::METARECORD* new_endpath ( DATASTREAM& ds );
-    //! Create a new CLOSEFIGURE record.
-    static EMF::METARECORD* new_closefigure ( DATASTREAM& ds );
-    //! Create a new SAVEDC record.
-    static EMF::METARECORD* new_savedc ( DATASTREAM& ds );
-    //! Create a new RESTOREDC record.
-    static EMF::METARECORD* new_restoredc ( DATASTREAM& ds );
-    //! Create a new SETMETARGN record.
-    static EMF::METARECORD* new_setmetargn ( DATASTREAM& ds );
-    //! Create a new SETMITERLIMIT record.
-    static EMF::METARECORD* new_setmiterlimit ( DATASTREAM& ds );
   };
 
   extern GLOBALOBJECTS globalObjects;
 
+  class LAZYRECORD;
+
+  //! The file behind a metafile loaded with GetEnhMetaFileLazy
+  /*!
+   * Records are decoded from the file when first used. The decoded
+   * records are kept, most recently used first, while their total size is
+   * within the budget; past that, the least recently used are dropped (to
+   * be decoded again if they are used again).
+   */
+  class RECORDSOURCE {
+    friend class LAZYRECORD;
+    ::FILE* fp_;		//!< The metafile, open for reading; null if it is in memory.
+    DATASTREAM ds_;		//!< Reads records from fp_ or bits_.
+    const BYTE* bits_;		//!< The metafile in memory.
+    size_t size_;		//!< ...its size.
+    std::vector<BYTE> copy_;	//!< The metafile, if it is a copy kept here.
+    size_t budget_;		//!< The most bytes of decoded records to keep; 0 for no limit.
+    size_t held_;		//!< The bytes of decoded records kept.
+    const LAZYRECORD* newest_;	//!< The most recently used decoded record.
+    const LAZYRECORD* oldest_;	//!< The least recently used decoded record.
+  public:
+    /*!
+     * \param fp the metafile, open for reading (this closes it).
+     * \param budget the most bytes of decoded records to keep; 0 for no limit.
+     */
+    RECORDSOURCE ( ::FILE* fp, size_t budget )
+      : fp_( fp ), ds_( fp ), bits_( 0 ), size_( 0 ), budget_( budget ), held_( 0 ),
+	newest_( 0 ), oldest_( 0 )
+    {}
+    /*!
+     * \param bits the metafile in memory.
+     * \param size its size.
+     * \param borrow if true, bits must be kept until the metafile is deleted;
+     * otherwise, this keeps a copy.
+     * \param budget the most bytes of decoded records to keep; 0 for no limit.
+     */
+    RECORDSOURCE ( const BYTE* bits, size_t size, bool borrow, size_t budget )
+      : fp_( 0 ), ds_( bits, size ), bits_( bits ), size_( size ), budget_( budget ),
+	held_( 0 ), newest_( 0 ), oldest_( 0 )
+    {
+      if ( ! borrow ) {
+	copy_.assign( bits, bits + size );
+	bits_ = copy_.data();
+      }
+    }
+    /*!
+     * All the records must have been deleted by now.
+     */
+    ~RECORDSOURCE ( ) { if ( fp_ != 0 ) ::fclose( fp_ ); }
+    /*!
+     * \return the metafile in memory; null if it is read from a file.
+     */
+    const BYTE* bits ( void ) const { return bits_; }
+    /*!
+     * \param position an offset in the metafile.
+     * \return the stream, positioned there.
+     */
+    DATASTREAM& at ( long position )
+    {
+      if ( fp_ != 0 )
+	::fseek( fp_, position, SEEK_SET );
+      else
+	ds_ = DATASTREAM( bits_ + position, size_ - position );
+      return ds_;
+    }
+    /*!
+     * \return the bytes of decoded records currently kept.
+     */
+    size_t held ( void ) const { return held_; }
+  };
+
+  //! A record of a lazily loaded metafile, decoded when it is used
+  /*!
+   * Until then, this is only where the record lies in the file. Otherwise,
+   * it stands in for the decoded record.
+   */
+  class LAZYRECORD : public METARECORD {
+    RECORDSOURCE* source_;	//!< Where the record is decoded from.
+    mutable long position_;	//!< The offset of the record in the file; -1 if it is unreadable.
+    DWORD iType_;		//!< The type of the record.
+    DWORD nSize_;		//!< The size of the record.
+    mutable METARECORD* record_; //!< The decoded record; null if not decoded.
+    mutable const LAZYRECORD* newer_; //!< The next more recently used decoded record.
+    mutable const LAZYRECORD* older_; //!< The next less recently used decoded record.
+
+    void drop ( void ) const;
+  public:
+    /*!
+     * \param source where the record is decoded from.
+     * \param position the offset of the record in the file.
+     * \param iType the type of the record.
+     * \param nSize the size of the record.
+     */
+    LAZYRECORD ( RECORDSOURCE* source, long position, DWORD iType, DWORD nSize )
+      : source_( source ), position_( position ), iType_( iType ), nSize_( nSize ),
+	record_( 0 ), newer_( 0 ), older_( 0 )
+    {}
+    /*!
+     * Release the decoded record, if any.
+     */
+    ~LAZYRECORD ( ) { drop(); }
+    METARECORD* record ( void ) const;
+    /*!
+     * \return the type of the record, without decoding it.
+     */
+    DWORD type ( void ) const { return iType_; }
+    /*!
+     * \return the offset of the record in the file; -1 if it is unreadable.
+     */
+    long position ( void ) const { return position_; }
+    /*!
+     * Decode the record if need be and execute it.
+     * \param source the device context from which this record is taken.
+     * \param dc the destination context.
+     */
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
+    {
+      METARECORD* decoded = record();
+      if ( decoded != 0 ) decoded->execute( source, dc );
+    }
+    /*!
+     * Decode the record if need be and write it out.
+     * \param ds the datastream to write to.
+     * \return true if the record was written.
+     */
+    bool serialize ( DATASTREAM ds )
+    {
+      METARECORD* decoded = record();
+      return decoded != 0 && decoded->serialize( ds );
+    }
+    /*!
+     * The size comes from the file, so this doesn't decode the record.
+     */
+    int size ( void ) const { return nSize_; }
+    /*!
+     * Decode the record if need be and describe what it paints.
+     * \param bounds returns the logical bounds of what is painted.
+     * \return as the decoded record's draws().
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      METARECORD* decoded = record();
+      return decoded != 0 ? decoded->draws( bounds ) : 0;
+    }
+#ifdef ENABLE_EDITING
+    /*!
+     * Decode the record if need be and print it.
+     */
+    void edit ( void ) const
+    {
+      METARECORD* decoded = record();
+      if ( decoded != 0 ) decoded->edit();
+    }
+#endif /* ENABLE_EDITING */
+  };
+
   //! Enhanced Metafile Header Record
   /**
    * The ENHMETAHEADER serves two purposes in this library: it keeps track
@@ -1532,21 +1836,27 @@ namespace EMF {
 	 >> nDescription >> offDescription >> nPalEntries
 	 >> szlDevice >> szlMillimeters;
 
-      // Some elements of the metafile header were added at later dates
+      // Some elements of the metafile header were added at later dates.
+      // They end where the description starts or, without one, with the
+      // record.
+      DWORD extent = offDescription != 0 ? offDescription : nSize;
 
 #define OffsetOf( a, b ) ((unsigned int)(((char*)&(((::ENHMETAHEADER*)a)->b)) - \
 (char*)((::ENHMETAHEADER*)a)))
-      if ( OffsetOf( this, szlMicrometers ) <= offDescription )
+      if ( OffsetOf( this, szlMicrometers ) <= extent )
 	ds >> cbPixelFormat >> offPixelFormat >> bOpenGL;
 #undef OffsetOf
-      if ( sizeof(::ENHMETAHEADER) <= offDescription )
+      if ( sizeof(::ENHMETAHEADER) <= extent )
 	ds >> szlMicrometers;
 
       // Should now probably check that the offset is correct...
 
+      // Without a description, there is nothing more to read
+      if ( nDescription == 0 || offDescription == 0 ) return true;
+
       int description_size_to_read = ( nSize - offDescription ) / sizeof(WCHAR);
 
-      if ( description_size_to_read < (int)nDescription ) {
+      if ( offDescription > nSize || description_size_to_read < (int)nDescription ) {
         throw std::runtime_error( "record size inconsistent with description size" );
       }
 
@@ -1566,6 +1876,10 @@ namespace EMF {
 
       return true;
     }
+    /*!
+     * \return the description (nDescription WCHARs); null if there is none.
+     */
+    LPCWSTR description ( void ) const { return description_w; }
     /*!
      * Internally computed size of this record.
      */
@@ -1575,7 +1889,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       // Actually handled by the destination device context.
       EMF_UNUSED(source);
@@ -1714,7 +2029,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       // Actually handled by the destination device context.
       EMF_UNUSED(source);
@@ -1775,11 +2091,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetViewportOrgEx( dc, ptlOrigin.x, ptlOrigin.y, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -1838,11 +2151,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetWindowOrgEx( dc, ptlOrigin.x, ptlOrigin.y, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -1899,11 +2209,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetViewportExtEx( dc, szlExtent.cx, szlExtent.cy, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -1964,11 +2271,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      ScaleViewportExtEx( dc, xNum, xDenom, yNum, yDenom, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2039,11 +2343,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetWindowExtEx( dc, szlExtent.cx, szlExtent.cy, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2104,11 +2405,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      ScaleWindowExtEx( dc, xNum, xDenom, yNum, yDenom, 0 );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2181,11 +2479,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      ModifyWorldTransform( dc, &xform, iMode );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2253,11 +2548,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetWorldTransform( dc, &xform );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2310,10 +2602,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetTextAlign( dc, iMode );
+      setTextAlign( dc, iMode );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2396,10 +2689,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetTextColor( dc, crColor );
+      setTextColor( dc, crColor );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2453,10 +2747,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetBkColor( dc, crColor );
+      setBkColor( dc, crColor );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2511,10 +2806,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetBkMode( dc, iMode );
+      setBkMode( dc, iMode );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2578,10 +2874,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetPolyFillMode( dc, iMode );
+      setPolyFillMode( dc, iMode );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2646,11 +2943,8 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SetMapMode( dc, iMode );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2714,12 +3008,17 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihObject; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2772,12 +3071,17 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihObject; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -2837,10 +3141,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      MoveToEx( dc,  ptl.x, ptl.y, 0 );
+      moveToEx( dc,  ptl.x, ptl.y, 0 );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2896,10 +3201,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      LineTo( dc,  ptl.x, ptl.y );
+      lineTo( dc,  ptl.x, ptl.y );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -2964,15 +3270,24 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBox;
+      return DRAWS | USES_PEN;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      Arc( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom,
+      arc( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom,
 	   ptlStart.x, ptlStart.y, ptlEnd.x, ptlEnd.y );
     }
 #ifdef ENABLE_EDITING
@@ -3045,10 +3360,11 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      ArcTo( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom,
+      arcTo( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom,
 	     ptlStart.x, ptlStart.y, ptlEnd.x, ptlEnd.y );
     }
 #ifdef ENABLE_EDITING
@@ -3106,15 +3422,24 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBox;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      Rectangle( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom );
+      rectangle( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3170,15 +3495,24 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBox;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      Ellipse( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom );
+      ellipse( dc, rclBox.left, rclBox.top, rclBox.right, rclBox.bottom );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3223,6 +3557,27 @@ namespace EMF {
 
       rclBounds = *bounds;
     }
+    /*!
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polyline.
+     * \param points array of polyline vertices.
+     * \param n number of vertices in points.
+     */
+    EMRPOLYLINE ( const RECTL* bounds, std::unique_ptr<POINTL[]> points, INT n )
+    {
+      cptl = n;
+      aptl[0].x = 0;		// Really unused
+      aptl[0].y = 0;
+
+      emr.iType = EMR_POLYLINE;
+      // The (cptl-1) below is to account for aptl, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYLINE ) + sizeof( POINTL ) * (cptl-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
     /*!
      * Destructor frees a copy of the points it buffered.
      */
@@ -3262,16 +3617,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      Polyline( dc, (POINT*)lpoints, cptl );
+      polyline( dc, (POINT*)lpoints, cptl );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3317,6 +3681,27 @@ namespace EMF {
 
       rclBounds = *bounds;
     }
+    /*!
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polyline.
+     * \param points array of polyline vertices.
+     * \param n number of vertices in points.
+     */
+    EMRPOLYLINE16 ( const RECTL* bounds, std::unique_ptr<POINT16[]> points, INT n )
+    {
+      cpts = n;
+      apts[0].x = 0;		// Really unused
+      apts[0].y = 0;
+
+      emr.iType = EMR_POLYLINE16;
+      // The (cpts-1) below is to account for apts, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYLINE16 ) + sizeof( POINT16 ) * (cpts-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
     /*!
      * Constructor with POINTs.
      * \param bounds overall bounding box of polyline.
@@ -3382,16 +3767,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      Polyline16( dc, lpoints, cpts );
+      polyline16( dc, lpoints, cpts );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3437,6 +3831,27 @@ namespace EMF {
 
       rclBounds = *bounds;
     }
+    /*!
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polygon.
+     * \param points array of polygon vertices.
+     * \param n number of vertices in points.
+     */
+    EMRPOLYGON ( const RECTL* bounds, std::unique_ptr<POINTL[]> points, INT n )
+    {
+      cptl = n;
+      aptl[0].x = 0;		// Really unused
+      aptl[0].y = 0;
+
+      emr.iType = EMR_POLYGON;
+      // The (cptl-1) below is to account for aptl, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYGON ) + sizeof( POINTL ) * (cptl-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
     /*!
      * Construct a Polygon record from the input stream.
      * \param ds Metafile datastream.
@@ -3477,16 +3892,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      Polygon( dc, (POINT*)lpoints, cptl );
+      polygon( dc, (POINT*)lpoints, cptl );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3532,6 +3956,27 @@ namespace EMF {
 
       rclBounds = *bounds;
     }
+    /*!
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polygon.
+     * \param points array of polygon vertices.
+     * \param n number of vertices in points.
+     */
+    EMRPOLYGON16 ( const RECTL* bounds, std::unique_ptr<POINT16[]> points, INT n )
+    {
+      cpts = n;
+      apts[0].x = 0;		// Really unused
+      apts[0].y = 0;
+
+      emr.iType = EMR_POLYGON16;
+      // The (cpts-1) below is to account for apts, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYGON16 ) + sizeof( POINT16 ) * (cpts-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
     /*!
      * Additional constructor which takes a POINT16 array.
      * \param bounds overall bounding box of polygon.
@@ -3597,16 +4042,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      Polygon16( dc, lpoints, cpts );
+      polygon16( dc, lpoints, cpts );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -3733,20 +4187,21 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      // According to the wine windef.h header, POINT and POINTL are equivalent
-      // (but DWORD and INT are not)
-      std::vector<INT> countsv( lcounts, lcounts + nPolys );
-
-      PolyPolygon( dc, (POINT*)lpoints, countsv.data(), nPolys );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -3942,20 +4397,21 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN | USES_BRUSH;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      // According to the wine windef.h header, POINT and POINTL are equivalent
-      // (but DWORD and INT are not)
-      std::vector<INT> counts( lcounts, lcounts + nPolys );
-
-      PolyPolygon16( dc, lpoints, counts.data(), nPolys );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -4027,12 +4483,33 @@ namespace EMF {
       rclBounds = *bounds;
     }
     /*!
-     * Construct a PolyBezier record from the input stream.
-     * \param ds Metafile datastream.
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polybezier curve.
+     * \param points array of polybezier vertices.
+     * \param n number of vertices in points.
      */
-    EMRPOLYBEZIER ( DATASTREAM& ds )
+    EMRPOLYBEZIER ( const RECTL* bounds, std::unique_ptr<POINTL[]> points, INT n )
     {
-      ds >> emr >> rclBounds >> cptl;
+      cptl = n;
+      aptl[0].x = 0;		// Really unused
+      aptl[0].y = 0;
+
+      emr.iType = EMR_POLYBEZIER;
+      // The (cptl-1) below is to account for aptl, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYBEZIER ) + sizeof( POINTL ) * (cptl-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
+    /*!
+     * Construct a PolyBezier record from the input stream.
+     * \param ds Metafile datastream.
+     */
+    EMRPOLYBEZIER ( DATASTREAM& ds )
+    {
+      ds >> emr >> rclBounds >> cptl;
 
       if ( emr.nSize - (sizeof( ::EMRPOLYBEZIER ) - sizeof(POINTL)) <
            sizeof( POINTL ) * cptl ) {
@@ -4066,16 +4543,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolyBezier( dc, (POINT*)lpoints, cptl );
+      polyBezier( dc, (POINT*)lpoints, cptl );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4121,6 +4607,27 @@ namespace EMF {
 
       rclBounds = *bounds;
     }
+    /*!
+     * Constructor which takes over an array of points already converted
+     * to the record's format (so the points aren't copied again).
+     * \param bounds overall bounding box of polybezier curve.
+     * \param points array of polybezier vertices.
+     * \param n number of vertices in points.
+     */
+    EMRPOLYBEZIER16 ( const RECTL* bounds, std::unique_ptr<POINT16[]> points, INT n )
+    {
+      cpts = n;
+      apts[0].x = 0;		// Really unused
+      apts[0].y = 0;
+
+      emr.iType = EMR_POLYBEZIER16;
+      // The (cpts-1) below is to account for apts, which isn't written out
+      emr.nSize = sizeof( ::EMRPOLYBEZIER16 ) + sizeof( POINT16 ) * (cpts-1);
+
+      lpoints = points.release();
+
+      rclBounds = *bounds;
+    }
     /*!
      * Convenience constructor with POINTs.
      * \param bounds overall bounding box of polybezier curve.
@@ -4186,16 +4693,25 @@ namespace EMF {
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the figure for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_PEN;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolyBezier16( dc, lpoints, cpts );
+      polyBezier16( dc, lpoints, cpts );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4286,11 +4802,12 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolyBezierTo( dc, (POINT*)lpoints, cptl );
+      polyBezierTo( dc, (POINT*)lpoints, cptl );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4406,11 +4923,12 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolyBezierTo16( dc, lpoints, cpts );
+      polyBezierTo16( dc, lpoints, cpts );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4501,11 +5019,12 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolylineTo( dc, (POINT*)lpoints, cptl );
+      polylineTo( dc, (POINT*)lpoints, cptl );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4621,11 +5140,12 @@ namespace EMF {
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       // According to the wine windef.h header, POINT and POINTL are equivalent
-      PolylineTo16( dc, lpoints, cpts );
+      polylineTo16( dc, lpoints, cpts );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -4786,7 +5306,8 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       RECT rect;
@@ -4795,7 +5316,7 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       rect.right = emrtext.rcl.right;
       rect.bottom = emrtext.rcl.bottom;
 
-      ExtTextOutA( dc, emrtext.ptlReference.x, emrtext.ptlReference.y,
+      extTextOutA( dc, emrtext.ptlReference.x, emrtext.ptlReference.y,
 		   emrtext.fOptions, &rect, string_a, emrtext.nChars,
 		   dx_i );
     }
@@ -5034,7 +5555,8 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
       RECT rect;
@@ -5043,7 +5565,7 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       rect.right = emrtext.rcl.right;
       rect.bottom = emrtext.rcl.bottom;
 
-      ExtTextOutW( dc, emrtext.ptlReference.x, emrtext.ptlReference.y,
+      extTextOutW( dc, emrtext.ptlReference.x, emrtext.ptlReference.y,
 		   emrtext.fOptions, &rect, string_a, emrtext.nChars,
 		   dx_i );
     }
@@ -5215,15 +5737,25 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the pixel for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds.left = bounds.right = ptlPixel.x;
+      bounds.top = bounds.bottom = ptlPixel.y;
+      return DRAWS;
+    }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetPixel( dc, ptlPixel.x, ptlPixel.y, crColor );
+      setPixel( dc, ptlPixel.x, ptlPixel.y, crColor );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5238,6 +5770,532 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
 #endif /* ENABLE_EDITING */
   };
 
+  //! A device independent bitmap, as carried by the bitmap records.
+  /*!
+   * The header and color table are always copied. The bits are normally
+   * copied too, but with EMF_OPTION_BORROW_BITS they are read from the
+   * caller's buffer until the metafile is closed (see adopt()). Identical
+   * bitmaps drawn into one metafile share a single DIB.
+   */
+  struct DIB {
+    std::vector<BYTE> bmi;	//!< The BITMAPINFO header and color table.
+    const BYTE* bits;		//!< The bitmap bits.
+    DWORD cb_bits;		//!< Size of the bits in bytes.
+    std::unique_ptr<BYTE[]> storage; //!< Memory holding the bits, unless borrowed.
+    /*!
+     * \param info bitmap header and color table.
+     * \param cb_info size of info in bytes.
+     * \param data bitmap bits.
+     * \param cb_data size of data in bytes.
+     * \param borrow if true, refer to data rather than copy it.
+     */
+    DIB ( const void* info, DWORD cb_info, const void* data, DWORD cb_data,
+	  bool borrow )
+      : bmi( (const BYTE*)info, (const BYTE*)info + cb_info ),
+	bits( (const BYTE*)data ), cb_bits( cb_data )
+    {
+      if ( !borrow ) adopt();
+    }
+    /*!
+     * Take over a buffer read from a metafile.
+     * \param buffer the memory holding the bits.
+     * \param info bitmap header and color table.
+     * \param cb_info size of info in bytes.
+     * \param data bitmap bits (within buffer).
+     * \param cb_data size of data in bytes.
+     */
+    DIB ( std::unique_ptr<BYTE[]> buffer, const BYTE* info, DWORD cb_info,
+	  const BYTE* data, DWORD cb_data )
+      : bmi( info, info + cb_info ), bits( data ), cb_bits( cb_data ),
+	storage( std::move( buffer ) )
+    {}
+    /*!
+     * Read the bitmap which follows the fixed part of a record, checking
+     * that the offsets and sizes in the record are consistent.
+     * \param ds Metafile datastream, positioned just after the fixed part.
+     * \param emr the record's header.
+     * \param fixed size of the fixed part of the record.
+     * \param off_bmi offset of the bitmap header from the start of the record.
+     * \param cb_bmi size of the bitmap header and color table.
+     * \param off_bits offset of the bits from the start of the record.
+     * \param cb_bits size of the bits.
+     */
+    static std::shared_ptr<DIB> read ( DATASTREAM& ds, const ::EMR& emr,
+				       DWORD fixed, DWORD off_bmi, DWORD cb_bmi,
+				       DWORD off_bits, DWORD cb_bits )
+    {
+      if ( emr.nSize < fixed ||
+	   ( cb_bmi > 0 && ( off_bmi < fixed || off_bmi > emr.nSize ||
+			     cb_bmi > emr.nSize - off_bmi ||
+			     cb_bmi < sizeof( BITMAPINFOHEADER ) ) ) ||
+	   ( cb_bits > 0 && ( off_bits < fixed || off_bits > emr.nSize ||
+			      cb_bits > emr.nSize - off_bits ) ) ) {
+	throw std::runtime_error( "Invalid bitmap specification" );
+      }
+
+      DWORD n = emr.nSize - fixed;
+      std::unique_ptr<BYTE[]> buffer( new BYTE[n] );
+      BYTEARRAY bytes( buffer.get(), n );
+
+      ds >> bytes;
+
+      const BYTE* base = buffer.get() - fixed;
+
+      return std::make_shared<DIB>( std::move( buffer ), base + off_bmi,
+				    cb_bmi, base + off_bits, cb_bits );
+    }
+    /*!
+     * \return the bitmap header and color table (null if there is none).
+     */
+    const BITMAPINFO* info ( void ) const
+    {
+      return bmi.empty() ? 0 : reinterpret_cast<const BITMAPINFO*>( bmi.data() );
+    }
+    /*!
+     * \return the space the bitmap takes up in a record.
+     */
+    DWORD size ( void ) const
+    {
+      return ROUND_TO_LONG( bmi.size() ) + ROUND_TO_LONG( cb_bits );
+    }
+    /*!
+     * Copy the bits, if they are still in the caller's buffer.
+     */
+    void adopt ( void )
+    {
+      if ( storage || cb_bits == 0 ) return;
+
+      storage.reset( new BYTE[cb_bits] );
+      memcpy( storage.get(), bits, cb_bits );
+      bits = storage.get();
+    }
+    /*!
+     * \param info bitmap header and color table.
+     * \param cb_info size of info in bytes.
+     * \param data bitmap bits.
+     * \param cb_data size of data in bytes.
+     * \return true if this is the same bitmap.
+     */
+    bool same ( const void* info, DWORD cb_info, const void* data,
+		DWORD cb_data ) const
+    {
+      return cb_info == bmi.size() && cb_data == cb_bits &&
+	( cb_info == 0 || memcmp( info, bmi.data(), cb_info ) == 0 ) &&
+	( cb_data == 0 || memcmp( data, bits, cb_data ) == 0 );
+    }
+    /*!
+     * Write the header and the bits, each padded out to a multiple of 4
+     * bytes, straight from where they are kept.
+     * \param ds Metafile datastream.
+     */
+    void serialize ( DATASTREAM& ds ) const
+    {
+      ds << BYTEARRAY( const_cast<BYTE*>( bmi.data() ), bmi.size() )
+	 << PADDING( ROUND_TO_LONG( bmi.size() ) - bmi.size() )
+	 << BYTEARRAY( const_cast<BYTE*>( bits ), cb_bits )
+	 << PADDING( ROUND_TO_LONG( cb_bits ) - cb_bits );
+    }
+  };
+
+  //! EMF StretchDIBits
+  /*!
+   * Copy a device independent bitmap into a rectangle, stretching it as
+   * necessary.
+   */
+  class EMRSTRETCHDIBITS : public METARECORD, ::EMRSTRETCHDIBITS {
+    std::shared_ptr<DIB> dib;	//!< The bitmap.
+  public:
+    /*!
+     * \param bounds bounding rectangle of the destination.
+     * \param x_dest x position of destination rectangle.
+     * \param y_dest y position of destination rectangle.
+     * \param cx_dest width of destination rectangle.
+     * \param cy_dest height of destination rectangle.
+     * \param x_src x position of source rectangle in the bitmap.
+     * \param y_src y position of source rectangle in the bitmap.
+     * \param cx_src width of source rectangle.
+     * \param cy_src height of source rectangle.
+     * \param bitmap the bitmap.
+     * \param usage whether the color table holds RGB values or palette indices.
+     * \param rop raster operation.
+     */
+    EMRSTRETCHDIBITS ( const RECTL* bounds, INT x_dest, INT y_dest,
+		       INT cx_dest, INT cy_dest, INT x_src, INT y_src,
+		       INT cx_src, INT cy_src, std::shared_ptr<DIB> bitmap,
+		       UINT usage, DWORD rop )
+      : dib( std::move( bitmap ) )
+    {
+      emr.iType = EMR_STRETCHDIBITS;
+
+      rclBounds = *bounds;
+      xDest = x_dest;
+      yDest = y_dest;
+      xSrc = x_src;
+      ySrc = y_src;
+      cxSrc = cx_src;
+      cySrc = cy_src;
+      iUsageSrc = usage;
+      dwRop = rop;
+      cxDest = cx_dest;
+      cyDest = cy_dest;
+
+      layout();
+    }
+    /*!
+     * Construct a StretchDIBits record from the input stream.
+     * \param ds Metafile datastream.
+     */
+    EMRSTRETCHDIBITS ( DATASTREAM& ds )
+    {
+      ds >> emr >> rclBounds >> xDest >> yDest >> xSrc >> ySrc >> cxSrc >> cySrc
+	 >> offBmiSrc >> cbBmiSrc >> offBitsSrc >> cbBitsSrc >> iUsageSrc
+	 >> dwRop >> cxDest >> cyDest;
+
+      dib = DIB::read( ds, emr, sizeof( ::EMRSTRETCHDIBITS ), offBmiSrc,
+		       cbBmiSrc, offBitsSrc, cbBitsSrc );
+
+      layout();
+    }
+    /*!
+     * Set the offsets and sizes for the bitmap packed right after the
+     * fixed part of the record.
+     */
+    void layout ( void )
+    {
+      offBmiSrc = sizeof( ::EMRSTRETCHDIBITS );
+      cbBmiSrc = dib->bmi.size();
+      offBitsSrc = offBmiSrc + ROUND_TO_LONG( cbBmiSrc );
+      cbBitsSrc = dib->cb_bits;
+      emr.nSize = sizeof( ::EMRSTRETCHDIBITS ) + dib->size();
+    }
+    /*!
+     * \param ds Metafile datastream.
+     */
+    bool serialize ( DATASTREAM ds )
+    {
+      ds << emr << rclBounds << xDest << yDest << xSrc << ySrc << cxSrc << cySrc
+	 << offBmiSrc << cbBmiSrc << offBitsSrc << cbBitsSrc << iUsageSrc
+	 << dwRop << cxDest << cyDest;
+      dib->serialize( ds );
+      return true;
+    }
+    /*!
+     * Internally computed size of this record.
+     */
+    int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the bitmap for reordering. (The raster operation may
+     * involve the brush.)
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS | USES_BRUSH;
+    }
+    /*!
+     * Execute this record in the context of the given device context.
+     * \param source the device context from which this record is taken.
+     * \param dc device context for execute.
+     */
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
+#ifdef ENABLE_EDITING
+    /*!
+     * Print it to stdout.
+     */
+    void edit ( void ) const
+    {
+#if defined(__LP64__)
+      const char* FMT0 = "\t%s\t\t: %d\n";
+      const char* FMT1 = "\t%s\t\t: 0x%x\n";
+#else
+      const char* FMT0 = "\t%s\t\t: %ld\n";
+      const char* FMT1 = "\t%s\t\t: 0x%lx\n";
+#endif /* __x86_64__ */
+      printf( "*STRETCHDIBITS*\n" );
+      edit_rectl( "rclBounds", rclBounds );
+      printf( FMT0, "xDest", xDest );
+      printf( FMT0, "yDest", yDest );
+      printf( FMT0, "xSrc", xSrc );
+      printf( FMT0, "ySrc", ySrc );
+      printf( FMT0, "cxSrc", cxSrc );
+      printf( FMT0, "cySrc", cySrc );
+      printf( FMT0, "offBmiSrc", offBmiSrc );
+      printf( FMT0, "cbBmiSrc", cbBmiSrc );
+      printf( FMT0, "offBitsSrc", offBitsSrc );
+      printf( FMT0, "cbBitsSrc", cbBitsSrc );
+      printf( FMT0, "iUsageSrc", iUsageSrc );
+      printf( FMT1, "dwRop\t", dwRop );
+      printf( FMT0, "cxDest", cxDest );
+      printf( FMT0, "cyDest", cyDest );
+    }
+#endif /* ENABLE_EDITING */
+  };
+
+  //! EMF SetDIBitsToDevice
+  /*!
+   * Copy some scan lines of a device independent bitmap into a rectangle,
+   * without stretching.
+   */
+  class EMRSETDIBITSTODEVICE : public METARECORD, ::EMRSETDIBITSTODEIVCE {
+    std::shared_ptr<DIB> dib;	//!< The bitmap.
+  public:
+    /*!
+     * \param bounds bounding rectangle of the destination.
+     * \param x_dest x position of destination rectangle.
+     * \param y_dest y position of destination rectangle.
+     * \param x_src x position of source rectangle in the bitmap.
+     * \param y_src y position of source rectangle in the bitmap.
+     * \param cx_src width of source (and destination) rectangle.
+     * \param cy_src height of source (and destination) rectangle.
+     * \param start_scan first scan line in the bits.
+     * \param scans number of scan lines in the bits.
+     * \param bitmap the bitmap.
+     * \param usage whether the color table holds RGB values or palette indices.
+     */
+    EMRSETDIBITSTODEVICE ( const RECTL* bounds, INT x_dest, INT y_dest,
+			   INT x_src, INT y_src, INT cx_src, INT cy_src,
+			   UINT start_scan, UINT scans,
+			   std::shared_ptr<DIB> bitmap, UINT usage )
+      : dib( std::move( bitmap ) )
+    {
+      emr.iType = EMR_SETDIBITSTODEVICE;
+
+      rclBounds = *bounds;
+      xDest = x_dest;
+      yDest = y_dest;
+      xSrc = x_src;
+      ySrc = y_src;
+      cxSrc = cx_src;
+      cySrc = cy_src;
+      iUsageSrc = usage;
+      iStartScan = start_scan;
+      cScans = scans;
+
+      layout();
+    }
+    /*!
+     * Construct a SetDIBitsToDevice record from the input stream.
+     * \param ds Metafile datastream.
+     */
+    EMRSETDIBITSTODEVICE ( DATASTREAM& ds )
+    {
+      ds >> emr >> rclBounds >> xDest >> yDest >> xSrc >> ySrc >> cxSrc >> cySrc
+	 >> offBmiSrc >> cbBmiSrc >> offBitsSrc >> cbBitsSrc >> iUsageSrc
+	 >> iStartScan >> cScans;
+
+      dib = DIB::read( ds, emr, sizeof( ::EMRSETDIBITSTODEIVCE ), offBmiSrc,
+		       cbBmiSrc, offBitsSrc, cbBitsSrc );
+
+      layout();
+    }
+    /*!
+     * Set the offsets and sizes for the bitmap packed right after the
+     * fixed part of the record.
+     */
+    void layout ( void )
+    {
+      offBmiSrc = sizeof( ::EMRSETDIBITSTODEIVCE );
+      cbBmiSrc = dib->bmi.size();
+      offBitsSrc = offBmiSrc + ROUND_TO_LONG( cbBmiSrc );
+      cbBitsSrc = dib->cb_bits;
+      emr.nSize = sizeof( ::EMRSETDIBITSTODEIVCE ) + dib->size();
+    }
+    /*!
+     * \param ds Metafile datastream.
+     */
+    bool serialize ( DATASTREAM ds )
+    {
+      ds << emr << rclBounds << xDest << yDest << xSrc << ySrc << cxSrc << cySrc
+	 << offBmiSrc << cbBmiSrc << offBitsSrc << cbBitsSrc << iUsageSrc
+	 << iStartScan << cScans;
+      dib->serialize( ds );
+      return true;
+    }
+    /*!
+     * Internally computed size of this record.
+     */
+    int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the bitmap for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS;
+    }
+    /*!
+     * Execute this record in the context of the given device context.
+     * \param source the device context from which this record is taken.
+     * \param dc device context for execute.
+     */
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
+#ifdef ENABLE_EDITING
+    /*!
+     * Print it to stdout.
+     */
+    void edit ( void ) const
+    {
+#if defined(__LP64__)
+      const char* FMT0 = "\t%s\t\t: %d\n";
+#else
+      const char* FMT0 = "\t%s\t\t: %ld\n";
+#endif /* __x86_64__ */
+      printf( "*SETDIBITSTODEVICE*\n" );
+      edit_rectl( "rclBounds", rclBounds );
+      printf( FMT0, "xDest", xDest );
+      printf( FMT0, "yDest", yDest );
+      printf( FMT0, "xSrc", xSrc );
+      printf( FMT0, "ySrc", ySrc );
+      printf( FMT0, "cxSrc", cxSrc );
+      printf( FMT0, "cySrc", cySrc );
+      printf( FMT0, "offBmiSrc", offBmiSrc );
+      printf( FMT0, "cbBmiSrc", cbBmiSrc );
+      printf( FMT0, "offBitsSrc", offBitsSrc );
+      printf( FMT0, "cbBitsSrc", cbBitsSrc );
+      printf( FMT0, "iUsageSrc", iUsageSrc );
+      printf( FMT0, "iStartScan", iStartScan );
+      printf( FMT0, "cScans", cScans );
+    }
+#endif /* ENABLE_EDITING */
+  };
+
+  //! EMF GradientFill
+  /*!
+   * Fill rectangles or triangles with colors shaded between those of their
+   * vertices.
+   */
+  class EMRGRADIENTFILL : public METARECORD, ::EMRGRADIENTFILL {
+    std::vector<TRIVERTEX> vertices; //!< The vertices (Ver[] is unused).
+    std::vector<DWORD> mesh;	//!< 2 (rectangle) or 3 (triangle) vertex indices each.
+    /*!
+     * \return the number of vertex indices per rectangle or triangle.
+     */
+    DWORD perMesh ( void ) const
+    {
+      return ulMode == GRADIENT_FILL_TRIANGLE ? 3 : 2;
+    }
+  public:
+    /*!
+     * \param bounds bounding rectangle of the vertices.
+     * \param vertex array of vertices.
+     * \param n_vertex number of vertices.
+     * \param meshes array of GRADIENT_RECTs or GRADIENT_TRIANGLEs.
+     * \param n_mesh number of rectangles or triangles.
+     * \param mode GRADIENT_FILL_RECT_H, GRADIENT_FILL_RECT_V or
+     * GRADIENT_FILL_TRIANGLE.
+     */
+    EMRGRADIENTFILL ( const RECTL* bounds, const TRIVERTEX* vertex, ULONG n_vertex,
+		      const void* meshes, ULONG n_mesh, ULONG mode )
+      : vertices( vertex, vertex + n_vertex )
+    {
+      emr.iType = EMR_GRADIENTFILL;
+
+      rclBounds = *bounds;
+      nVer = n_vertex;
+      nTri = n_mesh;
+      ulMode = mode;
+
+      const ULONG* indices = static_cast<const ULONG*>( meshes );
+      mesh.assign( indices, indices + perMesh() * nTri );
+
+      emr.nSize = sizeof( ::EMRGRADIENTFILL ) - sizeof( TRIVERTEX )
+	+ nVer * sizeof( TRIVERTEX ) + mesh.size() * sizeof( DWORD );
+    }
+    /*!
+     * Construct a GradientFill record from the input stream.
+     * \param ds Metafile datastream.
+     */
+    EMRGRADIENTFILL ( DATASTREAM& ds )
+    {
+      ds >> emr >> rclBounds >> nVer >> nTri >> ulMode;
+
+      const DWORD fixed = sizeof( ::EMRGRADIENTFILL ) - sizeof( TRIVERTEX );
+
+      if ( ulMode > GRADIENT_FILL_TRIANGLE || emr.nSize < fixed ||
+	   (unsigned long long)nVer * sizeof( TRIVERTEX ) +
+	   (unsigned long long)nTri * perMesh() * sizeof( DWORD ) >
+	   emr.nSize - fixed ) {
+	throw std::runtime_error( "Invalid gradient specification" );
+      }
+
+      vertices.resize( nVer );
+      for ( auto& vertex : vertices )
+	ds >> vertex;
+
+      mesh.resize( perMesh() * nTri );
+      DWORDARRAY indices( mesh.data(), mesh.size() );
+      ds >> indices;
+
+      for ( DWORD index : mesh )
+	if ( index >= nVer )
+	  throw std::runtime_error( "Invalid gradient vertex index" );
+    }
+    /*!
+     * \param ds Metafile datastream.
+     */
+    bool serialize ( DATASTREAM ds )
+    {
+      ds << emr << rclBounds << nVer << nTri << ulMode;
+      for ( const auto& vertex : vertices )
+	ds << vertex;
+      ds << DWORDARRAY( mesh.data(), mesh.size() );
+      return true;
+    }
+    /*!
+     * Internally computed size of this record.
+     */
+    int size ( void ) const { return emr.nSize; }
+    /*!
+     * Describe the gradient for reordering.
+     */
+    DWORD draws ( RECTL& bounds ) const
+    {
+      bounds = rclBounds;
+      return DRAWS;
+    }
+    /*!
+     * Execute this record in the context of the given device context.
+     * \param source the device context from which this record is taken.
+     * \param dc device context for execute.
+     */
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
+    {
+      EMF_UNUSED(source);
+      gradientFill( dc, const_cast<TRIVERTEX*>( vertices.data() ), nVer,
+		    const_cast<DWORD*>( mesh.data() ), nTri, ulMode );
+    }
+#ifdef ENABLE_EDITING
+    /*!
+     * Print it to stdout.
+     */
+    void edit ( void ) const
+    {
+#if defined(__LP64__)
+      const char* FMT0 = "\t%s\t\t: %d\n";
+      const char* FMT1 = "\tVer[%d]\t\t: (%d, %d) RGBA %04x %04x %04x %04x\n";
+      const char* FMT2 = "\tmesh[%d]\t\t: %d\n";
+#else
+      const char* FMT0 = "\t%s\t\t: %ld\n";
+      const char* FMT1 = "\tVer[%ld]\t\t: (%ld, %ld) RGBA %04x %04x %04x %04x\n";
+      const char* FMT2 = "\tmesh[%ld]\t\t: %ld\n";
+#endif /* __x86_64__ */
+      printf( "*GRADIENTFILL*\n" );
+      edit_rectl( "rclBounds", rclBounds );
+      printf( FMT0, "nVer\t", nVer );
+      printf( FMT0, "nTri\t", nTri );
+      printf( FMT0, "ulMode\t", ulMode );
+      for ( DWORD i = 0; i < nVer; i++ )
+	printf( FMT1, i, vertices[i].x, vertices[i].y, vertices[i].Red,
+		vertices[i].Green, vertices[i].Blue, vertices[i].Alpha );
+      for ( DWORD i = 0; i < perMesh() * nTri; i++ )
+	printf( FMT2, i, mesh[i] );
+    }
+#endif /* ENABLE_EDITING */
+  };
+
   class PEN;
   class EXTPEN;
   class BRUSH;
@@ -5273,12 +6331,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihPen; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -5331,12 +6394,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihPen; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -5405,12 +6473,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihBrush; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -5465,12 +6538,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \return the size of the record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihFont; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -5598,12 +6676,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * The metafile handle of the object.
+     */
+    DWORD* objectHandle ( void ) { return &ihPal; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const;
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -5655,10 +6738,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      FillPath( dc );
+      fillPath( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5711,10 +6795,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      StrokePath( dc );
+      strokePath( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5767,10 +6852,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      StrokeAndFillPath( dc );
+      strokeAndFillPath( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5822,10 +6908,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      BeginPath( dc );
+      beginPath( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5876,10 +6963,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      EndPath( dc );
+      endPath( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5930,10 +7018,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      CloseFigure( dc );
+      closeFigure( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -5985,11 +7074,8 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      SaveDC( dc );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -6035,16 +7121,18 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * Internally computed size of this record.
      */
     int size ( void ) const { return emr.nSize; }
+    /*!
+     * Which saved state is restored: if negative, relative to the current
+     * one; otherwise, the value SaveDC returned.
+     */
+    INT relative ( void ) const { return iRelative; }
     /*!
      * Execute this record in the context of the given device context.
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
-    {
-      EMF_UNUSED(source);
-      RestoreDC( dc, iRelative );
-    }
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const;
 #ifdef ENABLE_EDITING
     /*!
      * Print it to stdout.
@@ -6100,10 +7188,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetMetaRgn( dc );
+      setMetaRgn( dc );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -6146,6 +7235,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       contexts[dc] = emf_handle;
       return new EMRCREATEPEN( this, emf_handle );
     }
+    /*!
+     * Pens are identical if their LOGPENs are.
+     */
+    std::string key ( void ) const
+    {
+      std::string k( 1, 'P' );
+      appendKey( k, lopnStyle );
+      appendKey( k, lopnWidth );
+      appendKey( k, lopnColor );
+      return k;
+    }
   };
 
   //! Extended Graphics Pen
@@ -6182,6 +7282,20 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       contexts[dc] = emf_handle;
       return new EMREXTCREATEPEN( this, emf_handle );
     }
+    /*!
+     * Extended pens are identical if their EXTLOGPENs are. (We don't
+     * record any style entries.)
+     */
+    std::string key ( void ) const
+    {
+      std::string k( 1, 'X' );
+      appendKey( k, elpPenStyle );
+      appendKey( k, elpWidth );
+      appendKey( k, elpBrushStyle );
+      appendKey( k, elpColor );
+      appendKey( k, elpHatch );
+      return k;
+    }
   };
 
   //! Graphics Brush
@@ -6214,6 +7328,17 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       contexts[dc] = emf_handle;
       return new EMRCREATEBRUSHINDIRECT( this, emf_handle );
     }
+    /*!
+     * Brushes are identical if their LOGBRUSHes are.
+     */
+    std::string key ( void ) const
+    {
+      std::string k( 1, 'B' );
+      appendKey( k, lbStyle );
+      appendKey( k, lbColor );
+      appendKey( k, lbHatch );
+      return k;
+    }
   };
 
   //! Graphics Font
@@ -6255,6 +7380,24 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       contexts[dc] = emf_handle;
       return new EMREXTCREATEFONTINDIRECTW( this, emf_handle );
     }
+    /*!
+     * Fonts are identical if their EXTLOGFONTWs are.
+     */
+    std::string key ( void ) const
+    {
+      std::string k( 1, 'F' );
+      appendKey( k, elfLogFont );
+      appendKey( k, elfFullName );
+      appendKey( k, elfStyle );
+      appendKey( k, elfVersion );
+      appendKey( k, elfStyleSize );
+      appendKey( k, elfMatch );
+      appendKey( k, elfReserved );
+      appendKey( k, elfVendorId );
+      appendKey( k, elfCulture );
+      appendKey( k, elfPanose );
+      return k;
+    }
   };
 
   //! Graphics Palette
@@ -6333,10 +7476,11 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * \param source the device context from which this record is taken.
      * \param dc device context for execute.
      */
-    void execute ( METAFILEDEVICECONTEXT* source, HDC dc ) const
+    void execute ( METAFILEDEVICECONTEXT* source,
+		   METAFILEDEVICECONTEXT* dc ) const
     {
       EMF_UNUSED(source);
-      SetMiterLimit( dc, eMiterLimit, 0 );
+      setMiterLimit( dc, eMiterLimit, 0 );
     }
 #ifdef ENABLE_EDITING
     /*!
@@ -6431,6 +7575,7 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       max_device_point = viewport_org;
 
       pen = (PEN*)globalObjects.find( BLACK_PEN | ENHMETA_STOCK_OBJECT );
+      extpen = 0;
       brush = (BRUSH*)globalObjects.find( BLACK_BRUSH | ENHMETA_STOCK_OBJECT );
       font = (FONT*)globalObjects.find( DEVICE_DEFAULT_FONT | ENHMETA_STOCK_OBJECT);
       palette = (PALETTE*)globalObjects.find( DEFAULT_PALETTE|ENHMETA_STOCK_OBJECT);
@@ -6442,6 +7587,27 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
       polyfill_mode = ALTERNATE;
       map_mode = MM_TEXT;
       miter_limit = 10.f;
+      world_transform = false;
+      XFORM identity = { 1, 0, 0, 1, 0, 0 };
+      world = identity;
+      world_baked = false;
+      position_stale = false;
+      position_unknown = false;
+      in_path = false;
+      play_framed = false;
+      play_level = 0;
+      play_caching = false;
+      play_position = 0;
+
+      options = 0;
+      known_state = 0;
+      memset( &stats, 0, sizeof stats );
+
+      idle_interned = 0;
+      intern_clock = 0;
+
+      simplify_method = EMF_SIMPLIFY_NONE;
+      simplify_tolerance = 0.f;
 
       handle = globalObjects.add( this );
     }
@@ -6464,6 +7630,15 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      * All of the metafile records are stored in memory.
      */
     std::vector< EMF::METARECORD* > records;
+    /*!
+     * If the records are decoded as they are used, where from.
+     */
+    std::unique_ptr< RECORDSOURCE > record_source;
+    /*!
+     * What and where each record is; built when it is first asked for
+     * (or read from a cache next to the file).
+     */
+    std::vector< ::EMFRECORDINFO > record_index;
 
     // Keep a small set of graphics state information
     SIZEL resolution;		//!< The resolution in DPI of the *reference* DC.
@@ -6476,6 +7651,7 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
     POINT max_device_point;	//!< The rgt/btm-most painted point in device units.
     POINT point;		//!< The current point.
     PEN* pen;			//!< The current pen.
+    EXTPEN* extpen;		//!< The current extended pen (if not null, instead of pen).
     BRUSH* brush;		//!< The current brush.
     FONT* font;			//!< The current font.
     PALETTE* palette;		//!< The current palette.
@@ -6486,6 +7662,123 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
     INT polyfill_mode;		//!< The current polygon fill mode.
     INT map_mode;		//!< The current mapping mode.
     FLOAT miter_limit;          //!< The current miter length limit.
+    bool world_transform;	//!< Might a world transform other than the identity be in effect?
+    XFORM world;		//!< The world transform as set by the caller.
+    bool world_baked;		//!< Is world applied to the coordinates instead of written?
+    bool position_stale;	//!< Is the current position written under other coordinates?
+    bool position_unknown;	//!< Has text moved the current position by an unknown amount?
+    bool in_path;		//!< Is a path bracket open?
+    DWORD options;		//!< The optional writer optimizations in effect.
+    DWORD known_state;		//!< The state attributes actually written so far.
+    EMFSTATS stats;		//!< What the optional optimizations have done.
+
+    /*!
+     * The state attributes which may be tracked in known_state. An attribute
+     * is only "known" once a record setting it has been written to the
+     * metafile; until then, we can't assume anything about the playback
+     * device's state.
+     */
+    enum { STATE_TEXT_ALIGN	= 0x0001,
+	   STATE_TEXT_COLOR	= 0x0002,
+	   STATE_BK_COLOR	= 0x0004,
+	   STATE_BK_MODE	= 0x0008,
+	   STATE_POLYFILL_MODE	= 0x0010,
+	   STATE_MAP_MODE	= 0x0020,
+	   STATE_MITER_LIMIT	= 0x0040,
+	   STATE_PEN		= 0x0100,
+	   STATE_BRUSH		= 0x0200,
+	   STATE_FONT		= 0x0400,
+	   STATE_PALETTE	= 0x0800,
+	   STATE_OBJECTS	= 0x0f00 };
+
+    //! The graphics state pushed by SaveDC and popped by RestoreDC.
+    struct SAVEDSTATE {
+      SIZEL viewport_ext;	//!< The extent of the viewport.
+      POINT viewport_org;	//!< The origin of the viewport.
+      SIZEL window_ext;		//!< The extent of the window.
+      POINT window_org;		//!< The origin of the window.
+      POINT point;		//!< The current point.
+      PEN* pen;			//!< The current pen.
+      EXTPEN* extpen;		//!< The current extended pen.
+      BRUSH* brush;		//!< The current brush.
+      FONT* font;		//!< The current font.
+      PALETTE* palette;		//!< The current palette.
+      UINT text_alignment;	//!< The current text alignment.
+      COLORREF text_color;	//!< The current text foreground color.
+      COLORREF bk_color;	//!< The current background color.
+      INT bk_mode;		//!< The current background mode.
+      INT polyfill_mode;	//!< The current polygon fill mode.
+      INT map_mode;		//!< The current mapping mode.
+      FLOAT miter_limit;	//!< The current miter length limit.
+      bool world_transform;	//!< Might a world transform be in effect?
+      XFORM world;		//!< The world transform as set by the caller.
+      bool world_baked;		//!< Was world applied to the coordinates?
+      bool position_stale;	//!< Was the current position written under other coordinates?
+      bool position_unknown;	//!< Was the current position unknown?
+      DWORD known_state;	//!< The state attributes known at the time.
+    };
+    /*!
+     * The stack of states saved by SaveDC.
+     */
+    std::vector< SAVEDSTATE > saved_states;
+
+    //! A metafile object shared by identical graphics objects.
+    struct INTERNEDOBJECT {
+      HGDIOBJ emf_handle;	//!< The metafile handle of the shared object.
+      unsigned int references;	//!< The number of live objects using it.
+      unsigned long last_use;	//!< When it was last selected (for eviction).
+    };
+    /*!
+     * When EMF_OPTION_INTERN_OBJECTS is enabled, the metafile objects
+     * written so far, indexed by GRAPHICSOBJECT::key(). Entries which no
+     * longer have any references are kept around (up to MAX_IDLE_INTERNED
+     * of them) in case an identical object is selected again.
+     */
+    std::map< std::string, INTERNEDOBJECT > interned;
+    unsigned int idle_interned;	//!< Number of interned objects without references.
+    unsigned long intern_clock;	//!< Counts interned selections.
+
+    //! The number of unreferenced interned objects to hang on to.
+    enum { MAX_IDLE_INTERNED = 32 };
+
+    DWORD simplify_method;	//!< How to simplify polylines (EMF_SIMPLIFY_*).
+    FLOAT simplify_tolerance;	//!< The allowed simplification error in device units.
+
+    //! A SetPixel call held back by EMF_OPTION_COALESCE_PIXELS.
+    struct PIXEL {
+      LONG x;			//!< Horizontal position of the pixel.
+      LONG y;			//!< Vertical position of the pixel.
+      COLORREF color;		//!< Color of the pixel.
+    };
+    /*!
+     * With EMF_OPTION_COALESCE_PIXELS, SetPixel calls collect here until
+     * some other record is appended; then the dense clusters among them are
+     * written as bitmaps by flushPixels.
+     */
+    std::vector< PIXEL > pixels;
+    //! Pixels are clustered in tiles 2^PIXEL_TILE_SHIFT logical units square.
+    enum { PIXEL_TILE_SHIFT = 7, MAX_PENDING_PIXELS = 1 << 20 };
+
+    //! What EMF_OPTION_GROUP_OBJECTS knows about a record which may move.
+    struct ORDERING {
+      size_t record;		//!< The index of the record in records.
+      DWORD uses;		//!< Figure: DRAWS and USES_*; selection: its USES_* slot; creation: 0.
+      HGDIOBJ object;		//!< For a selection, the metafile handle selected.
+      RECTL bounds;		//!< For a figure, its device bounds, stroke included.
+    };
+    /*!
+     * With EMF_OPTION_GROUP_OBJECTS, the records which groupObjects may
+     * reorder, in order. Records not described here stay where they are.
+     */
+    std::vector< ORDERING > orderings;
+    //! How far ahead groupObjects looks for figures to move, and how many it may pass.
+    enum { GROUP_LOOKAHEAD = 4096, GROUP_MAX_PASSED = 256 };
+
+    /*!
+     * The bitmaps drawn so far, by content hash, so that identical ones
+     * can share a DIB.
+     */
+    std::multimap< unsigned long long, std::shared_ptr<DIB> > dibs;
 
     /*!
      * For compatibility, it appears that metafile handles are reused as
@@ -6495,11 +7788,71 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
     std::vector< bool > handles;
 
     /*!
-     * This map holds the *current* mapping between EMF handles and
-     * global object handles as a metafile is played back (with
-     * PlayEnhMetaFile).
+     * This table holds the *current* mapping between EMF handles and
+     * global objects as a metafile is played back (with PlayEnhMetaFile),
+     * indexed by EMF handle; 0 where there is none.
+     */
+    std::vector< GRAPHICSOBJECT* > emf_handles;
+    /*!
+     * Scratch space for records which have to convert their counts as they
+     * are played back, so that they needn't allocate it each time.
      */
-    std::map< HGDIOBJ, HGDIOBJ > emf_handles;
+    std::vector< INT > play_counts;
+    /*!
+     * While the metafile is played back into a frame (with PlayEnhMetaFile),
+     * the world transform which fits it into the frame, combined with the
+     * destination's own. The metafile's transforms are applied before it.
+     */
+    XFORM play_transform;
+    bool play_framed;		//!< Is the metafile being played into a frame?
+
+    //! The page mapping and world transform of a metafile played into a frame
+    //! (or merged with others).
+    struct PLAYMAPPING {
+      INT map_mode;		//!< The mapping mode.
+      POINTL window_org;	//!< The origin of the window.
+      SIZEL window_ext;		//!< The extent of the window.
+      POINTL viewport_org;	//!< The origin of the viewport.
+      SIZEL viewport_ext;	//!< The extent of the viewport.
+      XFORM world;		//!< The world transform.
+
+      bool setMapMode ( INT mode, const SIZEL& device, const SIZEL& millimeters );
+      bool setExtent ( bool window, LONG cx, LONG cy, const SIZEL& device,
+		       const SIZEL& millimeters );
+      XFORM page ( void ) const;
+    };
+    /*!
+     * In a frame, the metafile's own mapping records don't go to the
+     * destination (whose page maps the frame). They are kept here instead,
+     * and the destination's world transform maps the metafile's logical
+     * coordinates all the way into the frame.
+     */
+    PLAYMAPPING play_mapping;
+    std::vector< PLAYMAPPING > play_saved; //!< play_mapping saved by the metafile's SaveDCs.
+    INT play_level;		//!< The destination's SaveDC level under the metafile's.
+    /*!
+     * With the play cache on (SetEnhMetaFilePlayCache), the global objects
+     * which the Create* records made as the metafile was played back,
+     * indexed by record; 0 where there is none. They are kept, rather than
+     * deleted, so that the next playback selects them again.
+     */
+    std::vector< GRAPHICSOBJECT* > play_cache;
+    bool play_caching;		//!< Are objects kept from one playback to the next?
+    size_t play_position;	//!< The index of the record being played back.
+    //! A record of the metafile, ready to be played back.
+    struct PLAYOP {
+      METARECORDPLAY play;	//!< Plays the record back.
+      const METARECORD* record;	//!< The record.
+      bool measured;		//!< Are draws and bounds filled in yet?
+      DWORD draws;		//!< What the record draws (see draws()).
+      RECTL bounds;		//!< The logical bounds of what it draws.
+    };
+    /*!
+     * The records compiled for playback (by compilePlayback), one per
+     * record. Made the first time the metafile is played back and kept
+     * until its records change.
+     */
+    std::vector< PLAYOP > play_ops;
 
     /*!
      * Most graphics programs seem to want to handle the opening and closing
@@ -6566,10 +7919,14 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
      */
     void appendRecord ( METARECORD* record )
     {
+      if ( !pixels.empty() ) flushPixels();
+
       records.push_back( record );
 
       header->nBytes += record->size();
       header->nRecords++;
+
+      if ( options & EMF_OPTION_GROUP_OBJECTS ) describeRecord( record );
     }
     /*!
      * Add this record to the metafile.
@@ -6582,7 +7939,96 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
 
       header->nBytes += record->size();
       header->nRecords++;
+
+      // Object creations can move ahead of the figures around them
+      if ( options & EMF_OPTION_GROUP_OBJECTS ) {
+	ORDERING creation = { records.size() - 1, 0, 0, { 0, 0, 0, 0 } };
+	orderings.push_back( creation );
+      }
+    }
+    /*!
+     * \param ih a metafile object handle.
+     * \return the global object it stands for as the metafile is played
+     * back; 0 if there is none.
+     */
+    GRAPHICSOBJECT* playedObject ( DWORD ih ) const
+    {
+      return ih < emf_handles.size() ? emf_handles[ih] : 0;
+    }
+    /*!
+     * Record the global object which a metafile object handle stands for as
+     * the metafile is played back.
+     * \param ih a metafile object handle.
+     * \param object the global object; 0 for none.
+     */
+    void setPlayedObject ( DWORD ih, GRAPHICSOBJECT* object )
+    {
+      if ( ih < emf_handles.size() ) emf_handles[ih] = object;
     }
+    /*!
+     * \param ih a metafile object handle.
+     * \return true if the handle fits in the table sized for the metafile
+     * being played back.
+     */
+    bool playable ( DWORD ih ) const
+    {
+      return ih < emf_handles.size();
+    }
+    /*!
+     * The header's nHandles comes from the file, so it is only believed as
+     * far as the records could use: each handle needs a record to create
+     * it, and slot 0 is reserved.
+     * \return the size of the handle table for playing back this metafile.
+     */
+    size_t handleTableSize ( void ) const
+    {
+      return (std::min)( (size_t)header->nHandles, records.size() );
+    }
+    void playMapMode ( METAFILEDEVICECONTEXT* dc, INT mode );
+    void playExtent ( METAFILEDEVICECONTEXT* dc, bool window, LONG cx,
+		      LONG cy );
+    void playSave ( METAFILEDEVICECONTEXT* dc );
+    void playRestore ( METAFILEDEVICECONTEXT* dc, INT level );
+    void playMapping ( METAFILEDEVICECONTEXT* dc );
+    void compilePlayback ( void );
+    /*!
+     * \param counts polygon counts, as in a record.
+     * \param n the number of counts.
+     * \return the counts as INTs (in play_counts, unless they are already).
+     */
+    const INT* playCounts ( const DWORD* counts, DWORD n )
+    {
+      if ( sizeof(INT) == sizeof(DWORD) ) return reinterpret_cast<const INT*>( counts );
+      play_counts.assign( counts, counts + n );
+      return play_counts.data();
+    }
+    /*!
+     * \return the object which the record being played back created the
+     * last time, if it was kept; 0 otherwise.
+     */
+    GRAPHICSOBJECT* cachedObject ( void ) const
+    {
+      return play_caching && play_position < play_cache.size() ?
+	play_cache[play_position] : 0;
+    }
+    /*!
+     * Keep the object which the record being played back created, if the
+     * play cache is on.
+     * \param object the new global object.
+     */
+    void cacheObject ( GRAPHICSOBJECT* object )
+    {
+      if ( !play_caching ) return;
+      if ( play_position >= play_cache.size() )
+	play_cache.resize( (std::max)( records.size(), play_position + 1 ), 0 );
+      play_cache[play_position] = object;
+    }
+    /*!
+     * Delete the objects kept by the play cache. Not done by
+     * deleteMetafile: the destructor runs that while globalObjects is
+     * itself being torn down at exit.
+     */
+    void releasePlayCache ( void );
     /*!
      * Delete all the records from the metafile. This would seem to include deleting
      * the header record as well.
@@ -6593,7 +8039,434 @@ For pstoedit - this is "fixed" now by estimating dx in pstoedit
 	delete *r;
       }
       records.clear();
+      record_source.reset();
+      record_index.clear();
+      play_ops.clear();
+    }
+    /*!
+     * Push the current graphics state (as SaveDC does).
+     * \return the new depth of the saved state stack.
+     */
+    INT saveState ( void )
+    {
+      SAVEDSTATE state;
+      state.viewport_ext = viewport_ext;
+      state.viewport_org = viewport_org;
+      state.window_ext = window_ext;
+      state.window_org = window_org;
+      state.point = point;
+      state.pen = pen;
+      state.extpen = extpen;
+      state.brush = brush;
+      state.font = font;
+      state.palette = palette;
+      state.text_alignment = text_alignment;
+      state.text_color = text_color;
+      state.bk_color = bk_color;
+      state.bk_mode = bk_mode;
+      state.polyfill_mode = polyfill_mode;
+      state.map_mode = map_mode;
+      state.miter_limit = miter_limit;
+      state.world_transform = world_transform;
+      state.world = world;
+      state.world_baked = world_baked;
+      state.position_stale = position_stale;
+      state.position_unknown = position_unknown;
+      state.known_state = known_state;
+      saved_states.push_back( state );
+      return (INT)saved_states.size();
+    }
+    /*!
+     * Pop a saved graphics state (as RestoreDC does).
+     * \param n if negative, the state saved -n levels ago; if positive, the
+     * state saved at level n.
+     * \return false if there is no such saved state.
+     */
+    bool restoreState ( INT n )
+    {
+      INT depth = (INT)saved_states.size();
+      INT level = n < 0 ? depth + n + 1 : n;
+
+      if ( n == 0 || level < 1 || level > depth ) return false;
+
+      const SAVEDSTATE& state = saved_states[level-1];
+      viewport_ext = state.viewport_ext;
+      viewport_org = state.viewport_org;
+      window_ext = state.window_ext;
+      window_org = state.window_org;
+      point = state.point;
+      pen = state.pen;
+      extpen = state.extpen;
+      brush = state.brush;
+      font = state.font;
+      palette = state.palette;
+      text_alignment = state.text_alignment;
+      text_color = state.text_color;
+      bk_color = state.bk_color;
+      bk_mode = state.bk_mode;
+      polyfill_mode = state.polyfill_mode;
+      map_mode = state.map_mode;
+      miter_limit = state.miter_limit;
+      world_transform = state.world_transform;
+      world = state.world;
+      world_baked = state.world_baked;
+      position_stale = state.position_stale;
+      position_unknown = state.position_unknown;
+      known_state = state.known_state;
+      saved_states.resize( level-1 );
+      return true;
+    }
+    /*!
+     * Decide whether a state record can be left out of the metafile. It can
+     * if the optimization is enabled, the attribute has been written before
+     * and the new value does not change it. Either way, the attribute is
+     * known after this call.
+     * \param attribute the STATE_* attribute being set.
+     * \param unchanged true if the new value equals the current one.
+     * \return true if the caller should not append the record.
+     */
+    bool redundantState ( DWORD attribute, bool unchanged )
+    {
+      bool redundant = ( options & EMF_OPTION_ELIDE_STATE ) &&
+	( known_state & attribute ) && unchanged;
+
+      known_state |= attribute;
+
+      if ( redundant ) {
+	if ( attribute & STATE_OBJECTS )
+	  stats.nSelectRecordsDropped++;
+	else
+	  stats.nStateRecordsDropped++;
+      }
+
+      return redundant;
+    }
+    /*!
+     * Decide whether selecting the given object can be left out of the
+     * metafile, i.e., it is already the current object of its kind.
+     * \param gobj the object being selected.
+     * \return true if the caller should not append the selection record.
+     */
+    bool redundantSelect ( const GRAPHICSOBJECT* gobj )
+    {
+      switch ( gobj->getType() ) {
+      case O_PEN:		// (pen is left as it was while an extpen is current)
+	return redundantState( STATE_PEN, gobj == pen && extpen == 0 );
+      case O_EXTPEN:
+	return redundantState( STATE_PEN, gobj == extpen );
+      case O_BRUSH:
+	return redundantState( STATE_BRUSH, gobj == brush );
+      case O_FONT:
+	return redundantState( STATE_FONT, gobj == font );
+      case O_PALETTE:
+	return redundantState( STATE_PALETTE, gobj == palette );
+      default:
+	return false;
+      }
+    }
+    /*!
+     * An object is being deleted. Any state which refers to it, current or
+     * saved, is no longer known.
+     * \param gobj the object being deleted.
+     */
+    void forgetObject ( const GRAPHICSOBJECT* gobj )
+    {
+      DWORD attribute = 0;
+
+      switch ( gobj->getType() ) {
+      case O_PEN: attribute = STATE_PEN; break;
+      case O_EXTPEN: attribute = STATE_PEN; break;
+      case O_BRUSH: attribute = STATE_BRUSH; break;
+      case O_FONT: attribute = STATE_FONT; break;
+      case O_PALETTE: attribute = STATE_PALETTE; break;
+      default: return;
+      }
+
+      if ( gobj == pen || gobj == extpen || gobj == brush || gobj == font ||
+	   gobj == palette )
+	known_state &= ~attribute;
+
+      for ( auto s = saved_states.begin(); s != saved_states.end(); s++ ) {
+	if ( gobj == s->pen || gobj == s->extpen || gobj == s->brush ||
+	     gobj == s->font || gobj == s->palette )
+	  s->known_state &= ~attribute;
+      }
+    }
+    /*!
+     * Look for a metafile object identical to the given graphics object
+     * which has already been written to this metafile. If there is one,
+     * the graphics object shares its metafile handle.
+     * \param gobj the graphics object being selected for the first time.
+     * \return the shared metafile handle, or 0 if the object must be created.
+     */
+    HGDIOBJ findInterned ( GRAPHICSOBJECT* gobj )
+    {
+      if ( !( options & EMF_OPTION_INTERN_OBJECTS ) ) return 0;
+
+      std::string k = gobj->key();
+
+      if ( k.empty() ) return 0;
+
+      auto i = interned.find( k );
+
+      if ( i == interned.end() ) return 0;
+
+      if ( i->second.references++ == 0 )
+	idle_interned--;
+      i->second.last_use = ++intern_clock;
+
+      gobj->contexts[handle] = i->second.emf_handle;
+      stats.nCreateRecordsDropped++;
+
+      return i->second.emf_handle;
+    }
+    /*!
+     * Remember a graphics object just written to the metafile so that
+     * identical ones can share it.
+     * \param gobj the graphics object.
+     * \param emf_handle its metafile handle.
+     */
+    void addInterned ( const GRAPHICSOBJECT* gobj, HGDIOBJ emf_handle )
+    {
+      if ( !( options & EMF_OPTION_INTERN_OBJECTS ) ) return;
+
+      std::string k = gobj->key();
+
+      if ( k.empty() ) return;
+
+      INTERNEDOBJECT object = { emf_handle, 1, ++intern_clock };
+
+      interned[k] = object;
+    }
+    /*!
+     * A graphics object which may share its metafile object is being deleted.
+     * The metafile object itself is only deleted (by the caller) if it is
+     * not interned. Otherwise, it is kept for reuse, and the least recently
+     * used idle object may be evicted to bound the size of the handle table.
+     * \param gobj the graphics object being deleted.
+     * \param emf_handle its metafile handle in this context.
+     * \return true if the caller should delete the metafile object.
+     */
+    bool releaseInterned ( const GRAPHICSOBJECT* gobj, HGDIOBJ emf_handle )
+    {
+      if ( interned.empty() ) return true;
+
+      auto i = interned.find( gobj->key() );
+
+      if ( i == interned.end() || i->second.emf_handle != emf_handle )
+	return true;
+
+      if ( i->second.references > 0 && --i->second.references == 0 )
+	idle_interned++;
+
+      stats.nDeleteRecordsDropped++;
+
+      if ( idle_interned > MAX_IDLE_INTERNED ) {
+	auto lru = interned.end();
+	for ( auto j = interned.begin(); j != interned.end(); j++ ) {
+	  if ( j->second.references == 0 &&
+	       ( lru == interned.end() ||
+		 j->second.last_use < lru->second.last_use ) )
+	    lru = j;
+	}
+	appendRecord( new EMRDELETEOBJECT( lru->second.emf_handle ) );
+	clearHandle( lru->second.emf_handle );
+	stats.nDeleteRecordsDropped--;
+	interned.erase( lru );
+	idle_interned--;
+      }
+
+      return false;
+    }
+    /*!
+     * Set a pixel, either directly with a SetPixelV record or, with
+     * EMF_OPTION_COALESCE_PIXELS, by holding it for flushPixels. A bitmap
+     * only covers the same pixels as SetPixelV while a logical unit is a
+     * device pixel, i.e., in MM_TEXT without a world transform in the
+     * metafile; otherwise the pixel is written directly. (Any record which
+     * changes the mapping flushes the pixels held under the old one.)
+     * \param x horizontal position of the pixel.
+     * \param y vertical position of the pixel.
+     * \param color color of the pixel.
+     */
+    void appendPixel ( LONG x, LONG y, COLORREF color )
+    {
+      if ( ( options & EMF_OPTION_COALESCE_PIXELS ) && map_mode == MM_TEXT &&
+	   !world_transform ) {
+	PIXEL pixel = { x, y, color };
+	pixels.push_back( pixel );
+	if ( pixels.size() >= MAX_PENDING_PIXELS ) flushPixels();
+      }
+      else
+	appendRecord( new EMRSETPIXELV( x, y, color ) );
+    }
+    /*!
+     * Write out the pending pixels: those tiles in which a bitmap is
+     * smaller than the SetPixelV records become a StretchDIBits record,
+     * the rest are written as SetPixelV records.
+     */
+    void flushPixels ( void );
+    /*!
+     * Find or make the DIB for a bitmap about to be drawn.
+     * \param info bitmap header and color table.
+     * \param cb_info size of info in bytes.
+     * \param data bitmap bits.
+     * \param cb_data size of data in bytes.
+     * \param borrow if true, a new DIB refers to data rather than copying it.
+     * \return a DIB holding the bitmap, shared with any identical one.
+     */
+    std::shared_ptr<DIB> internDIB ( const void* info, DWORD cb_info,
+				     const void* data, DWORD cb_data,
+				     bool borrow );
+    void describeRecord ( const METARECORD* record );
+    /*!
+     * With EMF_OPTION_GROUP_OBJECTS, note that the record just appended
+     * selects an object.
+     * \param type the type of the object.
+     * \param handle its metafile handle.
+     */
+    void describeSelect ( OBJECTTYPE type, HGDIOBJ handle )
+    {
+      DWORD slot = type == O_PEN || type == O_EXTPEN ? METARECORD::USES_PEN :
+	type == O_BRUSH ? METARECORD::USES_BRUSH :
+	type == O_FONT ? METARECORD::USES_FONT : 0;
+
+      if ( !( options & EMF_OPTION_GROUP_OBJECTS ) || slot == 0 ) return;
+
+      ORDERING selection = { records.size() - 1, slot, handle, { 0, 0, 0, 0 } };
+      orderings.push_back( selection );
+    }
+    void groupObjects ( void );
+    void pruneRecords ( void );
+    /*!
+     * Copy any bits still borrowed from the caller, so that the metafile no
+     * longer depends on the caller's buffers.
+     */
+    void adoptDIBs ( void )
+    {
+      for ( auto& d : dibs )
+	d.second->adopt();
+    }
+    /*!
+     * Map a point from logical (window) coordinates to device (viewport)
+     * coordinates, just as mergePoint does, but without truncation.
+     * \param p the logical point.
+     * \param x returns the device x coordinate.
+     * \param y returns the device y coordinate.
+     */
+    void toDevice ( const POINT& p, double& x, double& y ) const
+    {
+      int window_width  = window_ext.cx <= 0 ? 1 : window_ext.cx;
+      int window_height = window_ext.cy <= 0 ? 1 : window_ext.cy;
+
+      x = (double)( p.x - window_org.x ) / window_width * viewport_ext.cx +
+	viewport_org.x;
+      y = (double)( p.y - window_org.y ) / window_height * viewport_ext.cy +
+	viewport_org.y;
+    }
+    bool simplify ( const POINT* points, size_t n, bool closed,
+		    std::vector<POINT>& result );
+
+    //! A rectangle in logical coordinates, with left <= right and top <= bottom.
+    struct CLIPRECT {
+      double left;		//!< The left edge.
+      double top;		//!< The top edge.
+      double right;		//!< The right edge.
+      double bottom;		//!< The bottom edge.
+    };
+    /*!
+     * How far, in device units, a stroke of the current pen may reach
+     * beyond the figure it outlines.
+     * \param scale the largest magnification from logical to device units.
+     */
+    double penReach ( double scale ) const;
+    /*!
+     * Does the current pen draw a dash or dot pattern?
+     */
+    bool styledPen ( void ) const;
+    bool deviceScale ( double& sx, double& sy ) const;
+
+    bool setWorld ( const XFORM& transform );
+    void writeWorld ( void );
+    //! How much of a world transform a figure can take into its coordinates.
+    enum BAKES {
+      BAKES_SCALE,		//!< Any scale (lines, polygons, pixels).
+      BAKES_UNMIRRORED,		//!< A scale which doesn't mirror (arcs, bitmaps).
+      BAKES_TRANSLATION		//!< Only a translation (text, unstretched bitmaps).
+    };
+    bool bakeWorld ( BAKES bakes, bool stroked );
+    /*!
+     * bakeWorld for a figure given by a few points, which also writes the
+     * transform out if one of them would be out of range once transformed.
+     * \param bakes how much of a transform the figure can absorb.
+     * \param stroked is the figure outlined with the current pen?
+     * \param x the horizontal coordinate of the first point.
+     * \param y the vertical coordinate of the first point.
+     * \param more the coordinates of the rest of the points.
+     * \return true if the coordinates of the figure are to be transformed.
+     */
+    template<class T, class... MORE>
+    bool bakeWorld ( BAKES bakes, bool stroked, T x, T y, MORE... more )
+    {
+      if ( !bakeWorld( bakes, stroked ) ) return false;
+
+      if ( fits( x, y, more... ) ) return true;
+
+      writeWorld();
+
+      return false;
+    }
+    void syncPosition ( void );
+    //! The end of the recursion of fits( T, T, MORE... ).
+    bool fits ( void ) const { return true; }
+    /*!
+     * \param x the horizontal coordinate of a point.
+     * \param y the vertical coordinate of a point.
+     * \param more the coordinates of more points.
+     * \return true if the points are still in range for their type when the
+     * world transform taken into the coordinates is applied.
+     */
+    template<class T, class... MORE>
+    bool fits ( T x, T y, MORE... more ) const
+    {
+      const double bx = x * (double)world.eM11 + world.eDx;
+      const double by = y * (double)world.eM22 + world.eDy;
+
+      return (std::min)( bx, by ) >= (std::numeric_limits<T>::min)() &&
+	(std::max)( bx, by ) <= (std::numeric_limits<T>::max)() &&
+	fits( more... );
+    }
+    /*!
+     * Apply the world transform taken into the coordinates to a point.
+     * Only call this after bakeWorld has returned true for it (so that the
+     * transform is whole and the point fits).
+     * \param x the horizontal coordinate, transformed in place.
+     * \param y the vertical coordinate, transformed in place.
+     */
+    template<class T>
+    void bake ( T& x, T& y ) const
+    {
+      x = (T)(long long)( x * (double)world.eM11 + world.eDx );
+      y = (T)(long long)( y * (double)world.eM22 + world.eDy );
+    }
+    const POINT* bake ( const POINT* points, size_t n,
+			std::vector<POINT>& baked );
+    const RECT* bake ( const RECT* boxes, size_t n,
+		       std::vector<RECT>& baked );
+    bool clipRect ( CLIPRECT& clip ) const;
+    bool culled ( LONG x0, LONG y0, LONG x1, LONG y1 );
+    /*!
+     * Is a box (whose corners may be given in either order) entirely
+     * outside the frame? See culled( LONG, LONG, LONG, LONG ).
+     */
+    bool culled ( const RECTL& box )
+    {
+      return culled( box.left, box.top, box.right, box.bottom );
     }
+    //! What clip() did to a figure.
+    enum CLIPRESULT { CLIP_UNCHANGED, CLIP_TRIMMED, CLIP_CULLED };
+    CLIPRESULT clip ( const POINT* points, size_t n, bool closed, bool keep_ends,
+		      std::vector<POINT>& result );
     /*!
      * Somewhat superfluous, except checker doesn't understand
      * the initialization of automatic structures in the declaration.